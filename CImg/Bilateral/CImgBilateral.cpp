@@ -35,6 +35,7 @@
 
 #include "CImgFilter.h"
 #include "CImgOperator.h"
+#include "CImgBilateralGrid.h"
 
 #if cimg_version < 160
 #error "The bilateral filter before CImg 1.6.0 produces incorrect results, please upgrade CImg."
@@ -48,7 +49,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping      "Filter"
 #define kPluginDescription \
     "Blur input stream by bilateral filtering.\n" \
-    "Uses the 'blur_bilateral' function from the CImg library.\n" \
+    "Uses the 'blur_bilateral' function from the CImg library, or a faster multithreaded approximation (bilateral grid or permutohedral lattice, see the Algorithm parameter).\n" \
     "CImg is a free, open-source library distributed under the CeCILL-C " \
     "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
     "It can be used in commercial applications (see http://cimg.eu)."
@@ -57,14 +58,16 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: add the multithreaded Grid and Permutohedral algorithms
+// version 2.2: Permutohedral: multithreaded simplex computation, splat and neighbor lookup, use Grid for small sigma_s
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kPluginGuidedName          "BilateralGuidedCImg"
 #define kPluginGuidedIdentifier    "net.sf.cimg.CImgBilateralGuided"
 #define kPluginGuidedDescription \
     "Apply joint/cross bilateral filtering on image A, guided by the intensity differences of image B. " \
-    "Uses the 'blur_bilateral' function from the CImg library.\n" \
+    "Uses the 'blur_bilateral' function from the CImg library, or a faster multithreaded approximation (bilateral grid or permutohedral lattice, see the Algorithm parameter).\n" \
     "CImg is a free, open-source library distributed under the CeCILL-C " \
     "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
     "It can be used in commercial applications (see http://cimg.eu)."
@@ -105,6 +108,8 @@ struct CImgBilateralParams
 {
     double sigma_s;
     double sigma_r;
+    AlgorithmEnum algorithm;
+    double gridSampling;
 };
 
 class CImgBilateralPlugin
@@ -117,7 +122,9 @@ public:
     {
         _sigma_s  = fetchDoubleParam(kParamSigmaS);
         _sigma_r  = fetchDoubleParam(kParamSigmaR);
-        assert(_sigma_s && _sigma_r);
+        _algorithm = fetchChoiceParam(kParamAlgorithm);
+        _gridSampling = fetchDoubleParam(kParamGridSampling);
+        assert(_sigma_s && _sigma_r && _algorithm && _gridSampling);
     }
 
     virtual void getValuesAtTime(double time,
@@ -125,6 +132,8 @@ public:
     {
         _sigma_s->getValueAtTime(time, params.sigma_s);
         _sigma_r->getValueAtTime(time, params.sigma_r);
+        params.algorithm = (AlgorithmEnum)_algorithm->getValueAtTime(time);
+        _gridSampling->getValueAtTime(time, params.gridSampling);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -153,7 +162,11 @@ public:
         if (params.sigma_s == 0.) {
             return;
         }
-        cimg.blur_bilateral(cimg, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+        if (params.algorithm == eAlgorithmCImg) {
+            cimg.blur_bilateral(cimg, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+        } else {
+            cimgBilateral(*this, cimg, cimg, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r, params.algorithm, params.gridSampling);
+        }
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments & /*args*/,
@@ -167,6 +180,8 @@ private:
     // params
     OFX::DoubleParam *_sigma_s;
     OFX::DoubleParam *_sigma_r;
+    OFX::ChoiceParam *_algorithm;
+    OFX::DoubleParam *_gridSampling;
 };
 
 class CImgBilateralGuidedPlugin
@@ -179,7 +194,9 @@ public:
     {
         _sigma_s  = fetchDoubleParam(kParamSigmaS);
         _sigma_r  = fetchDoubleParam(kParamSigmaR);
-        assert(_sigma_s && _sigma_r);
+        _algorithm = fetchChoiceParam(kParamAlgorithm);
+        _gridSampling = fetchDoubleParam(kParamGridSampling);
+        assert(_sigma_s && _sigma_r && _algorithm && _gridSampling);
     }
 
     virtual void getValuesAtTime(double time,
@@ -187,6 +204,8 @@ public:
     {
         _sigma_s->getValueAtTime(time, params.sigma_s);
         _sigma_r->getValueAtTime(time, params.sigma_r);
+        params.algorithm = (AlgorithmEnum)_algorithm->getValueAtTime(time);
+        _gridSampling->getValueAtTime(time, params.gridSampling);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -217,7 +236,12 @@ public:
         if (params.sigma_s == 0.) {
             return;
         }
-        dst = srcA.get_blur_bilateral(srcB, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+        if (params.algorithm == eAlgorithmCImg) {
+            dst = srcA.get_blur_bilateral(srcB, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+        } else {
+            dst = srcA;
+            cimgBilateral(*this, dst, srcB, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r, params.algorithm, params.gridSampling);
+        }
     }
 
     virtual int isIdentity(const OFX::IsIdentityArguments & /*args*/,
@@ -231,6 +255,8 @@ private:
     // params
     OFX::DoubleParam *_sigma_s;
     OFX::DoubleParam *_sigma_r;
+    OFX::ChoiceParam *_algorithm;
+    OFX::DoubleParam *_gridSampling;
 };
 
 mDeclarePluginFactory(CImgBilateralPluginFactory, {}, {});
@@ -303,6 +329,33 @@ CImgBilateralPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+    {
+        OFX::ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamAlgorithm);
+        param->setLabel(kParamAlgorithmLabel);
+        param->setHint(kParamAlgorithmHint);
+        assert(param->getNOptions() == eAlgorithmCImg);
+        param->appendOption(kParamAlgorithmOptionCImg, kParamAlgorithmOptionCImgHint);
+        assert(param->getNOptions() == eAlgorithmGrid);
+        param->appendOption(kParamAlgorithmOptionGrid, kParamAlgorithmOptionGridHint);
+        assert(param->getNOptions() == eAlgorithmPermutohedral);
+        param->appendOption(kParamAlgorithmOptionPermutohedral, kParamAlgorithmOptionPermutohedralHint);
+        param->setDefault( (int)eAlgorithmCImg );
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamGridSampling);
+        param->setLabel(kParamGridSamplingLabel);
+        param->setHint(kParamGridSamplingHint);
+        param->setRange(0.1, 10.);
+        param->setDisplayRange(0.5, 4.);
+        param->setDefault(kParamGridSamplingDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     CImgBilateralPlugin::describeInContextEnd(desc, context, page);
 }
 
@@ -381,6 +434,33 @@ CImgBilateralGuidedPluginFactory::describeInContext(OFX::ImageEffectDescriptor&
             page->addChild(*param);
         }
     }
+    {
+        OFX::ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamAlgorithm);
+        param->setLabel(kParamAlgorithmLabel);
+        param->setHint(kParamAlgorithmHint);
+        assert(param->getNOptions() == eAlgorithmCImg);
+        param->appendOption(kParamAlgorithmOptionCImg, kParamAlgorithmOptionCImgHint);
+        assert(param->getNOptions() == eAlgorithmGrid);
+        param->appendOption(kParamAlgorithmOptionGrid, kParamAlgorithmOptionGridHint);
+        assert(param->getNOptions() == eAlgorithmPermutohedral);
+        param->appendOption(kParamAlgorithmOptionPermutohedral, kParamAlgorithmOptionPermutohedralHint);
+        param->setDefault( (int)eAlgorithmCImg );
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamGridSampling);
+        param->setLabel(kParamGridSamplingLabel);
+        param->setHint(kParamGridSamplingHint);
+        param->setRange(0.1, 10.);
+        param->setDisplayRange(0.5, 4.);
+        param->setDefault(kParamGridSamplingDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     CImgBilateralGuidedPlugin::describeInContextEnd(desc, context, page);
 }
 
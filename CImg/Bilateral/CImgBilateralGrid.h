@@ -0,0 +1,849 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2013-2016 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+//
+//  CImgBilateralGrid.h
+//
+//  Multithreaded approximations of the bilateral filter:
+//  - the bilateral grid (J. Chen, S. Paris, F. Durand, "Real-time edge-aware image processing with the bilateral
+//    grid", SIGGRAPH 2007), which filters each channel using its own values as the range,
+//  - the permutohedral lattice (A. Adams, J. Baek, M. A. Davis, "Fast High-Dimensional Filtering Using the
+//    Permutohedral Lattice", Eurographics 2010), which filters all channels using all the channels of the guide
+//    as the range.
+//
+
+#ifndef Misc_CImgBilateralGrid_h
+#define Misc_CImgBilateralGrid_h
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+
+#include "CImgFilter.h"
+
+#define kParamAlgorithm "algorithm"
+#define kParamAlgorithmLabel "Algorithm"
+#define kParamAlgorithmHint "Algorithm used to compute the bilateral filter."
+#define kParamAlgorithmOptionCImg "CImg"
+#define kParamAlgorithmOptionCImgHint "The 'blur_bilateral' function from the CImg library. Each channel is filtered using its own values (or the values of the corresponding channel of the guide) as the range. This is the reference result, but it is single-threaded."
+#define kParamAlgorithmOptionGrid "Grid"
+#define kParamAlgorithmOptionGridHint "Multithreaded bilateral grid. Each channel is filtered using its own values (or the values of the corresponding channel of the guide) as the range, as with CImg. The grid sampling controls the accuracy/speed trade-off."
+#define kParamAlgorithmOptionPermutohedral "Permutohedral"
+#define kParamAlgorithmOptionPermutohedralHint "Multithreaded permutohedral lattice. All channels are filtered together, using all the channels (e.g. the color) of the guide as the range, which avoids color shifts at the edges. The Grid algorithm is used instead when sigma_s is below 2 pixels (at the current render scale), where the lattice would need several points per pixel."
+
+enum AlgorithmEnum
+{
+    eAlgorithmCImg = 0,
+    eAlgorithmGrid,
+    eAlgorithmPermutohedral,
+};
+
+#define kParamGridSampling "gridSampling"
+#define kParamGridSamplingLabel "Grid Sampling"
+#define kParamGridSamplingHint "Size of the cells of the bilateral grid, relative to sigma_s and sigma_r. Only used by the Grid algorithm. Larger values are faster but less accurate, and values above 1.7 make the filter slightly wider than requested."
+#define kParamGridSamplingDefault 1.
+
+/* Gaussian blur of n cells separated by stride, each with nv values, in place.
+   buffer must have room for n*nv values. */
+inline void
+bilateralBlurLine(float *line,
+                  std::ptrdiff_t stride,
+                  int n,
+                  int nv,
+                  const std::vector<float>& kernel,
+                  std::vector<float>& buffer)
+{
+    const int r = (int)kernel.size() - 1;
+
+    buffer.resize(n * nv);
+    for (int i = 0; i < n; ++i) {
+        std::copy(line + i * stride, line + i * stride + nv, &buffer[i * nv]);
+    }
+    for (int i = 0; i < n; ++i) {
+        float *dst = line + i * stride;
+        for (int v = 0; v < nv; ++v) {
+            dst[v] = kernel[0] * buffer[i * nv + v];
+        }
+        for (int k = 1; k <= r; ++k) {
+            if (i - k >= 0) {
+                const float *src = &buffer[(i - k) * nv];
+                for (int v = 0; v < nv; ++v) {
+                    dst[v] += kernel[k] * src[v];
+                }
+            }
+            if (i + k < n) {
+                const float *src = &buffer[(i + k) * nv];
+                for (int v = 0; v < nv; ++v) {
+                    dst[v] += kernel[k] * src[v];
+                }
+            }
+        }
+    }
+}
+
+// half of a normalized Gaussian kernel, truncated at 3 sigma
+inline std::vector<float>
+bilateralGaussianKernel(double sigma)
+{
+    const int r = (int)std::ceil(3 * sigma);
+    std::vector<float> kernel(r + 1);
+    double sum = 0.;
+
+    for (int k = 0; k <= r; ++k) {
+        kernel[k] = (float)std::exp( -0.5 * k * k / (sigma * sigma) );
+        sum += (k == 0) ? kernel[k] : 2 * kernel[k];
+    }
+    for (int k = 0; k <= r; ++k) {
+        kernel[k] /= (float)sum;
+    }
+
+    return kernel;
+}
+
+/* Bilateral grid of one channel.
+ * Each cell holds the sum of the weighted values and the sum of the weights. Pixels are splatted to the 8 nearest
+ * cells with trilinear weights, the grid is blurred by a separable Gaussian, and the result is sliced with trilinear
+ * interpolation. The trilinear splatting and slicing add a variance of 1/6 cell each, which is subtracted from the
+ * variance of the blur.
+ */
+class CImgBilateralGridProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    CImgBilateralGridProcessor(OFX::ImageEffect &effect,
+                               cimgpix_t *data,
+                               const cimgpix_t *guide,
+                               int width,
+                               int height,
+                               float sigma_s,
+                               float sigma_r,
+                               double sampling)
+        : _effect(effect)
+        , _data(data)
+        , _guide(guide)
+        , _width(width)
+        , _height(height)
+        , _sampling_s(1.f)
+        , _sampling_r(1.f)
+        , _rmin(0.f)
+        , _padding(0)
+        , _gx(0)
+        , _gy(0)
+        , _gr(0)
+        , _grid()
+        , _kernel_s()
+        , _kernel_r()
+        , _phase(ePhaseSplat)
+        , _parity(0)
+    {
+        // range of the guide
+        float rmax = 0.f;
+        bool first = true;
+        for (std::size_t i = 0; i < (std::size_t)width * height; ++i) {
+            const float v = guide[i];
+            if (v - v == 0.f) {
+                if (first) {
+                    _rmin = rmax = v;
+                    first = false;
+                } else if (v < _rmin) {
+                    _rmin = v;
+                } else if (v > rmax) {
+                    rmax = v;
+                }
+            }
+        }
+        _sampling_s = std::max(1.f, (float)(sigma_s * sampling));
+        // at most 256 range cells, as in CImg
+        _sampling_r = std::max( (float)(sigma_r * sampling), (rmax - _rmin) / 256 );
+        if ( !(_sampling_r > 0.f) ) {
+            _sampling_r = 1.f;
+        }
+        const double blur_s = std::sqrt( std::max(0., (double)sigma_s * sigma_s / (_sampling_s * _sampling_s) - 1. / 3) );
+        const double blur_r = std::sqrt( std::max(0., (double)sigma_r * sigma_r / (_sampling_r * _sampling_r) - 1. / 3) );
+        if (blur_s > 0.01) {
+            _kernel_s = bilateralGaussianKernel(blur_s);
+        }
+        if (blur_r > 0.01) {
+            _kernel_r = bilateralGaussianKernel(blur_r);
+        }
+        _padding = (int)std::max( _kernel_s.size(), _kernel_r.size() ) + 1;
+        _gx = (int)( (width - 1) / _sampling_s ) + 2 + 2 * _padding;
+        _gy = (int)( (height - 1) / _sampling_s ) + 2 + 2 * _padding;
+        _gr = (int)( (rmax - _rmin) / _sampling_r ) + 2 + 2 * _padding;
+    }
+
+    void process()
+    {
+        _grid.assign( (std::size_t)_gx * _gy * _gr * 2, 0.f );
+        // splat the pixels that go to even, then odd grid rows, so that threads never write to the same cell
+        _phase = ePhaseSplat;
+        for (_parity = 0; _parity < 2; ++_parity) {
+            run( ( (int)( (_height - 1) / _sampling_s ) + 2 ) / 2 + 1 );
+        }
+        if ( !_kernel_s.empty() ) {
+            _phase = ePhaseBlurX;
+            run(_gy * _gr);
+            _phase = ePhaseBlurY;
+            run(_gx * _gr);
+        }
+        if ( !_kernel_r.empty() ) {
+            _phase = ePhaseBlurR;
+            run(_gx * _gy);
+        }
+        _phase = ePhaseSlice;
+        run(_height);
+        _grid.clear();
+    }
+
+private:
+    enum PhaseEnum
+    {
+        ePhaseSplat,
+        ePhaseBlurX,
+        ePhaseBlurY,
+        ePhaseBlurR,
+        ePhaseSlice,
+    };
+
+    void run(int nItems)
+    {
+        if ( (nItems <= 0) || _effect.abort() ) {
+            return;
+        }
+        // nested calls to the multithread suite run on a single thread
+        const unsigned int nCPUs = OFX::MultiThread::isSpawnedThread() ? 1 : OFX::MultiThread::getNumCPUs();
+        multiThread( std::min(nCPUs, (unsigned int)nItems) );
+    }
+
+    float* cell(int X,
+                int Y,
+                int R)
+    {
+        return &_grid[( ( (std::size_t)R * _gy + Y ) * _gx + X ) * 2];
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        std::vector<float> buffer;
+
+        switch (_phase) {
+        case ePhaseSplat: {
+            // grid rows Y and Y+1 get the pixels of band Y, bands of the same parity are processed in parallel
+            const int nBands = (int)( (_height - 1) / _sampling_s ) + 2;
+            for (int band = _parity + 2 * (int)threadId; band < nBands; band += 2 * (int)nThreads) {
+                if ( _effect.abort() ) {
+                    return;
+                }
+                const int y1 = std::max(0, (int)std::ceil(band * _sampling_s) - 1);
+                const int y2 = std::min(_height, (int)std::ceil( (band + 1) * _sampling_s ) + 1);
+                for (int y = y1; y < y2; ++y) {
+                    // use the same rounding as gridPosition()
+                    if ( (int)(y / _sampling_s) == band ) {
+                        splatRow(y);
+                    }
+                }
+            }
+            break;
+        }
+        case ePhaseBlurX:
+            for (int i = (int)threadId; i < _gy * _gr; i += (int)nThreads) {
+                bilateralBlurLine(cell(0, i % _gy, i / _gy), 2, _gx, 2, _kernel_s, buffer);
+            }
+            break;
+        case ePhaseBlurY:
+            for (int i = (int)threadId; i < _gx * _gr; i += (int)nThreads) {
+                bilateralBlurLine(cell(i % _gx, 0, i / _gx), 2 * _gx, _gy, 2, _kernel_s, buffer);
+            }
+            break;
+        case ePhaseBlurR:
+            for (int i = (int)threadId; i < _gx * _gy; i += (int)nThreads) {
+                bilateralBlurLine(cell(i % _gx, i / _gx, 0), (std::ptrdiff_t)2 * _gx * _gy, _gr, 2, _kernel_r, buffer);
+            }
+            break;
+        case ePhaseSlice:
+            for (int y = (int)threadId; y < _height; y += (int)nThreads) {
+                if ( _effect.abort() ) {
+                    return;
+                }
+                sliceRow(y);
+            }
+            break;
+        }
+    } // multiThreadFunction
+
+    // position of a pixel in the grid
+    void gridPosition(int x,
+                      int y,
+                      float g,
+                      int *X,
+                      int *Y,
+                      int *R,
+                      float *fx,
+                      float *fy,
+                      float *fr) const
+    {
+        const float px = x / _sampling_s;
+        const float py = y / _sampling_s;
+        float pr = (g - _rmin) / _sampling_r;
+
+        if ( !(pr >= 0.f) ) { // also catches NaN
+            pr = 0.f;
+        } else if (pr > _gr - 2 * _padding - 1) {
+            pr = (float)(_gr - 2 * _padding - 1);
+        }
+        *X = (int)px;
+        *Y = (int)py;
+        *R = (int)pr;
+        *fx = px - *X;
+        *fy = py - *Y;
+        *fr = pr - *R;
+        *X += _padding;
+        *Y += _padding;
+        *R += _padding;
+    }
+
+    void splatRow(int y)
+    {
+        const cimgpix_t *src = _data + (std::size_t)y * _width;
+        const cimgpix_t *guide = _guide + (std::size_t)y * _width;
+
+        for (int x = 0; x < _width; ++x) {
+            int X, Y, R;
+            float fx, fy, fr;
+            gridPosition(x, y, guide[x], &X, &Y, &R, &fx, &fy, &fr);
+            const float v = src[x];
+            for (int k = 0; k < 8; ++k) {
+                const float w = ( (k & 1) ? fx : 1 - fx ) * ( (k & 2) ? fy : 1 - fy ) * ( (k & 4) ? fr : 1 - fr );
+                float *c = cell( X + (k & 1), Y + ( (k >> 1) & 1 ), R + ( (k >> 2) & 1 ) );
+                c[0] += w * v;
+                c[1] += w;
+            }
+        }
+    }
+
+    void sliceRow(int y)
+    {
+        cimgpix_t *dst = _data + (std::size_t)y * _width;
+        const cimgpix_t *guide = _guide + (std::size_t)y * _width;
+
+        for (int x = 0; x < _width; ++x) {
+            int X, Y, R;
+            float fx, fy, fr;
+            gridPosition(x, y, guide[x], &X, &Y, &R, &fx, &fy, &fr);
+            float v = 0.f;
+            float w = 0.f;
+            for (int k = 0; k < 8; ++k) {
+                const float t = ( (k & 1) ? fx : 1 - fx ) * ( (k & 2) ? fy : 1 - fy ) * ( (k & 4) ? fr : 1 - fr );
+                const float *c = cell( X + (k & 1), Y + ( (k >> 1) & 1 ), R + ( (k >> 2) & 1 ) );
+                v += t * c[0];
+                w += t * c[1];
+            }
+            if (w > 0.f) {
+                dst[x] = v / w;
+            }
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    cimgpix_t *_data;
+    const cimgpix_t *_guide;
+    const int _width;
+    const int _height;
+    float _sampling_s;
+    float _sampling_r;
+    float _rmin;
+    int _padding;
+    int _gx;
+    int _gy;
+    int _gr;
+    std::vector<float> _grid;
+    std::vector<float> _kernel_s;
+    std::vector<float> _kernel_r;
+    PhaseEnum _phase;
+    int _parity;
+};
+
+#define kPermutohedralSigmaSMin 2.f // smallest sigma_s, in pixels, processed by CImgPermutohedralProcessor
+
+/* Hash table of the points of the permutohedral lattice, with their values.
+ * Keys are the first d coordinates of the points (the last one is minus their sum).
+ */
+class PermutohedralHashTable
+{
+public:
+    PermutohedralHashTable(int d)
+        : _d(d)
+        , _keys()
+        , _table(1024, -1)
+    {
+    }
+
+    int size() const { return (int)_keys.size() / _d; }
+
+    const int* key(int i) const { return &_keys[(std::size_t)i * _d]; }
+
+    // index of a key, inserted if create is true, or -1.
+    // The table is not modified if create is false, so that several threads may look up keys.
+    int find(const int *key,
+             bool create)
+    {
+        if ( create && ( 2 * ( size() + 1 ) > (int)_table.size() ) ) {
+            grow();
+        }
+        const std::size_t mask = _table.size() - 1;
+        std::size_t h = hash(key) & mask;
+        for (;;) {
+            const int i = _table[h];
+            if (i < 0) {
+                if (!create) {
+                    return -1;
+                }
+                _table[h] = size();
+                _keys.insert(_keys.end(), key, key + _d);
+
+                return _table[h];
+            }
+            if ( std::equal(key, key + _d, &_keys[(std::size_t)i * _d]) ) {
+                return i;
+            }
+            h = (h + 1) & mask;
+        }
+    }
+
+private:
+    std::size_t hash(const int *key) const
+    {
+        std::size_t h = 0;
+
+        for (int i = 0; i < _d; ++i) {
+            h = (h + (unsigned int)key[i]) * 2531011;
+        }
+
+        return h;
+    }
+
+    void grow()
+    {
+        _table.assign(_table.size() * 2, -1);
+        const std::size_t mask = _table.size() - 1;
+        for (int i = 0; i < size(); ++i) {
+            std::size_t h = hash( key(i) ) & mask;
+            while (_table[h] >= 0) {
+                h = (h + 1) & mask;
+            }
+            _table[h] = i;
+        }
+    }
+
+    const int _d;
+    std::vector<int> _keys;
+    std::vector<int> _table;
+};
+
+/* Permutohedral lattice filter.
+ * The position of each pixel is (x/sigma_s, y/sigma_s, guide/sigma_r), of dimension d = 2 + number of guide channels.
+ * Pixel values (with a homogeneous weight) are splatted to the d+1 vertices of the enclosing simplex of the lattice,
+ * blurred along the d+1 lattice directions with a [1 2 1]/4 kernel, and sliced back with the same barycentric weights.
+ * Only the insertion of the points in the hash table is sequential: the enclosing simplex of each pixel, the splat
+ * (each thread sums the values of its range of points), the neighbor lookup, the blur and the slice are multithreaded.
+ * The lattice has up to d+1 points per pixel when sigma_s is close to one pixel, so cimgBilateral() does not use it
+ * below kPermutohedralSigmaSMin.
+ */
+class CImgPermutohedralProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    CImgPermutohedralProcessor(OFX::ImageEffect &effect,
+                               cimg_library::CImg<cimgpix_t>& cimg,
+                               const cimg_library::CImg<cimgpix_t>& guide,
+                               float sigma_s,
+                               float sigma_r)
+        : _effect(effect)
+        , _cimg(cimg)
+        , _guide(guide)
+        , _sigma_s(sigma_s)
+        , _sigma_r(sigma_r)
+        , _d( 2 + guide.spectrum() )
+        , _vd(cimg.spectrum() + 1)
+        , _hash( 2 + guide.spectrum() )
+        , _offsets()
+        , _greedy()
+        , _weights()
+        , _values()
+        , _newValues()
+        , _neighbors()
+        , _phase(ePhaseBlur)
+        , _direction(0)
+    {
+    }
+
+    void process()
+    {
+        const int width = _cimg.width();
+        const int height = _cimg.height();
+        const int d = _d;
+        const std::size_t nPixels = (std::size_t)width * height;
+
+        _offsets.resize( nPixels * (d + 1) );
+        _weights.resize( nPixels * (d + 1) );
+        _greedy.resize( nPixels * d );
+
+        // the enclosing simplex of each pixel: its remainder-0 vertex is stored in _greedy, the ranks in _offsets
+        _phase = ePhaseEmbed;
+        run(height);
+        if ( _effect.abort() ) {
+            return;
+        }
+
+        // insert the vertices of the simplices in the hash table, and replace the ranks by the indices of the points
+        std::vector<int> rank(d + 1);
+        std::vector<int> key(d);
+        for (std::size_t pix = 0; pix < nPixels; ++pix) {
+            const int *greedy = &_greedy[pix * d];
+            int *offsets = &_offsets[pix * (d + 1)];
+            std::copy(offsets, offsets + d + 1, rank.begin());
+            for (int remainder = 0; remainder <= d; ++remainder) {
+                for (int i = 0; i < d; ++i) {
+                    key[i] = greedy[i] + ( (rank[i] <= d - remainder) ? remainder : remainder - (d + 1) );
+                }
+                offsets[remainder] = _hash.find(&key[0], true);
+            }
+        }
+        std::vector<int>().swap(_greedy);
+
+        // splat, each thread summing the values of its range of points
+        const int nPoints = _hash.size();
+        _values.assign( (std::size_t)nPoints * _vd, 0.f );
+        _phase = ePhaseSplat;
+        run(nPoints);
+
+        // neighbors of each point along each direction
+        _neighbors.resize( (std::size_t)nPoints * (d + 1) * 2 );
+        _phase = ePhaseNeighbors;
+        run(nPoints);
+        if ( _effect.abort() ) {
+            return;
+        }
+
+        // blur
+        _newValues.resize( _values.size() );
+        _phase = ePhaseBlur;
+        for (_direction = 0; _direction <= d; ++_direction) {
+            run(nPoints);
+            _values.swap(_newValues);
+        }
+
+        // slice
+        _phase = ePhaseSlice;
+        run(height);
+    } // process
+
+private:
+    enum PhaseEnum
+    {
+        ePhaseEmbed,
+        ePhaseSplat,
+        ePhaseNeighbors,
+        ePhaseBlur,
+        ePhaseSlice,
+    };
+
+    // the remainder-0 vertex, the ranks and the barycentric weights of the simplex enclosing each pixel of rows [y1,y2)
+    void embedRows(int y1,
+                   int y2)
+    {
+        const int width = _cimg.width();
+        const int d = _d;
+        // scale of each coordinate of the position in the lattice, so that the blur has a standard deviation of 1
+        std::vector<float> scale(d);
+
+        for (int i = 0; i < d; ++i) {
+            scale[i] = (float)( (d + 1) * std::sqrt(2. / 3.) / std::sqrt( (i + 1.) * (i + 2.) ) );
+        }
+        std::vector<float> position(d);
+        std::vector<float> elevated(d + 1);
+        std::vector<int> greedy(d + 1);
+        std::vector<int> rank(d + 1);
+        std::vector<float> barycentric(d + 2);
+        for (int y = y1; y < y2; ++y) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            for (int x = 0; x < width; ++x) {
+                const std::size_t pix = (std::size_t)y * width + x;
+                position[0] = x / _sigma_s;
+                position[1] = y / _sigma_s;
+                for (int c = 0; c < _guide.spectrum(); ++c) {
+                    const float v = _guide.data(0, 0, 0, c)[pix];
+                    position[2 + c] = (v - v == 0.f) ? (v / _sigma_r) : 0.f;
+                }
+
+                // elevate the position to the hyperplane of the lattice
+                elevated[d] = -d * position[d - 1] * scale[d - 1];
+                for (int i = d - 1; i > 0; --i) {
+                    elevated[i] = elevated[i + 1] - i * position[i - 1] * scale[i - 1] + (i + 2) * position[i] * scale[i];
+                }
+                elevated[0] = elevated[1] + 2 * position[0] * scale[0];
+
+                // closest remainder-0 point, and ranks of the differences
+                int sum = 0;
+                for (int i = 0; i <= d; ++i) {
+                    const float v = elevated[i] / (d + 1);
+                    const int up = (int)std::ceil(v) * (d + 1);
+                    const int down = (int)std::floor(v) * (d + 1);
+                    greedy[i] = (up - elevated[i] < elevated[i] - down) ? up : down;
+                    sum += greedy[i];
+                }
+                sum /= d + 1;
+                std::fill(rank.begin(), rank.end(), 0);
+                for (int i = 0; i < d; ++i) {
+                    for (int j = i + 1; j <= d; ++j) {
+                        if (elevated[i] - greedy[i] < elevated[j] - greedy[j]) {
+                            ++rank[i];
+                        } else {
+                            ++rank[j];
+                        }
+                    }
+                }
+                // bring the point back to the hyperplane
+                if (sum > 0) {
+                    for (int i = 0; i <= d; ++i) {
+                        if (rank[i] >= d + 1 - sum) {
+                            greedy[i] -= d + 1;
+                            rank[i] += sum - (d + 1);
+                        } else {
+                            rank[i] += sum;
+                        }
+                    }
+                } else if (sum < 0) {
+                    for (int i = 0; i <= d; ++i) {
+                        if (rank[i] < -sum) {
+                            greedy[i] += d + 1;
+                            rank[i] += (d + 1) + sum;
+                        } else {
+                            rank[i] += sum;
+                        }
+                    }
+                }
+
+                // barycentric coordinates in the simplex
+                std::fill(barycentric.begin(), barycentric.end(), 0.f);
+                for (int i = 0; i <= d; ++i) {
+                    const float delta = (elevated[i] - greedy[i]) / (d + 1);
+                    barycentric[d - rank[i]] += delta;
+                    barycentric[d + 1 - rank[i]] -= delta;
+                }
+                barycentric[0] += 1.f + barycentric[d + 1];
+
+                std::copy(greedy.begin(), greedy.begin() + d, &_greedy[pix * d]);
+                std::copy(rank.begin(), rank.end(), &_offsets[pix * (d + 1)]);
+                std::copy(barycentric.begin(), barycentric.begin() + d + 1, &_weights[pix * (d + 1)]);
+            }
+        }
+    } // embedRows
+
+    // add the weighted values of the pixels to the points [i1,i2), in the same order as a sequential splat
+    void splatPoints(int i1,
+                     int i2)
+    {
+        const int d = _d;
+        const std::size_t nPixels = (std::size_t)_cimg.width() * _cimg.height();
+
+        for (std::size_t pix = 0; pix < nPixels; ++pix) {
+            if ( ( (pix & 0xffff) == 0 ) && _effect.abort() ) {
+                return;
+            }
+            for (int r = 0; r <= d; ++r) {
+                const int i = _offsets[pix * (d + 1) + r];
+                if ( (i < i1) || (i >= i2) ) {
+                    continue;
+                }
+                float *v = &_values[(std::size_t)i * _vd];
+                const float w = _weights[pix * (d + 1) + r];
+                for (int c = 0; c < _vd - 1; ++c) {
+                    v[c] += w * _cimg.data(0, 0, 0, c)[pix];
+                }
+                v[_vd - 1] += w;
+            }
+        }
+    }
+
+    // the two neighbors of the points [i1,i2) along each direction
+    void findNeighbors(int i1,
+                       int i2)
+    {
+        const int d = _d;
+        std::vector<int> key(d);
+
+        for (int i = i1; i < i2; ++i) {
+            const int *k = _hash.key(i);
+            for (int j = 0; j <= d; ++j) {
+                for (int l = 0; l < d; ++l) {
+                    key[l] = k[l] - 1;
+                }
+                if (j < d) {
+                    key[j] = k[j] + d;
+                }
+                _neighbors[( (std::size_t)i * (d + 1) + j ) * 2] = _hash.find(&key[0], false);
+                for (int l = 0; l < d; ++l) {
+                    key[l] = k[l] + 1;
+                }
+                if (j < d) {
+                    key[j] = k[j] - d;
+                }
+                _neighbors[( (std::size_t)i * (d + 1) + j ) * 2 + 1] = _hash.find(&key[0], false);
+            }
+        }
+    }
+
+    void run(int nItems)
+    {
+        if ( (nItems <= 0) || _effect.abort() ) {
+            return;
+        }
+        // nested calls to the multithread suite run on a single thread
+        const unsigned int nCPUs = OFX::MultiThread::isSpawnedThread() ? 1 : OFX::MultiThread::getNumCPUs();
+        multiThread( std::min(nCPUs, (unsigned int)nItems) );
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int d = _d;
+
+        if (_phase == ePhaseEmbed) {
+            // contiguous bands of rows
+            const int height = _cimg.height();
+            embedRows( (int)( (long)height * threadId / nThreads ), (int)( (long)height * (threadId + 1) / nThreads ) );
+        } else if ( (_phase == ePhaseSplat) || (_phase == ePhaseNeighbors) ) {
+            // contiguous ranges of points
+            const int nPoints = _hash.size();
+            const int i1 = (int)( (long)nPoints * threadId / nThreads );
+            const int i2 = (int)( (long)nPoints * (threadId + 1) / nThreads );
+            if (_phase == ePhaseSplat) {
+                splatPoints(i1, i2);
+            } else {
+                findNeighbors(i1, i2);
+            }
+        } else if (_phase == ePhaseBlur) {
+            const int nPoints = _hash.size();
+            const int i1 = (int)( (long)nPoints * threadId / nThreads );
+            const int i2 = (int)( (long)nPoints * (threadId + 1) / nThreads );
+            for (int i = i1; i < i2; ++i) {
+                const int n1 = _neighbors[( (std::size_t)i * (d + 1) + _direction ) * 2];
+                const int n2 = _neighbors[( (std::size_t)i * (d + 1) + _direction ) * 2 + 1];
+                const float *v = &_values[(std::size_t)i * _vd];
+                float *nv = &_newValues[(std::size_t)i * _vd];
+                for (int c = 0; c < _vd; ++c) {
+                    nv[c] = 0.5f * v[c];
+                }
+                if (n1 >= 0) {
+                    const float *v1 = &_values[(std::size_t)n1 * _vd];
+                    for (int c = 0; c < _vd; ++c) {
+                        nv[c] += 0.25f * v1[c];
+                    }
+                }
+                if (n2 >= 0) {
+                    const float *v2 = &_values[(std::size_t)n2 * _vd];
+                    for (int c = 0; c < _vd; ++c) {
+                        nv[c] += 0.25f * v2[c];
+                    }
+                }
+            }
+        } else {
+            const int width = _cimg.width();
+            std::vector<float> v(_vd);
+            for (int y = (int)threadId; y < _cimg.height(); y += (int)nThreads) {
+                if ( _effect.abort() ) {
+                    return;
+                }
+                for (int x = 0; x < width; ++x) {
+                    const std::size_t pix = (std::size_t)y * width + x;
+                    std::fill(v.begin(), v.end(), 0.f);
+                    for (int r = 0; r <= d; ++r) {
+                        const float *pv = &_values[(std::size_t)_offsets[pix * (d + 1) + r] * _vd];
+                        const float w = _weights[pix * (d + 1) + r];
+                        for (int c = 0; c < _vd; ++c) {
+                            v[c] += w * pv[c];
+                        }
+                    }
+                    if (v[_vd - 1] > 0.f) {
+                        for (int c = 0; c < _vd - 1; ++c) {
+                            _cimg.data(0, 0, 0, c)[pix] = v[c] / v[_vd - 1];
+                        }
+                    }
+                }
+            }
+        }
+    } // multiThreadFunction
+
+    OFX::ImageEffect &_effect;
+    cimg_library::CImg<cimgpix_t>& _cimg;
+    const cimg_library::CImg<cimgpix_t>& _guide;
+    const float _sigma_s;
+    const float _sigma_r;
+    const int _d;
+    const int _vd;
+    PermutohedralHashTable _hash;
+    std::vector<int> _offsets; // the vertices of the simplex of each pixel
+    std::vector<int> _greedy; // the remainder-0 vertex of the simplex of each pixel, until the points are inserted
+    std::vector<float> _weights; // the barycentric weights of each pixel
+    std::vector<float> _values;
+    std::vector<float> _newValues;
+    std::vector<int> _neighbors; // the two neighbors of each point along each direction
+    PhaseEnum _phase;
+    int _direction;
+};
+
+/* Bilateral filter of cimg, using the range given by guide (which may be cimg itself), with one of the
+ * multithreaded algorithms. The permutohedral lattice falls back to the grid for small values of sigma_s.
+ */
+inline void
+cimgBilateral(OFX::ImageEffect &effect,
+              cimg_library::CImg<cimgpix_t>& cimg,
+              const cimg_library::CImg<cimgpix_t>& guide,
+              float sigma_s,
+              float sigma_r,
+              AlgorithmEnum algorithm,
+              double sampling)
+{
+    if ( (algorithm == eAlgorithmPermutohedral) && (sigma_r > 0.f) && (sigma_s >= kPermutohedralSigmaSMin) ) {
+        CImgPermutohedralProcessor processor(effect, cimg, guide, sigma_s, sigma_r);
+        processor.process();
+
+        return;
+    }
+    // the guide is copied, in case it is cimg itself
+    const cimg_library::CImg<cimgpix_t> guideCopy(guide);
+    for (int c = 0; c < cimg.spectrum(); ++c) {
+        CImgBilateralGridProcessor processor(effect, cimg.data(0, 0, 0, c), guideCopy.data(0, 0, 0, c % guideCopy.spectrum()),
+                                             cimg.width(), cimg.height(), sigma_s, sigma_r, sampling);
+        processor.process();
+        if ( effect.abort() ) {
+            return;
+        }
+    }
+}
+
+#endif // ifndef Misc_CImgBilateralGrid_h
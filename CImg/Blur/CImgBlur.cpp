@@ -26,6 +26,7 @@
 #include <climits>
 #include <cfloat> // DBL_MAX
 #include <algorithm>
+#include <vector>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
 #endif
@@ -82,7 +83,8 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "The blur radii follow a geometric progression (of common ratio 2 in the original implementation, " \
     "bloomRatio in this implementation), and a total of bloomCount blur kernels are summed up (bloomCount=5 " \
     "in the original implementation, and the kernels are Gaussian).\n" \
-    "The blur filter can be a quasi-Gaussian, a Gaussian, a box, a triangle or a quadratic filter.\n" \
+    "The blur filter can be a quasi-Gaussian, a Gaussian, a box, a triangle or a quadratic filter. " \
+    "Quasi-Gaussian and Gaussian kernels are computed on an image pyramid, which is much faster for large kernels.\n" \
     "Ref.: Masaki Kawase, \"Practical Implementation of High Dynamic Range Rendering\", GDC 2004.\n" \
     "Uses the 'vanvliet' and 'deriche' functions from the CImg library.\n" \
     "CImg is a free, open-source library distributed under the CeCILL-C " \
@@ -97,8 +99,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // version 1.0: initial version
 // version 2.0: size now has two dimensions
 // version 3.0: use kNatronOfxParamProcess* parameters
+// version 3.1: BloomCImg computes Gaussian blurs on an image pyramid, and needs a smaller RoI
+// version 3.2: BloomCImg: the pyramid is aligned on the image, so that tiles match
 #define kPluginVersionMajor 3 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1 // except for ChromaBlur
 #define kSupportsTiles 1
@@ -148,6 +152,12 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamBloomCountHint "Number of blur kernels of the bloom filter. The original implementation uses a value of 5. Higher values give a wider of heavier tail (the size of the largest blur kernel is 2**bloomCount * size). A count of 1 is just the original blur."
 #define kParamBloomCountDefault 5
 
+// Gaussian bloom kernels are computed on an image pyramid: see bloomLevel()
+#define kBloomSigmaMin 2. // minimum blur applied at a level of the pyramid, in pixels of that level
+#define kBloomPyramidVariance 0.5 // variance added by each down/upsampling, relative to the pixel size
+#define kBloomRoITolerance 0.005 // maximum weight of the pixels outside of the RoI
+#define kBloomLevelsMax 12 // maximum number of levels of the pyramid, so that the coarsest pixels are at most 2048 pixels wide
+
 #define kParamBoundary "boundary"
 #define kParamBoundaryLabel "Border Conditions" //"Boundary Conditions"
 #define kParamBoundaryHint "Specifies how pixel values are computed out of the image domain. This mostly affects values at the boundary of the image. If the image represents intensities, Nearest (Neumann) conditions should be used. If the image represents gradients or derivatives, Black (Dirichlet) boundary conditions should be used."
@@ -749,6 +759,199 @@ vanvliet(CImg<T>& img,
 
 #endif // cimg_version < 160
 
+// Downsample src by a factor 2 into dst, using the [1 4 6 4 1]/16 binomial filter (Burt & Adelson 1983).
+// Pixel X of dst is centered on pixel 2X of src, so that the borders of all levels of the pyramid are aligned.
+static void
+bloomDownsample(const CImg<T>& src,
+                CImg<T>& dst,
+                const bool boundary_conditions)
+{
+    static const T kernel[5] = { (T)1 / 16, (T)4 / 16, (T)6 / 16, (T)4 / 16, (T)1 / 16 };
+    const int w = src.width();
+    const int h = src.height();
+    const int dw = w / 2 + 1;
+    const int dh = h / 2 + 1;
+    CImg<T> tmp(dw, h, 1, src.spectrum());
+
+    dst.assign(dw, dh, 1, src.spectrum(), 0.);
+    for (int c = 0; c < src.spectrum(); ++c) {
+        // horizontal pass
+        for (int y = 0; y < h; ++y) {
+            T *s = const_cast<T*>( src.data(0, y, 0, c) );
+            T *t = tmp.data(0, y, 0, c);
+            for (int X = 0; X < dw; ++X) {
+                if ( (2 * X - 2 >= 0) && (2 * X + 2 < w) ) {
+                    const T *p = s + 2 * X;
+                    t[X] = kernel[0] * (p[-2] + p[2]) + kernel[1] * (p[-1] + p[1]) + kernel[2] * p[0];
+                } else {
+                    T v = 0;
+                    for (int k = 0; k < 5; ++k) {
+                        v += kernel[k] * get_data(s, w, 1, boundary_conditions, 2 * X + k - 2);
+                    }
+                    t[X] = v;
+                }
+            }
+        }
+        // vertical pass
+        for (int Y = 0; Y < dh; ++Y) {
+            T *d = dst.data(0, Y, 0, c);
+            for (int k = 0; k < 5; ++k) {
+                const int y = 2 * Y + k - 2;
+                if ( !boundary_conditions && ( (y < 0) || (y >= h) ) ) {
+                    continue;
+                }
+                const T *t = tmp.data(0, std::max( 0, std::min(y, h - 1) ), 0, c);
+                for (int X = 0; X < dw; ++X) {
+                    d[X] += kernel[k] * t[X];
+                }
+            }
+        }
+    }
+} // bloomDownsample
+
+// Copy src into dst, with px columns added on the left and py rows added at the bottom, filled with the
+// values of the closest pixels if boundary_conditions is true, or with zero.
+static void
+bloomPad(const CImg<T>& src,
+         CImg<T>& dst,
+         const int px,
+         const int py,
+         const bool boundary_conditions)
+{
+    const int w = src.width();
+    const int h = src.height();
+
+    dst.assign(w + px, h + py, 1, src.spectrum(), 0.);
+    for (int c = 0; c < src.spectrum(); ++c) {
+        for (int y = 0; y < h + py; ++y) {
+            if ( (y < py) && !boundary_conditions ) {
+                continue;
+            }
+            const T *s = src.data(0, std::max(0, y - py), 0, c);
+            T *d = dst.data(0, y, 0, c);
+            if (boundary_conditions) {
+                std::fill(d, d + px, s[0]);
+            }
+            std::copy(s, s + w, d + px);
+        }
+    }
+}
+
+// Upsample src by a factor 2 into dst of size w x h, using bilinear interpolation.
+// This is the inverse mapping of bloomDownsample: pixel x of dst is at x/2 in src.
+static void
+bloomUpsample(const CImg<T>& src,
+              CImg<T>& dst,
+              const int w,
+              const int h)
+{
+    const int sw = src.width();
+    const int sh = src.height();
+    std::vector<int> x0(w), x1(w);
+
+    dst.assign(w, h, 1, src.spectrum());
+
+    for (int x = 0; x < w; ++x) {
+        x0[x] = std::min(x / 2, sw - 1);
+        x1[x] = std::min(x / 2 + (x & 1), sw - 1);
+    }
+    for (int c = 0; c < dst.spectrum(); ++c) {
+        for (int y = 0; y < h; ++y) {
+            const int y0 = std::min(y / 2, sh - 1);
+            const int y1 = std::min(y / 2 + (y & 1), sh - 1);
+            const T *s0 = src.data(0, y0, 0, c);
+            const T *s1 = src.data(0, y1, 0, c);
+            T *d = dst.data(0, y, 0, c);
+            for (int x = 0; x < w; ++x) {
+                d[x] = (s0[x0[x]] + s0[x1[x]] + s1[x0[x]] + s1[x1[x]]) / 4;
+            }
+        }
+    }
+}
+
+// Pyramid level at which a Gaussian blur of standard deviation sigma (in pixels) is computed.
+// The variance added by downsampling to level L and upsampling back is kBloomPyramidVariance*(4^L-1),
+// and the residual blur at level L must be at least kBloomSigmaMin pixels of that level.
+static int
+bloomLevel(double sigma)
+{
+    int level = 0;
+    double scale = 4.;
+
+    while (scale * (kBloomSigmaMin * kBloomSigmaMin + kBloomPyramidVariance) <= sigma * sigma + kBloomPyramidVariance) {
+        ++level;
+        scale *= 4.;
+    }
+
+    return std::min(level, kBloomLevelsMax - 1);
+}
+
+// Number of levels of the pyramid used for the sum of count Gaussian blurs with standard deviations sigma*ratio^i.
+static int
+bloomPyramidLevels(double sigma,
+                   double ratio,
+                   int count)
+{
+    int nLevels = 1;
+
+    for (int i = 0; i < count; ++i) {
+        nLevels = std::max( nLevels, bloomLevel( sigma * ipow(ratio, i) ) + 1 );
+    }
+
+    return nLevels;
+}
+
+// Standard deviation, in pixels of pyramid level, of the blur to apply at that level to get a blur of sigma.
+static float
+bloomLevelSigma(double sigma,
+                int level)
+{
+    const double scale = ipow(4., level);
+
+    return (float)std::sqrt( std::max(0., (sigma * sigma - kBloomPyramidVariance * (scale - 1.) ) / scale) );
+}
+
+// Complementary error function (Abramowitz & Stegun 7.1.26, absolute error < 1.5e-7), for x >= 0.
+static double
+erfcPositive(double x)
+{
+    const double t = 1. / (1. + 0.3275911 * x);
+
+    return t * std::exp(-x * x) * ( 0.254829592 + t * ( -0.284496736 + t * ( 1.421413741 + t * ( -1.453152027 + t * 1.061405429 ) ) ) );
+}
+
+// Half-size of the region needed to compute the sum of count Gaussian blurs with standard deviations
+// sigma*ratio^i, so that the total weight of the pixels outside of that region is below kBloomRoITolerance.
+static double
+bloomRoIRadius(double sigma,
+               double ratio,
+               int count)
+{
+    const double sigmaMax = sigma * ipow(ratio, count - 1);
+    double r1 = 0.;
+    double r2 = 3.6 * sigmaMax;
+
+    if (sigmaMax <= 0.) {
+        return 0.;
+    }
+    // the weight outside of the region is a decreasing function of its size
+    for (int iter = 0; iter < 32; ++iter) {
+        const double r = (r1 + r2) / 2;
+        double tail = 0.;
+        double s = sigma;
+        for (int i = 0; i < count; ++i, s *= ratio) {
+            tail += erfcPositive( r / (s * std::sqrt(2.) ) );
+        }
+        if (tail / count > kBloomRoITolerance) {
+            r1 = r;
+        } else {
+            r2 = r;
+        }
+    }
+
+    return r2;
+}
+
 /// Blur plugin
 struct CImgBlurParams
 {
@@ -945,6 +1148,17 @@ public:
 
             int delta_pixX = std::max( 3, (int)std::ceil(sx * 1.5) );
             int delta_pixY = std::max( 3, (int)std::ceil(sy * 1.5) );
+            if (_blurPlugin == eBlurPluginBloom) {
+                // the largest kernels only have a weight of 1/bloomCount, so that their tails can be cut closer
+                delta_pixX = std::max( 3, (int)std::ceil( bloomRoIRadius(renderScale.x * params.sizex / 2.4, params.bloomRatio, params.bloomCount) ) );
+                delta_pixY = std::max( 3, (int)std::ceil( bloomRoIRadius(renderScale.y * params.sizey / 2.4, params.bloomRatio, params.bloomCount) ) );
+                // the down/upsampling filters of the pyramid, which are applied before and after the blurs, reach
+                // 2*(2^L-1) pixels further to the coarsest level L, and 2^(L+1)-2 pixels back from it
+                const int nLevels = bloomPyramidLevels(std::min(renderScale.x * params.sizex, renderScale.y * params.sizey) / 2.4, params.bloomRatio, params.bloomCount);
+                const int margin = (4 << (nLevels - 1) ) - 4;
+                delta_pixX += margin;
+                delta_pixY += margin;
+            }
             roi->x1 = rect.x1 - delta_pixX - params.orderX;
             roi->x2 = rect.x2 + delta_pixX + params.orderX;
             roi->y1 = rect.y1 - delta_pixY - params.orderY;
@@ -965,8 +1179,8 @@ public:
 
     virtual void render(const OFX::RenderArguments &args,
                         const CImgBlurParams& params,
-                        int /*x1*/,
-                        int /*y1*/,
+                        int x1,
+                        int y1,
                         cimg_library::CImg<cimgpix_t>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
@@ -1024,6 +1238,11 @@ public:
                 }
             }
         } else if (_blurPlugin == eBlurPluginBloom) {
+            if ( (params.filter == eFilterQuasiGaussian) || (params.filter == eFilterGaussian) ) {
+                renderBloomPyramid(params, x1, y1, sx, sy, cimg);
+
+                return;
+            }
             // allocate a zero-valued result image to store the sum
             cimg1.assign(cimg.width(), cimg.height(), cimg.depth(), cimg.spectrum(), 0.);
         }
@@ -1160,6 +1379,95 @@ public:
 
 private:
 
+    // Gaussian blur of sigma (in pixels) along X and Y
+    void gaussianBlur(CImg<cimgpix_t>& img,
+                      const CImgBlurParams& params,
+                      float sigmax,
+                      float sigmay)
+    {
+        if (params.filter == eFilterGaussian) {
+#ifdef cimgblur_internal_vanvliet
+            vanvliet(img, sigmax, 0, 'x', (bool)params.boundary_i);
+            vanvliet(img, sigmay, 0, 'y', (bool)params.boundary_i);
+#else
+            img.vanvliet(sigmax, 0, 'x', (bool)params.boundary_i);
+            if ( abort() ) { return; }
+            img.vanvliet(sigmay, 0, 'y', (bool)params.boundary_i);
+#endif
+        } else {
+            img.deriche(sigmax, 0, 'x', (bool)params.boundary_i);
+            if ( abort() ) { return; }
+            img.deriche(sigmay, 0, 'y', (bool)params.boundary_i);
+        }
+    }
+
+    /* Bloom with Gaussian kernels, computed on an image pyramid.
+     * Each kernel is computed at the coarsest level where the remaining blur is at least kBloomSigmaMin pixels,
+     * and the results are accumulated from the coarsest to the finest level, so that the full resolution image is
+     * only blurred by the smallest kernels.
+     * (x1,y1) is the position of cimg in the image: the pyramid is aligned on it, so that all tiles use the same
+     * pixels at each level. cimg is left unchanged if the render is aborted.
+     */
+    void renderBloomPyramid(const CImgBlurParams& params,
+                            int x1,
+                            int y1,
+                            double sx,
+                            double sy,
+                            CImg<cimgpix_t>& cimg)
+    {
+        const int count = params.bloomCount;
+        std::vector<int> levels(count);
+        const int nLevels = bloomPyramidLevels(std::min(sx, sy) / 2.4, params.bloomRatio, count);
+
+        for (int i = 0; i < count; ++i) {
+            levels[i] = bloomLevel( std::min(sx, sy) / 2.4 * ipow(params.bloomRatio, i) );
+        }
+        // pad the image on the left and at the bottom, so that its origin is a multiple of the size of the
+        // pixels of the coarsest level
+        const int step = 1 << (nLevels - 1);
+        const int px = ( (x1 % step) + step ) % step;
+        const int py = ( (y1 % step) + step ) % step;
+
+        // build the pyramid
+        std::vector<CImg<cimgpix_t> > pyramid(1);
+        bloomPad(cimg, pyramid[0], px, py, (bool)params.boundary_i);
+        while ( (int)pyramid.size() < nLevels ) {
+            pyramid.push_back( CImg<cimgpix_t>() );
+            bloomDownsample(pyramid[pyramid.size() - 2], pyramid.back(), (bool)params.boundary_i);
+            if ( abort() ) { return; }
+        }
+
+        // accumulate the blurred images, from the coarsest level to the finest
+        CImg<cimgpix_t> sum;
+        CImg<cimgpix_t> blurred;
+        for (int l = nLevels - 1; l >= 0; --l) {
+            CImg<cimgpix_t> levelSum;
+            if (l < nLevels - 1) {
+                bloomUpsample(sum, levelSum, pyramid[l].width(), pyramid[l].height());
+            } else {
+                levelSum.assign(pyramid[l].width(), pyramid[l].height(), 1, pyramid[l].spectrum(), 0.);
+            }
+            for (int i = 0; i < count; ++i) {
+                if (levels[i] != l) {
+                    continue;
+                }
+                const double scale = ipow(params.bloomRatio, i);
+                blurred.assign(pyramid[l]);
+                gaussianBlur( blurred, params, bloomLevelSigma(sx * scale / 2.4, l), bloomLevelSigma(sy * scale / 2.4, l) );
+                if ( abort() ) { return; }
+                levelSum += blurred;
+            }
+            sum.swap(levelSum);
+            pyramid.pop_back();
+        }
+        if ( (px == 0) && (py == 0) ) {
+            cimg.swap(sum);
+        } else {
+            cimg = sum.get_crop(px, py, px + cimg.width() - 1, py + cimg.height() - 1);
+        }
+        cimg /= (cimgpix_t)count;
+    } // renderBloomPyramid
+
     // params
     const BlurPluginEnum _blurPlugin;
     OFX::Double2DParam *_size;
@@ -28,9 +28,11 @@
 #include <cassert>
 #include <memory>
 #include <algorithm>
+#include <new> // std::bad_alloc
 
 #include "ofxsImageEffect.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 #include "ofxsPixelProcessor.h"
 #include "ofxsCopier.h"
 #include "ofxsCoords.h"
@@ -314,6 +316,10 @@ public:
     // 0: Black/Dirichlet, 1: Nearest/Neumann, 2: Repeat/Periodic
     virtual int getBoundary(const Params& /*params*/) { return 0; }
 
+    // true if each output pixel only depends on the source pixels within the getRoI() of that pixel.
+    // The processed window is then split into tiles, which are rendered in parallel using the multithread suite.
+    virtual bool isLocal(const Params& /*params*/) { return false; }
+
     //static void describe(OFX::ImageEffectDescriptor &desc, bool supportsTiles);
 
     static OFX::PageParamDescriptor* describeInContextBegin(OFX::ImageEffectDescriptor &desc,
@@ -342,6 +348,151 @@ public:
 };
 
 
+#define kCImgTileHeightMin 32 // tiles smaller than this (or than twice the padding) are not worth processing separately
+
+// Render the horizontal bands of the processed window on separate threads, and copy the result to the tmp image.
+// Each band is rendered from a crop of the source cimg that includes the padding given by getRoI().
+// Exceptions must not cross the thread boundary: the first error is recorded, and process() throws it.
+template <class Params, bool sourceIsOptional>
+class CImgFilterTileProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    CImgFilterTileProcessor(CImgFilterPluginHelper<Params, sourceIsOptional> &effect,
+                            const OFX::RenderArguments &args,
+                            const Params& params,
+                            const cimg_library::CImg<cimgpix_t>& cimg,
+                            const OfxRectI& cimgBounds,
+                            const OfxRectI& processWindow,
+                            int nTiles,
+                            float *tmpPixelData,
+                            int tmpPixelComponentCount,
+                            const std::vector<int>& srcChannel)
+        : _effect(effect)
+        , _args(args)
+        , _params(params)
+        , _cimg(cimg)
+        , _cimgBounds(cimgBounds)
+        , _processWindow(processWindow)
+        , _nTiles(nTiles)
+        , _tmpPixelData(tmpPixelData)
+        , _tmpPixelComponentCount(tmpPixelComponentCount)
+        , _srcChannel(srcChannel)
+        , _statusMutex()
+        , _status(kOfxStatOK)
+    {
+    }
+
+    void process()
+    {
+        multiThread(_nTiles);
+        if (_status != kOfxStatOK) {
+            OFX::throwSuiteStatusException(_status);
+        }
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+#ifdef cimg_use_openmp
+        // the tiles are already processed in parallel
+        omp_set_num_threads(1);
+#endif
+        const int height = _processWindow.y2 - _processWindow.y1;
+        for (int tile = (int)threadId; tile < _nTiles; tile += (int)nThreads) {
+            if ( _effect.abort() || (getStatus() != kOfxStatOK) ) {
+                return;
+            }
+            try {
+                processTile(tile, height);
+#ifdef HAVE_THREAD_LOCAL
+            } catch (cimg_library::CImgAbortException) {
+                tls::gImageEffect = 0;
+
+                return;
+#endif
+            } catch (const OFX::Exception::Suite &e) {
+                setStatus( e.status() );
+            } catch (const std::bad_alloc &) {
+                setStatus(kOfxStatErrMemory);
+            } catch (...) {
+                setStatus(kOfxStatFailed);
+            }
+#ifdef HAVE_THREAD_LOCAL
+            tls::gImageEffect = 0;
+#endif
+        }
+    }
+
+    // render the tile-th band of the processed window, which is height pixels high
+    void processTile(int tile,
+                     int height)
+    {
+        OfxRectI tileWindow = _processWindow;
+        tileWindow.y1 = _processWindow.y1 + height * tile / _nTiles;
+        tileWindow.y2 = _processWindow.y1 + height * (tile + 1) / _nTiles;
+        OfxRectI tileRoI;
+        _effect.getRoI(tileWindow, _args.renderScale, _params, &tileRoI);
+        if ( !OFX::Coords::rectIntersection(tileRoI, _cimgBounds, &tileRoI) ) {
+            return;
+        }
+        cimg_library::CImg<cimgpix_t> cimg = _cimg.get_crop(tileRoI.x1 - _cimgBounds.x1, tileRoI.y1 - _cimgBounds.y1,
+                                                            tileRoI.x2 - 1 - _cimgBounds.x1, tileRoI.y2 - 1 - _cimgBounds.y1);
+#ifdef HAVE_THREAD_LOCAL
+        tls::gImageEffect = &_effect;
+#endif
+        _effect.render(_args, _params, tileRoI.x1, tileRoI.y1, cimg);
+#ifdef HAVE_THREAD_LOCAL
+        tls::gImageEffect = 0;
+#endif
+        // check that the dimensions didn't change
+        assert( cimg.width() == (tileRoI.x2 - tileRoI.x1) && cimg.height() == (tileRoI.y2 - tileRoI.y1) && cimg.spectrum() == (int)_srcChannel.size() );
+
+        // copy back the processed channels of tileWindow to tmp
+        const int tmpWidth = _cimgBounds.x2 - _cimgBounds.x1;
+        for (int c = 0; c < cimg.spectrum(); ++c) {
+            for (int y = tileWindow.y1; y < tileWindow.y2; ++y) {
+                const cimgpix_t *src = cimg.data(tileWindow.x1 - tileRoI.x1, y - tileRoI.y1, 0, c);
+                float *dst = _tmpPixelData + ( (size_t)(y - _cimgBounds.y1) * tmpWidth + (tileWindow.x1 - _cimgBounds.x1) ) * _tmpPixelComponentCount + _srcChannel[c];
+                for (int x = tileWindow.x1; x < tileWindow.x2; ++x, ++src, dst += _tmpPixelComponentCount) {
+                    *dst = *src;
+                }
+            }
+        }
+    }
+
+    OfxStatus getStatus()
+    {
+        OFX::MultiThread::AutoMutex lock(_statusMutex);
+
+        return _status;
+    }
+
+    // record the first error
+    void setStatus(OfxStatus status)
+    {
+        OFX::MultiThread::AutoMutex lock(_statusMutex);
+
+        if (_status == kOfxStatOK) {
+            _status = status;
+        }
+    }
+
+    CImgFilterPluginHelper<Params, sourceIsOptional> &_effect;
+    const OFX::RenderArguments &_args;
+    const Params& _params;
+    const cimg_library::CImg<cimgpix_t>& _cimg;
+    const OfxRectI _cimgBounds;
+    const OfxRectI _processWindow;
+    const int _nTiles;
+    float *_tmpPixelData;
+    const int _tmpPixelComponentCount;
+    const std::vector<int>& _srcChannel;
+    OFX::MultiThread::Mutex _statusMutex;
+    OfxStatus _status;
+};
+
 template <class Params, bool sourceIsOptional>
 void
 CImgFilterPluginHelper<Params, sourceIsOptional>::render(const OFX::RenderArguments &args)
@@ -826,35 +977,54 @@ CImgFilterPluginHelper<Params, sourceIsOptional>::render(const OFX::RenderArgume
         //////////////////////////////////////////////////////////////////////////////////////////
         // 3- process the cimg
         printRectI("render srcRoI", srcRoI);
+        // if the operation is local, split processWindow into horizontal bands that are rendered in parallel,
+        // unless the bands would be too small compared to the padding
+        int nTiles = 1;
+        if ( (tmpSize > 0) && isLocal(params) ) {
+            OfxRectI processRoI;
+            getRoI(processWindow, renderScale, params, &processRoI);
+            const int padding = std::max(processWindow.y1 - processRoI.y1, processRoI.y2 - processWindow.y2);
+            const int tileHeightMin = std::max(kCImgTileHeightMin, 2 * padding);
+            nTiles = std::min( (int)OFX::MultiThread::getNumCPUs(), (processWindow.y2 - processWindow.y1) / tileHeightMin );
+        }
+        if (nTiles > 1) {
+            CImgFilterTileProcessor<Params, sourceIsOptional> processor(*this, args, params, cimg, srcRoI, processWindow, nTiles,
+                                                                        tmpPixelData, tmpPixelComponentCount, srcChannel);
+            processor.process();
+            if ( abort() ) {
+                return;
+            }
+        } else {
 #ifdef HAVE_THREAD_LOCAL
-        tls::gImageEffect = this;
-        try {
-            render(args, params, srcRoI.x1, srcRoI.y1, cimg);
-        } catch (cimg_library::CImgAbortException) {
-            tls::gImageEffect = 0;
+            tls::gImageEffect = this;
+            try {
+                render(args, params, srcRoI.x1, srcRoI.y1, cimg);
+            } catch (cimg_library::CImgAbortException) {
+                tls::gImageEffect = 0;
 
-            return;
-        }
+                return;
+            }
 
-        tls::gImageEffect = 0;
+            tls::gImageEffect = 0;
 #else
-        render(args, params, srcRoI.x1, srcRoI.y1, cimg);
+            render(args, params, srcRoI.x1, srcRoI.y1, cimg);
 #endif
-        // check that the dimensions didn't change
-        assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
-        if ( abort() ) {
-            return;
-        }
+            // check that the dimensions didn't change
+            assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
+            if ( abort() ) {
+                return;
+            }
 
-        //////////////////////////////////////////////////////////////////////////////////////////
-        // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
-
-        // We copy the whole srcRoI. This could be optimized to copy only renderWindow
-        for (int c = 0; c < cimgSpectrum; ++c) {
-            const cimgpix_t *src = cimg.data(0, 0, 0, c);
-            float *dst = tmpPixelData + srcChannel[c];
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += tmpPixelComponentCount) {
-                *dst = *src;
+            //////////////////////////////////////////////////////////////////////////////////////////
+            // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
+
+            // We copy the whole srcRoI. This could be optimized to copy only renderWindow
+            for (int c = 0; c < cimgSpectrum; ++c) {
+                const cimgpix_t *src = cimg.data(0, 0, 0, c);
+                float *dst = tmpPixelData + srcChannel[c];
+                for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += tmpPixelComponentCount) {
+                    *dst = *src;
+                }
             }
         }
     }
@@ -24,6 +24,7 @@
 #include <cmath>
 #include <cstring>
 #include <algorithm>
+#include <vector>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
 #endif
@@ -33,6 +34,7 @@
 #include "ofxsMacros.h"
 #include "ofxsCoords.h"
 #include "ofxsCopier.h"
+#include "ofxsMultiThread.h"
 
 #include "CImgFilter.h"
 
@@ -48,7 +50,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "Non-Local Image Smoothing by Applying Anisotropic Diffusion PDE's in the Space of Patches " \
     "(D. Tschumperlé, L. Brun), ICIP'09 " \
     "(https://tschumperle.users.greyc.fr/publications/tschumperle_icip09.pdf).\n" \
-    "Uses the 'blur_patch' function from the CImg library.\n" \
+    "The result is the same as the 'blur_patch' function from the CImg library, but the patch distances are computed using summed-area tables, so that the processing time does not depend on the patch size.\n" \
     "CImg is a free, open-source library distributed under the CeCILL-C " \
     "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
     "It can be used in commercial applications (see http://cimg.eu)."
@@ -57,8 +59,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: patch distances computed using summed-area tables
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1
 #define kSupportsTiles 1
@@ -109,6 +112,203 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 using namespace cimg_library;
 
+/* Non-local patch averaging, as in CImg's blur_patch(), computed offset by offset (J. Darbon et al.,
+ * "Fast nonlocal filtering applied to electron cryomicroscopy", ISBI 2008).
+ * For each offset of the lookup window, the squared difference between the guide image and its translation
+ * is summed over the patch of every pixel using a summed-area table, so that the processing time does not
+ * depend on the patch size. The weights of each offset are then accumulated.
+ * Each thread processes a band of rows, with its own summed-area table, so that there is no allocation
+ * in the loop over the offsets.
+ * Pixels out of the image have the value of the nearest pixel, as in blur_patch().
+ */
+class CImgDenoiseProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    CImgDenoiseProcessor(OFX::ImageEffect &effect,
+                         const CImg<cimgpix_t>& cimg,
+                         const CImg<cimgpix_t>& img,
+                         float sigma_s,
+                         float sigma_p,
+                         int patch_size,
+                         int lookup_size,
+                         bool is_fast_approx,
+                         CImg<cimgpix_t>& res)
+        : _effect(effect)
+        , _cimg(cimg)
+        , _img(img)
+        , _res(res)
+        , _psize1(patch_size - patch_size / 2 - 1)
+        , _psize2(patch_size / 2)
+        , _rsize1(lookup_size - lookup_size / 2 - 1)
+        , _rsize2(lookup_size / 2)
+        , _sigma_s2(sigma_s * sigma_s)
+        , _sigma_p3(3 * sigma_p)
+        , _Pnorm(patch_size * patch_size * cimg.spectrum() * sigma_p * sigma_p)
+        , _is_fast_approx(is_fast_approx)
+        , _nBands(0)
+    {
+    }
+
+    void process()
+    {
+        // nested calls to the multithread suite run on a single thread
+        const unsigned int nCPUs = OFX::MultiThread::isSpawnedThread() ? 1 : OFX::MultiThread::getNumCPUs();
+
+        _nBands = std::min( (int)nCPUs, _cimg.height() );
+        multiThread(_nBands);
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        for (int band = (int)threadId; band < _nBands; band += (int)nThreads) {
+            const int y1 = _cimg.height() * band / _nBands;
+            const int y2 = _cimg.height() * (band + 1) / _nBands;
+            if ( !processBand(y1, y2) ) {
+                return;
+            }
+        }
+    }
+
+    // process rows [y1,y2)
+    bool processBand(int y1,
+                     int y2)
+    {
+        const int width = _cimg.width();
+        const int height = _cimg.height();
+        const int spectrum = _cimg.spectrum();
+        const int patch_size = _psize1 + _psize2 + 1;
+        // the summed-area table covers the patches of the band: columns [-psize1,width+psize2), rows [y1-psize1,y2+psize2)
+        const int satWidth = width + patch_size; // one more column and row of zeroes
+        const int satHeight = y2 - y1 + patch_size;
+        std::vector<double> sat( (std::size_t)satWidth * satHeight, 0. );
+        const int bandSize = (y2 - y1) * width;
+        std::vector<float> sum_weights(bandSize, 0.f);
+        std::vector<float> weight_max(bandSize, 0.f);
+        std::vector<const cimgpix_t*> imgc(spectrum);
+        std::vector<const cimgpix_t*> cimgc(spectrum);
+        std::vector<cimgpix_t*> resc(spectrum);
+        for (int c = 0; c < spectrum; ++c) {
+            imgc[c] = _img.data(0, 0, 0, c);
+            cimgc[c] = _cimg.data(0, 0, 0, c);
+            resc[c] = _res.data(0, 0, 0, c);
+            std::fill( resc[c] + (std::size_t)y1 * width, resc[c] + (std::size_t)y2 * width, 0.f );
+        }
+
+        for (int dy = -_rsize1; dy <= _rsize2; ++dy) {
+            if ( _effect.abort() ) {
+                return false;
+            }
+            // the rows where pixel (x+dx,y+dy) is in the image
+            const int ya = std::max(y1, -dy);
+            const int yb = std::min(y2, height - dy);
+            if (ya >= yb) {
+                continue;
+            }
+            for (int dx = -_rsize1; dx <= _rsize2; ++dx) {
+                const int xa = std::max(0, -dx);
+                const int xb = std::min(width, width - dx);
+                if (xa >= xb) {
+                    continue;
+                }
+                const float dist_s = (float)(dx * dx + dy * dy) / _sigma_s2;
+                if ( _is_fast_approx ? (dist_s > 3) : (dx == 0 && dy == 0) ) {
+                    // the weights of this offset are all zero, or the center is processed at the end
+                    continue;
+                }
+
+                // summed-area table of the squared difference between the patches
+                for (int j = 0; j < satHeight - 1; ++j) {
+                    const int v = y1 - _psize1 + j;
+                    const std::size_t rowP = (std::size_t)std::max( 0, std::min(v, height - 1) ) * width;
+                    const std::size_t rowQ = (std::size_t)std::max( 0, std::min(v + dy, height - 1) ) * width;
+                    const double *satPrev = &sat[(std::size_t)j * satWidth];
+                    double *satRow = &sat[(std::size_t)(j + 1) * satWidth];
+                    double rowSum = 0.;
+                    for (int i = 0; i < satWidth - 1; ++i) {
+                        const int u = i - _psize1;
+                        const std::size_t p = rowP + std::max( 0, std::min(u, width - 1) );
+                        const std::size_t q = rowQ + std::max( 0, std::min(u + dx, width - 1) );
+                        float d2 = 0.f;
+                        for (int c = 0; c < spectrum; ++c) {
+                            const float dI = (float)imgc[c][p] - (float)imgc[c][q];
+                            d2 += dI * dI;
+                        }
+                        rowSum += d2;
+                        satRow[i + 1] = satPrev[i + 1] + rowSum;
+                    }
+                }
+
+                // accumulate the weights
+                for (int y = ya; y < yb; ++y) {
+                    const double *satTop = &sat[(std::size_t)(y - y1) * satWidth];
+                    const double *satBottom = &sat[(std::size_t)(y - y1 + patch_size) * satWidth];
+                    const std::size_t offset = (std::size_t)(y - y1) * width;
+                    const std::size_t pix = (std::size_t)y * width;
+                    const std::ptrdiff_t shift = (std::ptrdiff_t)dy * width + dx;
+                    for (int x = xa; x < xb; ++x) {
+                        if ( _is_fast_approx && !(std::abs(imgc[0][pix + x] - imgc[0][pix + x + shift]) < _sigma_p3) ) {
+                            continue;
+                        }
+                        const double patchDist = satBottom[x + patch_size] - satTop[x + patch_size] - satBottom[x] + satTop[x];
+                        const float distance2 = (float)(patchDist / _Pnorm + dist_s);
+                        float weight;
+                        if (_is_fast_approx) {
+                            weight = distance2 > 3 ? 0.0f : 1.0f;
+                        } else {
+                            weight = (float)std::exp(-distance2);
+                            if (weight > weight_max[offset + x]) {
+                                weight_max[offset + x] = weight;
+                            }
+                        }
+                        sum_weights[offset + x] += weight;
+                        for (int c = 0; c < spectrum; ++c) {
+                            resc[c][pix + x] += weight * cimgc[c][pix + x + shift];
+                        }
+                    }
+                }
+            }
+        }
+
+        // normalize
+        for (int y = y1; y < y2; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const std::size_t offset = (std::size_t)(y - y1) * width + x;
+                const std::size_t pix = (std::size_t)y * width + x;
+                float sum = sum_weights[offset];
+                if (!_is_fast_approx) {
+                    // the center pixel gets the maximum weight
+                    sum += weight_max[offset];
+                    for (int c = 0; c < spectrum; ++c) {
+                        resc[c][pix] += weight_max[offset] * cimgc[c][pix];
+                    }
+                }
+                for (int c = 0; c < spectrum; ++c) {
+                    resc[c][pix] = (sum > 0) ? (resc[c][pix] / sum) : cimgc[c][pix];
+                }
+            }
+        }
+
+        return true;
+    } // processBand
+
+    OFX::ImageEffect &_effect;
+    const CImg<cimgpix_t>& _cimg;
+    const CImg<cimgpix_t>& _img;
+    CImg<cimgpix_t>& _res;
+    const int _psize1;
+    const int _psize2;
+    const int _rsize1;
+    const int _rsize2;
+    const float _sigma_s2;
+    const float _sigma_p3;
+    const float _Pnorm;
+    const bool _is_fast_approx;
+    int _nBands;
+};
+
 /// Denoise plugin
 struct CImgDenoiseParams
 {
@@ -171,160 +371,27 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-#ifdef CIMG_ABORTABLE
-        // code copied from CImg.h's get_blur_patch, with calls to abort() added here and there
-
-        // args
         const float sigma_s = (float)(params.sigma_s * args.renderScale.x);
         const float sigma_p = (float)params.sigma_r;
-        const unsigned int patch_size = (unsigned int)std::ceil(std::max(0, params.psize) * args.renderScale.x);
-        const unsigned int lookup_size = (unsigned int)std::ceil(std::max(0, params.lsize) * args.renderScale.x);
+        const int patch_size = (int)std::ceil(std::max(0, params.psize) * args.renderScale.x);
+        const int lookup_size = (int)std::ceil(std::max(0, params.lsize) * args.renderScale.x);
         const float smoothness = (float)(params.smoothness * args.renderScale.x);
-        const bool is_fast_approx = params.fast_approx;
 
-#define Tfloat float
-#define T float
-#undef _cimg_blur_patch2d_fast
-#undef _cimg_blur_patch2d
-
-#undef cimg_abort_test
-#ifdef cimg_use_openmp
-#define cimg_abort_test() if (!omp_get_thread_num() && abort()) throw CImgAbortException("")
-#else
-#define cimg_abort_test() if (abort()) throw CImgAbortException("")
-#endif
-
-        // the macros are taken from CImg.h, with (*this) replaced by (cimg)
-#define _cimg_blur_patch2d_fast(N) \
-        cimg_for##N##Y(res,y) { cimg_abort_test(); \
-        cimg_for##N##X(res,x) { \
-          T *pP = P._data; cimg_forC(res,c) { cimg_get##N##x##N(img,x,y,0,c,pP,T); pP+=N2; } \
-          const int x0 = x - rsize1, y0 = y - rsize1, x1 = x + rsize2, y1 = y + rsize2; \
-          float sum_weights = 0; \
-          cimg_for_in##N##XY(res,x0,y0,x1,y1,p,q) if (cimg::abs(img(x,y,0,0) - img(p,q,0,0))<sigma_p3) { \
-            T *pQ = Q._data; cimg_forC(res,c) { cimg_get##N##x##N(img,p,q,0,c,pQ,T); pQ+=N2; } \
-            float distance2 = 0; \
-            pQ = Q._data; cimg_for(P,pP,T) { const float dI = (float)*pP - (float)*(pQ++); distance2+=dI*dI; } \
-            distance2/=Pnorm; \
-            const float dx = (float)p - x, dy = (float)q - y, \
-              alldist = distance2 + (dx*dx+dy*dy)/sigma_s2, weight = alldist>3?0.0f:1.0f; \
-            sum_weights+=weight; \
-            cimg_forC(res,c) res(x,y,c)+=weight*(cimg)(p,q,c); \
-          } \
-          if (sum_weights>0) cimg_forC(res,c) res(x,y,c)/=sum_weights; \
-          else cimg_forC(res,c) res(x,y,c) = (Tfloat)((cimg)(x,y,c)); \
-        } }
-
-#define _cimg_blur_patch2d(N) \
-        cimg_for##N##Y(res,y) { cimg_abort_test(); \
-        cimg_for##N##X(res,x) { \
-          T *pP = P._data; cimg_forC(res,c) { cimg_get##N##x##N(img,x,y,0,c,pP,T); pP+=N2; } \
-          const int x0 = x - rsize1, y0 = y - rsize1, x1 = x + rsize2, y1 = y + rsize2; \
-          float sum_weights = 0, weight_max = 0; \
-          cimg_for_in##N##XY(res,x0,y0,x1,y1,p,q) if (p!=x || q!=y) { \
-            T *pQ = Q._data; cimg_forC(res,c) { cimg_get##N##x##N(img,p,q,0,c,pQ,T); pQ+=N2; } \
-            float distance2 = 0; \
-            pQ = Q._data; cimg_for(P,pP,T) { const float dI = (float)*pP - (float)*(pQ++); distance2+=dI*dI; } \
-            distance2/=Pnorm; \
-            const float dx = (float)p - x, dy = (float)q - y, \
-              alldist = distance2 + (dx*dx+dy*dy)/sigma_s2, weight = (float)std::exp(-alldist); \
-            if (weight>weight_max) weight_max = weight; \
-            sum_weights+=weight; \
-            cimg_forC(res,c) res(x,y,c)+=weight*(cimg)(p,q,c); \
-          } \
-          sum_weights+=weight_max; cimg_forC(res,c) res(x,y,c)+=weight_max*(cimg)(x,y,c); \
-          if (sum_weights>0) cimg_forC(res,c) res(x,y,c)/=sum_weights; \
-          else cimg_forC(res,c) res(x,y,c) = (Tfloat)((cimg)(x,y,c)); \
-    } }
-
-        if (cimg.is_empty() || !patch_size || !lookup_size) return;
-        CImg<Tfloat> res(cimg._width,cimg._height,cimg._depth,cimg._spectrum,0);
-        const CImg<T> _img = smoothness>0?cimg.get_blur(smoothness):CImg<Tfloat>(),&img = smoothness>0?_img:cimg;
-        CImg<T> P(patch_size*patch_size*cimg._spectrum), Q(P);
-        const float
-        nsigma_s = sigma_s>=0?sigma_s:-sigma_s*cimg::max(cimg._width,cimg._height,cimg._depth)/100,
-        sigma_s2 = nsigma_s*nsigma_s, sigma_p2 = sigma_p*sigma_p, sigma_p3 = 3*sigma_p,
-        Pnorm = P.size()*sigma_p2;
-        const int rsize2 = (int)lookup_size/2, rsize1 = (int)lookup_size - rsize2 - 1;
-        const unsigned int N2 = patch_size*patch_size, N3 = N2*patch_size;
-        cimg::unused(N2,N3);
-        switch (patch_size) { // 2d
-            case 2 : if (is_fast_approx) _cimg_blur_patch2d_fast(2) else _cimg_blur_patch2d(2) break;
-            case 3 : if (is_fast_approx) _cimg_blur_patch2d_fast(3) else _cimg_blur_patch2d(3) break;
-            case 4 : if (is_fast_approx) _cimg_blur_patch2d_fast(4) else _cimg_blur_patch2d(4) break;
-            case 5 : if (is_fast_approx) _cimg_blur_patch2d_fast(5) else _cimg_blur_patch2d(5) break;
-                // use OpenMP when patch_size > 5
-            //case 6 : if (is_fast_approx) _cimg_blur_patch2d_fast(6) else _cimg_blur_patch2d(6) break;
-            //case 7 : if (is_fast_approx) _cimg_blur_patch2d_fast(7) else _cimg_blur_patch2d(7) break;
-            //case 8 : if (is_fast_approx) _cimg_blur_patch2d_fast(8) else _cimg_blur_patch2d(8) break;
-            //case 9 : if (is_fast_approx) _cimg_blur_patch2d_fast(9) else _cimg_blur_patch2d(9) break;
-            default : { // Fast
-                const int psize2 = (int)patch_size/2, psize1 = (int)patch_size - psize2 - 1;
-                cimg_abort_init;
-                if (is_fast_approx) {
-                    cimg_pragma_openmp(parallel for cimg_openmp_if(res._width>=32 && res._height>=4) firstprivate(P,Q))
-                    cimg_forY(res,y) {
-                        cimg_abort_try {
-                            cimg_abort_test();
-                            cimg_forX(res,x) { // 2d fast approximation.
-                                P = img.get_crop(x - psize1,y - psize1,x + psize2,y + psize2,true);
-                                const int x0 = x - rsize1, y0 = y - rsize1, x1 = x + rsize2, y1 = y + rsize2;
-                                float sum_weights = 0;
-                                cimg_for_inXY(res,x0,y0,x1,y1,p,q) if (cimg::abs(img(x,y,0)-img(p,q,0))<sigma_p3) {
-                                    (Q = img.get_crop(p - psize1,q - psize1,p + psize2,q + psize2,true))-=P;
-                                    const float
-                                        dx = (float)x - p, dy = (float)y - q,
-                                        distance2 = (float)(Q.pow(2).sum()/Pnorm + (dx*dx + dy*dy)/sigma_s2),
-                                        weight = distance2>3?0.0f:1.0f;
-                                    sum_weights+=weight;
-                                    cimg_forC(res,c) res(x,y,c)+=weight*cimg(p,q,c);
-                                }
-                                if (sum_weights>0) cimg_forC(res,c) res(x,y,c)/=sum_weights;
-                                else cimg_forC(res,c) res(x,y,c) = (Tfloat)(cimg(x,y,c));
-                            }
-                        } cimg_abort_catch()
-                    }
-                } else {
-                    cimg_pragma_openmp(parallel for cimg_openmp_if(res._width>=32 && res._height>=4) firstprivate(P,Q))
-                    cimg_forY(res,y) {
-                        cimg_abort_try {
-                            cimg_abort_test();
-                            cimg_forX(res,x) { // 2d exact algorithm.
-                                P = img.get_crop(x - psize1,y - psize1,x + psize2,y + psize2,true);
-                                const int x0 = x - rsize1, y0 = y - rsize1, x1 = x + rsize2, y1 = y + rsize2;
-                                float sum_weights = 0, weight_max = 0;
-                                cimg_for_inXY(res,x0,y0,x1,y1,p,q) if (p!=x || q!=y) {
-                                    (Q = img.get_crop(p - psize1,q - psize1,p + psize2,q + psize2,true))-=P;
-                                    const float
-                                            dx = (float)x - p, dy = (float)y - q,
-                                            distance2 = (float)(Q.pow(2).sum()/Pnorm + (dx*dx + dy*dy)/sigma_s2),
-                                            weight = (float)std::exp(-distance2);
-                                    if (weight>weight_max) weight_max = weight;
-                                    sum_weights+=weight;
-                                    cimg_forC(res,c) res(x,y,c)+=weight*cimg(p,q,c);
-                                }
-                                sum_weights+=weight_max; cimg_forC(res,c) res(x,y,c)+=weight_max*cimg(x,y,c);
-                                if (sum_weights>0) cimg_forC(res,c) res(x,y,c)/=sum_weights;
-                                else cimg_forC(res,c) res(x,y,0,c) = (Tfloat)(cimg(x,y,c));
-                            }
-                        } cimg_abort_catch()
-                    }
-                }
-                cimg_abort_test();
-            }
+        if ( cimg.is_empty() || !patch_size || !lookup_size ) {
+            return;
+        }
+        // the patches are compared on a smoothed image
+        const CImg<cimgpix_t> _img = smoothness > 0 ? cimg.get_blur(smoothness) : CImg<cimgpix_t>(), &img = smoothness > 0 ? _img : cimg;
+        if ( abort() ) {
+            return;
+        }
+        CImg<cimgpix_t> res(cimg.width(), cimg.height(), 1, cimg.spectrum());
+        CImgDenoiseProcessor processor(*this, cimg, img, sigma_s, sigma_p, patch_size, lookup_size, params.fast_approx, res);
+        processor.process();
+        if ( abort() ) {
+            return;
         }
         cimg.assign(res);
-#undef Tfloat
-#undef T
-
-#else // ifdef CIMG_ABORTABLE
-        cimg.blur_patch( (float)(params.sigma_s * args.renderScale.x),
-                         (float)params.sigma_r,
-                         (unsigned int)std::ceil(std::max(0, params.psize) * args.renderScale.x),
-                         (unsigned int)std::ceil(std::max(0, params.lsize) * args.renderScale.x),
-                         (float)(params.smoothness * args.renderScale.x),
-                         params.fast_approx );
-#endif // ifdef CIMG_ABORTABLE
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments & /*args*/,
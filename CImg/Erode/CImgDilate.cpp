@@ -35,6 +35,7 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgMorphology.h"
 
 using namespace OFX;
 
@@ -43,10 +44,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginName          "DilateCImg"
 #define kPluginGrouping      "Filter"
 #define kPluginDescription \
-    "Dilate (or erode) input stream by a rectangular structuring element of specified size and Neumann boundary conditions (pixels out of the image get the value of the nearest pixel).\n" \
+    "Dilate (or erode) input stream by a rectangular or octagonal structuring element of specified size and Neumann boundary conditions (pixels out of the image get the value of the nearest pixel).\n" \
     "A negative size will perform an erosion instead of a dilation.\n" \
     "Different sizes can be given for the x and y axis.\n" \
-    "Uses the 'dilate' and 'erode' functions from the CImg library.\n" \
+    "The van Herk/Gil-Werman algorithm is used, so that the processing time does not depend on the size of the structuring element.\n" \
     "CImg is a free, open-source library distributed under the CeCILL-C " \
     "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
     "It can be used in commercial applications (see http://cimg.eu)."
@@ -55,8 +56,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: process tiles in parallel
+// version 2.2: van Herk/Gil-Werman algorithm, octagonal structuring element
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1
 #define kSupportsTiles 1
@@ -77,7 +80,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamSize "size"
 #define kParamSizeLabel "size"
-#define kParamSizeHint "Width/height of the rectangular structuring element is 2*size+1, in pixel units (>=0)."
+#define kParamSizeHint "Width/height of the structuring element is 2*size+1, in pixel units (>=0)."
 #define kParamSizeDefault 1
 
 
@@ -86,6 +89,7 @@ struct CImgDilateParams
 {
     int sx;
     int sy;
+    ElementEnum element;
 };
 
 class CImgDilatePlugin
@@ -97,13 +101,15 @@ public:
         : CImgFilterPluginHelper<CImgDilateParams, false>(handle, kSupportsComponentRemapping, kSupportsTiles, kSupportsMultiResolution, kSupportsRenderScale, /*defaultUnpremult=*/ true, /*defaultProcessAlphaOnRGBA=*/ false)
     {
         _size  = fetchInt2DParam(kParamSize);
-        assert(_size);
+        _element = fetchChoiceParam(kParamElement);
+        assert(_size && _element);
     }
 
     virtual void getValuesAtTime(double time,
                                  CImgDilateParams& params) OVERRIDE FINAL
     {
         _size->getValueAtTime(time, params.sx, params.sy);
+        params.element = (ElementEnum)_element->getValueAtTime(time);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -130,16 +136,20 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        if ( (params.sx > 0) || (params.sy > 0) ) {
-            cimg.dilate( (unsigned int)std::floor(std::max(0, params.sx) * args.renderScale.x) * 2 + 1,
-                         (unsigned int)std::floor(std::max(0, params.sy) * args.renderScale.y) * 2 + 1 );
-        }
-        if ( (params.sx < 0) || (params.sy < 0) ) {
-            cimg.erode( (unsigned int)std::floor(std::max(0, -params.sx) * args.renderScale.x) * 2 + 1,
-                        (unsigned int)std::floor(std::max(0, -params.sy) * args.renderScale.y) * 2 + 1 );
-        }
+        cimgMorphology(*this, cimg,
+                       (int)std::floor(std::max(0, params.sx) * args.renderScale.x),
+                       (int)std::floor(std::max(0, params.sy) * args.renderScale.y),
+                       params.element, /*erode=*/ false);
+        if ( abort() ) { return; }
+        cimgMorphology(*this, cimg,
+                       (int)std::floor(std::max(0, -params.sx) * args.renderScale.x),
+                       (int)std::floor(std::max(0, -params.sy) * args.renderScale.y),
+                       params.element, /*erode=*/ true);
     }
 
+    // the result only depends on the neighborhood given by getRoI(), so that tiles can be processed in parallel
+    virtual bool isLocal(const CImgDilateParams& /*params*/) OVERRIDE FINAL { return true; }
+
     virtual bool isIdentity(const OFX::IsIdentityArguments &args,
                             const CImgDilateParams& params) OVERRIDE FINAL
     {
@@ -150,6 +160,7 @@ private:
 
     // params
     OFX::Int2DParam *_size;
+    OFX::ChoiceParam *_element;
 };
 
 
@@ -210,6 +221,19 @@ CImgDilatePluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+    {
+        OFX::ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamElement);
+        param->setLabel(kParamElementLabel);
+        param->setHint(kParamElementHint);
+        assert(param->getNOptions() == eElementBox && param->getNOptions() == 0);
+        param->appendOption(kParamElementOptionBox, kParamElementOptionBoxHint);
+        assert(param->getNOptions() == eElementOctagon && param->getNOptions() == 1);
+        param->appendOption(kParamElementOptionOctagon, kParamElementOptionOctagonHint);
+        param->setDefault( (int)eElementBox );
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     CImgDilatePlugin::describeInContextEnd(desc, context, page);
 }
 
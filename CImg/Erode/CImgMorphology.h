@@ -0,0 +1,392 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2013-2016 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+//
+//  CImgMorphology.h
+//
+//  Erosion and dilation by rectangles and octagons, in constant time per pixel whatever the size of the
+//  structuring element, using the van Herk/Gil-Werman algorithm on line segments.
+//
+
+#ifndef Misc_CImgMorphology_h
+#define Misc_CImgMorphology_h
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+
+#include "CImgFilter.h"
+
+#define kParamElement "element"
+#define kParamElementLabel "Element"
+#define kParamElementHint "Shape of the structuring element."
+#define kParamElementOptionBox "Box"
+#define kParamElementOptionBoxHint "Rectangle of width 2*size.x+1 and height 2*size.y+1."
+#define kParamElementOptionOctagon "Octagon"
+#define kParamElementOptionOctagonHint "Octagon inscribed in the rectangle, the closest shape to a disk or an ellipse that can be processed in constant time. It is built from horizontal, vertical and diagonal lines."
+
+enum ElementEnum
+{
+    eElementBox = 0,
+    eElementOctagon,
+};
+
+#define kMorphologyStripWidth 64 // number of columns processed together by the vertical pass
+
+// Erosion takes the minimum over the structuring element, dilation takes the maximum.
+struct MorphologyErode
+{
+    static float identity() { return std::numeric_limits<float>::infinity(); }
+
+    static float apply(float a,
+                       float b) { return (a < b) ? a : b; }
+};
+
+struct MorphologyDilate
+{
+    static float identity() { return -std::numeric_limits<float>::infinity(); }
+
+    static float apply(float a,
+                       float b) { return (a > b) ? a : b; }
+};
+
+enum MorphologyPassEnum
+{
+    eMorphologyPassHorizontal = 0,
+    eMorphologyPassVertical,
+    eMorphologyPassDiagonal, // direction (1,1)
+    eMorphologyPassAntiDiagonal, // direction (-1,1)
+    eMorphologyPassCross, // 3x3 cross, not separable
+};
+
+/* Erode or dilate the n values of a line, separated by stride, by a segment of 2*r+1 values.
+ * Values out of the line are ignored, which is equivalent to Neumann boundary conditions.
+ * van Herk/Gil-Werman: the line is split into blocks of the segment length, and the running min/max is computed
+ * forward (g) and backward (h) within each block. The segment starting at i covers the end of a block and the
+ * beginning of the next one, so its min/max is the min/max of h[i] and g[i+2r].
+ */
+template <class Op>
+void
+morphologyLine(float *line,
+               std::ptrdiff_t stride,
+               int n,
+               int r,
+               std::vector<float>& buffer)
+{
+    if ( (r <= 0) || (n <= 1) ) {
+        return;
+    }
+    const int k = 2 * r + 1;
+    const int m = n + 2 * r; // padded length
+    buffer.resize(2 * m);
+    float *g = &buffer[0];
+    float *h = &buffer[m];
+
+    for (int j = 0, b = 0; j < m; ++j, ++b) {
+        const int i = j - r;
+        const float f = (0 <= i && i < n) ? line[i * stride] : Op::identity();
+        if (b == k) {
+            b = 0;
+        }
+        g[j] = (b == 0) ? f : Op::apply(g[j - 1], f);
+    }
+    for (int j = m - 1; j >= 0; --j) {
+        const int i = j - r;
+        const float f = (0 <= i && i < n) ? line[i * stride] : Op::identity();
+        h[j] = ( (j == m - 1) || ( (j + 1) % k == 0 ) ) ? f : Op::apply(h[j + 1], f);
+    }
+    for (int i = 0; i < n; ++i) {
+        line[i * stride] = Op::apply(h[i], g[i + 2 * r]);
+    }
+}
+
+/* Apply one pass of the erosion or dilation to a single-channel image, in place.
+ * Rows, strips of columns, or diagonals are distributed over the threads.
+ * The vertical pass computes the running min/max of whole rows of a strip, so that the inner loops are
+ * over contiguous pixels and can be vectorized by the compiler.
+ */
+class CImgMorphologyProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    CImgMorphologyProcessor(OFX::ImageEffect &effect,
+                            float *data,
+                            int width,
+                            int height,
+                            bool erode)
+        : _effect(effect)
+        , _data(data)
+        , _width(width)
+        , _height(height)
+        , _erode(erode)
+        , _pass(eMorphologyPassHorizontal)
+        , _radius(0)
+        , _copy()
+    {
+    }
+
+    void process(MorphologyPassEnum pass,
+                 int radius)
+    {
+        if ( (radius <= 0) || _effect.abort() ) {
+            return;
+        }
+        _pass = pass;
+        _radius = radius;
+        int nItems = 0;
+        switch (pass) {
+        case eMorphologyPassHorizontal:
+        case eMorphologyPassCross:
+            nItems = _height;
+            break;
+        case eMorphologyPassVertical:
+            nItems = (_width + kMorphologyStripWidth - 1) / kMorphologyStripWidth;
+            break;
+        case eMorphologyPassDiagonal:
+        case eMorphologyPassAntiDiagonal:
+            nItems = _width + _height - 1;
+            break;
+        }
+        if (pass == eMorphologyPassCross) {
+            _copy.assign(_data, _data + (std::size_t)_width * _height);
+        }
+        // nested calls to the multithread suite run on a single thread (e.g. when rendering tiles)
+        const unsigned int nCPUs = OFX::MultiThread::isSpawnedThread() ? 1 : OFX::MultiThread::getNumCPUs();
+        multiThread( std::max( 1u, std::min(nCPUs, (unsigned int)nItems) ) );
+        _copy.clear();
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        if (_erode) {
+            processItems<MorphologyErode>(threadId, nThreads);
+        } else {
+            processItems<MorphologyDilate>(threadId, nThreads);
+        }
+    }
+
+    template <class Op>
+    void processItems(unsigned int threadId,
+                      unsigned int nThreads)
+    {
+        std::vector<float> buffer;
+
+        switch (_pass) {
+        case eMorphologyPassHorizontal:
+            for (int y = (int)threadId; y < _height; y += (int)nThreads) {
+                if ( _effect.abort() ) {
+                    return;
+                }
+                morphologyLine<Op>(_data + (std::size_t)y * _width, 1, _width, _radius, buffer);
+            }
+            break;
+        case eMorphologyPassVertical: {
+            const int nStrips = (_width + kMorphologyStripWidth - 1) / kMorphologyStripWidth;
+            for (int s = (int)threadId; s < nStrips; s += (int)nThreads) {
+                if ( _effect.abort() ) {
+                    return;
+                }
+                const int x1 = s * kMorphologyStripWidth;
+                verticalStrip<Op>( x1, std::min(_width, x1 + kMorphologyStripWidth), buffer );
+            }
+            break;
+        }
+        case eMorphologyPassDiagonal:
+        case eMorphologyPassAntiDiagonal: {
+            const bool anti = (_pass == eMorphologyPassAntiDiagonal);
+            for (int d = (int)threadId; d < _width + _height - 1; d += (int)nThreads) {
+                if ( (d % 256 == 0) && _effect.abort() ) {
+                    return;
+                }
+                // diagonals start on the first row, then on the first (or last) column
+                const int y0 = std::max(0, d - _width + 1);
+                const int x0 = (d < _width) ? (anti ? d : _width - 1 - d) : (anti ? _width - 1 : 0);
+                const int n = std::min(anti ? x0 + 1 : _width - x0, _height - y0);
+                morphologyLine<Op>(_data + (std::size_t)y0 * _width + x0, anti ? _width - 1 : _width + 1, n, _radius, buffer);
+            }
+            break;
+        }
+        case eMorphologyPassCross:
+            for (int y = (int)threadId; y < _height; y += (int)nThreads) {
+                if ( _effect.abort() ) {
+                    return;
+                }
+                const float *src = &_copy[(std::size_t)y * _width];
+                float *dst = _data + (std::size_t)y * _width;
+                for (int x = 0; x < _width; ++x) {
+                    float v = src[x];
+                    if (x > 0) {
+                        v = Op::apply(v, src[x - 1]);
+                    }
+                    if (x < _width - 1) {
+                        v = Op::apply(v, src[x + 1]);
+                    }
+                    if (y > 0) {
+                        v = Op::apply(v, src[x - _width]);
+                    }
+                    if (y < _height - 1) {
+                        v = Op::apply(v, src[x + _width]);
+                    }
+                    dst[x] = v;
+                }
+            }
+            break;
+        }
+    } // processItems
+
+    // the vertical pass of morphologyLine() on columns [x1,x2), processing whole rows of the strip at once.
+    // The inner loops are branch-free min/max over contiguous rows, and Op::apply() has the semantics of
+    // minps/maxps: they are auto-vectorized at -O3 (about twice as fast as scalar code), and the pass is then
+    // limited by memory bandwidth, so explicit intrinsics would not help.
+    template <class Op>
+    void verticalStrip(int x1,
+                       int x2,
+                       std::vector<float>& buffer)
+    {
+        const int r = _radius;
+        const int k = 2 * r + 1;
+        const int w = x2 - x1;
+        const int m = _height + 2 * r; // padded height
+
+        buffer.resize( (std::size_t)(2 * m + 1) * w );
+        float *g = &buffer[0];
+        float *h = &buffer[(std::size_t)m * w];
+        float *identity = &buffer[(std::size_t)2 * m * w];
+        std::fill( identity, identity + w, Op::identity() );
+
+        for (int j = 0, b = 0; j < m; ++j, ++b) {
+            const int y = j - r;
+            const float *f = (0 <= y && y < _height) ? (_data + (std::size_t)y * _width + x1) : identity;
+            float *gj = g + (std::size_t)j * w;
+            if (b == k) {
+                b = 0;
+            }
+            if (b == 0) {
+                std::copy(f, f + w, gj);
+            } else {
+                const float *gp = gj - w;
+                for (int x = 0; x < w; ++x) {
+                    gj[x] = Op::apply(gp[x], f[x]);
+                }
+            }
+        }
+        for (int j = m - 1; j >= 0; --j) {
+            const int y = j - r;
+            const float *f = (0 <= y && y < _height) ? (_data + (std::size_t)y * _width + x1) : identity;
+            float *hj = h + (std::size_t)j * w;
+            if ( (j == m - 1) || ( (j + 1) % k == 0 ) ) {
+                std::copy(f, f + w, hj);
+            } else {
+                const float *hn = hj + w;
+                for (int x = 0; x < w; ++x) {
+                    hj[x] = Op::apply(hn[x], f[x]);
+                }
+            }
+        }
+        for (int y = 0; y < _height; ++y) {
+            const float *hy = h + (std::size_t)y * w;
+            const float *gy = g + (std::size_t)(y + 2 * r) * w;
+            float *dst = _data + (std::size_t)y * _width + x1;
+            for (int x = 0; x < w; ++x) {
+                dst[x] = Op::apply(hy[x], gy[x]);
+            }
+        }
+    } // verticalStrip
+
+    OFX::ImageEffect &_effect;
+    float *_data;
+    const int _width;
+    const int _height;
+    const bool _erode;
+    MorphologyPassEnum _pass;
+    int _radius;
+    std::vector<float> _copy;
+};
+
+/* Erode (or dilate, if erode is false) all channels of cimg by a box of size (2*rx+1)x(2*ry+1), or by an
+ * octagon inscribed in that box, with Neumann boundary conditions.
+ * The octagon is the sum of a box and of a diamond. The diamond of radius 2*d+1 is the sum of two diagonal
+ * segments of 2*d+1 pixels and of the 3x3 cross (the diagonal segments alone only cover every other pixel).
+ * Its proportions are those of a regular octagon, rounded so that the octagon fits exactly in the box.
+ */
+inline void
+cimgMorphology(OFX::ImageEffect &effect,
+               cimg_library::CImg<cimgpix_t>& cimg,
+               int rx,
+               int ry,
+               ElementEnum element,
+               bool erode)
+{
+    if ( (rx <= 0) && (ry <= 0) ) {
+        return;
+    }
+    const int width = cimg.width();
+    const int height = cimg.height();
+    const int rmin = std::min(rx, ry);
+    if ( (element == eElementBox) || (rmin <= 0) ) {
+        for (int c = 0; c < cimg.spectrum(); ++c) {
+            CImgMorphologyProcessor processor(effect, cimg.data(0, 0, 0, c), width, height, erode);
+            processor.process(eMorphologyPassHorizontal, rx);
+            processor.process(eMorphologyPassVertical, ry);
+        }
+
+        return;
+    }
+
+    const int d = std::max( 0, (int)std::floor( ( rmin * ( 2. - std::sqrt(2.) ) - 1. ) / 2. + 0.5 ) );
+    const int diamond = 2 * d + 1;
+    // the diagonal passes are not separable with respect to the image borders, so that the image is first
+    // padded by the radius of the diamond, with the values of the nearest pixels.
+    const int pwidth = width + 2 * diamond;
+    const int pheight = height + 2 * diamond;
+    std::vector<float> padded( (std::size_t)pwidth * pheight );
+    for (int c = 0; c < cimg.spectrum(); ++c) {
+        const cimgpix_t *src = cimg.data(0, 0, 0, c);
+        for (int y = 0; y < pheight; ++y) {
+            const cimgpix_t *srcRow = src + (std::size_t)std::max( 0, std::min(y - diamond, height - 1) ) * width;
+            float *dst = &padded[(std::size_t)y * pwidth];
+            for (int x = 0; x < pwidth; ++x) {
+                dst[x] = srcRow[std::max( 0, std::min(x - diamond, width - 1) )];
+            }
+        }
+        CImgMorphologyProcessor processor(effect, &padded.front(), pwidth, pheight, erode);
+        processor.process(eMorphologyPassHorizontal, rx - diamond);
+        processor.process(eMorphologyPassVertical, ry - diamond);
+        processor.process(eMorphologyPassDiagonal, d);
+        processor.process(eMorphologyPassAntiDiagonal, d);
+        processor.process(eMorphologyPassCross, 1);
+        if ( effect.abort() ) {
+            return;
+        }
+        cimgpix_t *dst = cimg.data(0, 0, 0, c);
+        for (int y = 0; y < height; ++y) {
+            const float *srcRow = &padded[(std::size_t)(y + diamond) * pwidth + diamond];
+            std::copy(srcRow, srcRow + width, dst + (std::size_t)y * width);
+        }
+    }
+} // cimgMorphology
+
+#endif // ifndef Misc_CImgMorphology_h
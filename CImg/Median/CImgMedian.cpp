@@ -25,6 +25,8 @@
 #include <cstring>
 #include <cfloat> // DBL_MAX
 #include <algorithm>
+#include <limits>
+#include <vector>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
 #endif
@@ -34,6 +36,7 @@
 #include "ofxsMacros.h"
 #include "ofxsCoords.h"
 #include "ofxsCopier.h"
+#include "ofxsMultiThread.h"
 
 #include "CImgFilter.h"
 
@@ -45,7 +48,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping      "Filter"
 #define kPluginDescription \
     "Apply a median filter to input images. Pixel values within a square box of the given size around the current pixel are sorted, and the median value is output if it does not differ from the current value by more than the given. Median filtering is performed per-channel.\n" \
-    "Uses the 'blur_median' function from the CImg library.\n" \
+    "Large windows are processed in constant time per pixel using a sliding histogram. Values are quantized to 65536 levels over [0,1] for sizes up to 31, and to fewer levels for larger sizes (down to 4081 levels for sizes above 256), so that the memory used does not grow with the size. Values above 1 are quantized logarithmically, with as many levels per stop as per 8-bit step. This is exact for 8-bit images, and for 16-bit images with sizes up to 31. The quantization does not depend on the image, so that tiles give the same result. Small windows use the 'blur_median' function from the CImg library.\n" \
     "CImg is a free, open-source library distributed under the CeCILL-C " \
     "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
     "It can be used in commercial applications (see http://cimg.eu)."
@@ -54,8 +57,12 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: process tiles in parallel
+// version 2.2: constant-time median for large windows
+// version 2.3: fewer histogram levels for very large windows, do not clear the column histograms for each strip
+// version 2.4: quantize over a fixed range, so that tiles match
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 4 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1
 #define kSupportsTiles 1
@@ -84,6 +91,519 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamThresholdHint "Threshold used to discard pixels too far from the current pixel value in the median computation. A threshold value of zero disables the threshold."
 #define kParamThresholdDefault 1
 
+#define kMedianCImgSizeMax 5 // windows up to this size are faster with CImg's blur_median()
+#define kMedianStepsMax 257 // maximum number of quantization steps per 8-bit step, i.e. 16 bits over [0,1]
+#define kMedianStepsMin 16 // minimum number of quantization steps per 8-bit step, i.e. 12 bits over [0,1]
+#define kMedianStops 32 // values above 1 are quantized logarithmically, up to 2^kMedianStops
+#define kMedianStripBytes (16 * 1024 * 1024) // maximum size of the column histograms of a thread
+#define kMedianStripWidthMin 16
+
+
+/* The sorted values of a channel, used as histogram levels.
+ * Values are quantized to fixed buckets, which do not depend on the image, so that all tiles give the same result:
+ * the absolute value is quantized in 255*steps steps over [0,1], and in steps steps per stop above 1, and each
+ * non-empty bucket is a level whose value is the center of the bucket.
+ * 8-bit values are exact, and so are 16-bit values if steps is 257. NaNs count as zero.
+ */
+struct MedianLevels
+{
+    int steps;
+    int kMax; // largest bucket index of positive values
+    std::vector<int> bucketLevel; // level of each bucket, or -1 if empty
+    std::vector<float> values; // value of each level, in increasing order
+
+    MedianLevels()
+        : steps(kMedianStepsMax)
+        , kMax(0)
+        , bucketLevel()
+        , values()
+    {
+    }
+
+    // the bucket index of v, from 0 (-infinity) to 2*kMax (+infinity)
+    int bucket(float v) const
+    {
+        const float a = std::abs(v);
+        int k;
+
+        if (a <= 1.f) {
+            k = (int)(a * (255 * steps) + 0.5f);
+        } else if ( !(a < std::numeric_limits<float>::infinity()) ) {
+            k = (a == a) ? kMax : 0;
+        } else {
+            // piecewise-linear log2 of a, exact at powers of 2
+            int e;
+            const float m = std::frexp(a, &e); // a = m * 2^e, 0.5 <= m < 1
+            const float l = (e - 1) + (2.f * m - 1.f);
+            k = 255 * steps + 1 + std::min( (int)(l * steps), kMedianStops * steps - 1 );
+        }
+
+        return (v < 0.f) ? (kMax - k) : (kMax + k);
+    }
+
+    // the value at the center of bucket b
+    float bucketValue(int b) const
+    {
+        const int k = std::abs(b - kMax);
+        float a;
+
+        if (k <= 255 * steps) {
+            a = k / (float)(255 * steps);
+        } else {
+            const float l = (k - 255 * steps - 1 + 0.5f) / steps;
+            const int e = (int)l;
+            a = std::ldexp(1.f + (l - e), e);
+        }
+
+        return (b < kMax) ? -a : a;
+    }
+
+    int level(float v) const
+    {
+        return bucketLevel[bucket(v)];
+    }
+
+    void build(const cimgpix_t *data,
+               std::size_t n,
+               int s)
+    {
+        steps = s;
+        kMax = 255 * steps + kMedianStops * steps;
+        const int nBuckets = 2 * kMax + 1;
+        bucketLevel.assign(nBuckets, -1);
+        for (std::size_t i = 0; i < n; ++i) {
+            bucketLevel[bucket(data[i])] = 0;
+        }
+        values.clear();
+        for (int b = 0; b < nBuckets; ++b) {
+            if (bucketLevel[b] == 0) {
+                bucketLevel[b] = (int)values.size();
+                values.push_back( bucketValue(b) );
+            }
+        }
+    }
+
+    // The number of quantization steps for a window radius: the column histograms of a strip at least as wide as
+    // the window (2*radius+1 columns, plus 2*radius columns of margin) fit in kMedianStripBytes if the image has
+    // no values outside of [0,1], so that updating the column histograms costs a few operations per pixel.
+    static int stepsForRadius(int radius)
+    {
+        const std::size_t columns = 4 * (std::size_t)radius + 1;
+        int steps = kMedianStepsMax;
+
+        while ( (steps > kMedianStepsMin) && (columns * (255 * steps + 1) * sizeof(unsigned short) > kMedianStripBytes) ) {
+            steps = (steps == kMedianStepsMax) ? 128 : steps / 2;
+        }
+
+        return steps;
+    }
+};
+
+// The two-level histogram of the window [x1,x2) of the current row, computed from the column histograms.
+struct MedianWindow
+{
+    int *coarse;
+    int *fine;
+    int *fineX1; // columns [fineX1,fineX2) are in the fine segment
+    int *fineX2;
+    int *fineRow; // the row for which the fine segment is valid
+    const unsigned short *columnCoarse;
+    const unsigned short *columnFine;
+    int hx1; // the first column of the column histograms
+    const cimgpix_t *src;
+    const MedianLevels *levels;
+    int width;
+    int height;
+    int radius;
+    int nLevels;
+    int fineBits;
+    int nCoarse;
+    int row;
+    int x1;
+    int x2;
+    int n; // number of values in the window
+
+    // add (n = 1) or remove (n = -1) column x to the coarse histogram
+    void addColumn(int x,
+                   int n)
+    {
+        const unsigned short *cc = columnCoarse + (std::size_t)(x - hx1) * nCoarse;
+
+        for (int b = 0; b < nCoarse; ++b) {
+            coarse[b] += n * cc[b];
+        }
+    }
+
+    // add (n = 1) or remove (n = -1) columns [from,to) to the fine segment f, which starts at level l1
+    void addColumns(int *f,
+                    int l1,
+                    int size,
+                    int from,
+                    int to,
+                    int n) const
+    {
+        for (int x = from; x < to; ++x) {
+            const unsigned short *cf = columnFine + (std::size_t)(x - hx1) * nLevels + l1;
+            for (int i = 0; i < size; ++i) {
+                f[i] += n * cf[i];
+            }
+        }
+    }
+
+    // add (n = 1) or remove (n = -1) the values of row y in columns [from,to) that are in the fine segment f
+    void addRowValues(int *f,
+                      int l1,
+                      int size,
+                      int y,
+                      int from,
+                      int to,
+                      int n) const
+    {
+        if ( (y < 0) || (y >= height) ) {
+            return;
+        }
+        const cimgpix_t *srcPix = src + (std::size_t)y * width + from;
+        for (int x = from; x < to; ++x, ++srcPix) {
+            const int i = levels->level(*srcPix) - l1;
+            if ( (0 <= i) && (i < size) ) {
+                f[i] += n;
+            }
+        }
+    }
+
+    // bring the fine segment b up to date, by adding and removing rows and columns or by recomputing it
+    int* updateFine(int b)
+    {
+        const int l1 = b << fineBits;
+        const int size = std::min(1 << fineBits, nLevels - l1);
+        int *f = fine + l1;
+        const int rows = row - fineRow[b];
+        const int incrementalCost = 2 * rows * (fineX2[b] - fineX1[b]) + ( std::abs(x1 - fineX1[b]) + std::abs(x2 - fineX2[b]) ) * size;
+
+        if ( incrementalCost > (x2 - x1) * size ) {
+            std::fill(f, f + size, 0);
+            addColumns(f, l1, size, x1, x2, 1);
+        } else {
+            // the rows that changed since the segment was updated, on the columns of the segment
+            for (int y = fineRow[b] + 1; y <= row; ++y) {
+                addRowValues(f, l1, size, y + radius, fineX1[b], fineX2[b], 1);
+                addRowValues(f, l1, size, y - radius - 1, fineX1[b], fineX2[b], -1);
+            }
+            // the columns that changed
+            addColumns(f, l1, size, fineX1[b], std::min(x1, fineX2[b]), -1);
+            addColumns(f, l1, size, std::max(x2, fineX1[b]), fineX2[b], -1);
+            addColumns(f, l1, size, x1, std::min(x2, fineX1[b]), 1);
+            addColumns(f, l1, size, std::max(x1, fineX2[b]), x2, 1);
+        }
+        fineRow[b] = row;
+        fineX1[b] = x1;
+        fineX2[b] = x2;
+
+        return f;
+    }
+
+    // number of values of the window below level l
+    int rank(int l)
+    {
+        if (l >= nLevels) {
+            return n;
+        }
+        const int b = l >> fineBits;
+        int res = 0;
+        for (int i = 0; i < b; ++i) {
+            res += coarse[i];
+        }
+        const int *f = updateFine(b);
+        for (int i = 0; i < l - (b << fineBits); ++i) {
+            res += f[i];
+        }
+
+        return res;
+    }
+
+    // level of the k-th smallest value of the window (k starts at 0)
+    int kth(int k)
+    {
+        int b = 0;
+
+        while (b < nCoarse - 1 && k >= coarse[b]) {
+            k -= coarse[b];
+            ++b;
+        }
+        const int *f = updateFine(b);
+        const int size = std::min(1 << fineBits, nLevels - (b << fineBits));
+        int i = 0;
+        while (i < size - 1 && k >= f[i]) {
+            k -= f[i];
+            ++i;
+        }
+
+        return (b << fineBits) + i;
+    }
+};
+
+/* Constant-time median filter (Perreault and Hebert, "Median Filtering in Constant Time", 2007).
+ * Each thread processes vertical strips of the image. A histogram of each column of the strip is updated when moving
+ * to the next row, and the histogram of the window is updated by adding and removing columns when moving to the next pixel.
+ * Histograms have two levels: the coarse histogram of the window is always up to date, while each fine segment is
+ * only updated when the median falls in it, from the rows and columns that changed since its last update.
+ * The window is clipped at the image borders, and the median of an even number of values is the mean of the two
+ * middle values, as in CImg's blur_median().
+ */
+class CImgMedianProcessor
+    : public OFX::MultiThread::Processor
+{
+public:
+    CImgMedianProcessor(OFX::ImageEffect &effect,
+                        const cimg_library::CImg<cimgpix_t>& src,
+                        cimgpix_t *dst,
+                        const std::vector<MedianLevels>& levels,
+                        int radius,
+                        float threshold)
+        : _effect(effect)
+        , _src(src)
+        , _dst(dst)
+        , _levels(levels)
+        , _radius(radius)
+        , _threshold(threshold)
+        , _stripWidth(0)
+        , _nStrips(0)
+    {
+    }
+
+    void process()
+    {
+        const int width = _src.width();
+        int nLevelsMax = 1;
+
+        for (std::size_t c = 0; c < _levels.size(); ++c) {
+            nLevelsMax = std::max( nLevelsMax, (int)_levels[c].values.size() );
+        }
+        // nested calls to the multithread suite run on a single thread (e.g. when rendering tiles)
+        const unsigned int nCPUs = OFX::MultiThread::isSpawnedThread() ? 1 : OFX::MultiThread::getNumCPUs();
+        const int columnsMax = kMedianStripBytes / (int)( nLevelsMax * sizeof(unsigned short) );
+        _stripWidth = std::max(kMedianStripWidthMin, columnsMax - 2 * _radius);
+        _stripWidth = std::min( _stripWidth, (width + (int)nCPUs - 1) / (int)nCPUs );
+        _stripWidth = std::max(1, _stripWidth);
+        _nStrips = (width + _stripWidth - 1) / _stripWidth;
+        multiThread( std::min(nCPUs, (unsigned int)_nStrips) );
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int width = _src.width();
+        std::vector<unsigned short> columnCoarse;
+        std::vector<unsigned short> columnFine;
+
+        for (int s = (int)threadId; s < _nStrips; s += (int)nThreads) {
+            const int x1 = s * _stripWidth;
+            const int x2 = std::min(width, x1 + _stripWidth);
+            for (int c = 0; c < _src.spectrum(); ++c) {
+                if ( !processStrip(x1, x2, c, columnCoarse, columnFine) ) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // add (n = 1) or remove (n = -1) row y to the column histograms and to the window
+    void addRow(const MedianLevels& lv,
+                const cimgpix_t *src,
+                int y,
+                int hx2,
+                int n,
+                unsigned short *columnCoarse,
+                unsigned short *columnFine,
+                MedianWindow& w)
+    {
+        const cimgpix_t *srcPix = src + (std::size_t)y * _src.width() + w.hx1;
+
+        for (int x = w.hx1; x < hx2; ++x, ++srcPix) {
+            const int l = lv.level(*srcPix);
+            assert(l >= 0);
+            const int b = l >> w.fineBits;
+            columnCoarse[(std::size_t)(x - w.hx1) * w.nCoarse + b] += n;
+            columnFine[(std::size_t)(x - w.hx1) * w.nLevels + l] += n;
+            if ( (w.x1 <= x) && (x < w.x2) ) {
+                w.coarse[b] += n;
+            }
+        }
+    }
+
+    bool processStrip(int x1,
+                      int x2,
+                      int c,
+                      std::vector<unsigned short>& columnCoarseBuffer,
+                      std::vector<unsigned short>& columnFineBuffer)
+    {
+        const MedianLevels& lv = _levels[c];
+        const int width = _src.width();
+        const int height = _src.height();
+        const int r = _radius;
+        const cimgpix_t *src = _src.data(0, 0, 0, c);
+        cimgpix_t *dst = _dst + (std::size_t)width * height * c;
+        const int nLevels = (int)lv.values.size();
+
+        if (nLevels <= 1) {
+            // constant channel
+            for (int y = 0; y < height; ++y) {
+                std::copy(src + (std::size_t)y * width + x1, src + (std::size_t)y * width + x2, dst + (std::size_t)y * width + x1);
+            }
+
+            return true;
+        }
+
+        // fine segments have 2^fineBits levels
+        int fineBits = 0;
+        while ( (1 << (2 * fineBits)) < nLevels ) {
+            ++fineBits;
+        }
+        const int nCoarse = ( nLevels + (1 << fineBits) - 1 ) >> fineBits;
+
+        // column histograms.
+        // The buffers are zero when a strip starts: the rows left in the histograms are removed at the end of each
+        // strip, which costs less than clearing the buffers, and they are only cleared when they grow.
+        const int hx1 = std::max(0, x1 - r);
+        const int hx2 = std::min(width, x2 + r);
+        if ( columnCoarseBuffer.size() < (std::size_t)(hx2 - hx1) * nCoarse ) {
+            columnCoarseBuffer.resize( (std::size_t)(hx2 - hx1) * nCoarse, 0 );
+        }
+        if ( columnFineBuffer.size() < (std::size_t)(hx2 - hx1) * nLevels ) {
+            columnFineBuffer.resize( (std::size_t)(hx2 - hx1) * nLevels, 0 );
+        }
+        unsigned short *columnCoarse = &columnCoarseBuffer.front();
+        unsigned short *columnFine = &columnFineBuffer.front();
+
+        // the window starts empty at the first pixel of the strip, and rows are added one at a time.
+        // Rows are scanned alternately left to right and right to left, so that the window is only updated
+        // by the row changes at the end of each row, and fine segments can be updated from the previous row.
+        std::vector<int> coarse(nCoarse, 0);
+        std::vector<int> fine(nCoarse << fineBits, 0);
+        std::vector<int> fineX1( nCoarse, std::max(0, x1 - r) );
+        std::vector<int> fineX2( nCoarse, std::min(width, x1 + r + 1) );
+        std::vector<int> fineRow(nCoarse, -r - 1);
+        MedianWindow w = { &coarse.front(), &fine.front(), &fineX1.front(), &fineX2.front(), &fineRow.front(),
+                           columnCoarse, columnFine, hx1, src, &lv, width, height, r, nLevels, fineBits, nCoarse,
+                           -r - 1, fineX1[0], fineX2[0], 0 };
+        bool forward = true;
+
+        for (int y = -r; y < height; ++y) {
+            if ( (y >= 0) && _effect.abort() ) {
+                return false;
+            }
+            w.row = y;
+            if (y + r < height) {
+                addRow(lv, src, y + r, hx2, 1, columnCoarse, columnFine, w);
+            }
+            if (y - r - 1 >= 0) {
+                addRow(lv, src, y - r - 1, hx2, -1, columnCoarse, columnFine, w);
+            }
+            if (y < 0) {
+                continue;
+            }
+            const int nRows = std::min(height - 1, y + r) - std::max(0, y - r) + 1;
+            const cimgpix_t *srcRow = src + (std::size_t)y * width;
+            cimgpix_t *dstRow = dst + (std::size_t)y * width;
+            for (int i = 0; i < x2 - x1; ++i) {
+                const int x = forward ? (x1 + i) : (x2 - 1 - i);
+                if (i > 0) {
+                    // slide the window
+                    if (forward) {
+                        if (x - r - 1 >= 0) {
+                            w.addColumn(x - r - 1, -1);
+                            ++w.x1;
+                        }
+                        if (x + r < width) {
+                            w.addColumn(x + r, 1);
+                            ++w.x2;
+                        }
+                    } else {
+                        if (x + r + 1 < width) {
+                            w.addColumn(x + r + 1, -1);
+                            --w.x2;
+                        }
+                        if (x - r >= 0) {
+                            w.addColumn(x - r, 1);
+                            --w.x1;
+                        }
+                    }
+                }
+                w.n = (w.x2 - w.x1) * nRows;
+
+                int first = 0; // rank of the first value of the window that is within the threshold
+                int count = w.n; // number of values of the window within the threshold
+                if (_threshold > 0) {
+                    const float val0 = srcRow[x];
+                    first = w.rank( lowerLevel(lv, val0) );
+                    count = w.rank( upperLevel(lv, val0) ) - first;
+                    if (count <= 0) {
+                        dstRow[x] = val0;
+                        continue;
+                    }
+                }
+                const float res = lv.values[w.kth(first + count / 2)];
+                dstRow[x] = (count % 2) ? res : (cimgpix_t)( ( res + lv.values[w.kth(first + count / 2 - 1)] ) / 2 );
+            }
+            forward = !forward;
+        }
+        // remove the remaining rows, so that the column histograms are zero for the next strip
+        for (int y = std::max(0, height - r - 1); y < height; ++y) {
+            addRow(lv, src, y, hx2, -1, columnCoarse, columnFine, w);
+        }
+
+        return true;
+    } // processStrip
+
+    // first level l such that values[l] - val0 >= -threshold
+    int lowerLevel(const MedianLevels& lv,
+                   float val0) const
+    {
+        int lo = 0;
+        int hi = (int)lv.values.size();
+
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (lv.values[mid] - val0 < -_threshold) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+
+    // first level l such that values[l] - val0 > threshold
+    int upperLevel(const MedianLevels& lv,
+                   float val0) const
+    {
+        int lo = 0;
+        int hi = (int)lv.values.size();
+
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (lv.values[mid] - val0 <= _threshold) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+
+    OFX::ImageEffect &_effect;
+    const cimg_library::CImg<cimgpix_t>& _src;
+    cimgpix_t *_dst;
+    const std::vector<MedianLevels>& _levels;
+    const int _radius;
+    const float _threshold;
+    int _stripWidth;
+    int _nStrips;
+};
+
 
 /// Median plugin
 struct CImgMedianParams
@@ -136,9 +656,30 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        cimg.blur_median( (unsigned int)std::floor(std::max(1, params.size) * args.renderScale.x) * 2 + 1, params.threshold );
+        const int radius = (int)std::floor(std::max(1, params.size) * args.renderScale.x);
+        if (radius * 2 + 1 <= kMedianCImgSizeMax) {
+            cimg.blur_median( (unsigned int)radius * 2 + 1, params.threshold );
+
+            return;
+        }
+        const std::size_t channelSize = (std::size_t)cimg.width() * cimg.height();
+        std::vector<MedianLevels> levels( cimg.spectrum() );
+        const int steps = MedianLevels::stepsForRadius(radius);
+        for (int c = 0; c < cimg.spectrum(); ++c) {
+            levels[c].build(cimg.data(0, 0, 0, c), channelSize, steps);
+        }
+        if ( abort() ) {
+            return;
+        }
+        std::vector<cimgpix_t> res( channelSize * cimg.spectrum() );
+        CImgMedianProcessor processor(*this, cimg, &res.front(), levels, radius, (float)params.threshold);
+        processor.process();
+        std::copy( res.begin(), res.end(), cimg.data() );
     }
 
+    // the result only depends on the neighborhood given by getRoI(), so that tiles can be processed in parallel
+    virtual bool isLocal(const CImgMedianParams& /*params*/) OVERRIDE FINAL { return true; }
+
     virtual bool isIdentity(const OFX::IsIdentityArguments &args,
                             const CImgMedianParams& params) OVERRIDE FINAL
     {
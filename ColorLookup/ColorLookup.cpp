@@ -50,7 +50,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription \
     "Apply a parametric lookup curve to each channel separately.\n" \
     "The master curve is combined with the red, green and blue curves, but not with the alpha curve.\n" \
-    "Computation is faster for values that are within the given range.\n" \
+    "Computation is faster for values that are within the given range: values outside of this range are computed from a coarser lookup table, with log-spaced samples.\n" \
     "\n" \
     "Note that you can easily do color remapping by setting Source and Target colors and clicking \"Set RGB\" or \"Set RGBA\" below.\n" \
     "This will add control points on the curve to match the target from the source. You can add as many point as you like.\n" \
@@ -58,7 +58,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginIdentifier "net.sf.openfx.ColorLookupPlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -113,7 +113,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamRange "range"
 #define kParamRangeLabel "Range"
-#define kParamRangeHint "Expected range for input values. Within this range, a lookup table is used for faster computation."
+#define kParamRangeHint "Expected range for input values. Within this range, a lookup table is used for faster computation. Outside of this range, a coarser lookup table with log-spaced samples is used, and the curves are extrapolated linearly beyond 65536 times the range width."
 
 #define kParamClampBlack "clampBlack"
 #define kParamClampBlackLabel "Clamp Black"
@@ -132,6 +132,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kCurveAlpha 4
 #define kCurveNb 5
 
+// Outside of the range, the curves are sampled in kExtOctaves octaves of the range width on each side,
+// with kExtSamplesPerOctave linearly spaced samples in each octave.
+#define kExtOctaves 16
+#define kExtSamplesPerOctave 32
+
 
 class ColorLookupProcessorBase
     : public OFX::ImageProcessor
@@ -268,20 +273,36 @@ public:
         assert( (PIX)maxValue == maxValue );
         // except for float, maxValue is the same as nbValues
         assert( maxValue == 1 || (maxValue == nbValues) );
+        const int nbExtValues = kExtOctaves * kExtSamplesPerOctave;
         for (int component = 0; component < nComponents; ++component) {
             _lookupTable[component].resize(nbValues + 1);
-            int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
-            for (int position = 0; position <= nbValues; ++position) {
-                // position to evaluate the param at
-                double parametricPos = _rangeMin + (_rangeMax - _rangeMin) * double(position) / nbValues;
-
-                // evaluate the parametric param
-                double value = _lookupTableParam->getValue(lutIndex, _time, parametricPos);
-                if ( (nComponents != 1) && (lutIndex != kCurveAlpha) ) {
-                    value += _lookupTableParam->getValue(kCurveMaster, _time, parametricPos) - parametricPos;
-                }
-                // set that in the lut
-                _lookupTable[component][position] = (float)clamp<PIX>(value, maxValue);
+            _lookupTableAbove[component].resize(nbExtValues + 1);
+            _lookupTableBelow[component].resize(nbExtValues + 1);
+        }
+        float values[nComponents];
+        for (int position = 0; position <= nbValues; ++position) {
+            // position to evaluate the param at
+            double parametricPos = _rangeMin + (_rangeMax - _rangeMin) * double(position) / nbValues;
+
+            evaluateCurves(parametricPos, values);
+            for (int component = 0; component < nComponents; ++component) {
+                _lookupTable[component][position] = values[component];
+            }
+        }
+        // the extended tables: sample j is at (s - 1) range widths from the range, with s = 2^o * (1 + i / kExtSamplesPerOctave),
+        // where o = j / kExtSamplesPerOctave and i = j % kExtSamplesPerOctave (see interpolateExtended())
+        for (int position = 0; position <= nbExtValues; ++position) {
+            const int o = position / kExtSamplesPerOctave;
+            const int i = position % kExtSamplesPerOctave;
+            const double offset = (_rangeMax - _rangeMin) * ( std::ldexp(1. + double(i) / kExtSamplesPerOctave, o) - 1. );
+
+            evaluateCurves(_rangeMax + offset, values);
+            for (int component = 0; component < nComponents; ++component) {
+                _lookupTableAbove[component][position] = values[component];
+            }
+            evaluateCurves(_rangeMin - offset, values);
+            for (int component = 0; component < nComponents; ++component) {
+                _lookupTableBelow[component][position] = values[component];
             }
         }
     }
@@ -331,19 +352,66 @@ private:
         }
     }
 
-    // on input to interpolate, value should be normalized to the [0-1] range
-    float interpolate(int component,
-                      float value)
+    // evaluate the curves of all components at parametricPos.
+    // The master curve is only evaluated once, and combined with the red, green and blue curves.
+    void evaluateCurves(double parametricPos,
+                        float values[nComponents])
     {
-        if ( (value < _rangeMin) || (_rangeMax < value) ) {
-            // slow version
+        double master = 0.;
+
+        if (nComponents != 1) {
+            master = _lookupTableParam->getValue(kCurveMaster, _time, parametricPos) - parametricPos;
+        }
+        for (int component = 0; component < nComponents; ++component) {
             int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
-            double ret = _lookupTableParam->getValue(lutIndex, _time, value);
+            double value = _lookupTableParam->getValue(lutIndex, _time, parametricPos);
             if ( (nComponents != 1) && (lutIndex != kCurveAlpha) ) {
-                ret += _lookupTableParam->getValue(kCurveMaster, _time, value) - value;
+                value += master;
             }
+            values[component] = clamp<PIX>( (float)value, maxValue );
+        }
+    }
+
+    // interpolate in an extended table, s >= 1 being the distance to the range in range widths, plus one
+    static float interpolateExtended(const std::vector<float> &table,
+                                     double s)
+    {
+        const int last = kExtOctaves * kExtSamplesPerOctave;
+        const double sLast = double(1 << kExtOctaves);
+
+        if (s < sLast) {
+            int e;
+            const double m = std::frexp(s, &e); // s = m * 2^e, with 0.5 <= m < 1
+            const double x = (2. * m - 1.) * kExtSamplesPerOctave; // the position in octave e-1, in samples
+            const int i = std::min( (int)x, kExtSamplesPerOctave - 1 );
+            const int j = (e - 1) * kExtSamplesPerOctave + i;
+            assert(0 <= j && j < last);
+            const float alpha = (float)(x - i);
+
+            return table[j] * (1.f - alpha) + table[j + 1] * alpha;
+        }
+        // extrapolate linearly from the last segment
+        const double sPrev = sLast * (1. - 0.5 / kExtSamplesPerOctave);
+        const float delta = table[last] - table[last - 1];
+        if (delta == 0.f) {
+            return table[last];
+        }
+
+        return table[last] + (float)( delta * (s - sLast) / (sLast - sPrev) );
+    }
+
+    // on input to interpolate, value should be normalized to the [0-1] range
+    float interpolate(int component,
+                      float value)
+    {
+        if (value < _rangeMin) {
+            double s = 1. + (_rangeMin - value) / (_rangeMax - _rangeMin);
+
+            return clamp<PIX>(interpolateExtended(_lookupTableBelow[component], s), maxValue);
+        } else if (_rangeMax < value) {
+            double s = 1. + (value - _rangeMax) / (_rangeMax - _rangeMin);
 
-            return (float)clamp<PIX>(ret, maxValue);;
+            return clamp<PIX>(interpolateExtended(_lookupTableAbove[component], s), maxValue);
         } else {
             float x = (float)(value - _rangeMin) / (float)(_rangeMax - _rangeMin);
             int i = (int)(x * nbValues);
@@ -358,6 +426,8 @@ private:
 
 private:
     std::vector<float> _lookupTable[nComponents];
+    std::vector<float> _lookupTableAbove[nComponents]; // log-spaced samples above _rangeMax
+    std::vector<float> _lookupTableBelow[nComponents]; // log-spaced samples below _rangeMin
     OFX::ParametricParam*  _lookupTableParam;
     double _time;
     double _rangeMin;
@@ -48,7 +48,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginIdentifier    "net.sf.openfx.Deinterlace"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 0
 #define kSupportsMultiResolution 0
@@ -130,6 +130,64 @@ enum YadifModeEnum
     eYadifModeTemporal,
 };
 
+class DeinterlaceProcessorBase
+    : public OFX::ImageProcessor
+{
+protected:
+    const OFX::Image *_srcPrevImg;
+    const OFX::Image *_srcImg;
+    const OFX::Image *_srcNextImg;
+    int _mode;
+    int _parity;
+    int _tff;
+
+public:
+    DeinterlaceProcessorBase(OFX::ImageEffect &instance)
+        : OFX::ImageProcessor(instance)
+        , _srcPrevImg(0)
+        , _srcImg(0)
+        , _srcNextImg(0)
+        , _mode(0)
+        , _parity(0)
+        , _tff(0)
+    {
+    }
+
+    /** @brief set the previous, current and next source images. The previous and next images may be NULL. */
+    void setSrcImgs(const OFX::Image *srcPrev,
+                    const OFX::Image *src,
+                    const OFX::Image *srcNext)
+    {
+        _srcPrevImg = srcPrev;
+        _srcImg = src;
+        _srcNextImg = srcNext;
+    }
+
+    void setValues(int mode,
+                   int parity,
+                   int tff)
+    {
+        _mode = mode;
+        _parity = parity;
+        _tff = tff;
+    }
+};
+
+// the processor is split by rows: each row only depends on the rows around it in the source images
+template <int nComponents, typename Comp, typename Diff>
+class DeinterlaceProcessor
+    : public DeinterlaceProcessorBase
+{
+public:
+    DeinterlaceProcessor(OFX::ImageEffect &instance)
+        : DeinterlaceProcessorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL;
+};
+
 class DeinterlacePlugin
     : public OFX::ImageEffect
 {
@@ -139,14 +197,19 @@ public:
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         _srcClip = getContext() == OFX::eContextGenerator ? NULL : fetchClip(kOfxImageEffectSimpleSourceClipName);
 
-        mode = fetchChoiceParam("mode");
-        fieldOrder = fetchChoiceParam("fieldOrder");
-        parity = fetchChoiceParam("parity");
+        mode = fetchChoiceParam(kParamYadifMode);
+        fieldOrder = fetchChoiceParam(kParamFieldOrder);
+        parity = fetchChoiceParam(kParamParity);
     }
 
 private:
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
 
+    template <int nComponents>
+    void renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
+    void setupAndProcess(DeinterlaceProcessorBase &, const OFX::RenderArguments &args);
+
     /** @brief get the clip preferences */
     virtual void getClipPreferences(OFX::ClipPreferencesSetter &clipPreferences) OVERRIDE FINAL;
 
@@ -274,12 +337,12 @@ one1(float *) { return 0.f; }
  \
     dst[0] = (Comp)spatial_pred; \
  \
-    dst += ch; \
-    cur += ch; \
-    prev += ch; \
-    next += ch; \
-    prev2 += ch; \
-    next2 += ch; \
+    ++dst; \
+    ++cur; \
+    ++prev; \
+    ++next; \
+    ++prev2; \
+    ++next2; \
     }
 
 template<int ch, typename Comp, typename Diff>
@@ -302,10 +365,12 @@ filter_line_c(Comp *dst1,
     const Comp *prev2 = parity ? prev : cur;
     const Comp *next2 = parity ? cur  : next;
 
-    /* The function is called with the pointers already pointing to data[3] and
-     * with 6 subtracted from the width.  This allows the FILTER macro to be
+    /* The function is called with the pointers already pointing to pixel 3 and
+     * with 6 pixels subtracted from the width.  This allows the FILTER macro to be
      * called so that it processes all the pixels normally.  A constant value of
-     * true for is_not_edge lets the compiler ignore the if statement. */
+     * true for is_not_edge lets the compiler ignore the if statement.
+     * w is a number of samples: the channels of each pixel are processed in the
+     * same unit-stride loop, which the compiler can vectorize. */
     FILTER(0, w, 1)
 }
 
@@ -332,7 +397,7 @@ filter_edges(Comp *dst1,
 
     /* Only edge pixels need to be processed here.  A constant value of false
      * for is_not_edge should let the compiler ignore the whole branch. */
-    FILTER(0, 3, 0)
+    FILTER(0, 3 * ch, 0)
 
     dst  = dst1  + (w - 3) * ch;
     prev = prev1 + (w - 3) * ch;
@@ -341,7 +406,7 @@ filter_edges(Comp *dst1,
     prev2 = parity ? prev : cur;
     next2 = parity ? cur  : next;
 
-    FILTER(w - 3, w, 0)
+    FILTER(0, 3 * ch, 0)
 }
 
 #if 0
@@ -372,86 +437,67 @@ interpolate(float *dst,
 }
 #endif
 
+// filter row y of an image of height h.
+// The pointers point to the start of row y, and refs is the distance between two rows, in samples.
 template<int ch, typename Comp, typename Diff>
 static void
-filter_plane(int mode,
-             Comp *dst,
-             int dst_stride,
-             const Comp *prev0,
-             const Comp *cur0,
-             const Comp *next0,
-             int refs,
-             int w,
-             int h,
-             int parity,
-             int tff)
+filter_row(int mode,
+           Comp *dst,
+           const Comp *prev,
+           const Comp *cur,
+           const Comp *next,
+           int refs,
+           int w,
+           int y,
+           int h,
+           int parity,
+           int tff)
 {
-    int pix_3 = 3 * ch;
-
-    for (int y = 0; y < h; ++y) {
-        if ( ( (y ^ parity) & 1 ) ) {
-            const Comp *prev = prev0 + y * refs;
-            const Comp *cur = cur0 + y * refs;
-            const Comp *next = next0 + y * refs;
-            Comp *dst2 = dst + y * dst_stride;
-            int mode2 = y == 1 || y + 2 == h ? 2 : mode;
-
-            for (int c = 0; c < ch; ++c) {
-                filter_line_c<ch, Comp, Diff>(dst2 + c + pix_3, prev + c + pix_3, cur + c + pix_3, next + c + pix_3, w - 6,
-                                              y + 1 < h ? refs : -refs,
-                                              y ? -refs : refs,
-                                              parity ^ tff, mode2);
-                filter_edges<ch, Comp, Diff>(dst2 + c, prev + c, cur + c, next + c, w,
-                                             y + 1 < h ? refs : -refs,
-                                             y ? -refs : refs,
-                                             parity ^ tff, mode2);
-            }
-        } else {
-            std::memcpy( &dst[y * dst_stride],
-                         &cur0[y * refs], w * ch * sizeof(Comp) ); // copy original
-        }
+    if ( ( (y ^ parity) & 1 ) ) {
+        int pix_3 = 3 * ch;
+        int mode2 = y == 1 || y + 2 == h ? 2 : mode;
+        int prefs = y + 1 < h ? refs : -refs;
+        int mrefs = y ? -refs : refs;
+
+        filter_line_c<ch, Comp, Diff>(dst + pix_3, prev + pix_3, cur + pix_3, next + pix_3, (w - 6) * ch,
+                                      prefs, mrefs, parity ^ tff, mode2);
+        filter_edges<ch, Comp, Diff>(dst, prev, cur, next, w,
+                                     prefs, mrefs, parity ^ tff, mode2);
+    } else {
+        std::memcpy( dst, cur, w * ch * sizeof(Comp) ); // copy original
     }
 }
 
-template<int ch, typename Comp, typename Diff>
-static void
-filter_plane_ofx(int mode,
-                 OFX::Image *dst_,
-                 const OFX::Image *srcp,
-                 const OFX::Image *src,
-                 const OFX::Image *srcn,
-                 int parity,
-                 int tff)
-{
-    Comp *dst = (Comp*)dst_->getPixelData(); // change this when we support renderWindow
-    int dst_stride = dst_->getRowBytes() / sizeof(Comp);
-    const Comp *prev0 = (const Comp*)( srcp ? srcp->getPixelData() : src->getPixelData() );
-    const Comp *cur0 = (const Comp*)src->getPixelData();
-    const Comp *next0 = (const Comp*)( srcn ? srcn->getPixelData() : src->getPixelData() );
-    int refs = src->getRowBytes() / sizeof(Comp);
-    const OfxRectI bounds = dst_->getBounds();
-
-    filter_plane<ch, Comp, Diff>(mode, dst, dst_stride,
-                                 prev0, cur0, next0,
-                                 refs,
-                                 bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
-                                 parity, tff);
-}
-
 // =========== GNU Lesser General Public License code end =================
 
+template <int nComponents, typename Comp, typename Diff>
 void
-DeinterlacePlugin::render(const OFX::RenderArguments &args)
+DeinterlaceProcessor<nComponents, Comp, Diff>::multiThreadProcessImages(OfxRectI procWindow)
 {
-    if ( !kSupportsRenderScale && ( (args.renderScale.x != 1.) || (args.renderScale.y != 1.) ) ) {
-        OFX::throwSuiteStatusException(kOfxStatFailed);
+    assert(_dstImg && _srcImg);
+    const OfxRectI bounds = _dstImg->getBounds();
+    // the whole rows are processed (tiles are not supported)
+    assert(procWindow.x1 == bounds.x1 && procWindow.x2 == bounds.x2);
+    const int w = bounds.x2 - bounds.x1;
+    const int h = bounds.y2 - bounds.y1;
+    const int refs = _srcImg->getRowBytes() / (int)sizeof(Comp);
+
+    for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+        if ( _effect.abort() ) {
+            break;
+        }
+        Comp *dst = (Comp*)_dstImg->getPixelAddress(bounds.x1, y);
+        const Comp *cur = (const Comp*)_srcImg->getPixelAddress(bounds.x1, y);
+        const Comp *prev = _srcPrevImg ? (const Comp*)_srcPrevImg->getPixelAddress(bounds.x1, y) : cur;
+        const Comp *next = _srcNextImg ? (const Comp*)_srcNextImg->getPixelAddress(bounds.x1, y) : cur;
+        filter_row<nComponents, Comp, Diff>(_mode, dst, prev, cur, next, refs, w, y - bounds.y1, h, _parity, _tff);
     }
+}
 
-    OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
-    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
-
-    assert( kSupportsMultipleClipPARs   || !_srcClip || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio() );
-    assert( kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth() );
+void
+DeinterlacePlugin::setupAndProcess(DeinterlaceProcessorBase &processor,
+                                   const OFX::RenderArguments &args)
+{
     std::auto_ptr<OFX::Image> dst( _dstClip->fetchImage(args.time) );
     if ( !dst.get() ) {
         OFX::throwSuiteStatusException(kOfxStatFailed);
@@ -532,112 +578,65 @@ DeinterlacePlugin::render(const OFX::RenderArguments &args)
                 std::fill( lineStart, lineStart + lineLen, 0 );
             }
         }
+
+        return;
+    }
+
+    processor.setDstImg( dst.get() );
+    processor.setSrcImgs( srcp.get(), src.get(), srcn.get() );
+    processor.setRenderWindow(rect);
+    processor.setValues(imode, iparity, ifieldOrder);
+    processor.process();
+} // DeinterlacePlugin::setupAndProcess
+
+// the internal render function
+template <int nComponents>
+void
+DeinterlacePlugin::renderForComponents(const OFX::RenderArguments &args,
+                                       OFX::BitDepthEnum dstBitDepth)
+{
+    switch (dstBitDepth) {
+    case OFX::eBitDepthUByte: {
+        DeinterlaceProcessor<nComponents, unsigned char, int> fred(*this);
+        setupAndProcess(fred, args);
+        break;
+    }
+    case OFX::eBitDepthUShort: {
+        DeinterlaceProcessor<nComponents, unsigned short, int> fred(*this);
+        setupAndProcess(fred, args);
+        break;
+    }
+    case OFX::eBitDepthFloat: {
+        DeinterlaceProcessor<nComponents, float, float> fred(*this);
+        setupAndProcess(fred, args);
+        break;
+    }
+    default:
+        OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+void
+DeinterlacePlugin::render(const OFX::RenderArguments &args)
+{
+    if ( !kSupportsRenderScale && ( (args.renderScale.x != 1.) || (args.renderScale.y != 1.) ) ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+
+    OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+
+    assert( kSupportsMultipleClipPARs   || !_srcClip || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio() );
+    assert( kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth() );
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        renderForComponents<4>(args, dstBitDepth);
+    } else if (dstComponents == OFX::ePixelComponentRGB) {
+        renderForComponents<3>(args, dstBitDepth);
+    } else if (dstComponents == OFX::ePixelComponentXY) {
+        renderForComponents<2>(args, dstBitDepth);
     } else {
-        if (dstComponents == OFX::ePixelComponentRGBA) {
-            switch (dstBitDepth) {
-            case OFX::eBitDepthUByte:
-                filter_plane_ofx<4, unsigned char, int>(imode, // mode
-                                                        dst.get(),
-                                                        srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder); // parity, tff
-                break;
-
-            case OFX::eBitDepthUShort:
-                filter_plane_ofx<4, unsigned short, int>(imode, // mode
-                                                         dst.get(),
-                                                         srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder); // parity, tff
-                break;
-
-            case OFX::eBitDepthFloat:
-                filter_plane_ofx<4, float, float>(imode,   // mode
-                                                  dst.get(),
-                                                  srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
-                break;
-
-            default:
-                break;
-            }
-        } else if (dstComponents == OFX::ePixelComponentRGB) {
-            switch (dstBitDepth) {
-            case OFX::eBitDepthUByte:
-                filter_plane_ofx<3, unsigned char, int>(imode,   // mode
-                                                        dst.get(),
-                                                        srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder);  // parity, tff
-                break;
-
-            case OFX::eBitDepthUShort:
-                filter_plane_ofx<3, unsigned short, int>(imode,   // mode
-                                                         dst.get(),
-                                                         srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder);  // parity, tff
-                break;
-
-            case OFX::eBitDepthFloat:
-                filter_plane_ofx<3, float, float>(imode,   // mode
-                                                  dst.get(),
-                                                  srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
-                break;
-
-            default:
-                break;
-            }
-        } else if (dstComponents == OFX::ePixelComponentXY) {
-            switch (dstBitDepth) {
-            case OFX::eBitDepthUByte:
-                filter_plane_ofx<2, unsigned char, int>(imode,   // mode
-                                                        dst.get(),
-                                                        srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder);  // parity, tff
-                break;
-
-            case OFX::eBitDepthUShort:
-                filter_plane_ofx<2, unsigned short, int>(imode,   // mode
-                                                         dst.get(),
-                                                         srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder);  // parity, tff
-                break;
-
-            case OFX::eBitDepthFloat:
-                filter_plane_ofx<2, float, float>(imode,   // mode
-                                                  dst.get(),
-                                                  srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
-                break;
-
-            default:
-                break;
-            }
-        } else if (dstComponents == OFX::ePixelComponentAlpha) {
-            switch (dstBitDepth) {
-            case OFX::eBitDepthUByte:
-                filter_plane_ofx<1, unsigned char, int>(imode,   // mode
-                                                        dst.get(),
-                                                        srcp.get(), src.get(), srcn.get(),
-                                                        iparity, ifieldOrder);  // parity, tff
-                break;
-
-            case OFX::eBitDepthUShort:
-                filter_plane_ofx<1, unsigned short, int>(imode,   // mode
-                                                         dst.get(),
-                                                         srcp.get(), src.get(), srcn.get(),
-                                                         iparity, ifieldOrder);  // parity, tff
-                break;
-
-            case OFX::eBitDepthFloat:
-                filter_plane_ofx<1, float, float>(imode,   // mode
-                                                  dst.get(),
-                                                  srcp.get(), src.get(), srcn.get(),
-                                                  iparity, ifieldOrder);  // parity, tff
-                break;
-
-            default:
-                break;
-            }
-        }
+        assert(dstComponents == OFX::ePixelComponentAlpha);
+        renderForComponents<1>(args, dstBitDepth);
     }
 } // DeinterlacePlugin::render
 
@@ -27,10 +27,26 @@
 #include <climits> // for INT_MAX
 #include <cfloat>
 #include <cassert>
+#include <cstdlib> // for abs
 #include <algorithm>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
 
 #include "ofxsPixelProcessor.h"
 #include "ofxsMaskMix.h"
@@ -53,7 +69,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -109,18 +125,18 @@ enum OperationEnum
 
 #define kClipFgMName "FgM"
 
-#define kFrameChunk 4 // how many frames to process simultaneously
-
 
 class FrameBlendProcessorBase
     : public OFX::PixelProcessor
 {
 protected:
     const OFX::Image *_srcImg;
-    std::vector<const OFX::Image*> _srcImgs;
-    std::vector<const OFX::Image*> _fgMImgs;
+    const OFX::Image *_frameImg;
+    const OFX::Image *_fgMImg;
     float *_accumulatorData;
     unsigned short *_countData;
+    double *_sumData; // running sums of the sliding window cache, used instead of _accumulatorData if set
+    bool _subtract; // remove the frame from the running sums
     const OFX::Image *_maskImg;
     bool _processR;
     bool _processG;
@@ -137,10 +153,12 @@ public:
     FrameBlendProcessorBase(OFX::ImageEffect &instance)
         : OFX::PixelProcessor(instance)
         , _srcImg(0)
-        , _srcImgs(0)
-        , _fgMImgs(0)
+        , _frameImg(0)
+        , _fgMImg(0)
         , _accumulatorData(0)
         , _countData(0)
+        , _sumData(0)
+        , _subtract(false)
         , _maskImg(0)
         , _processR(true)
         , _processG(true)
@@ -154,15 +172,20 @@ public:
     {
     }
 
-    void setSrcImgs(const OFX::Image *src,
-                    const std::vector<const OFX::Image*> &v) {_srcImg = src; _srcImgs = v; }
+    void setSrcImg(const OFX::Image *v) {_srcImg = v; }
 
-    void setFgMImgs(const std::vector<const OFX::Image*> &v) {_fgMImgs = v; }
+    // the frame to fold into the accumulator, and its foreground matte
+    void setFrameImgs(const OFX::Image *frame,
+                      const OFX::Image *fgM) {_frameImg = frame; _fgMImg = fgM; }
 
     void setAccumulators(float *accumulatorData,
                          unsigned short *countData)
     {_accumulatorData = accumulatorData; _countData = countData; }
 
+    // only for eOperationAverage and eOperationSum
+    void setSums(double *sumData,
+                 bool subtract) {_sumData = sumData; _subtract = subtract; }
+
     void setMaskImg(const OFX::Image *v,
                     bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
 
@@ -191,6 +214,8 @@ private:
 };
 
 
+// The frames are blended one at a time: each pass folds one source frame into the float accumulator,
+// and the last pass computes the output image from the accumulator.
 template <class PIX, int nComponents, int maxValue, OperationEnum operation>
 class FrameBlendProcessor
     : public FrameBlendProcessorBase
@@ -205,8 +230,42 @@ private:
 
     virtual OperationEnum getOperation() OVERRIDE FINAL { return operation; };
 
+    template<class ACC, bool subtract>
+    static inline ACC blend(ACC acc,
+                            ACC v)
+    {
+        switch (operation) {
+        case eOperationAverage:
+        case eOperationSum:
+
+            return subtract ? (acc - v) : (acc + v);
+        case eOperationMin:
+
+            return std::min(acc, v);
+        case eOperationMax:
+
+            return std::max(acc, v);
+        case eOperationProduct:
+
+            return acc * v;
+        }
+
+        return acc;
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
     {
+        if (!_lastPass) {
+            if (_sumData) {
+                if (_subtract) {
+                    return accumulate<double, true>(procWindow, _sumData);
+                }
+
+                return accumulate<double, false>(procWindow, _sumData);
+            }
+
+            return accumulate<float, false>(procWindow, _accumulatorData);
+        }
 #     ifndef __COVERITY__ // too many coverity[dead_error_line] errors
         const bool r = _processR && (nComponents != 1);
         const bool g = _processG && (nComponents >= 2);
@@ -276,42 +335,90 @@ private:
 #     endif // ifndef __COVERITY__
     } // multiThreadProcessImages
 
-    template<bool processR, bool processG, bool processB, bool processA>
-    void process(const OfxRectI& procWindow)
+    // fold _frameImg into the accumulator, one row at a time.
+    // Pixels outside of the frame bounds count as black, pixels where the foreground matte is positive are skipped.
+    // If subtract is true, the frame is removed from the running sums instead.
+    template<class ACC, bool subtract>
+    void accumulate(const OfxRectI& procWindow,
+                    ACC *accumulatorData)
     {
         assert(1 <= nComponents && nComponents <= 4);
-        assert(!_lastPass || _dstPixelData);
-        assert( _srcImgs.size() == _fgMImgs.size() );
-        float tmpPix[nComponents];
-        float initVal = 0.;
-        if (!_accumulatorData) {
-            switch (operation) {
-            case eOperationAverage:
-                initVal = 0.;
-                break;
-            case eOperationMin:
-                initVal = std::numeric_limits<float>::infinity();
-                break;
-            case eOperationMax:
-                initVal = -std::numeric_limits<float>::infinity();
-                break;
-            case eOperationSum:
-                initVal = 0.;
-                break;
-            case eOperationProduct:
-                initVal = 1.;
+        assert(accumulatorData);
+        assert( !subtract || operation == eOperationAverage || operation == eOperationSum );
+        const OfxRectI frameBounds = _frameImg ? _frameImg->getBounds() : procWindow;
+        const int frameX1 = std::max(procWindow.x1, frameBounds.x1);
+        const int frameX2 = std::min(procWindow.x2, frameBounds.x2);
+        const OfxRectI fgMBounds = _fgMImg ? _fgMImg->getBounds() : procWindow;
+        const int fgMX1 = std::max(procWindow.x1, fgMBounds.x1);
+        const int fgMX2 = std::min(procWindow.x2, fgMBounds.x2);
+        const int renderWidth = _renderWindow.x2 - _renderWindow.x1;
+
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if ( _effect.abort() ) {
                 break;
             }
+
+            // accRow and countRow point to the pixel (_renderWindow.x1, y)
+            const size_t rowPix = (size_t)renderWidth * (y - _renderWindow.y1);
+            ACC *accRow = &accumulatorData[rowPix * nComponents];
+            unsigned short *countRow = _countData ? &_countData[rowPix] : 0;
+            const bool frameRow = _frameImg && frameX1 < frameX2 && frameBounds.y1 <= y && y < frameBounds.y2;
+            const PIX *srcPix = frameRow ? (const PIX *) _frameImg->getPixelAddress(frameX1, y) : 0;
+            const bool fgMRow = _fgMImg && fgMX1 < fgMX2 && fgMBounds.y1 <= y && y < fgMBounds.y2;
+            const PIX *fgMPix = fgMRow ? (const PIX *) _fgMImg->getPixelAddress(fgMX1, y) : 0;
+
+            if (!fgMPix) {
+                // every pixel of the row is used: this loop is trivially vectorizable
+                if (srcPix) {
+                    ACC *acc = &accRow[(frameX1 - _renderWindow.x1) * nComponents];
+                    const int n = (frameX2 - frameX1) * nComponents;
+                    for (int i = 0; i < n; ++i) {
+                        acc[i] = blend<ACC, subtract>(acc[i], srcPix[i]);
+                    }
+                }
+                if (countRow) {
+                    for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                        countRow[x - _renderWindow.x1] += subtract ? -1 : 1;
+                    }
+                }
+            } else {
+                for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                    // the foreground matte is an alpha image
+                    if ( (fgMX1 <= x) && (x < fgMX2) && (fgMPix[x - fgMX1] > 0) ) {
+                        continue;
+                    }
+                    if ( srcPix && (frameX1 <= x) && (x < frameX2) ) {
+                        ACC *acc = &accRow[(x - _renderWindow.x1) * nComponents];
+                        const PIX *src = &srcPix[(x - frameX1) * nComponents];
+                        for (int c = 0; c < nComponents; ++c) {
+                            acc[c] = blend<ACC, subtract>(acc[c], src[c]);
+                        }
+                    }
+                    if (countRow) {
+                        countRow[x - _renderWindow.x1] += subtract ? -1 : 1;
+                    }
+                }
+            }
         }
+    } // accumulate
+
+    // compute the output image from the accumulator
+    template<bool processR, bool processG, bool processB, bool processA>
+    void process(const OfxRectI& procWindow)
+    {
+        assert(1 <= nComponents && nComponents <= 4);
+        assert(_dstPixelData);
+        assert(_accumulatorData);
+        float tmpPix[nComponents];
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if ( _effect.abort() ) {
                 break;
             }
 
-            PIX *dstPix = _lastPass ? (PIX *) getDstPixelAddress(procWindow.x1, y) : 0;
-            assert(!_lastPass || dstPix);
-            if (_lastPass && !dstPix) {
+            PIX *dstPix = (PIX *) getDstPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            if (!dstPix) {
                 // coverity[dead_error_line]
                 continue;
             }
@@ -321,103 +428,131 @@ private:
                 size_t renderPix = ( (_renderWindow.x2 - _renderWindow.x1) * (y - _renderWindow.y1) +
                                      (x - _renderWindow.x1) );
                 int count = _countData ? _countData[renderPix] : 0;
-                if (_accumulatorData) {
-                    std::copy(&_accumulatorData[renderPix * nComponents], &_accumulatorData[renderPix * nComponents + nComponents], tmpPix);
-                } else {
-                    std::fill(tmpPix, tmpPix + nComponents, initVal);
-                }
-                // accumulate
-                for (unsigned i = 0; i < _srcImgs.size(); ++i) {
-                    const PIX *fgMPix = (const PIX *)  (_fgMImgs[i] ? _fgMImgs[i]->getPixelAddress(x, y) : 0);
-                    if ( !fgMPix || (*fgMPix <= 0) ) {
-                        const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
-                        if (srcPixi) {
-                            for (int c = 0; c < nComponents; ++c) {
-                                switch (operation) {
-                                case eOperationAverage:
-                                    tmpPix[c] += srcPixi[c];
-                                    break;
-                                case eOperationMin:
-                                    tmpPix[c] = std::min(tmpPix[c], (float)srcPixi[c]);
-                                    break;
-                                case eOperationMax:
-                                    tmpPix[c] = std::max(tmpPix[c], (float)srcPixi[c]);
-                                    break;
-                                case eOperationSum:
-                                    tmpPix[c] += srcPixi[c];
-                                    break;
-                                case eOperationProduct:
-                                    tmpPix[c] *= srcPixi[c];
-                                    break;
-                                }
-                            }
-                        }
-                        ++count;
+                std::copy(&_accumulatorData[renderPix * nComponents], &_accumulatorData[renderPix * nComponents + nComponents], tmpPix);
+                if (nComponents == 1) {
+                    int c = 0;
+                    if (_outputCount) {
+                        tmpPix[c] = count;
+                    } else if (operation == eOperationAverage) {
+                        tmpPix[c] =  (count ? (tmpPix[c] / count) : 0);
                     }
-                }
-                if (!_lastPass) {
-                    if (_countData) {
-                        _countData[renderPix] = count;
-                    }
-                    if (_accumulatorData) {
-                        std::copy(tmpPix, tmpPix + nComponents, &_accumulatorData[renderPix * nComponents]);
+                } else if ( (3 <= nComponents) && (nComponents <= 4) ) {
+                    if (operation == eOperationAverage) {
+                        for (int c = 0; c < 3; ++c) {
+                            tmpPix[c] = (count ? (tmpPix[c] / count) : 0);
+                        }
                     }
-                } else {
-                    // copy back original values from unprocessed channels
-                    if (nComponents == 1) {
-                        int c = 0;
+                    if (nComponents >= 4) {
+                        int c = nComponents - 1;
                         if (_outputCount) {
                             tmpPix[c] = count;
                         } else if (operation == eOperationAverage) {
                             tmpPix[c] =  (count ? (tmpPix[c] / count) : 0);
                         }
-                    } else if ( (3 <= nComponents) && (nComponents <= 4) ) {
-                        if (operation == eOperationAverage) {
-                            for (int c = 0; c < 3; ++c) {
-                                tmpPix[c] = (count ? (tmpPix[c] / count) : 0);
-                            }
-                        }
-                        if (nComponents >= 4) {
-                            int c = nComponents - 1;
-                            if (_outputCount) {
-                                tmpPix[c] = count;
-                            } else if (operation == eOperationAverage) {
-                                tmpPix[c] =  (count ? (tmpPix[c] / count) : 0);
-                            }
-                        }
                     }
-                    // tmpPix is not normalized, it is within [0,maxValue]
-                    ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking,
-                                                                     _maskImg, _mix, _maskInvert,
-                                                                     dstPix);
-                    // copy back original values from unprocessed channels
-                    if (nComponents == 1) {
-                        if (!processA) {
-                            dstPix[0] = srcPix ? srcPix[0] : PIX();
-                        }
-                    } else {
-                        if (!processR) {
-                            dstPix[0] = srcPix ? srcPix[0] : PIX();
-                        }
-                        if ( (nComponents >= 2) && !processG ) {
-                            dstPix[1] = srcPix ? srcPix[1] : PIX();
-                        }
-                        if ( (nComponents >= 3) && !processB ) {
-                            dstPix[2] = srcPix ? srcPix[2] : PIX();
-                        }
-                        if ( (nComponents >= 4) && !processA ) {
-                            dstPix[3] = srcPix ? srcPix[3] : PIX();
-                        }
+                }
+                // tmpPix is not normalized, it is within [0,maxValue]
+                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking,
+                                                                 _maskImg, _mix, _maskInvert,
+                                                                 dstPix);
+                // copy back original values from unprocessed channels
+                if (nComponents == 1) {
+                    if (!processA) {
+                        dstPix[0] = srcPix ? srcPix[0] : PIX();
+                    }
+                } else {
+                    if (!processR) {
+                        dstPix[0] = srcPix ? srcPix[0] : PIX();
+                    }
+                    if ( (nComponents >= 2) && !processG ) {
+                        dstPix[1] = srcPix ? srcPix[1] : PIX();
+                    }
+                    if ( (nComponents >= 3) && !processB ) {
+                        dstPix[2] = srcPix ? srcPix[2] : PIX();
+                    }
+                    if ( (nComponents >= 4) && !processA ) {
+                        dstPix[3] = srcPix ? srcPix[3] : PIX();
                     }
-                    // increment the dst pixel
-                    dstPix += nComponents;
                 }
+                // increment the dst pixel
+                dstPix += nComponents;
             }
         }
     } // process
 };
 
 
+/* The running sums of the frames blended by the last sequential render, for the Average and Sum operations.
+ * When the next frame is rendered with a relative frame range, all frames but one are shared with the
+ * previous render: the frames that left the range are subtracted from the sums, and the frames that entered
+ * the range are added, so that only two frames are fetched per render instead of the whole range.
+ * Double precision is used so that the sums do not drift over long sequences.
+ * A NaN or an infinite value cannot be subtracted from the sums: the cache is then not reused, and all frames are
+ * accumulated again until the frame that contains it leaves the range.
+ */
+struct SlidingWindowCache
+{
+    bool valid;
+    OfxRectI renderWindow;
+    OfxPointD renderScale;
+    OperationEnum operation;
+    int nComponents;
+    bool fgM;
+    int first; // the first frame of the range
+    int interval;
+    int n; // the number of frames
+    std::vector<double> sums; // renderWindow-sized, nComponents per pixel
+    std::vector<unsigned short> counts; // renderWindow-sized
+
+    SlidingWindowCache()
+        : valid(false)
+        , operation(eOperationAverage)
+        , nComponents(0)
+        , fgM(false)
+        , first(0)
+        , interval(1)
+        , n(0)
+        , sums()
+        , counts()
+    {
+        renderWindow.x1 = renderWindow.y1 = renderWindow.x2 = renderWindow.y2 = 0;
+        renderScale.x = renderScale.y = 1.;
+    }
+
+    // true if the frames from the same range were accumulated with the same parameters
+    bool isCompatible(const OfxRectI &renderWindow_,
+                      const OfxPointD &renderScale_,
+                      OperationEnum operation_,
+                      int nComponents_,
+                      bool fgM_,
+                      int interval_,
+                      int n_) const
+    {
+        return ( valid &&
+                 renderWindow.x1 == renderWindow_.x1 && renderWindow.y1 == renderWindow_.y1 &&
+                 renderWindow.x2 == renderWindow_.x2 && renderWindow.y2 == renderWindow_.y2 &&
+                 renderScale.x == renderScale_.x && renderScale.y == renderScale_.y &&
+                 operation == operation_ && nComponents == nComponents_ && fgM == fgM_ &&
+                 interval == interval_ && n == n_ );
+    }
+
+    // does not copy the buffers
+    void swap(SlidingWindowCache &other)
+    {
+        std::swap(valid, other.valid);
+        std::swap(renderWindow, other.renderWindow);
+        std::swap(renderScale, other.renderScale);
+        std::swap(operation, other.operation);
+        std::swap(nComponents, other.nComponents);
+        std::swap(fgM, other.fgM);
+        std::swap(first, other.first);
+        std::swap(interval, other.interval);
+        std::swap(n, other.n);
+        sums.swap(other.sums);
+        counts.swap(other.counts);
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class FrameBlendPlugin
@@ -444,6 +579,8 @@ public:
         , _mix(0)
         , _maskApply(0)
         , _maskInvert(0)
+        , _slidingWindowMutex()
+        , _slidingWindow()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert( _dstClip && (!_dstClip->isConnected() || _dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -494,6 +631,12 @@ private:
     /** @brief called when a param has just had its value changed */
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    /** @brief the sliding window cache is only used between these two calls */
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
 private:
 
     template<int nComponents>
@@ -505,6 +648,17 @@ private:
     template <class PIX, int nComponents, int maxValue, OperationEnum operation>
     void renderForOperation(const OFX::RenderArguments &args);
 
+    /* fetch the source image and foreground matte at time t, and fold them into the accumulator */
+    void accumulateFrame(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args, double t);
+
+    /* bring the sliding window cache to the given frame range, and copy it to the accumulators.
+       Returns false if the render was aborted. */
+    bool updateSlidingWindow(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args,
+                             int first, int interval, int n, int nComponents,
+                             float *accumulatorData, unsigned short *countData);
+
+    void clearSlidingWindow();
+
     // do not need to delete these, the ImageEffect is managing them for us
     OFX::Clip *_dstClip;
     OFX::Clip *_srcClip;
@@ -523,6 +677,8 @@ private:
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+    Mutex _slidingWindowMutex; //< protects _slidingWindow
+    SlidingWindowCache _slidingWindow;
 };
 
 
@@ -532,25 +688,6 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 // basic plugin render function, just a skelington to instantiate templates from
 
-// Since we cannot hold a std::auto_ptr in the vector we must hold a raw pointer.
-// To ensure that images are always freed even in case of exceptions, use a RAII class.
-struct OptionalImagesHolder_RAII
-{
-    std::vector<const OFX::Image*> images;
-
-    OptionalImagesHolder_RAII()
-        : images()
-    {
-    }
-
-    ~OptionalImagesHolder_RAII()
-    {
-        for (unsigned int i = 0; i < images.size(); ++i) {
-            delete images[i];
-        }
-    }
-};
-
 /* set up and run a processor */
 void
 FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
@@ -645,7 +782,7 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
     _frameInterval->getValueAtTime(time, interval);
     interval = std::max(1, interval);
 
-    int n = (max + 1 - min) / interval;
+    int n = (max - min) / interval + 1; // same frames as in getFramesNeeded()
     if (!absolute) {
         min += time;
         //max += time; // max is not used anymore
@@ -655,103 +792,213 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor,
     size_t nPixels = (renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
     OperationEnum operation = processor.getOperation();
 
+    // Initialize accumulator image (always use float)
+    int dstNComponents = _dstClip->getPixelComponentCount();
+    accumulator.reset( new OFX::ImageMemory(nPixels * dstNComponents * sizeof(float), this) );
+    accumulatorData = (float*)accumulator->lock();
+    switch (operation) {
+    case eOperationAverage:
+    case eOperationSum:
+        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.);
+        break;
+    case eOperationMin:
+        std::fill( accumulatorData, accumulatorData + nPixels * dstNComponents, std::numeric_limits<float>::infinity() );
+        break;
+    case eOperationMax:
+        std::fill( accumulatorData, accumulatorData + nPixels * dstNComponents, -std::numeric_limits<float>::infinity() );
+        break;
+    case eOperationProduct:
+        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 1.);
+        break;
+    }
+    // Initialize count image if operator is average or outputCount is true and output has alpha (use short)
+    if ( (operation == eOperationAverage) || outputCount ) {
+        count.reset( new OFX::ImageMemory(nPixels * sizeof(unsigned short), this) );
+        countData = (unsigned short*)count->lock();
+        std::fill(countData, countData + nPixels, 0);
+    }
+
+    // set the render window
+    processor.setRenderWindow(renderWindow);
+    processor.setValues(processR, processG, processB, processA,
+                        false, outputCount, mix);
+
     // Main processing loop.
-    // We process the frame range by chunks, to avoid using too much memory.
-    int imin;
-    int imax = 0;
-    while (imax < n) {
-        imin = imax;
-        imax = std::min(imin + kFrameChunk, n);
-        bool lastPass = (imax == n);
-
-        if (!lastPass) {
-            // Initialize accumulator image (always use float)
-            if (!accumulatorData) {
-                int dstNComponents = _dstClip->getPixelComponentCount();
-                accumulator.reset( new OFX::ImageMemory(nPixels * dstNComponents * sizeof(float), this) );
-                accumulatorData = (float*)accumulator->lock();
-                switch (operation) {
-                case eOperationAverage:
-                case eOperationSum:
-                    std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.);
-                    break;
-                case eOperationMin:
-                    std::fill( accumulatorData, accumulatorData + nPixels * dstNComponents, std::numeric_limits<float>::infinity() );
-                    break;
-                case eOperationMax:
-                    std::fill( accumulatorData, accumulatorData + nPixels * dstNComponents, -std::numeric_limits<float>::infinity() );
-                    break;
-                case eOperationProduct:
-                    std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 1.);
-                    break;
-                }
-            }
-            // Initialize count image if operator is average or outputCount is true and output has alpha (use short)
-            if ( !countData && ( (operation == eOperationAverage) || outputCount ) ) {
-                count.reset( new OFX::ImageMemory(nPixels * sizeof(unsigned short), this) );
-                countData = (unsigned short*)count->lock();
-                std::fill(countData, countData + nPixels, 0);
-            }
+    // The frames are folded into the accumulator one at a time, and released right after,
+    // so that the memory usage does not depend on the number of frames.
+    // During sequential renders, Average and Sum only process the frames that entered or left the range.
+    if ( args.sequentialRenderStatus && ( (operation == eOperationAverage) || (operation == eOperationSum) ) ) {
+        if ( !updateSlidingWindow(processor, args, min, interval, n, dstNComponents, accumulatorData, countData) ) {
+            return;
         }
-
-        // fetch the source images
-        OptionalImagesHolder_RAII srcImgs;
-        for (int i = imin; i < imax; ++i) {
+    } else {
+        processor.setAccumulators(accumulatorData, countData);
+        for (int i = 0; i < n; ++i) {
             if ( abort() ) {
                 return;
             }
-            const OFX::Image* src = _srcClip ? _srcClip->fetchImage(min + i * interval) : 0;
-            if (src) {
-                if ( (src->getRenderScale().x != args.renderScale.x) ||
-                     ( src->getRenderScale().y != args.renderScale.y) ||
-                     ( ( src->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( src->getField() != args.fieldToRender) ) ) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-                OFX::BitDepthEnum srcBitDepth      = src->getPixelDepth();
-                OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
-                if ( (srcBitDepth != dstBitDepth) || (srcComponents != dstComponents) ) {
-                    OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
-                }
-            }
-            srcImgs.images.push_back(src);
+            accumulateFrame(processor, args, min + i * interval);
         }
-        // fetch the foreground mattes
-        OptionalImagesHolder_RAII fgMImgs;
-        for (int i = imin; i < imax; ++i) {
-            if ( abort() ) {
-                return;
-            }
-            const OFX::Image* mask = ( _fgMClip && _fgMClip->isConnected() ) ? _fgMClip->fetchImage(min + i * interval) : 0;
-            if (mask) {
-                assert( _fgMClip->isConnected() );
-                if ( (mask->getRenderScale().x != args.renderScale.x) ||
-                     ( mask->getRenderScale().y != args.renderScale.y) ||
-                     ( ( mask->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( mask->getField() != args.fieldToRender) ) ) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
+    }
+
+    // last pass: compute the output image from the accumulator
+    processor.setAccumulators(accumulatorData, countData);
+    processor.setDstImg( dst.get() );
+    processor.setSrcImg( src.get() );
+    processor.setValues(processR, processG, processB, processA,
+                        true, outputCount, mix);
+    processor.process();
+} // FrameBlendPlugin::setupAndProcess
+
+void
+FrameBlendPlugin::accumulateFrame(FrameBlendProcessorBase &processor,
+                                  const OFX::RenderArguments &args,
+                                  double t)
+{
+    // fetch the source image
+    std::auto_ptr<const OFX::Image> frame( _srcClip ? _srcClip->fetchImage(t) : 0 );
+
+    if ( frame.get() ) {
+        if ( (frame->getRenderScale().x != args.renderScale.x) ||
+             ( frame->getRenderScale().y != args.renderScale.y) ||
+             ( ( frame->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( frame->getField() != args.fieldToRender) ) ) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        OFX::BitDepthEnum srcBitDepth      = frame->getPixelDepth();
+        OFX::PixelComponentEnum srcComponents = frame->getPixelComponents();
+        if ( ( srcBitDepth != _dstClip->getPixelDepth() ) || ( srcComponents != _dstClip->getPixelComponents() ) ) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+    }
+    // fetch the foreground matte
+    std::auto_ptr<const OFX::Image> fgM( ( _fgMClip && _fgMClip->isConnected() ) ? _fgMClip->fetchImage(t) : 0 );
+    if ( fgM.get() ) {
+        if ( (fgM->getRenderScale().x != args.renderScale.x) ||
+             ( fgM->getRenderScale().y != args.renderScale.y) ||
+             ( ( fgM->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( fgM->getField() != args.fieldToRender) ) ) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
+
+    processor.setFrameImgs( frame.get(), fgM.get() );
+    // Call the base class process member, this will call the derived templated process code
+    processor.process();
+    processor.setFrameImgs(0, 0);
+}
+
+bool
+FrameBlendPlugin::updateSlidingWindow(FrameBlendProcessorBase &processor,
+                                      const OFX::RenderArguments &args,
+                                      int first,
+                                      int interval,
+                                      int n,
+                                      int nComponents,
+                                      float *accumulatorData,
+                                      unsigned short *countData)
+{
+    const OfxRectI& renderWindow = args.renderWindow;
+    if ( (renderWindow.x2 <= renderWindow.x1) || (renderWindow.y2 <= renderWindow.y1) ) {
+        // nothing to accumulate, and the cache must keep its window
+        return true;
+    }
+    const size_t nPixels = (renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
+    const OperationEnum operation = processor.getOperation();
+    const bool fgM = _fgMClip && _fgMClip->isConnected();
+    // Take the cache: concurrent renders (e.g. other tiles) do not use it meanwhile.
+    // In case of abort or exception, the partially updated cache is simply dropped.
+    SlidingWindowCache cache;
+    {
+        AutoMutex guard(_slidingWindowMutex);
+        cache.swap(_slidingWindow);
+    }
+
+    // the frames to remove from the sums and the frames to add
+    int removeFirst = 0;
+    int removeCount = 0;
+    int addFirst = first;
+    int addCount = n;
+    if ( cache.isCompatible(renderWindow, args.renderScale, operation, nComponents, fgM, interval, n) &&
+         ( (first - cache.first) % interval == 0 ) ) {
+        int shift = (first - cache.first) / interval;
+        int k = std::abs(shift);
+        if (k < n) {
+            if (shift > 0) {
+                removeFirst = cache.first;
+                addFirst = cache.first + n * interval;
+            } else {
+                removeFirst = first + n * interval;
+                addFirst = first;
             }
-            fgMImgs.images.push_back(mask);
+            removeCount = addCount = k;
         }
+    }
+    if (addCount == n) {
+        // nothing can be reused
+        cache.valid = true;
+        cache.renderWindow = renderWindow;
+        cache.renderScale = args.renderScale;
+        cache.operation = operation;
+        cache.nComponents = nComponents;
+        cache.fgM = fgM;
+        cache.interval = interval;
+        cache.n = n;
+        cache.sums.assign(nPixels * nComponents, 0.);
+        cache.counts.assign(nPixels, 0);
+    }
+    cache.first = first;
 
-        // set the images
-        if (lastPass) {
-            processor.setDstImg( dst.get() );
+    processor.setAccumulators(0, &cache.counts[0]);
+    processor.setSums(&cache.sums[0], true);
+    for (int i = 0; i < removeCount; ++i) {
+        if ( abort() ) {
+            return false;
         }
-        processor.setSrcImgs(lastPass ? src.get() : 0, srcImgs.images);
-        processor.setFgMImgs(fgMImgs.images);
-        // set the render window
-        processor.setRenderWindow(renderWindow);
-        processor.setAccumulators(accumulatorData, countData);
+        accumulateFrame(processor, args, removeFirst + i * interval);
+    }
+    processor.setSums(&cache.sums[0], false);
+    for (int i = 0; i < addCount; ++i) {
+        if ( abort() ) {
+            return false;
+        }
+        accumulateFrame(processor, args, addFirst + i * interval);
+    }
+    processor.setSums(0, false);
+    if ( abort() ) {
+        return false;
+    }
+    for (std::vector<double>::const_iterator it = cache.sums.begin(); it != cache.sums.end(); ++it) {
+        if (*it - *it != 0.) {
+            // NaN or infinite
+            cache.valid = false;
+            break;
+        }
+    }
 
-        processor.setValues(processR, processG, processB, processA,
-                            lastPass, outputCount, mix);
+    std::copy(cache.sums.begin(), cache.sums.end(), accumulatorData);
+    if (countData) {
+        std::copy(cache.counts.begin(), cache.counts.end(), countData);
+    }
 
-        // Call the base class process member, this will call the derived templated process code
-        processor.process();
+    // store the cache for the next render
+    {
+        AutoMutex guard(_slidingWindowMutex);
+        cache.swap(_slidingWindow);
     }
-} // FrameBlendPlugin::setupAndProcess
+
+    return true;
+} // FrameBlendPlugin::updateSlidingWindow
+
+void
+FrameBlendPlugin::clearSlidingWindow()
+{
+    SlidingWindowCache cache; // release the memory outside of the lock
+    {
+        AutoMutex guard(_slidingWindowMutex);
+        cache.swap(_slidingWindow);
+    }
+}
 
 // the overridden render function
 void
@@ -830,7 +1077,7 @@ template <class PIX, int nComponents, int maxValue, OperationEnum operation>
 void
 FrameBlendPlugin::renderForOperation(const OFX::RenderArguments &args)
 {
-    FrameBlendProcessor<PIX, nComponents, maxValue, eOperationAverage> fred(*this);
+    FrameBlendProcessor<PIX, nComponents, maxValue, operation> fred(*this);
     setupAndProcess(fred, args);
 }
 
@@ -995,6 +1242,24 @@ FrameBlendPlugin::changedParam(const InstanceChangedArgs &args,
     }
 }
 
+void
+FrameBlendPlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments & /*args*/)
+{
+    clearSlidingWindow();
+}
+
+void
+FrameBlendPlugin::endSequenceRender(const OFX::EndSequenceRenderArguments & /*args*/)
+{
+    clearSlidingWindow();
+}
+
+void
+FrameBlendPlugin::purgeCaches()
+{
+    clearSlidingWindow();
+}
+
 mDeclarePluginFactory(FrameBlendPluginFactory, {}, {});
 void
 FrameBlendPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
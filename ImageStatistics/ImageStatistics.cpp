@@ -24,6 +24,9 @@
 #include <cfloat> // DBL_MAX
 #include <climits>
 #include <algorithm>
+#include <limits>
+#include <vector>
+#include <map>
 
 #include "ofxsProcessing.H"
 #include "ofxsRectangleInteract.h"
@@ -69,10 +72,12 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription \
     "Compute image statistics over the whole image or over a rectangle. " \
     "The statistics can be computed either on RGBA components or in the HSVL colorspace " \
-    "(which is the HSV coilorspace with an additional L component from HSL)."
+    "(which is the HSV coilorspace with an additional L component from HSL).\n" \
+    "The median, percentiles and clipped pixel counts are computed from histograms of the R, G, B components " \
+    "and of the luminance (Rec. 709), or of the alpha component for Alpha images."
 #define kPluginIdentifier "net.sf.openfx.ImageStatistics"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -92,7 +97,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamAnalyzeSequence "analyzeSequence"
 #define kParamAnalyzeSequenceLabel "Analyze Sequence"
-#define kParamAnalyzeSequenceHint "Analyze all frames from the sequence and set values."
+#define kParamAnalyzeSequenceHint "Analyze all frames from the sequence and set values. Frames that were already analyzed with the same analysis rectangle are only skipped if \"Reuse Analysis\" is checked."
 
 #define kParamClearFrame "clearFrame"
 #define kParamClearFrameLabel "Clear Frame"
@@ -100,12 +105,16 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamClearSequence "clearSequence"
 #define kParamClearSequenceLabel "Clear Sequence"
-#define kParamClearSequenceHint "Clear analysis for all frames from the sequence."
+#define kParamClearSequenceHint "Clear analysis for all frames from the sequence, as well as the cached analysis results."
 
 #define kParamAutoUpdate "autoUpdate"
 #define kParamAutoUpdateLabel "Auto Update"
 #define kParamAutoUpdateHint "Automatically update values when input or rectangle changes if an analysis was performed at current frame. If not checked, values are only updated if the plugin parameters change. "
 
+#define kParamReuseAnalysis "reuseAnalysis"
+#define kParamReuseAnalysisLabel "Reuse Analysis"
+#define kParamReuseAnalysisHint "When analyzing, reuse the results of previous analyses of the same frames with the same parameters instead of fetching and analyzing the source again. Only check this if the input does not change, since changes upstream are not detected. The results kept in memory are cleared by \"Clear Sequence\", when the input is disconnected, and before rendering a sequence."
+
 #define kParamGroupRGBA "RGBA"
 
 #define kParamStatMin "statMin"
@@ -154,7 +163,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamAnalyzeSequenceHSVL "analyzeSequenceHSVL"
 #define kParamAnalyzeSequenceHSVLLabel "Analyze Sequence"
-#define kParamAnalyzeSequenceHSVLHint "Analyze all frames from the sequence as HSVL and set values."
+#define kParamAnalyzeSequenceHSVLHint "Analyze all frames from the sequence as HSVL and set values. Frames that were already analyzed with the same analysis rectangle are only skipped if \"Reuse Analysis\" is checked."
 
 #define kParamClearFrameHSVL "clearFrameHSVL"
 #define kParamClearFrameHSVLLabel "Clear Frame"
@@ -162,7 +171,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamClearSequenceHSVL "clearSequenceHSVL"
 #define kParamClearSequenceHSVLLabel "Clear Sequence"
-#define kParamClearSequenceHSVLHint "Clear HSVL analysis for all frames from the sequence."
+#define kParamClearSequenceHSVLHint "Clear HSVL analysis for all frames from the sequence, as well as the cached HSVL analysis results."
 
 #define kParamStatHSVLMin "statHSVLMin"
 #define kParamStatHSVLMinLabel "HSVL Min."
@@ -201,6 +210,75 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "• The skewness is unitless.\n" \
     "• Any threshold or rule of thumb is arbitrary, but here is one: If the skewness is greater than 1.0 (or less than -1.0), the skewness is substantial and the distribution is far from symmetrical."
 
+#define kParamGroupPercentiles "Percentiles"
+
+#define kParamAnalyzeFramePercentiles "analyzeFramePercentiles"
+#define kParamAnalyzeFramePercentilesLabel "Analyze Frame"
+#define kParamAnalyzeFramePercentilesHint "Compute histograms of the current frame and set the median, percentiles and clipped pixel counts."
+
+#define kParamAnalyzeSequencePercentiles "analyzeSequencePercentiles"
+#define kParamAnalyzeSequencePercentilesLabel "Analyze Sequence"
+#define kParamAnalyzeSequencePercentilesHint "Compute histograms of all frames from the sequence and set the median, percentiles and clipped pixel counts. Frames that were already analyzed with the same analysis rectangle and histogram parameters are only skipped if \"Reuse Analysis\" is checked."
+
+#define kParamClearFramePercentiles "clearFramePercentiles"
+#define kParamClearFramePercentilesLabel "Clear Frame"
+#define kParamClearFramePercentilesHint "Clear percentiles analysis for current frame."
+
+#define kParamClearSequencePercentiles "clearSequencePercentiles"
+#define kParamClearSequencePercentilesLabel "Clear Sequence"
+#define kParamClearSequencePercentilesHint "Clear percentiles analysis for all frames from the sequence, as well as the cached percentiles analysis results."
+
+#define kParamHistogramBins "histogramBins"
+#define kParamHistogramBinsLabel "Histogram Bins"
+#define kParamHistogramBinsHint "Number of bins of the histogram of each component. The precision of the percentiles is about the width of a bin."
+
+#define kParamHistogramLog "histogramLog"
+#define kParamHistogramLogLabel "Log Bins"
+#define kParamHistogramLogHint "Use logarithmically-spaced bins (the bins are narrow near the minimum value and wide near the maximum value). This gives a much better precision on HDR images, where most values are small but the range is large."
+
+// maximum number of histogram bins (the histogram is replicated in each analysis thread)
+#define kHistogramBinsMax 65536
+// ratio between the value range and the width of the first logarithmic bin, relative to linear bins:
+// log bins follow log(1 + kHistogramLogRange * (v - min) / (max - min)), which does not depend on the scale of the values
+#define kHistogramLogRange 10000.
+
+#define kParamPercentileLow "percentileLow"
+#define kParamPercentileLowLabel "Low Percentile"
+#define kParamPercentileLowHint "Percentage of the pixels which are below the value given in \"Low Perc.\"."
+
+#define kParamPercentileHigh "percentileHigh"
+#define kParamPercentileHighLabel "High Percentile"
+#define kParamPercentileHighHint "Percentage of the pixels which are below the value given in \"High Perc.\"."
+
+#define kParamStatMedian "statMedian"
+#define kParamStatMedianLabel "Median"
+#define kParamStatMedianHint "The median is the value separating the higher half of the pixels from the lower half."
+
+#define kParamStatPercentileLow "statPercentileLow"
+#define kParamStatPercentileLowLabel "Low Perc."
+#define kParamStatPercentileLowHint "The value below which the \"Low Percentile\" percentage of the pixels fall."
+
+#define kParamStatPercentileHigh "statPercentileHigh"
+#define kParamStatPercentileHighLabel "High Perc."
+#define kParamStatPercentileHighHint "The value below which the \"High Percentile\" percentage of the pixels fall."
+
+#define kParamStatClippedLow "statClippedLow"
+#define kParamStatClippedLowLabel "Clipped Low"
+#define kParamStatClippedLowHint "Number of pixels which are less than or equal to 0."
+
+#define kParamStatClippedHigh "statClippedHigh"
+#define kParamStatClippedHighLabel "Clipped High"
+#define kParamStatClippedHighHint "Number of pixels which are greater than or equal to the maximum value (1 for floating-point images)."
+
+// maximum number of frames fetched and analyzed at the same time by "Analyze Sequence"
+#define kAnalysisFramesInFlightMax 8
+
+// number of frames analyzed by each thread between two updates of the parameters and progress
+#define kAnalysisFramesPerThread 4
+
+// maximum number of analysis results kept in memory for "Reuse Analysis"
+#define kAnalysisCacheMax 10000
+
 #define POINT_TOLERANCE 6
 #define POINT_SIZE 5
 
@@ -221,6 +299,108 @@ struct Results
     RGBAValues sdev;
     RGBAValues skewness;
     RGBAValues kurtosis;
+    RGBAValues median;
+    RGBAValues percentileLow;
+    RGBAValues percentileHigh;
+    RGBAValues clippedLow;
+    RGBAValues clippedHigh;
+};
+
+enum AnalysisModeEnum
+{
+    eAnalysisRGBA = 0,
+    eAnalysisHSVL,
+    eAnalysisPercentiles,
+};
+
+// parameters of the histogram analysis
+struct HistogramParams
+{
+    int bins;
+    bool logBins;
+    double percentileLow; // in percent
+    double percentileHigh; // in percent
+
+    HistogramParams() : bins(0), logBins(false), percentileLow(0.), percentileHigh(0.) {}
+};
+
+/* Key of the analysis cache: everything the results of the analysis of a frame depend on.
+ *
+ * The source image content is not part of the key, since the only way to get it is to fetch the image.
+ * The cached results are thus only used if "Reuse Analysis" is checked, and the cache is cleared when
+ * the source clip changes, before rendering a sequence, and by "Clear Sequence".
+ */
+struct AnalysisKey
+{
+    double time;
+    AnalysisModeEnum mode;
+    HistogramParams histogram; // only used by eAnalysisPercentiles
+    OfxRectI window; // the analysis window, in pixel coordinates
+    OfxPointD renderScale;
+    OfxRectD srcRoD;
+    int srcComponents;
+    int srcBitDepth;
+
+    bool operator<(const AnalysisKey &other) const
+    {
+        // time comes first, so that all keys for a given frame are contiguous
+        if (time != other.time) {
+            return time < other.time;
+        }
+        if (mode != other.mode) {
+            return mode < other.mode;
+        }
+        if (histogram.bins != other.histogram.bins) {
+            return histogram.bins < other.histogram.bins;
+        }
+        if (histogram.logBins != other.histogram.logBins) {
+            return histogram.logBins < other.histogram.logBins;
+        }
+        if (histogram.percentileLow != other.histogram.percentileLow) {
+            return histogram.percentileLow < other.histogram.percentileLow;
+        }
+        if (histogram.percentileHigh != other.histogram.percentileHigh) {
+            return histogram.percentileHigh < other.histogram.percentileHigh;
+        }
+        const int w[4] = { window.x1, window.y1, window.x2, window.y2 };
+        const int ow[4] = { other.window.x1, other.window.y1, other.window.x2, other.window.y2 };
+        if ( !std::equal(w, w + 4, ow) ) {
+            return std::lexicographical_compare(w, w + 4, ow, ow + 4);
+        }
+        const double d[6] = { renderScale.x, renderScale.y, srcRoD.x1, srcRoD.y1, srcRoD.x2, srcRoD.y2 };
+        const double od[6] = { other.renderScale.x, other.renderScale.y, other.srcRoD.x1, other.srcRoD.y1, other.srcRoD.x2, other.srcRoD.y2 };
+        if ( !std::equal(d, d + 6, od) ) {
+            return std::lexicographical_compare(d, d + 6, od, od + 6);
+        }
+        if (srcComponents != other.srcComponents) {
+            return srcComponents < other.srcComponents;
+        }
+
+        return srcBitDepth < other.srcBitDepth;
+    }
+};
+
+typedef std::map<AnalysisKey, Results> AnalysisCache;
+
+static bool
+rectIsEqual(const OfxRectI &a,
+            const OfxRectI &b)
+{
+    return a.x1 == b.x1 && a.y1 == b.y1 && a.x2 == b.x2 && a.y2 == b.y2;
+}
+
+// the results of the analysis of a single frame
+struct FrameResults
+{
+    bool badScale; // the host gave an image with the wrong scale
+    bool rgba; // resultsRGBA is valid
+    bool hsvl; // resultsHSVL is valid
+    bool percentiles; // resultsPercentiles is valid
+    Results resultsRGBA;
+    Results resultsHSVL;
+    Results resultsPercentiles;
+
+    FrameResults() : badScale(false), rgba(false), hsvl(false), percentiles(false) {}
 };
 
 class ImageStatisticsProcessorBase
@@ -242,9 +422,23 @@ public:
     {
     }
 
-    virtual void setPrevResults(const Results &results) = 0;
     virtual void getResults(Results *results) = 0;
 
+    virtual void setHistogramParams(const HistogramParams & /*params*/) {}
+
+    // called after each pass over the image, returns true if another pass is needed
+    virtual bool nextPass() { return false; }
+
+    /** @brief process the whole render window in the calling thread.
+       This is used when the analysis is launched from a thread that was itself
+       spawned by the multithread suite, which cannot spawn threads recursively. */
+    void processInCurrentThread()
+    {
+        if (_renderWindow.x1 < _renderWindow.x2 && _renderWindow.y1 < _renderWindow.y2) {
+            multiThreadProcessImages(_renderWindow);
+        }
+    }
+
 protected:
 
     template<class PIX, int nComponents, int maxValue>
@@ -321,556 +515,530 @@ protected:
 };
 
 
-template <class PIX, int nComponents, int maxValue>
-class ImageMinMaxMeanProcessor
-    : public ImageStatisticsProcessorBase
+/* Central moments of a set of values, up to order 4.
+ *
+ * Partial moments computed over disjoint sets (a line, or the window processed by one thread)
+ * are combined using the pairwise update formulas from:
+ * P. Pébay, "Formulas for Robust, One-Pass Parallel Computation of Covariances and
+ * Arbitrary-Order Statistical Moments", Sandia Report SAND2008-6212, 2008.
+ * This is what lets us compute all statistics in a single pass over the image.
+ */
+struct Moments
 {
-private:
-    double _min[nComponents];
-    double _max[nComponents];
-    double _sum[nComponents];
-
-public:
-    ImageMinMaxMeanProcessor(OFX::ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
+    unsigned long n;
+    double min;
+    double max;
+    double mean;
+    double m2; // sum of (v-mean)^2
+    double m3; // sum of (v-mean)^3
+    double m4; // sum of (v-mean)^4
+
+    Moments()
+        : n(0)
+        , min( +std::numeric_limits<double>::infinity() )
+        , max( -std::numeric_limits<double>::infinity() )
+        , mean(0.)
+        , m2(0.)
+        , m3(0.)
+        , m4(0.)
     {
-        std::fill( _min, _min + nComponents, +std::numeric_limits<double>::infinity() );
-        std::fill( _max, _max + nComponents, -std::numeric_limits<double>::infinity() );
-        std::fill(_sum, _sum + nComponents, 0.);
     }
 
-    ~ImageMinMaxMeanProcessor()
+    void merge(const Moments &b)
     {
+        if (b.n == 0) {
+            return;
+        }
+        if (n == 0) {
+            *this = b;
+
+            return;
+        }
+        double na = (double)n;
+        double nb = (double)b.n;
+        double delta = b.mean - mean;
+        double delta_n = delta / (na + nb);
+        double delta_n2 = delta_n * delta_n;
+        double term1 = delta * delta_n * na * nb;
+
+        // order matters: m4 uses the previous m2 and m3, m3 uses the previous m2
+        m4 += b.m4 + term1 * delta_n2 * (na * na - na * nb + nb * nb) +
+              6. * delta_n2 * (na * na * b.m2 + nb * nb * m2) +
+              4. * delta_n * (na * b.m3 - nb * m3);
+        m3 += b.m3 + term1 * delta_n * (na - nb) +
+              3. * delta_n * (na * b.m2 - nb * m2);
+        m2 += b.m2 + term1;
+        mean += delta_n * nb;
+        n += b.n;
+        min = std::min(min, b.min);
+        max = std::max(max, b.max);
     }
+};
 
-    void setPrevResults(const Results & /*results*/) OVERRIDE FINAL {}
+// compute the moments of a line of pixels.
+// The line is read twice (once for the mean, once for the central moments), but it stays in the cache.
+template<class T, int nComponents>
+void
+lineMoments(const T *pix,
+            int width,
+            Moments moments[nComponents])
+{
+    double sumLine[nComponents];
 
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        if (_count > 0) {
-            toRGBA<double, nComponents, 1>(_min, &results->min);
-            toRGBA<double, nComponents, 1>(_max, &results->max);
-            double mean[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                mean[c] = _sum[c] / _count;
-            }
-            toRGBA<double, nComponents, 1>(mean, &results->mean);
-        }
+    std::fill(sumLine, sumLine + nComponents, 0.);
+    for (int c = 0; c < nComponents; ++c) {
+        moments[c] = Moments();
     }
-
-private:
-
-    void addResults(double min[nComponents],
-                    double max[nComponents],
-                    double sum[nComponents],
-                    unsigned long count)
-    {
-        _mutex.lock();
+    if (width <= 0) {
+        return;
+    }
+    const T *p = pix;
+    for (int x = 0; x < width; ++x) {
+        for (int c = 0; c < nComponents; ++c) {
+            double v = *p;
+            moments[c].min = std::min(moments[c].min, v);
+            moments[c].max = std::max(moments[c].max, v);
+            sumLine[c] += v;
+            ++p;
+        }
+    }
+    for (int c = 0; c < nComponents; ++c) {
+        moments[c].n = width;
+        moments[c].mean = sumLine[c] / width;
+    }
+    double m2[nComponents], m3[nComponents], m4[nComponents];
+    std::fill(m2, m2 + nComponents, 0.);
+    std::fill(m3, m3 + nComponents, 0.);
+    std::fill(m4, m4 + nComponents, 0.);
+    p = pix;
+    for (int x = 0; x < width; ++x) {
         for (int c = 0; c < nComponents; ++c) {
-            _min[c] = std::min(_min[c], min[c]);
-            _max[c] = std::max(_max[c], max[c]);
-            _sum[c] += sum[c];
+            double d = *p - moments[c].mean;
+            double d2 = d * d;
+            m2[c] += d2;
+            m3[c] += d2 * d;
+            m4[c] += d2 * d2;
+            ++p;
         }
-        _count += count;
-        _mutex.unlock();
     }
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
-    {
-        double min[nComponents], max[nComponents], sum[nComponents];
-        std::fill( min, min + nComponents, +std::numeric_limits<double>::infinity() );
-        std::fill( max, max + nComponents, -std::numeric_limits<double>::infinity() );
-        std::fill(sum, sum + nComponents, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = *dstPix;
-                    min[c] = std::min(min[c], v);
-                    max[c] = std::max(max[c], v);
-                    sumLine[c] += v;
-                    ++dstPix;
-                }
-            }
-            for (int c = 0; c < nComponents; ++c) {
-                sum[c] += sumLine[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
-        }
-
-        addResults(min, max, sum, count);
+    for (int c = 0; c < nComponents; ++c) {
+        moments[c].m2 = m2[c];
+        moments[c].m3 = m3[c];
+        moments[c].m4 = m4[c];
     }
-};
-
+}
 
-template <class PIX, int nComponents, int maxValue>
-class ImageSDevProcessor
+// Computes min, max, mean, sdev, skewness and kurtosis in a single pass.
+// nComponentsStat is the number of components of the statistics (nComponents for RGBA, 4 for HSVL).
+template <int nComponentsStat>
+class ImageMomentsProcessorBase
     : public ImageStatisticsProcessorBase
 {
-private:
-    double _mean[nComponents];
-    double _sum_p2[nComponents];
+protected:
+    Moments _moments[nComponentsStat];
 
 public:
-    ImageSDevProcessor(OFX::ImageEffect &instance)
+    ImageMomentsProcessorBase(OFX::ImageEffect &instance)
         : ImageStatisticsProcessorBase(instance)
     {
-        std::fill(_mean, _mean + nComponents, 0.);
-        std::fill(_sum_p2, _sum_p2 + nComponents, 0.);
-    }
-
-    ~ImageSDevProcessor()
-    {
-    }
-
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
     }
 
     void getResults(Results *results) OVERRIDE FINAL
     {
+        if (_count > 0) {
+            double min[nComponentsStat], max[nComponentsStat], mean[nComponentsStat];
+            for (int c = 0; c < nComponentsStat; ++c) {
+                min[c] = _moments[c].min;
+                max[c] = _moments[c].max;
+                mean[c] = _moments[c].mean;
+            }
+            toRGBA<double, nComponentsStat, 1>(min, &results->min);
+            toRGBA<double, nComponentsStat, 1>(max, &results->max);
+            toRGBA<double, nComponentsStat, 1>(mean, &results->mean);
+        }
+        double sdev[nComponentsStat];
+        std::fill(sdev, sdev + nComponentsStat, 0.);
         if (_count > 1) {
-            double sdev[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
+            for (int c = 0; c < nComponentsStat; ++c) {
                 // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt( std::max( 0., _sum_p2[c] / (_count - 1) ) );
-            }
-            toRGBA<double, nComponents, 1>(sdev, &results->sdev);
-        }
-    }
-
-private:
-
-    void addResults(double sum_p2[nComponents],
-                    unsigned long count)
-    {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p2[c] += sum_p2[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
-    {
-        double sum_p2[nComponents];
-        std::fill(sum_p2, sum_p2 + nComponents, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
+                sdev[c] = std::sqrt( std::max( 0., _moments[c].m2 / (_count - 1) ) );
             }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p2[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = (*dstPix - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                    ++dstPix;
-                }
-            }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p2[c] += sumLine_p2[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+            toRGBA<double, nComponentsStat, 1>(sdev, &results->sdev);
         }
-
-        addResults(sum_p2, count);
-    }
-};
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageSkewnessKurtosisProcessor
-    : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponents];
-    double _sdev[nComponents];
-    double _sum_p3[nComponents];
-    double _sum_p4[nComponents];
-
-public:
-    ImageSkewnessKurtosisProcessor(OFX::ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean + nComponents, 0.);
-        std::fill(_sdev, _sdev + nComponents, 0.);
-        std::fill(_sum_p3, _sum_p3 + nComponents, 0.);
-        std::fill(_sum_p4, _sum_p4 + nComponents, 0.);
-    }
-
-    ~ImageSkewnessKurtosisProcessor()
-    {
-    }
-
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
-        toComponents<double, nComponents, 1>(results.sdev, _sdev);
-    }
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
         if (_count > 2) {
-            double skewness[nComponents];
+            double skewness[nComponentsStat];
             // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
             double skewfac = ( (double)_count * _count ) / ( (double)(_count - 1) * (_count - 2) );
             assert( !isnan(skewfac) );
-            for (int c = 0; c < nComponents; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
+            for (int c = 0; c < nComponentsStat; ++c) {
+                double sum_p3 = (sdev[c] > 0.) ? _moments[c].m3 / (sdev[c] * sdev[c] * sdev[c]) : 0.;
+                skewness[c] = skewfac * sum_p3 / _count;
             }
-            toRGBA<double, nComponents, 1>(skewness, &results->skewness);
+            toRGBA<double, nComponentsStat, 1>(skewness, &results->skewness);
             assert( !isnan(results->skewness.r) && !isnan(results->skewness.g) && !isnan(results->skewness.b) && !isnan(results->skewness.a) );
         }
         if (_count > 3) {
-            double kurtosis[nComponents];
+            double kurtosis[nComponentsStat];
             double kurtfac = ( (double)(_count + 1) * _count ) / ( (double)(_count - 1) * (_count - 2) * (_count - 3) );
             double kurtshift = -3 * ( (double)(_count - 1) * (_count - 1) ) / ( (double)(_count - 2) * (_count - 3) );
             assert( !isnan(kurtfac) && !isnan(kurtshift) );
-            for (int c = 0; c < nComponents; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
+            for (int c = 0; c < nComponentsStat; ++c) {
+                double sdev2 = sdev[c] * sdev[c];
+                double sum_p4 = (sdev[c] > 0.) ? _moments[c].m4 / (sdev2 * sdev2) : 0.;
+                kurtosis[c] = kurtfac * sum_p4 + kurtshift;
             }
-            toRGBA<double, nComponents, 1>(kurtosis, &results->kurtosis);
+            toRGBA<double, nComponentsStat, 1>(kurtosis, &results->kurtosis);
             assert( !isnan(results->kurtosis.r) && !isnan(results->kurtosis.g) && !isnan(results->kurtosis.b) && !isnan(results->kurtosis.a) );
         }
     }
 
-private:
+protected:
 
-    void addResults(double sum_p3[nComponents],
-                    double sum_p4[nComponents],
-                    unsigned long count)
+    // merge the partial moments computed by one thread
+    void addResults(const Moments moments[nComponentsStat])
     {
         _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
+        for (int c = 0; c < nComponentsStat; ++c) {
+            _moments[c].merge(moments[c]);
         }
-        _count += count;
+        _count = _moments[0].n;
         _mutex.unlock();
     }
+};
+
+
+template <class PIX, int nComponents, int maxValue>
+class ImageMomentsProcessor
+    : public ImageMomentsProcessorBase<nComponents>
+{
+public:
+    ImageMomentsProcessor(OFX::ImageEffect &instance)
+        : ImageMomentsProcessorBase<nComponents>(instance)
+    {
+    }
+
+    ~ImageMomentsProcessor()
+    {
+    }
+
+private:
 
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
     {
-        double sum_p3[nComponents];
-        double sum_p4[nComponents];
-        std::fill(sum_p3, sum_p3 + nComponents, 0.);
-        std::fill(sum_p4, sum_p4 + nComponents, 0.);
-        unsigned long count = 0;
+        const OFX::Image* img = this->_dstImg;
+        Moments moments[nComponents];
 
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
+        assert(img->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= img->getBounds().y2 &&
+               img->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= img->getBounds().y2);
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
+            if ( this->_effect.abort() ) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p3[nComponents]; // partial sum to avoid underflows
-            double sumLine_p4[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponents, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (*dstPix - _mean[c]) / _sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
-                    }
-                    ++dstPix;
-                }
-            }
+            const PIX *dstPix = (const PIX *) img->getPixelAddress(procWindow.x1, y);
+            Moments momentsLine[nComponents]; // partial moments to avoid underflows
+            lineMoments<PIX, nComponents>(dstPix, procWindow.x2 - procWindow.x1, momentsLine);
             for (int c = 0; c < nComponents; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
+                moments[c].merge(momentsLine[c]);
             }
-            count += procWindow.x2 - procWindow.x1;
         }
 
-        addResults(sum_p3, sum_p4, count);
+        this->addResults(moments);
     }
 };
 
 #define nComponentsHSVL 4
 
 template <class PIX, int nComponents, int maxValue>
-class ImageHSVLMinMaxMeanProcessor
-    : public ImageStatisticsProcessorBase
+class ImageHSVLMomentsProcessor
+    : public ImageMomentsProcessorBase<nComponentsHSVL>
 {
-private:
-    double _min[nComponentsHSVL];
-    double _max[nComponentsHSVL];
-    double _sum[nComponentsHSVL];
-
 public:
-    ImageHSVLMinMaxMeanProcessor(OFX::ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
+    ImageHSVLMomentsProcessor(OFX::ImageEffect &instance)
+        : ImageMomentsProcessorBase<nComponentsHSVL>(instance)
     {
-        std::fill( _min, _min + nComponentsHSVL, +std::numeric_limits<double>::infinity() );
-        std::fill( _max, _max + nComponentsHSVL, -std::numeric_limits<double>::infinity() );
-        std::fill(_sum, _sum + nComponentsHSVL, 0.);
     }
 
-    ~ImageHSVLMinMaxMeanProcessor()
+    ~ImageHSVLMomentsProcessor()
     {
     }
 
-    void setPrevResults(const Results & /*results*/) OVERRIDE FINAL {}
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        if (_count > 0) {
-            toRGBA<double, nComponentsHSVL, 1>(_min, &results->min);
-            toRGBA<double, nComponentsHSVL, 1>(_max, &results->max);
-            double mean[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                mean[c] = _sum[c] / _count;
-            }
-            toRGBA<double, nComponentsHSVL, 1>(mean, &results->mean);
-        }
-    }
-
 private:
 
-    void addResults(double min[nComponentsHSVL],
-                    double max[nComponentsHSVL],
-                    double sum[nComponentsHSVL],
-                    unsigned long count)
-    {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _min[c] = std::min(_min[c], min[c]);
-            _max[c] = std::max(_max[c], max[c]);
-            _sum[c] += sum[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
-
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
     {
-        double min[nComponentsHSVL], max[nComponentsHSVL], sum[nComponentsHSVL];
-        std::fill( min, min + nComponentsHSVL, +std::numeric_limits<double>::infinity() );
-        std::fill( max, max + nComponentsHSVL, -std::numeric_limits<double>::infinity() );
-        std::fill(sum, sum + nComponentsHSVL, 0.);
-        unsigned long count = 0;
+        if ( (procWindow.x2 <= procWindow.x1) || (procWindow.y2 <= procWindow.y1) ) {
+            return;
+        }
+        const OFX::Image* img = this->_dstImg;
+        Moments moments[nComponentsHSVL];
+        // the HSVL conversion is done only once per pixel, into a line buffer
+        std::vector<float> hsvlLine( (procWindow.x2 - procWindow.x1) * nComponentsHSVL );
 
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
+        assert(img->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= img->getBounds().y2 &&
+               img->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= img->getBounds().y2);
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
+            if ( this->_effect.abort() ) {
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponentsHSVL, 0.);
-
+            const PIX *dstPix = (const PIX *) img->getPixelAddress(procWindow.x1, y);
             for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = hsvl[c];
-                    min[c] = std::min(min[c], v);
-                    max[c] = std::max(max[c], v);
-                    sumLine[c] += v;
-                }
+                this->template pixToHSVL<PIX, nComponents, maxValue>(dstPix, &hsvlLine[(x - procWindow.x1) * nComponentsHSVL]);
                 dstPix += nComponents;
             }
+            Moments momentsLine[nComponentsHSVL]; // partial moments to avoid underflows
+            lineMoments<float, nComponentsHSVL>(&hsvlLine.front(), procWindow.x2 - procWindow.x1, momentsLine);
             for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum[c] += sumLine[c];
+                moments[c].merge(momentsLine[c]);
             }
-            count += procWindow.x2 - procWindow.x1;
         }
 
-        addResults(min, max, sum, count);
+        this->addResults(moments);
     }
 };
 
 
+#define nComponentsHistogram 4
+
+// the histograms filled by a single thread
+struct ThreadHistogram
+{
+    double min[nComponentsHistogram];
+    double max[nComponentsHistogram];
+    unsigned long count[nComponentsHistogram];
+    unsigned long clippedLow[nComponentsHistogram];
+    unsigned long clippedHigh[nComponentsHistogram];
+    std::vector<unsigned long> bins; // the histograms of all components, one after the other
+
+    ThreadHistogram()
+        : bins()
+    {
+        std::fill( min, min + nComponentsHistogram, +std::numeric_limits<double>::infinity() );
+        std::fill( max, max + nComponentsHistogram, -std::numeric_limits<double>::infinity() );
+        std::fill(count, count + nComponentsHistogram, 0);
+        std::fill(clippedLow, clippedLow + nComponentsHistogram, 0);
+        std::fill(clippedHigh, clippedHigh + nComponentsHistogram, 0);
+    }
+};
+
+/* Histograms of the r, g, b components and of the luminance (Rec. 709) of the pixels,
+ * used to compute the median, the percentiles and the clipped pixel counts.
+ * For Alpha images, the fourth component is the alpha value.
+ *
+ * Each thread fills its own histograms, which are only summed in getResults(), so that no lock is needed.
+ * For integer images the histogram spans [0, maxValue], and for floating-point images a first pass
+ * computes the range of values.
+ */
 template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSDevProcessor
+class ImageHistogramProcessor
     : public ImageStatisticsProcessorBase
 {
 private:
-    double _mean[nComponentsHSVL];
-    double _sum_p2[nComponentsHSVL];
+    HistogramParams _params;
+    bool _rangePass; // true during the first pass, which computes the range of values
+    double _rangeMin[nComponentsHistogram];
+    double _rangeMax[nComponentsHistogram];
+    double _tMin[nComponentsHistogram]; // the bin of value v is (transform(v) - _tMin) * _tScale
+    double _tScale[nComponentsHistogram];
+    double _logScale[nComponentsHistogram]; // normalization of the values before the log transform
+    std::vector<ThreadHistogram> _threadHistograms; // indexed by thread
 
 public:
-    ImageHSVLSDevProcessor(OFX::ImageEffect &instance)
+    ImageHistogramProcessor(OFX::ImageEffect &instance)
         : ImageStatisticsProcessorBase(instance)
+        , _params()
+        , _rangePass(maxValue == 1)
+        , _threadHistograms( std::max(1u, OFX::MultiThread::getNumCPUs()) )
     {
-        std::fill(_mean, _mean + nComponentsHSVL, 0.);
-        std::fill(_sum_p2, _sum_p2 + nComponentsHSVL, 0.);
+        std::fill(_rangeMin, _rangeMin + nComponentsHistogram, 0.);
+        std::fill(_rangeMax, _rangeMax + nComponentsHistogram, (double)maxValue);
+        std::fill(_tMin, _tMin + nComponentsHistogram, 0.);
+        std::fill(_tScale, _tScale + nComponentsHistogram, 0.);
+        std::fill(_logScale, _logScale + nComponentsHistogram, 0.);
     }
 
-    ~ImageHSVLSDevProcessor()
+    ~ImageHistogramProcessor()
     {
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
+    void setHistogramParams(const HistogramParams &params) OVERRIDE FINAL
     {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
+        _params = params;
+        _params.bins = std::max(1, params.bins);
+        if (!_rangePass) {
+            computeBinning();
+        }
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    bool nextPass() OVERRIDE FINAL
     {
-        if (_count > 1) {
-            double sdev[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt( std::max( 0., _sum_p2[c] / (_count - 1) ) );
+        if (!_rangePass) {
+            return false;
+        }
+        // merge the ranges computed by each thread, and start filling the histograms
+        bool empty = true;
+        std::fill( _rangeMin, _rangeMin + nComponentsHistogram, +std::numeric_limits<double>::infinity() );
+        std::fill( _rangeMax, _rangeMax + nComponentsHistogram, -std::numeric_limits<double>::infinity() );
+        for (std::size_t i = 0; i < _threadHistograms.size(); ++i) {
+            const ThreadHistogram &h = _threadHistograms[i];
+            for (int c = 0; c < nComponentsHistogram; ++c) {
+                if (h.count[c] > 0) {
+                    _rangeMin[c] = std::min(_rangeMin[c], h.min[c]);
+                    _rangeMax[c] = std::max(_rangeMax[c], h.max[c]);
+                    empty = false;
+                }
+            }
+        }
+        for (int c = 0; c < nComponentsHistogram; ++c) {
+            if (_rangeMin[c] > _rangeMax[c]) {
+                _rangeMin[c] = _rangeMax[c] = 0.;
             }
-            toRGBA<double, nComponentsHSVL, 1>(sdev, &results->sdev);
         }
+        std::fill( _threadHistograms.begin(), _threadHistograms.end(), ThreadHistogram() );
+        _rangePass = false;
+        computeBinning();
+
+        return !empty;
+    }
+
+    void getResults(Results *results) OVERRIDE FINAL
+    {
+        if (_rangePass) {
+            // the histograms were not computed
+            return;
+        }
+        const int nBins = _params.bins;
+        std::vector<unsigned long> bins(nComponentsHistogram * nBins, 0);
+        unsigned long count[nComponentsHistogram];
+        unsigned long clippedLow[nComponentsHistogram];
+        unsigned long clippedHigh[nComponentsHistogram];
+        std::fill(count, count + nComponentsHistogram, 0);
+        std::fill(clippedLow, clippedLow + nComponentsHistogram, 0);
+        std::fill(clippedHigh, clippedHigh + nComponentsHistogram, 0);
+        for (std::size_t i = 0; i < _threadHistograms.size(); ++i) {
+            const ThreadHistogram &h = _threadHistograms[i];
+            if ( h.bins.empty() ) {
+                continue;
+            }
+            for (std::size_t b = 0; b < bins.size(); ++b) {
+                bins[b] += h.bins[b];
+            }
+            for (int c = 0; c < nComponentsHistogram; ++c) {
+                count[c] += h.count[c];
+                clippedLow[c] += h.clippedLow[c];
+                clippedHigh[c] += h.clippedHigh[c];
+            }
+        }
+        double median[nComponentsHistogram], low[nComponentsHistogram], high[nComponentsHistogram];
+        for (int c = 0; c < nComponentsHistogram; ++c) {
+            const unsigned long *hist = &bins[c * nBins];
+            median[c] = percentile(c, hist, count[c], 50.);
+            low[c] = percentile(c, hist, count[c], _params.percentileLow);
+            high[c] = percentile(c, hist, count[c], _params.percentileHigh);
+        }
+        setRGBA(median, &results->median);
+        setRGBA(low, &results->percentileLow);
+        setRGBA(high, &results->percentileHigh);
+        double clipped[nComponentsHistogram];
+        std::copy(clippedLow, clippedLow + nComponentsHistogram, clipped);
+        setRGBA(clipped, &results->clippedLow);
+        std::copy(clippedHigh, clippedHigh + nComponentsHistogram, clipped);
+        setRGBA(clipped, &results->clippedHigh);
     }
 
 private:
 
-    void addResults(double sum_p2[nComponentsHSVL],
-                    unsigned long count)
+    static bool hasComponent(int c)
     {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p2[c] += sum_p2[c];
-        }
-        _count += count;
-        _mutex.unlock();
+        return (nComponents >= 3) || (c == 3) || (nComponents == 2 && c < 2);
     }
 
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    static void setRGBA(const double v[nComponentsHistogram],
+                        RGBAValues *rgba)
     {
-        double sum_p2[nComponentsHSVL];
-        std::fill(sum_p2, sum_p2 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p2[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponentsHSVL, 0.);
+        rgba->r = v[0];
+        rgba->g = v[1];
+        rgba->b = v[2];
+        rgba->a = v[3];
+    }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = (hsvl[c] - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p2[c] += sumLine_p2[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+    static void pixValues(const PIX *p,
+                          double v[nComponentsHistogram])
+    {
+        if (nComponents >= 3) {
+            v[0] = p[0];
+            v[1] = p[1];
+            v[2] = p[2];
+            v[3] = 0.2126 * v[0] + 0.7152 * v[1] + 0.0722 * v[2];
+        } else if (nComponents == 2) {
+            v[0] = p[0];
+            v[1] = p[1];
+            v[2] = 0.;
+            v[3] = 0.2126 * v[0] + 0.7152 * v[1];
+        } else if (nComponents == 1) {
+            v[0] = v[1] = v[2] = 0.;
+            v[3] = p[0];
+        } else {
+            v[0] = v[1] = v[2] = v[3] = 0.;
         }
-
-        addResults(sum_p2, count);
     }
-};
 
-
-template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSkewnessKurtosisProcessor
-    : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponentsHSVL];
-    double _sdev[nComponentsHSVL];
-    double _sum_p3[nComponentsHSVL];
-    double _sum_p4[nComponentsHSVL];
-
-public:
-    ImageHSVLSkewnessKurtosisProcessor(OFX::ImageEffect &instance)
-        : ImageStatisticsProcessorBase(instance)
+    double transform(int c,
+                     double v) const
     {
-        std::fill(_mean, _mean + nComponentsHSVL, 0.);
-        std::fill(_sdev, _sdev + nComponentsHSVL, 0.);
-        std::fill(_sum_p3, _sum_p3 + nComponentsHSVL, 0.);
-        std::fill(_sum_p4, _sum_p4 + nComponentsHSVL, 0.);
+        return _params.logBins ? std::log(1. + (v - _rangeMin[c]) * _logScale[c]) : v;
     }
 
-    ~ImageHSVLSkewnessKurtosisProcessor()
+    double inverseTransform(int c,
+                            double t) const
     {
+        return _params.logBins ? ( (_logScale[c] > 0.) ? (_rangeMin[c] + (std::exp(t) - 1.) / _logScale[c]) : _rangeMin[c] ) : t;
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
+    void computeBinning()
     {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
-        toComponents<double, nComponentsHSVL, 1>(results.sdev, _sdev);
+        for (int c = 0; c < nComponentsHistogram; ++c) {
+            // normalize by the range before taking the log, so that the binning is scale-invariant
+            _logScale[c] = (_rangeMax[c] > _rangeMin[c]) ? (kHistogramLogRange / (_rangeMax[c] - _rangeMin[c])) : 0.;
+            _tMin[c] = transform(c, _rangeMin[c]);
+            double tMax = transform(c, _rangeMax[c]);
+            _tScale[c] = (tMax > _tMin[c]) ? (_params.bins / (tMax - _tMin[c])) : 0.;
+        }
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    // the value below which p percent of the values fall, interpolated linearly within the bin
+    double percentile(int c,
+                      const unsigned long *hist,
+                      unsigned long count,
+                      double p) const
     {
-        if (_count > 2) {
-            double skewness[nComponentsHSVL];
-            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ( (double)_count * _count ) / ( (double)(_count - 1) * (_count - 2) );
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
-            }
-            toRGBA<double, nComponentsHSVL, 1>(skewness, &results->skewness);
+        if ( (count == 0) || (_tScale[c] <= 0.) ) {
+            return (count == 0) ? 0. : _rangeMin[c];
         }
-        if (_count > 3) {
-            double kurtosis[nComponentsHSVL];
-            double kurtfac = ( (double)(_count + 1) * _count ) / ( (double)(_count - 1) * (_count - 2) * (_count - 3) );
-            double kurtshift = -3 * ( (double)(_count - 1) * (_count - 1) ) / ( (double)(_count - 2) * (_count - 3) );
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
+        double target = std::max( 0., std::min(100., p) ) / 100. * count;
+        double cumul = 0.;
+        for (int b = 0; b < _params.bins; ++b) {
+            if ( (hist[b] > 0) && (cumul + hist[b] >= target) ) {
+                double t = _tMin[c] + (b + (target - cumul) / hist[b]) / _tScale[c];
+
+                return std::max( _rangeMin[c], std::min( _rangeMax[c], inverseTransform(c, t) ) );
             }
-            toRGBA<double, nComponentsHSVL, 1>(kurtosis, &results->kurtosis);
+            cumul += hist[b];
         }
-    }
 
-private:
-
-    void addResults(double sum_p3[nComponentsHSVL],
-                    double sum_p4[nComponentsHSVL],
-                    unsigned long count)
-    {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
-        }
-        _count += count;
-        _mutex.unlock();
+        return _rangeMax[c];
     }
 
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    void accumulate(const OfxRectI &procWindow,
+                    unsigned int threadId)
     {
-        double sum_p3[nComponentsHSVL];
-        double sum_p4[nComponentsHSVL];
-        std::fill(sum_p3, sum_p3 + nComponentsHSVL, 0.);
-        std::fill(sum_p4, sum_p4 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
+        assert( threadId < _threadHistograms.size() );
+        ThreadHistogram &h = _threadHistograms[threadId];
+        const int nBins = _params.bins;
+        if ( !_rangePass && h.bins.empty() ) {
+            h.bins.assign(nComponentsHistogram * nBins, 0);
+        }
 
         assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
                _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
@@ -879,33 +1047,52 @@ private:
                 break;
             }
 
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-            double sumLine_p3[nComponentsHSVL]; // partial sum to avoid underflows
-            double sumLine_p4[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponentsHSVL, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (hsvl[c] - _mean[c]) / _sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
+            const PIX *dstPix = (const PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                double v[nComponentsHistogram];
+                pixValues(dstPix, v);
+                for (int c = 0; c < nComponentsHistogram; ++c) {
+                    if ( !hasComponent(c) || isnan(v[c]) ) {
+                        continue;
                     }
+                    ++h.count[c];
+                    if (_rangePass) {
+                        h.min[c] = std::min(h.min[c], v[c]);
+                        h.max[c] = std::max(h.max[c], v[c]);
+                        continue;
+                    }
+                    if (v[c] <= 0.) {
+                        ++h.clippedLow[c];
+                    }
+                    if (v[c] >= maxValue) {
+                        ++h.clippedHigh[c];
+                    }
+                    int b = (int)( ( transform(c, v[c]) - _tMin[c] ) * _tScale[c] );
+                    b = std::max( 0, std::min(nBins - 1, b) );
+                    ++h.bins[c * nBins + b];
                 }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
             }
-            count += procWindow.x2 - procWindow.x1;
         }
+    }
+
+    // same slicing as OFX::ImageProcessor::multiThreadFunction, but each thread works on its own histograms
+    virtual void multiThreadFunction(unsigned int threadId,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        OfxRectI win = _renderWindow;
+        unsigned int dy = _renderWindow.y2 - _renderWindow.y1;
 
-        addResults(sum_p3, sum_p4, count);
+        win.y1 = _renderWindow.y1 + threadId * dy / nThreads;
+        win.y2 = _renderWindow.y1 + std::min(dy, (threadId + 1) * dy / nThreads);
+        if (win.y1 < win.y2) {
+            accumulate(win, threadId);
+        }
+    }
+
+    // used by processInCurrentThread()
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        accumulate(procWindow, 0);
     }
 };
 
@@ -924,6 +1111,8 @@ public:
         , _size(0)
         , _interactive(0)
         , _restrictToRectangle(0)
+        , _cacheMutex()
+        , _cache()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert( _dstClip && (!_dstClip->isConnected() || _dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -940,7 +1129,8 @@ public:
         _interactive = fetchBooleanParam(kParamRectangleInteractInteractive);
         _restrictToRectangle = fetchBooleanParam(kParamRestrictToRectangle);
         _autoUpdate = fetchBooleanParam(kParamAutoUpdate);
-        assert(_btmLeft && _size && _interactive && _restrictToRectangle && _autoUpdate);
+        _reuseAnalysis = fetchBooleanParam(kParamReuseAnalysis);
+        assert(_btmLeft && _size && _interactive && _restrictToRectangle && _autoUpdate && _reuseAnalysis);
         _statMin = fetchRGBAParam(kParamStatMin);
         _statMax = fetchRGBAParam(kParamStatMax);
         _statMean = fetchRGBAParam(kParamStatMean);
@@ -961,6 +1151,17 @@ public:
         _analyzeFrameHSVL = fetchPushButtonParam(kParamAnalyzeFrameHSVL);
         _analyzeSequenceHSVL = fetchPushButtonParam(kParamAnalyzeSequenceHSVL);
         assert(_analyzeFrameHSVL && _analyzeSequenceHSVL);
+        _histogramBins = fetchIntParam(kParamHistogramBins);
+        _histogramLog = fetchBooleanParam(kParamHistogramLog);
+        _percentileLow = fetchDoubleParam(kParamPercentileLow);
+        _percentileHigh = fetchDoubleParam(kParamPercentileHigh);
+        assert(_histogramBins && _histogramLog && _percentileLow && _percentileHigh);
+        _statMedian = fetchRGBAParam(kParamStatMedian);
+        _statPercentileLow = fetchRGBAParam(kParamStatPercentileLow);
+        _statPercentileHigh = fetchRGBAParam(kParamStatPercentileHigh);
+        _statClippedLow = fetchRGBAParam(kParamStatClippedLow);
+        _statClippedHigh = fetchRGBAParam(kParamStatClippedHigh);
+        assert(_statMedian && _statPercentileLow && _statPercentileHigh && _statClippedLow && _statClippedHigh);
 
         // update visibility
         bool restrictToRectangle = _restrictToRectangle->getValue();
@@ -973,6 +1174,16 @@ public:
         _interactive->setIsSecret(!restrictToRectangle || !doUpdate);
     }
 
+    // fetch and analyze a single frame.
+    // This is called by the SequenceAnalyzer, possibly from several threads at the same time,
+    // so it must not modify any parameter.
+    void analyzeFrame(double time, const OfxPointD &renderScale, bool doRGBA, bool doHSVL, bool doPercentiles, FrameResults *results);
+
+    // set the parameter values from the results of an analysis
+    void setResults(double time, const Results &results);
+    void setResultsHSVL(double time, const Results &results);
+    void setResultsPercentiles(double time, const Results &results);
+
 private:
     /* override is identity */
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
@@ -983,48 +1194,65 @@ private:
     virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD & rod) OVERRIDE FINAL;
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+    virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
 
     /* set up and run a processor */
-    void setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results &prevResults, Results *results);
+    void setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const HistogramParams &histogramParams, Results *results);
 
     // compute computation window in srcImg
     bool computeWindow(const OFX::Image* srcImg, double time, OfxRectI *analysisWindow);
+    bool computeWindow(double time, const OfxPointD &renderScale, double par, const OfxRectI &srcBounds, OfxRectI *analysisWindow);
+
+    // analysis cache, see AnalysisKey
+    bool getAnalysisKey(double time, const OfxPointD &renderScale, AnalysisModeEnum mode, AnalysisKey *key);
+    bool getCachedResults(const AnalysisKey &key, Results *results);
+    void setCachedResults(const AnalysisKey &key, const Results &results);
+    void clearCachedResults(AnalysisModeEnum mode, bool allFrames, double time);
+
+    HistogramParams getHistogramParams(double time);
+
+    // compute image statistics, return false if aborted
+    bool computeStatistics(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow, Results *results);
+    bool computeStatisticsHSVL(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow, Results *results);
+    bool computeStatisticsPercentiles(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow, Results *results);
 
     // update image statistics
     void update(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
     void updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
+    void updatePercentiles(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
 
     template <template<class PIX, int nComponents, int maxValue> class Processor, class PIX, int nComponents, int maxValue>
     void updateSubComponentsDepth(const OFX::Image* srcImg,
                                   double time,
                                   const OfxRectI &analysisWindow,
-                                  const Results& prevResults,
+                                  const HistogramParams &histogramParams,
                                   Results* results)
     {
         Processor<PIX, nComponents, maxValue> fred(*this);
-        setupAndProcess(fred, srcImg, time, analysisWindow, prevResults, results);
+        setupAndProcess(fred, srcImg, time, analysisWindow, histogramParams, results);
     }
 
     template <template<class PIX, int nComponents, int maxValue> class Processor, int nComponents>
     void updateSubComponents(const OFX::Image* srcImg,
                              double time,
                              const OfxRectI &analysisWindow,
-                             const Results& prevResults,
+                             const HistogramParams &histogramParams,
                              Results* results)
     {
         OFX::BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
 
         switch (srcBitDepth) {
         case OFX::eBitDepthUByte: {
-            updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, histogramParams, results);
             break;
         }
         case OFX::eBitDepthUShort: {
-            updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, histogramParams, results);
             break;
         }
         case OFX::eBitDepthFloat: {
-            updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, histogramParams, results);
             break;
         }
         default:
@@ -1036,18 +1264,18 @@ private:
     void updateSub(const OFX::Image* srcImg,
                    double time,
                    const OfxRectI &analysisWindow,
-                   const Results& prevResults,
+                   const HistogramParams &histogramParams,
                    Results* results)
     {
         OFX::PixelComponentEnum srcComponents  = srcImg->getPixelComponents();
 
         assert(srcComponents == OFX::ePixelComponentAlpha || srcComponents == OFX::ePixelComponentRGB || srcComponents == OFX::ePixelComponentRGBA);
         if (srcComponents == OFX::ePixelComponentAlpha) {
-            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, histogramParams, results);
         } else if (srcComponents == OFX::ePixelComponentRGBA) {
-            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, histogramParams, results);
         } else if (srcComponents == OFX::ePixelComponentRGB) {
-            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, histogramParams, results);
         } else {
             // coverity[dead_error_line]
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
@@ -1064,6 +1292,7 @@ private:
     BooleanParam* _interactive;
     BooleanParam* _restrictToRectangle;
     BooleanParam* _autoUpdate;
+    BooleanParam* _reuseAnalysis;
     RGBAParam* _statMin;
     RGBAParam* _statMax;
     RGBAParam* _statMean;
@@ -1080,6 +1309,160 @@ private:
     RGBAParam* _statHSVLKurtosis;
     PushButtonParam* _analyzeFrameHSVL;
     PushButtonParam* _analyzeSequenceHSVL;
+    IntParam* _histogramBins;
+    BooleanParam* _histogramLog;
+    DoubleParam* _percentileLow;
+    DoubleParam* _percentileHigh;
+    RGBAParam* _statMedian;
+    RGBAParam* _statPercentileLow;
+    RGBAParam* _statPercentileHigh;
+    RGBAParam* _statClippedLow;
+    RGBAParam* _statClippedHigh;
+    Mutex _cacheMutex; //< protects _cache, which is accessed by the render and analysis threads
+    AnalysisCache _cache; //< results of previous analyses
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** @brief Analyzes a range of frames using several threads.
+ *
+ * The frames are analyzed by batches. Within a batch, the frames form a work queue:
+ * each thread takes the next frame to be analyzed, fetches it and analyzes it, so that
+ * the host can read a frame while the other frames are being analyzed.
+ * The worker threads only compute the results. The parameters and the progress may
+ * only be set from the thread that called changedParam, so process() sets them
+ * in frame order after each batch.
+ */
+class SequenceAnalyzer
+    : public OFX::MultiThread::Processor
+{
+public:
+    SequenceAnalyzer(ImageStatisticsPlugin &effect,
+                     int tmin,
+                     int tmax,
+                     const OfxPointD &renderScale,
+                     bool doRGBA,
+                     bool doHSVL,
+                     bool doPercentiles)
+        : _effect(effect)
+        , _mutex()
+        , _tmin(tmin)
+        , _tmax(tmax)
+        , _renderScale(renderScale)
+        , _doRGBA(doRGBA)
+        , _doHSVL(doHSVL)
+        , _doPercentiles(doPercentiles)
+        , _next(tmin)
+        , _last(tmin - 1)
+        , _first(tmin)
+        , _failed(false)
+        , _badScale(false)
+        , _cancelled(false)
+        , _results()
+    {
+    }
+
+    // analyze the frames and set the results.
+    // Must be called from the thread that called changedParam.
+    void process(unsigned int nThreads)
+    {
+        nThreads = std::max(1u, nThreads);
+        const int batchSize = (int)nThreads * kAnalysisFramesPerThread;
+        for (int t1 = _tmin; t1 <= _tmax; t1 += batchSize) {
+            const int t2 = std::min(t1 + batchSize - 1, _tmax);
+            _first = t1;
+            _next = t1;
+            _last = t2;
+            _results.assign( t2 - t1 + 1, FrameResults() );
+            multiThread( std::min( nThreads, (unsigned int)(t2 - t1 + 1) ) );
+            if (_failed) {
+                return;
+            }
+            for (int t = t1; t <= t2; ++t) {
+                const FrameResults &results = _results[t - t1];
+                if (results.badScale) {
+                    _badScale = true;
+
+                    return;
+                }
+                if (results.rgba) {
+                    _effect.setResults(t, results.resultsRGBA);
+                }
+                if (results.hsvl) {
+                    _effect.setResultsHSVL(t, results.resultsHSVL);
+                }
+                if (results.percentiles) {
+                    _effect.setResultsPercentiles(t, results.resultsPercentiles);
+                }
+                if ( (_tmax != _tmin) && !_effect.progressUpdate( (t - _tmin) / (double)(_tmax - _tmin) ) ) {
+                    _cancelled = true;
+
+                    return;
+                }
+            }
+            if ( _effect.abort() ) {
+                _cancelled = true;
+
+                return;
+            }
+        }
+    }
+
+    bool failed() const
+    {
+        return _failed;
+    }
+
+    bool badScale() const
+    {
+        return _badScale;
+    }
+
+    bool cancelled() const
+    {
+        return _cancelled;
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int /*threadId*/,
+                                     unsigned int /*nThreads*/) OVERRIDE FINAL
+    {
+        for (;;) {
+            int t;
+            {
+                AutoMutex guard(_mutex);
+                if ( (_next > _last) || _failed ) {
+                    return;
+                }
+                t = _next;
+                ++_next;
+            }
+            // exceptions must not cross the thread boundary
+            try {
+                _effect.analyzeFrame(t, _renderScale, _doRGBA, _doHSVL, _doPercentiles, &_results[t - _first]);
+            } catch (...) {
+                AutoMutex guard(_mutex);
+                _failed = true;
+
+                return;
+            }
+        }
+    }
+
+    ImageStatisticsPlugin &_effect;
+    Mutex _mutex; //< protects _next and _failed
+    const int _tmin;
+    const int _tmax;
+    const OfxPointD _renderScale;
+    const bool _doRGBA;
+    const bool _doHSVL;
+    const bool _doPercentiles;
+    int _next; //< next frame to analyze in the current batch
+    int _last; //< last frame of the current batch
+    int _first; //< first frame of the current batch
+    bool _failed;
+    bool _badScale;
+    bool _cancelled;
+    std::vector<FrameResults> _results; //< one per frame of the current batch, each one is written by a single thread
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1143,6 +1526,10 @@ ImageStatisticsPlugin::render(const OFX::RenderArguments &args)
                 if (k != -1) {
                     updateHSVL(src.get(), args.time, analysisWindow);
                 }
+                k = _statMedian->getKeyIndex(args.time, eKeySearchNear);
+                if (k != -1) {
+                    updatePercentiles(src.get(), args.time, analysisWindow);
+                }
             }
         }
     }
@@ -1214,6 +1601,8 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
     bool doAnalyzeHSVL = false;
     bool doAnalyzeSequenceRGBA = false;
     bool doAnalyzeSequenceHSVL = false;
+    bool doAnalyzePercentiles = false;
+    bool doAnalyzeSequencePercentiles = false;
     OfxRectI analysisWindow;
     const double time = args.time;
 
@@ -1240,18 +1629,43 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         doUpdate = _autoUpdate->getValueAtTime(time);
     }
     if (paramName == kParamAnalyzeFrame) {
+        if ( !_reuseAnalysis->getValue() ) {
+            clearCachedResults(eAnalysisRGBA, false, time);
+        }
         doAnalyzeRGBA = true;
     }
     if (paramName == kParamAnalyzeSequence) {
+        if ( !_reuseAnalysis->getValue() ) {
+            clearCachedResults(eAnalysisRGBA, true, time);
+        }
         doAnalyzeSequenceRGBA = true;
     }
     if (paramName == kParamAnalyzeFrameHSVL) {
+        if ( !_reuseAnalysis->getValue() ) {
+            clearCachedResults(eAnalysisHSVL, false, time);
+        }
         doAnalyzeHSVL = true;
     }
     if (paramName == kParamAnalyzeSequenceHSVL) {
+        if ( !_reuseAnalysis->getValue() ) {
+            clearCachedResults(eAnalysisHSVL, true, time);
+        }
         doAnalyzeSequenceHSVL = true;
     }
+    if (paramName == kParamAnalyzeFramePercentiles) {
+        if ( !_reuseAnalysis->getValue() ) {
+            clearCachedResults(eAnalysisPercentiles, false, time);
+        }
+        doAnalyzePercentiles = true;
+    }
+    if (paramName == kParamAnalyzeSequencePercentiles) {
+        if ( !_reuseAnalysis->getValue() ) {
+            clearCachedResults(eAnalysisPercentiles, true, time);
+        }
+        doAnalyzeSequencePercentiles = true;
+    }
     if (paramName == kParamClearFrame) {
+        clearCachedResults(eAnalysisRGBA, false, args.time);
         _statMin->deleteKeyAtTime(args.time);
         _statMax->deleteKeyAtTime(args.time);
         _statMean->deleteKeyAtTime(args.time);
@@ -1260,6 +1674,7 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statKurtosis->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequence) {
+        clearCachedResults(eAnalysisRGBA, true, args.time);
         _statMin->deleteAllKeys();
         _statMax->deleteAllKeys();
         _statMean->deleteAllKeys();
@@ -1268,6 +1683,7 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statKurtosis->deleteAllKeys();
     }
     if (paramName == kParamClearFrameHSVL) {
+        clearCachedResults(eAnalysisHSVL, false, args.time);
         _statHSVLMin->deleteKeyAtTime(args.time);
         _statHSVLMax->deleteKeyAtTime(args.time);
         _statHSVLMean->deleteKeyAtTime(args.time);
@@ -1276,6 +1692,7 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statHSVLKurtosis->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequenceHSVL) {
+        clearCachedResults(eAnalysisHSVL, true, args.time);
         _statHSVLMin->deleteAllKeys();
         _statHSVLMax->deleteAllKeys();
         _statHSVLMean->deleteAllKeys();
@@ -1283,15 +1700,38 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statHSVLSkewness->deleteAllKeys();
         _statHSVLKurtosis->deleteAllKeys();
     }
+    if (paramName == kParamClearFramePercentiles) {
+        clearCachedResults(eAnalysisPercentiles, false, args.time);
+        _statMedian->deleteKeyAtTime(args.time);
+        _statPercentileLow->deleteKeyAtTime(args.time);
+        _statPercentileHigh->deleteKeyAtTime(args.time);
+        _statClippedLow->deleteKeyAtTime(args.time);
+        _statClippedHigh->deleteKeyAtTime(args.time);
+    }
+    if (paramName == kParamClearSequencePercentiles) {
+        clearCachedResults(eAnalysisPercentiles, true, args.time);
+        _statMedian->deleteAllKeys();
+        _statPercentileLow->deleteAllKeys();
+        _statPercentileHigh->deleteAllKeys();
+        _statClippedLow->deleteAllKeys();
+        _statClippedHigh->deleteAllKeys();
+    }
+    if ( (paramName == kParamHistogramBins) || (paramName == kParamHistogramLog) ||
+         ( paramName == kParamPercentileLow) || ( paramName == kParamPercentileHigh) ) {
+        int k = _statMedian->getKeyIndex(args.time, eKeySearchNear);
+        doAnalyzePercentiles = (k != -1);
+    }
     if (doUpdate) {
         // check if there is already a Keyframe, if yes update it
         int k = _statMean->getKeyIndex(args.time, eKeySearchNear);
         doAnalyzeRGBA = (k != -1);
         k = _statHSVLMean->getKeyIndex(args.time, eKeySearchNear);
         doAnalyzeHSVL = (k != -1);
+        k = _statMedian->getKeyIndex(args.time, eKeySearchNear);
+        doAnalyzePercentiles = (k != -1);
     }
     // RGBA analysis
-    if ( (doAnalyzeRGBA || doAnalyzeHSVL) && _srcClip && _srcClip->isConnected() ) {
+    if ( (doAnalyzeRGBA || doAnalyzeHSVL || doAnalyzePercentiles) && _srcClip && _srcClip->isConnected() ) {
         std::auto_ptr<OFX::Image> src( ( _srcClip && _srcClip->isConnected() ) ?
                                        _srcClip->fetchImage(args.time) : 0 );
         if ( src.get() ) {
@@ -1311,13 +1751,16 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
                 if (doAnalyzeHSVL) {
                     updateHSVL(src.get(), args.time, analysisWindow);
                 }
+                if (doAnalyzePercentiles) {
+                    updatePercentiles(src.get(), args.time, analysisWindow);
+                }
 #             ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
                 getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
 #             endif
             }
         }
     }
-    if ( (doAnalyzeSequenceRGBA || doAnalyzeSequenceHSVL) && _srcClip && _srcClip->isConnected() ) {
+    if ( (doAnalyzeSequenceRGBA || doAnalyzeSequenceHSVL || doAnalyzeSequencePercentiles) && _srcClip && _srcClip->isConnected() ) {
 #     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
         getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
 #     endif
@@ -1326,29 +1769,21 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
         int tmin = (int)std::ceil(range.min);
         int tmax = (int)std::floor(range.max);
-        for (int t = tmin; t <= tmax; ++t) {
-            std::auto_ptr<OFX::Image> src( ( _srcClip && _srcClip->isConnected() ) ?
-                                           _srcClip->fetchImage(t) : 0 );
-            if ( src.get() ) {
-                if ( (src->getRenderScale().x != args.renderScale.x) ||
-                     ( src->getRenderScale().y != args.renderScale.y) ) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-                bool intersect = computeWindow(src.get(), t, &analysisWindow);
-                if (intersect) {
-                    if (doAnalyzeSequenceRGBA) {
-                        update(src.get(), t, analysisWindow);
-                    }
-                    if (doAnalyzeSequenceHSVL) {
-                        updateHSVL(src.get(), t, analysisWindow);
-                    }
-                }
+        // Several frames are fetched and analyzed at the same time, so that fetching a frame
+        // (which may involve reading and decoding it) overlaps with the analysis of the other frames.
+        // The results are set in frame order by this thread, see SequenceAnalyzer.
+        if (tmin <= tmax) {
+            unsigned int nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)kAnalysisFramesInFlightMax);
+            SequenceAnalyzer analyzer(*this, tmin, tmax, args.renderScale, doAnalyzeSequenceRGBA, doAnalyzeSequenceHSVL, doAnalyzeSequencePercentiles);
+            analyzer.process(nThreads);
+            if ( analyzer.badScale() ) {
+                progressEnd();
+                setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+                OFX::throwSuiteStatusException(kOfxStatFailed);
             }
-            if (tmax != tmin) {
-                if ( !progressUpdate( (t - tmin) / (double)(tmax - tmin) ) ) {
-                    break;
-                }
+            if ( analyzer.failed() ) {
+                progressEnd();
+                OFX::throwSuiteStatusException(kOfxStatFailed);
             }
         }
         progressEnd();
@@ -1358,13 +1793,33 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
     }
 } // ImageStatisticsPlugin::changedParam
 
+void
+ImageStatisticsPlugin::changedClip(const OFX::InstanceChangedArgs & /*args*/,
+                                   const std::string &clipName)
+{
+    if (clipName == kOfxImageEffectSimpleSourceClipName) {
+        // the source changed, previous analysis results cannot be trusted anymore
+        AutoMutex guard(_cacheMutex);
+        _cache.clear();
+    }
+}
+
+void
+ImageStatisticsPlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments & /*args*/)
+{
+    // the source may have changed since the last analysis, and there is no way to detect it
+    AutoMutex guard(_cacheMutex);
+
+    _cache.clear();
+}
+
 /* set up and run a processor */
 void
 ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor,
                                        const OFX::Image* srcImg,
                                        double /*time*/,
                                        const OfxRectI &analysisWindow,
-                                       const Results &prevResults,
+                                       const HistogramParams &histogramParams,
                                        Results *results)
 {
     // set the images
@@ -1373,10 +1828,17 @@ ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor,
     // set the render window
     processor.setRenderWindow(analysisWindow);
 
-    processor.setPrevResults(prevResults);
+    processor.setHistogramParams(histogramParams);
 
     // Call the base class process member, this will call the derived templated process code
-    processor.process();
+    do {
+        if ( OFX::MultiThread::isSpawnedThread() ) {
+            // we are analyzing several frames in parallel, see SequenceAnalyzer
+            processor.processInCurrentThread();
+        } else {
+            processor.process();
+        }
+    } while ( !abort() && processor.nextPass() );
 
     if ( !abort() ) {
         processor.getResults(results);
@@ -1387,6 +1849,16 @@ bool
 ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg,
                                      double time,
                                      OfxRectI *analysisWindow)
+{
+    return computeWindow(time, srcImg->getRenderScale(), srcImg->getPixelAspectRatio(), srcImg->getBounds(), analysisWindow);
+}
+
+bool
+ImageStatisticsPlugin::computeWindow(double time,
+                                     const OfxPointD &renderScale,
+                                     double par,
+                                     const OfxRectI &srcBounds,
+                                     OfxRectI *analysisWindow)
 {
     OfxRectD regionOfInterest;
     bool restrictToRectangle = _restrictToRectangle->getValueAtTime(time);
@@ -1414,35 +1886,158 @@ ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg,
         regionOfInterest.x2 += regionOfInterest.x1;
         regionOfInterest.y2 += regionOfInterest.y1;
     }
-    Coords::toPixelEnclosing(regionOfInterest,
-                             srcImg->getRenderScale(),
-                             srcImg->getPixelAspectRatio(),
-                             analysisWindow);
-
-    return OFX::Coords::rectIntersection(*analysisWindow, srcImg->getBounds(), analysisWindow);
+    Coords::toPixelEnclosing(regionOfInterest,
+                             renderScale,
+                             par,
+                             analysisWindow);
+
+    return OFX::Coords::rectIntersection(*analysisWindow, srcBounds, analysisWindow);
+}
+
+// compute the cache key for the analysis of the source at the given time, without fetching the source image.
+// Returns false if the analysis of this frame cannot be cached.
+bool
+ImageStatisticsPlugin::getAnalysisKey(double time,
+                                      const OfxPointD &renderScale,
+                                      AnalysisModeEnum mode,
+                                      AnalysisKey *key)
+{
+    if ( !_srcClip || !_srcClip->isConnected() ) {
+        return false;
+    }
+    OfxRectD srcRoD = _srcClip->getRegionOfDefinition(time);
+    if ( (srcRoD.x1 <= kOfxFlagInfiniteMin) || (srcRoD.x2 >= kOfxFlagInfiniteMax) ||
+         ( srcRoD.y1 <= kOfxFlagInfiniteMin) || ( srcRoD.y2 >= kOfxFlagInfiniteMax) ) {
+        return false;
+    }
+    // the bounds of the fetched image are the source RoD
+    OfxRectI srcBounds;
+    double par = _srcClip->getPixelAspectRatio();
+    Coords::toPixelEnclosing(srcRoD, renderScale, par, &srcBounds);
+    if ( !computeWindow(time, renderScale, par, srcBounds, &key->window) ) {
+        return false;
+    }
+    key->time = time;
+    key->mode = mode;
+    if (mode == eAnalysisPercentiles) {
+        key->histogram = getHistogramParams(time);
+    }
+    key->renderScale = renderScale;
+    key->srcRoD = srcRoD;
+    key->srcComponents = (int)_srcClip->getPixelComponents();
+    key->srcBitDepth = (int)_srcClip->getPixelDepth();
+
+    return true;
+}
+
+bool
+ImageStatisticsPlugin::getCachedResults(const AnalysisKey &key,
+                                        Results *results)
+{
+    AutoMutex guard(_cacheMutex);
+    AnalysisCache::const_iterator it = _cache.find(key);
+
+    if ( it == _cache.end() ) {
+        return false;
+    }
+    *results = it->second;
+
+    return true;
+}
+
+void
+ImageStatisticsPlugin::setCachedResults(const AnalysisKey &key,
+                                        const Results &results)
+{
+    AutoMutex guard(_cacheMutex);
+
+    if ( ( _cache.size() >= kAnalysisCacheMax) && ( _cache.find(key) == _cache.end() ) ) {
+        // evict the results for the frame which is the farthest from this one
+        AnalysisCache::iterator first = _cache.begin();
+        AnalysisCache::iterator last = _cache.end();
+        --last;
+        if ( (key.time - first->first.time) >= (last->first.time - key.time) ) {
+            _cache.erase(first);
+        } else {
+            _cache.erase(last);
+        }
+    }
+    _cache[key] = results;
 }
 
-// update image statistics
 void
-ImageStatisticsPlugin::update(const OFX::Image* srcImg,
-                              double time,
-                              const OfxRectI &analysisWindow)
+ImageStatisticsPlugin::clearCachedResults(AnalysisModeEnum mode,
+                                          bool allFrames,
+                                          double time)
 {
-    // TODO: CHECK if checkDoubleAnalysis param is true and analysisWindow is the same as btmLeft/sizeAnalysis
-    Results results;
+    AutoMutex guard(_cacheMutex);
 
-    if ( !abort() ) {
-        updateSub<ImageMinMaxMeanProcessor>(srcImg, time, analysisWindow, results, &results);
+    for (AnalysisCache::iterator it = _cache.begin(); it != _cache.end();) {
+        if ( (it->first.mode == mode) && (allFrames || it->first.time == time) ) {
+            _cache.erase(it++);
+        } else {
+            ++it;
+        }
     }
+}
+
+// compute image statistics
+bool
+ImageStatisticsPlugin::computeStatistics(const OFX::Image* srcImg,
+                                         double time,
+                                         const OfxRectI &analysisWindow,
+                                         Results *results)
+{
     if ( !abort() ) {
-        updateSub<ImageSDevProcessor>(srcImg, time, analysisWindow, results, &results);
+        updateSub<ImageMomentsProcessor>(srcImg, time, analysisWindow, HistogramParams(), results);
     }
+
+    return !abort();
+}
+
+bool
+ImageStatisticsPlugin::computeStatisticsHSVL(const OFX::Image* srcImg,
+                                             double time,
+                                             const OfxRectI &analysisWindow,
+                                             Results *results)
+{
     if ( !abort() ) {
-        updateSub<ImageSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, results, &results);
+        updateSub<ImageHSVLMomentsProcessor>(srcImg, time, analysisWindow, HistogramParams(), results);
     }
-    if ( abort() ) {
-        return;
+
+    return !abort();
+}
+
+bool
+ImageStatisticsPlugin::computeStatisticsPercentiles(const OFX::Image* srcImg,
+                                                    double time,
+                                                    const OfxRectI &analysisWindow,
+                                                    Results *results)
+{
+    if ( !abort() ) {
+        updateSub<ImageHistogramProcessor>(srcImg, time, analysisWindow, getHistogramParams(time), results);
     }
+
+    return !abort();
+}
+
+HistogramParams
+ImageStatisticsPlugin::getHistogramParams(double time)
+{
+    HistogramParams params;
+
+    params.bins = std::max( 1, std::min(_histogramBins->getValueAtTime(time), kHistogramBinsMax) );
+    params.logBins = _histogramLog->getValueAtTime(time);
+    params.percentileLow = _percentileLow->getValueAtTime(time);
+    params.percentileHigh = _percentileHigh->getValueAtTime(time);
+
+    return params;
+}
+
+void
+ImageStatisticsPlugin::setResults(double time,
+                                  const Results &results)
+{
     beginEditBlock("updateStatisticsRGBA");
     _statMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
     _statMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
@@ -1454,6 +2049,51 @@ ImageStatisticsPlugin::update(const OFX::Image* srcImg,
     endEditBlock();
 }
 
+void
+ImageStatisticsPlugin::setResultsHSVL(double time,
+                                      const Results &results)
+{
+    beginEditBlock("updateStatisticsHSVL");
+    _statHSVLMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
+    _statHSVLMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
+    _statHSVLMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
+    _statHSVLSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
+    _statHSVLSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
+    _statHSVLKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+    endEditBlock();
+}
+
+void
+ImageStatisticsPlugin::setResultsPercentiles(double time,
+                                             const Results &results)
+{
+    beginEditBlock("updateStatisticsPercentiles");
+    _statMedian->setValueAtTime(time, results.median.r, results.median.g, results.median.b, results.median.a);
+    _statPercentileLow->setValueAtTime(time, results.percentileLow.r, results.percentileLow.g, results.percentileLow.b, results.percentileLow.a);
+    _statPercentileHigh->setValueAtTime(time, results.percentileHigh.r, results.percentileHigh.g, results.percentileHigh.b, results.percentileHigh.a);
+    _statClippedLow->setValueAtTime(time, results.clippedLow.r, results.clippedLow.g, results.clippedLow.b, results.clippedLow.a);
+    _statClippedHigh->setValueAtTime(time, results.clippedHigh.r, results.clippedHigh.g, results.clippedHigh.b, results.clippedHigh.a);
+    endEditBlock();
+}
+
+// update image statistics
+void
+ImageStatisticsPlugin::update(const OFX::Image* srcImg,
+                              double time,
+                              const OfxRectI &analysisWindow)
+{
+    // TODO: CHECK if checkDoubleAnalysis param is true and analysisWindow is the same as btmLeft/sizeAnalysis
+    Results results;
+
+    if ( computeStatistics(srcImg, time, analysisWindow, &results) ) {
+        AnalysisKey key;
+        if ( getAnalysisKey(time, srcImg->getRenderScale(), eAnalysisRGBA, &key) && rectIsEqual(key.window, analysisWindow) ) {
+            setCachedResults(key, results);
+        }
+        setResults(time, results);
+    }
+}
+
 void
 ImageStatisticsPlugin::updateHSVL(const OFX::Image* srcImg,
                                   double time,
@@ -1461,26 +2101,93 @@ ImageStatisticsPlugin::updateHSVL(const OFX::Image* srcImg,
 {
     Results results;
 
-    if ( !abort() ) {
-        updateSub<ImageHSVLMinMaxMeanProcessor>(srcImg, time, analysisWindow, results, &results);
+    if ( computeStatisticsHSVL(srcImg, time, analysisWindow, &results) ) {
+        AnalysisKey key;
+        if ( getAnalysisKey(time, srcImg->getRenderScale(), eAnalysisHSVL, &key) && rectIsEqual(key.window, analysisWindow) ) {
+            setCachedResults(key, results);
+        }
+        setResultsHSVL(time, results);
     }
-    if ( !abort() ) {
-        updateSub<ImageHSVLSDevProcessor>(srcImg, time, analysisWindow, results, &results);
+}
+
+void
+ImageStatisticsPlugin::updatePercentiles(const OFX::Image* srcImg,
+                                         double time,
+                                         const OfxRectI &analysisWindow)
+{
+    Results results;
+
+    if ( computeStatisticsPercentiles(srcImg, time, analysisWindow, &results) ) {
+        AnalysisKey key;
+        if ( getAnalysisKey(time, srcImg->getRenderScale(), eAnalysisPercentiles, &key) && rectIsEqual(key.window, analysisWindow) ) {
+            setCachedResults(key, results);
+        }
+        setResultsPercentiles(time, results);
     }
-    if ( !abort() ) {
-        updateSub<ImageHSVLSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, results, &results);
+}
+
+void
+ImageStatisticsPlugin::analyzeFrame(double time,
+                                    const OfxPointD &renderScale,
+                                    bool doRGBA,
+                                    bool doHSVL,
+                                    bool doPercentiles,
+                                    FrameResults *results)
+{
+    // first, try to get the results from the cache, without fetching the source image
+    AnalysisKey keyRGBA, keyHSVL, keyPercentiles;
+    bool cacheRGBA = doRGBA && getAnalysisKey(time, renderScale, eAnalysisRGBA, &keyRGBA);
+    bool cacheHSVL = doHSVL && getAnalysisKey(time, renderScale, eAnalysisHSVL, &keyHSVL);
+    bool cachePercentiles = doPercentiles && getAnalysisKey(time, renderScale, eAnalysisPercentiles, &keyPercentiles);
+
+    if (cacheRGBA) {
+        results->rgba = getCachedResults(keyRGBA, &results->resultsRGBA);
     }
-    if ( abort() ) {
+    if (cacheHSVL) {
+        results->hsvl = getCachedResults(keyHSVL, &results->resultsHSVL);
+    }
+    if (cachePercentiles) {
+        results->percentiles = getCachedResults(keyPercentiles, &results->resultsPercentiles);
+    }
+    if ( (!doRGBA || results->rgba) && (!doHSVL || results->hsvl) && (!doPercentiles || results->percentiles) ) {
         return;
     }
-    beginEditBlock("updateStatisticsHSVL");
-    _statHSVLMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
-    _statHSVLMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
-    _statHSVLMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
-    _statHSVLSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
-    _statHSVLSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
-    _statHSVLKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
-    endEditBlock();
+
+    std::auto_ptr<const OFX::Image> src( ( _srcClip && _srcClip->isConnected() ) ?
+                                         _srcClip->fetchImage(time) : 0 );
+    if ( !src.get() ) {
+        return;
+    }
+    if ( (src->getRenderScale().x != renderScale.x) ||
+         ( src->getRenderScale().y != renderScale.y) ) {
+        results->badScale = true;
+
+        return;
+    }
+    OfxRectI analysisWindow;
+    bool intersect = computeWindow(src.get(), time, &analysisWindow);
+    if (!intersect) {
+        return;
+    }
+    if (doRGBA && !results->rgba) {
+        results->rgba = computeStatistics(src.get(), time, analysisWindow, &results->resultsRGBA);
+        // only cache the results if the image bounds were correctly guessed from the RoD
+        if ( results->rgba && cacheRGBA && rectIsEqual(keyRGBA.window, analysisWindow) ) {
+            setCachedResults(keyRGBA, results->resultsRGBA);
+        }
+    }
+    if (doHSVL && !results->hsvl) {
+        results->hsvl = computeStatisticsHSVL(src.get(), time, analysisWindow, &results->resultsHSVL);
+        if ( results->hsvl && cacheHSVL && rectIsEqual(keyHSVL.window, analysisWindow) ) {
+            setCachedResults(keyHSVL, results->resultsHSVL);
+        }
+    }
+    if (doPercentiles && !results->percentiles) {
+        results->percentiles = computeStatisticsPercentiles(src.get(), time, analysisWindow, &results->resultsPercentiles);
+        if ( results->percentiles && cachePercentiles && rectIsEqual(keyPercentiles.window, analysisWindow) ) {
+            setCachedResults(keyPercentiles, results->resultsPercentiles);
+        }
+    }
 }
 
 class ImageStatisticsInteract
@@ -1693,6 +2400,18 @@ ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         }
     }
 
+    // reuseAnalysis
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamReuseAnalysis);
+        param->setLabel(kParamReuseAnalysisLabel);
+        param->setHint(kParamReuseAnalysisHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     // interactive
     {
         BooleanParamDescriptor* param = desc.defineBooleanParam(kParamRectangleInteractInteractive);
@@ -2012,6 +2731,218 @@ ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
             }
         }
     }
+
+    {
+        GroupParamDescriptor* group = desc.defineGroupParam(kParamGroupPercentiles);
+        if (group) {
+            group->setLabel(kParamGroupPercentiles);
+            group->setAsTab();
+        }
+
+        // histogramBins
+        {
+            IntParamDescriptor *param = desc.defineIntParam(kParamHistogramBins);
+            param->setLabel(kParamHistogramBinsLabel);
+            param->setHint(kParamHistogramBinsHint);
+            param->setRange(1, kHistogramBinsMax);
+            param->setDisplayRange(16, 4096);
+            param->setDefault(1024);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // histogramLog
+        {
+            BooleanParamDescriptor *param = desc.defineBooleanParam(kParamHistogramLog);
+            param->setLabel(kParamHistogramLogLabel);
+            param->setHint(kParamHistogramLogHint);
+            param->setDefault(false);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // percentileLow
+        {
+            DoubleParamDescriptor *param = desc.defineDoubleParam(kParamPercentileLow);
+            param->setLabel(kParamPercentileLowLabel);
+            param->setHint(kParamPercentileLowHint);
+            param->setRange(0., 100.);
+            param->setDisplayRange(0., 100.);
+            param->setDefault(1.);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // percentileHigh
+        {
+            DoubleParamDescriptor *param = desc.defineDoubleParam(kParamPercentileHigh);
+            param->setLabel(kParamPercentileHighLabel);
+            param->setHint(kParamPercentileHighHint);
+            param->setRange(0., 100.);
+            param->setDisplayRange(0., 100.);
+            param->setDefault(99.);
+            param->setAnimates(false);
+            param->setEvaluateOnChange(false);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statMedian
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatMedian);
+            param->setLabel(kParamStatMedianLabel);
+            param->setHint(kParamStatMedianHint);
+            param->setDimensionLabels("r", "g", "b", "y");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statPercentileLow
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatPercentileLow);
+            param->setLabel(kParamStatPercentileLowLabel);
+            param->setHint(kParamStatPercentileLowHint);
+            param->setDimensionLabels("r", "g", "b", "y");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statPercentileHigh
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatPercentileHigh);
+            param->setLabel(kParamStatPercentileHighLabel);
+            param->setHint(kParamStatPercentileHighHint);
+            param->setDimensionLabels("r", "g", "b", "y");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statClippedLow
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatClippedLow);
+            param->setLabel(kParamStatClippedLowLabel);
+            param->setHint(kParamStatClippedLowHint);
+            param->setDimensionLabels("r", "g", "b", "y");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statClippedHigh
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatClippedHigh);
+            param->setLabel(kParamStatClippedHighLabel);
+            param->setHint(kParamStatClippedHighHint);
+            param->setDimensionLabels("r", "g", "b", "y");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // analyzeFramePercentiles
+        {
+            PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeFramePercentiles);
+            param->setLabel(kParamAnalyzeFramePercentilesLabel);
+            param->setHint(kParamAnalyzeFramePercentilesHint);
+            param->setLayoutHint(eLayoutHintNoNewLine, 1);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // analyzeSequencePercentiles
+        {
+            PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeSequencePercentiles);
+            param->setLabel(kParamAnalyzeSequencePercentilesLabel);
+            param->setHint(kParamAnalyzeSequencePercentilesHint);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // clearFramePercentiles
+        {
+            PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamClearFramePercentiles);
+            param->setLabel(kParamClearFramePercentilesLabel);
+            param->setHint(kParamClearFramePercentilesHint);
+            param->setLayoutHint(eLayoutHintNoNewLine, 1);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // clearSequencePercentiles
+        {
+            PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamClearSequencePercentiles);
+            param->setLabel(kParamClearSequencePercentilesLabel);
+            param->setHint(kParamClearSequencePercentilesHint);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+    }
 } // ImageStatisticsPluginFactory::describeInContext
 
 static ImageStatisticsPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
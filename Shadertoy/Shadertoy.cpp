@@ -22,9 +22,6 @@
  * References:
  * https://www.shadertoy.com (v0.8.3 as of march 22, 2016)
  * http://www.iquilezles.org/apps/shadertoy/index2.html (original Shader Toy v0.4)
- *
- * TODO:
- * - add multipass support (using tabs for UI as in shadertoys)
  */
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER) || defined(HAVE_OSMESA) // at least one is required for this plugin
@@ -34,7 +31,11 @@
 #include <cfloat> // DBL_MAX
 #include <cstddef>
 #include <climits>
+#include <cstdio> // sprintf, rename, remove
+#include <cstdlib> // getenv
 #include <string>
+#include <map>
+#include <vector>
 #include <fstream>
 #include <streambuf>
 #ifdef DEBUG
@@ -43,6 +44,11 @@
 
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
+#include <direct.h> // _mkdir
+#include <process.h> // _getpid
+#else
+#include <sys/stat.h> // mkdir
+#include <unistd.h> // getpid
 #endif
 
 #include "ofxsImageEffect.h"
@@ -56,11 +62,12 @@ using namespace OFX;
 //OFXS_NAMESPACE_ANONYMOUS_ENTER // defines external classes
 #define NBINPUTS SHADERTOY_NBINPUTS
 #define NBUNIFORMS SHADERTOY_NBUNIFORMS
+#define NBBUFFERS SHADERTOY_NBBUFFERS
 
 #define kPluginName "Shadertoy"
 #define kPluginGrouping "Filter"
 #define kPluginDescription \
-    "Apply a Shadertoy fragment shader (multipass shaders and sound are not supported). See http://www.shadertoy.com\n" \
+    "Apply a Shadertoy fragment shader (sound is not supported). See http://www.shadertoy.com\n" \
     "\n" \
     "This help only covers the parts of GLSL ES that are relevant for Shadertoy. " \
     "For the complete specification please have a look at GLSL ES specification " \
@@ -230,11 +237,15 @@ using namespace OFX;
     "* This one also sets the filter and wrap parameters:\n" \
     "  `// iChannel0: Source (Source image.), filter=linear, wrap=clamp`\n" \
     "* And this one sets the output bouding box (possible values are Default, Union, Interection, and iChannel0 to iChannel3):\n" \
-    "  `// BBox: iChannel0`"
+    "  `// BBox: iChannel0`\n" \
+    "\n" \
+    "Multipass shaders are supported: the Buffer A to Buffer D shaders (in the 'Multipass Buffers' group) are rendered in this order before the image shader, each into a floating-point texture that has the size of the output image. The iChannel parameters of each pass tell whether each iChannel reads an input or a buffer. A pass that reads a buffer which is rendered after it (or itself) gets the content of that buffer at the previous frame, which is kept in memory if 'Keep Previous Frame' is checked and if the previous frame was rendered just before (else it is black).\n" \
+    "\n" \
+    "If the OpenGL driver supports GL_ARB_get_program_binary, compiled shaders are kept in memory, and can also be cached on disk by setting the OFX_SHADERTOY_CACHE_PATH environment variable to a directory. The disk cache is disabled if this variable is not set. Its size is not limited, and its content may be deleted at any time."
 
 
 #define kPluginDescriptionMarkdown \
-    "Apply a [Shadertoy](http://www.shadertoy.com) fragment shader (multipass shaders and sound are not supported).\n" \
+    "Apply a [Shadertoy](http://www.shadertoy.com) fragment shader (sound is not supported).\n" \
     "\n" \
     "This help only covers the parts of GLSL ES that are relevant for Shadertoy. For the complete specification please have a look at [GLSL ES specification](http://www.khronos.org/registry/gles/specs/2.0/GLSL_ES_Specification_1.0.17.pdf)  or pages 3 and 4 of the [OpenGL ES 2.0 quick reference card](https://www.khronos.org/opengles/sdk/docs/reference_cards/OpenGL-ES-2_0-Reference-card.pdf).\n" \
     "See also the [Shadertoy/GLSL tutorial](https://www.shadertoy.com/view/Md23DV).\n" \
@@ -401,11 +412,15 @@ using namespace OFX;
     "* This one also sets the filter and wrap parameters:\n" \
     "  `// iChannel0: Source (Source image.), filter=linear, wrap=clamp`\n" \
     "* And this one sets the output bouding box (possible values are Default, Union, Interection, and iChannel0 to iChannel3):\n" \
-    "  `// BBox: iChannel0`"
+    "  `// BBox: iChannel0`\n" \
+    "\n" \
+    "Multipass shaders are supported: the Buffer A to Buffer D shaders (in the 'Multipass Buffers' group) are rendered in this order before the image shader, each into a floating-point texture that has the size of the output image. The iChannel parameters of each pass tell whether each iChannel reads an input or a buffer. A pass that reads a buffer which is rendered after it (or itself) gets the content of that buffer at the previous frame, which is kept in memory if 'Keep Previous Frame' is checked and if the previous frame was rendered just before (else it is black).\n" \
+    "\n" \
+    "If the OpenGL driver supports GL_ARB_get_program_binary, compiled shaders are kept in memory, and can also be cached on disk by setting the OFX_SHADERTOY_CACHE_PATH environment variable to a directory. The disk cache is disabled if this variable is not set. Its size is not limited, and its content may be deleted at any time."
 
 #define kPluginIdentifier "net.sf.openfx.Shadertoy"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 4 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -617,6 +632,29 @@ using namespace OFX;
 #define kParamInputHintLabel "Hint"
 #define kParamInputHintHint "Help for this input."
 
+#define kGroupBuffers "buffersGroup"
+#define kGroupBuffersLabel "Multipass Buffers"
+#define kGroupBuffersHint "Shaders rendered before the image shader, in the order Buffer A to Buffer D. Each buffer is rendered into a floating-point texture that has the size of the output image, and can be read by the following passes using their iChannel parameters."
+
+#define kParamBufferName "bufferName" // followed by buffer letter
+
+#define kParamBufferSource "bufferSource" // followed by buffer letter
+#define kParamBufferSourceLabel "Buffer " // followed by buffer letter
+#define kParamBufferSourceHint "Buffer shader. Leave empty to disable this buffer. The Compile button compiles all shaders.\n\n"kShaderInputsHint
+
+#define kParamBufferChannel "bufferChannel" // followed by buffer letter and channel number
+#define kParamImageChannel "imageChannel" // followed by channel number
+#define kParamImageChannelName "imageChannelName"
+#define kParamImageChannelNameLabel "Image"
+#define kParamChannelLabel "iChannel" // followed by channel number
+#define kParamChannelHint "The input or buffer read by this iChannel of the shader. A buffer which is rendered after this pass (or by this pass) contains the previous frame."
+#define kParamChannelOptionInputHint "Input " // followed by input name
+#define kParamChannelOptionBuffer "Buffer " // followed by buffer letter
+
+#define kParamBufferFeedback "bufferFeedback"
+#define kParamBufferFeedbackLabel "Keep Previous Frame"
+#define kParamBufferFeedbackHint "Keep the buffers in memory after rendering a frame, so that the passes that read a buffer which is rendered after them (or by them) get the content of this buffer at the previous frame. When unchecked, or if the previous frame was not rendered just before in the same sequence render, these buffers are black. The kept buffers are freed at the end of each sequence render."
+
 #if defined(OFX_SUPPORTS_OPENGLRENDER) && defined(HAVE_OSMESA)
 #define kParamEnableGPU "enableGPU"
 #define kParamEnableGPULabel "Enable GPU Render"
@@ -656,6 +694,213 @@ unsignedToString(unsigned i)
     return nb;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// The process-wide cache of linked program binaries (GL_ARB_get_program_binary).
+// The binaries are shared by all instances and all OpenGL or Mesa contexts. The least recently used binaries
+// are dropped when there are more than kProgramCacheMax of them.
+// If the OFX_SHADERTOY_CACHE_PATH environment variable is set, they are also stored on disk, so that other
+// processes (e.g. render farm workers) do not have to compile the same shaders again.
+// The key contains the OpenGL renderer string, so that a binary is never loaded by another driver.
+
+#define kProgramCacheMagic 0x53545042 // "STPB"
+#define kProgramCacheVersion 1
+#define kProgramCachePathEnv "OFX_SHADERTOY_CACHE_PATH" // disk cache directory, the disk cache is disabled if not set or empty
+#define kProgramCacheMax 64 // maximum number of program binaries kept in memory
+
+struct ShadertoyProgramBinary
+{
+    unsigned int format;
+    std::vector<unsigned char> binary;
+    unsigned long long lastUse; // value of gProgramCacheUse when the binary was last used
+
+    ShadertoyProgramBinary() : format(0), binary(), lastUse(0) {}
+};
+
+typedef std::map<std::string, ShadertoyProgramBinary> ShadertoyProgramCache;
+static std::auto_ptr<ShadertoyProgramCache> gProgramCache;
+static std::auto_ptr<ShadertoyPlugin::Mutex> gProgramCacheMutex;
+static unsigned long long gProgramCacheUse = 0;
+
+// the disk cache directory, or an empty string if there is no disk cache
+static std::string
+programCachePath()
+{
+    const char *path = std::getenv(kProgramCachePathEnv);
+
+    return path ? path : std::string();
+}
+
+// drop the least recently used binaries, so that there is room for one more.
+// gProgramCacheMutex must be locked.
+static void
+trimProgramCache()
+{
+    while (gProgramCache->size() >= kProgramCacheMax) {
+        ShadertoyProgramCache::iterator oldest = gProgramCache->begin();
+        for (ShadertoyProgramCache::iterator it = gProgramCache->begin(); it != gProgramCache->end(); ++it) {
+            if (it->second.lastUse < oldest->second.lastUse) {
+                oldest = it;
+            }
+        }
+        gProgramCache->erase(oldest);
+    }
+}
+
+// FNV-1a hash of the key, used as the file name in the disk cache
+static std::string
+programCacheFileName(const std::string &key)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    for (std::size_t i = 0; i < key.size(); ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    char name[32];
+    std::sprintf(name, "%08x%08x.bin", (unsigned int)(h >> 32), (unsigned int)(h & 0xffffffff) );
+
+    return name;
+}
+
+static bool
+readUInt32(std::ifstream &f,
+           unsigned int *v)
+{
+    unsigned char b[4];
+
+    if ( !f.read( (char*)b, 4 ) ) {
+        return false;
+    }
+    *v = (unsigned int)b[0] | ( (unsigned int)b[1] << 8 ) | ( (unsigned int)b[2] << 16 ) | ( (unsigned int)b[3] << 24 );
+
+    return true;
+}
+
+static void
+writeUInt32(std::ofstream &f,
+            unsigned int v)
+{
+    unsigned char b[4] = { (unsigned char)(v & 0xff), (unsigned char)( (v >> 8) & 0xff ), (unsigned char)( (v >> 16) & 0xff ), (unsigned char)( (v >> 24) & 0xff ) };
+
+    f.write( (const char*)b, 4 );
+}
+
+static bool
+readProgramBinaryFile(const std::string &path,
+                      const std::string &key,
+                      ShadertoyProgramBinary *program)
+{
+    std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+    unsigned int magic, version, keySize, binarySize;
+
+    if ( !f || !readUInt32(f, &magic) || (magic != kProgramCacheMagic) ||
+         !readUInt32(f, &version) || (version != kProgramCacheVersion) ||
+         !readUInt32(f, &keySize) || ( keySize != key.size() ) ) {
+        return false;
+    }
+    std::string fileKey(keySize, '\0');
+    if ( !f.read(&fileKey[0], keySize) || (fileKey != key) ||
+         !readUInt32(f, &program->format) || !readUInt32(f, &binarySize) || (binarySize == 0) ) {
+        return false;
+    }
+    program->binary.resize(binarySize);
+
+    return (bool)f.read( (char*)&program->binary[0], binarySize );
+}
+
+static void
+writeProgramBinaryFile(const std::string &dir,
+                       const std::string &fileName,
+                       const std::string &key,
+                       const ShadertoyProgramBinary &program)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    _mkdir( dir.c_str() );
+    const int pid = _getpid();
+#else
+    mkdir(dir.c_str(), 0777);
+    const int pid = (int)getpid();
+#endif
+    // write to a temporary file, and rename it, so that other processes never read a partial file
+    const std::string path = dir + "/" + fileName;
+    const std::string tmpPath = path + "." + unsignedToString(pid) + ".tmp";
+    {
+        std::ofstream f(tmpPath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!f) {
+            return;
+        }
+        writeUInt32(f, kProgramCacheMagic);
+        writeUInt32(f, kProgramCacheVersion);
+        writeUInt32( f, (unsigned int)key.size() );
+        f.write( key.data(), key.size() );
+        writeUInt32(f, program.format);
+        writeUInt32( f, (unsigned int)program.binary.size() );
+        f.write( (const char*)&program.binary[0], program.binary.size() );
+        if (!f) {
+            f.close();
+            std::remove( tmpPath.c_str() );
+
+            return;
+        }
+    }
+    if (std::rename( tmpPath.c_str(), path.c_str() ) != 0) {
+        std::remove( tmpPath.c_str() );
+    }
+}
+
+bool
+getShadertoyProgramBinary(const std::string &key,
+                          unsigned int *format,
+                          std::vector<unsigned char> *binary)
+{
+    ShadertoyPlugin::AutoMutex lock( gProgramCacheMutex.get() );
+
+    if ( !gProgramCache.get() ) {
+        gProgramCache.reset(new ShadertoyProgramCache);
+    }
+    ShadertoyProgramCache::iterator it = gProgramCache->find(key);
+    if ( it == gProgramCache->end() ) {
+        const std::string dir = programCachePath();
+        ShadertoyProgramBinary program;
+        if ( dir.empty() || !readProgramBinaryFile(dir + "/" + programCacheFileName(key), key, &program) ) {
+            return false;
+        }
+        trimProgramCache();
+        it = gProgramCache->insert( std::make_pair(key, program) ).first;
+    }
+    it->second.lastUse = ++gProgramCacheUse;
+    *format = it->second.format;
+    *binary = it->second.binary;
+
+    return true;
+}
+
+void
+setShadertoyProgramBinary(const std::string &key,
+                          unsigned int format,
+                          const std::vector<unsigned char> &binary)
+{
+    if ( binary.empty() ) {
+        return;
+    }
+    ShadertoyPlugin::AutoMutex lock( gProgramCacheMutex.get() );
+
+    if ( !gProgramCache.get() ) {
+        gProgramCache.reset(new ShadertoyProgramCache);
+    }
+    if ( gProgramCache->find(key) == gProgramCache->end() ) {
+        trimProgramCache();
+    }
+    ShadertoyProgramBinary &program = (*gProgramCache)[key];
+    program.lastUse = ++gProgramCacheUse;
+    program.format = format;
+    program.binary = binary;
+    const std::string dir = programCachePath();
+    if ( !dir.empty() ) {
+        writeProgramBinaryFile(dir, programCacheFileName(key), key, program);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 
@@ -668,6 +913,10 @@ ShadertoyPlugin::ShadertoyPlugin(OfxImageEffectHandle handle)
     , _inputHint    (NBINPUTS, (OFX::StringParam*) NULL)
     , _inputFilter  (NBINPUTS, (OFX::ChoiceParam*) NULL)
     , _inputWrap    (NBINPUTS, (OFX::ChoiceParam*) NULL)
+    , _bufferSource (NBBUFFERS, (OFX::StringParam*) NULL)
+    , _bufferChannel(NBBUFFERS * NBINPUTS, (OFX::ChoiceParam*) NULL)
+    , _imageChannel (NBINPUTS, (OFX::ChoiceParam*) NULL)
+    , _bufferFeedback(0)
     , _bbox(0)
     , _format(0)
     , _formatSize(0)
@@ -720,12 +969,14 @@ ShadertoyPlugin::ShadertoyPlugin(OfxImageEffectHandle handle)
     , _imageShaderInputWrap(NBINPUTS, eWrapRepeat)
     , _imageShaderBBox(eBBoxDefault)
     , _imageShaderCompiled(false)
+    , _bufferHistory()
     , _openGLContextData()
     , _openGLContextAttached(false)
 {
     try {
         _imageShaderMutex.reset(new Mutex);
         _rendererInfoMutex.reset(new Mutex);
+        _bufferHistoryMutex.reset(new Mutex);
 #if defined(HAVE_OSMESA)
         _osmesaMutex.reset(new Mutex);
 #endif
@@ -777,6 +1028,21 @@ ShadertoyPlugin::ShadertoyPlugin(OfxImageEffectHandle handle)
     _imageShaderTriggerRender = fetchIntParam(kParamImageShaderTriggerRender);
     _imageShaderParamsUpdated = fetchBooleanParam(kParamImageShaderParamsUpdated);
     assert(_imageShaderFileName && _imageShaderSource && _imageShaderCompile && _imageShaderTriggerRender && _imageShaderParamsUpdated);
+    for (unsigned b = 0; b < NBBUFFERS; ++b) {
+        std::string letter(1, (char)('A' + b));
+        _bufferSource[b] = fetchStringParam(kParamBufferSource + letter);
+        assert(_bufferSource[b]);
+        for (unsigned i = 0; i < NBINPUTS; ++i) {
+            _bufferChannel[b * NBINPUTS + i] = fetchChoiceParam(kParamBufferChannel + letter + unsignedToString(i));
+            assert(_bufferChannel[b * NBINPUTS + i]);
+        }
+    }
+    for (unsigned i = 0; i < NBINPUTS; ++i) {
+        _imageChannel[i] = fetchChoiceParam(kParamImageChannel + unsignedToString(i));
+        assert(_imageChannel[i]);
+    }
+    _bufferFeedback = fetchBooleanParam(kParamBufferFeedback);
+    assert(_bufferFeedback);
     _mouseParams = fetchBooleanParam(kParamMouseParams);
     assert(_mouseParams);
     _mousePosition = fetchDouble2DParam(kParamMousePosition);
@@ -1661,7 +1927,7 @@ ShadertoyPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         }
     } else if (paramName == kParamResetParams) {
         resetParamsValues();
-    } else if (paramName == kParamImageShaderSource) {
+    } else if ( (paramName == kParamImageShaderSource) || starts_with(paramName, kParamBufferSource) ) {
         _imageShaderCompile->setEnabled(true);
     } else if ( ( (paramName == kParamCount) ||
                   starts_with(paramName, kParamName) ) && (args.reason == eChangeUserEdit) ) {
@@ -1697,6 +1963,10 @@ ShadertoyPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         updateVisibility();
     } else if ( (paramName == kParamImageShaderSource) && (args.reason == eChangeUserEdit) ) {
         _imageShaderCompile->setEnabled(true);
+    } else if (paramName == kParamBufferFeedback) {
+        if ( !_bufferFeedback->getValue() ) {
+            clearBufferHistory();
+        }
     } else if (paramName == kParamRendererInfo) {
         std::string message;
         {
@@ -1725,7 +1995,29 @@ ShadertoyPlugin::changedParam(const OFX::InstanceChangedArgs &args,
     }
 } // ShadertoyPlugin::changedParam
 
-mDeclarePluginFactory(ShadertoyPluginFactory,; , {});
+void
+ShadertoyPlugin::endSequenceRender(const OFX::EndSequenceRenderArguments & /*args*/)
+{
+    clearBufferHistory();
+}
+
+void
+ShadertoyPlugin::purgeCaches()
+{
+    clearBufferHistory();
+}
+
+void
+ShadertoyPlugin::clearBufferHistory()
+{
+    std::map<double, BufferHistory> history; // release the memory outside of the lock
+    {
+        AutoMutex lock( _bufferHistoryMutex.get() );
+        history.swap(_bufferHistory);
+    }
+}
+
+mDeclarePluginFactory(ShadertoyPluginFactory,; , { gProgramCacheMutex.reset(NULL); gProgramCache.reset(NULL); });
 void
 ShadertoyPluginFactory::load()
 {
@@ -1737,6 +2029,9 @@ ShadertoyPluginFactory::load()
     //    throwHostMissingSuiteException(kOfxOpenGLRenderSuite);
     //}
     //#endif
+
+    // the program cache is shared by all instances, which may be created concurrently
+    gProgramCacheMutex.reset(new ShadertoyPlugin::Mutex);
 }
 
 void
@@ -2350,6 +2645,94 @@ ShadertoyPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 
         }
 
+        {
+            OFX::GroupParamDescriptor* sgroup = desc.defineGroupParam(kGroupBuffers);
+            if (sgroup) {
+                sgroup->setLabel(kGroupBuffersLabel);
+                sgroup->setHint(kGroupBuffersHint);
+                sgroup->setOpen(false);
+            }
+
+            // the source and the iChannel parameters of each pass (Buffer A to D, then Image)
+            for (unsigned b = 0; b <= NBBUFFERS; ++b) {
+                std::string letter(1, (char)('A' + b));
+                if (b < NBBUFFERS) {
+                    OFX::StringParamDescriptor* param = desc.defineStringParam(kParamBufferSource + letter);
+                    param->setLabel(kParamBufferSourceLabel + letter);
+                    param->setHint(kParamBufferSourceHint);
+                    param->setStringType(eStringTypeMultiLine);
+                    param->setDefault("");
+                    param->setEvaluateOnChange(false); // render is triggered using kParamImageShaderTriggerRender
+                    param->setAnimates(false);
+                    if (page) {
+                        page->addChild(*param);
+                    }
+                    if (sgroup) {
+                        param->setParent(*sgroup);
+                    }
+                }
+                {
+                    OFX::StringParamDescriptor* param = desc.defineStringParam( (b < NBBUFFERS) ? (kParamBufferName + letter) : std::string(kParamImageChannelName) );
+                    param->setLabel("");
+                    param->setDefault( (b < NBBUFFERS) ? (kParamChannelOptionBuffer + letter) : std::string(kParamImageChannelNameLabel) );
+                    param->setStringType(OFX::eStringTypeLabel);
+                    param->setLayoutHint(eLayoutHintNoNewLine, 1);
+                    if (page) {
+                        page->addChild(*param);
+                    }
+                    if (sgroup) {
+                        param->setParent(*sgroup);
+                    }
+                }
+                for (unsigned i = 0; i < NBINPUTS; ++i) {
+                    std::string nb = unsignedToString(i);
+                    OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam( (b < NBBUFFERS) ? (kParamBufferChannel + letter + nb) : (kParamImageChannel + nb) );
+                    param->setLabel(kParamChannelLabel + nb);
+                    param->setHint(kParamChannelHint);
+                    // options are the inputs, followed by the buffers
+                    for (unsigned j = 0; j < NBINPUTS; ++j) {
+                        std::string input = kClipChannel + unsignedToString(j);
+                        param->appendOption(input, kParamChannelOptionInputHint + input);
+                    }
+                    for (unsigned j = 0; j < NBBUFFERS; ++j) {
+                        param->appendOption( kParamChannelOptionBuffer + std::string(1, (char)('A' + j) ) );
+                    }
+                    param->setDefault(i);
+                    param->setAnimates(false);
+                    if (i < NBINPUTS - 1) {
+                        param->setLayoutHint(eLayoutHintNoNewLine, 1);
+                    }
+                    if (page) {
+                        page->addChild(*param);
+                    }
+                    if (sgroup) {
+                        param->setParent(*sgroup);
+                    }
+                }
+            }
+
+            {
+                OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamBufferFeedback);
+                param->setLabel(kParamBufferFeedbackLabel);
+                param->setHint(kParamBufferFeedbackHint);
+                param->setDefault(false);
+                param->setAnimates(false);
+                if (page) {
+                    page->addChild(*param);
+                }
+                if (sgroup) {
+                    param->setParent(*sgroup);
+                }
+            }
+
+            if (page && sgroup) {
+                page->addChild(*sgroup);
+            }
+            if (group && sgroup) {
+                sgroup->setParent(*group);
+            }
+        }
+
         // boundingBox
         {
             ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamBBox);
@@ -2596,7 +2979,7 @@ ShadertoyPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             if (page && sgroup) {
                 page->addChild(*sgroup);
             }
-            if (group) {
+            if (group && sgroup) {
                 sgroup->setParent(*group);
             }
         }
@@ -24,6 +24,8 @@
 #define Misc_Shadertoy_h
 
 #include <memory>
+#include <map>
+#include <vector>
 #include <climits>
 #include <cfloat> // DBL_MAX
 
@@ -38,6 +40,7 @@
 
 #define SHADERTOY_NBINPUTS 4 // number of input channels (the standard shadertoy has 4 inputs)
 #define SHADERTOY_NBUNIFORMS 7 // number of additional uniforms (if more than 7, Nuke's parameter page goes blank when unfolding the Extra Parameters group)
+#define SHADERTOY_NBBUFFERS 4 // number of buffer passes rendered before the image shader (Buffer A to D in the standard shadertoy)
 
 void getShadertoyPluginID(OFX::PluginFactoryArray &ids);
 
@@ -47,8 +50,11 @@ struct ShadertoyShaderOpenGL;
 class ShadertoyPlugin
     : public OFX::ImageEffect
 {
+    struct RenderDataGL;
 #if defined(HAVE_OSMESA)
     struct OSMesaPrivate;
+    struct RenderDataMesa;
+    class RenderTilesProcessorMesa;
 #endif
 
 public:
@@ -345,7 +351,10 @@ private:
     /* The OpenGL context is also set when beginSequenceRender() and endSequenceRender()
        are called. This may be useful to allocate/deallocate sequence-specific OpenGL data. */
     //virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
-    //virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    /* free the buffers kept for the next frame */
+    virtual void purgeCaches() OVERRIDE FINAL;
 
     void initOpenGL();
     void initMesa();
@@ -370,6 +379,7 @@ private:
     void updateExtra();
     void updateClips();
     void resetParamsValues();
+    void clearBufferHistory();
 
     // do not need to delete these, the ImageEffect is managing them for us
     OFX::Clip *_dstClip;
@@ -379,6 +389,10 @@ private:
     std::vector<OFX::StringParam*> _inputHint;
     std::vector<OFX::ChoiceParam*> _inputFilter;
     std::vector<OFX::ChoiceParam*> _inputWrap;
+    std::vector<OFX::StringParam*> _bufferSource;
+    std::vector<OFX::ChoiceParam*> _bufferChannel; // SHADERTOY_NBINPUTS per buffer
+    std::vector<OFX::ChoiceParam*> _imageChannel;
+    OFX::BooleanParam *_bufferFeedback;
     OFX::ChoiceParam *_bbox;
     OFX::ChoiceParam *_format;
     OFX::Int2DParam *_formatSize;
@@ -433,6 +447,19 @@ private:
     BBoxEnum _imageShaderBBox;
     bool _imageShaderCompiled;
 
+    // the content of the buffers rendered at a given frame, used by the next frame when a pass reads a buffer
+    // that is rendered after it
+    struct BufferHistory
+    {
+        OfxRectI bounds; // the output region of definition, in pixels
+        OfxPointD renderScale;
+        unsigned int shaderID; // the _imageShaderID the buffers were rendered with
+        std::vector<std::vector<float> > buffers; // RGBA pixels of each buffer (empty if not kept)
+    };
+
+    std::map<double, BufferHistory> _bufferHistory; // at most two consecutive frames
+    std::auto_ptr<Mutex> _bufferHistoryMutex;
+
     struct OpenGLContextData
     {
         OpenGLContextData()
@@ -441,14 +468,28 @@ private:
             , imageShader(0)
             , imageShaderID(0)
             , imageShaderUniformsID(0)
+            , haveProgramBinary(false)
+            , havePixelBufferSync(false)
+            , unpackBufferIndex(0)
         {
+            for (unsigned b = 0; b < SHADERTOY_NBBUFFERS; ++b) {
+                bufferShader[b] = 0;
+                packBuffer[b] = 0;
+            }
+            unpackBuffer[0] = unpackBuffer[1] = 0;
         }
 
         bool haveAniso;
         float maxAnisoMax;
         void *imageShader; //shader information
+        void *bufferShader[SHADERTOY_NBBUFFERS]; // shader information of each buffer pass, compiled with the image shader
         unsigned int imageShaderID; // the shader ID compiled for this context
         unsigned int imageShaderUniformsID; // the ID for custom uniform locations
+        bool haveProgramBinary; // programs can be saved to and loaded from the program cache
+        bool havePixelBufferSync; // pixel buffer objects and fences can be used for asynchronous transfers
+        unsigned int unpackBuffer[2]; // (multipass) pixel buffers used in turn to upload the previous frame of the buffers
+        unsigned int unpackBufferIndex; // the next unpack buffer to use
+        unsigned int packBuffer[SHADERTOY_NBBUFFERS]; // (multipass) pixel buffers the buffers are read back to
     };
 
     OpenGLContextData _openGLContextData; // (OpenGL-only) - the single openGL context, in case the host does not support kNatronOfxImageEffectPropOpenGLContextData
@@ -456,9 +497,18 @@ private:
     std::auto_ptr<Mutex> _rendererInfoMutex;
     std::string _rendererInfo;
 
+    // render the tiles of data.
+    // contextData is the current OpenGL context data (OpenGL), or NULL to render using a pooled context (OSMesa).
+    void renderTilesGL(RenderDataGL &data, OpenGLContextData *contextData);
+#if defined(HAVE_OSMESA)
+    void renderTilesMesa(RenderDataMesa &data, OpenGLContextData *contextData);
+    OSMesaPrivate* popMesaContext();
+    void pushMesaContext(OSMesaPrivate *osmesa);
+#endif
+
 #if defined(HAVE_OSMESA)
     // A list of Mesa contexts available for rendering.
-    // renderMesa() pops the last element, uses it, then pushes it back.
+    // Each thread of renderMesa() pops the last element, uses it, then pushes it back.
     // A new context is created if the list is empty.
     // That way, we can have multithreaded OSMesa rendering without having to create a context at each render
     std::list<OSMesaPrivate *> _osmesa;
@@ -472,4 +522,10 @@ void getBboxInfo(const char* fragmentShader, ShadertoyPlugin::BBoxEnum& bbox);
 
 void getExtraParameterInfo(const char* fragmentShader, ShadertoyPlugin::ExtraParameter &p);
 
+// get a linked program binary from the process-wide cache (or from the disk cache), return false if there is none
+bool getShadertoyProgramBinary(const std::string &key, unsigned int *format, std::vector<unsigned char> *binary);
+
+// store a linked program binary in the process-wide cache and in the disk cache
+void setShadertoyProgramBinary(const std::string &key, unsigned int format, const std::vector<unsigned char> &binary);
+
 #endif // Misc_Shadertoy_h
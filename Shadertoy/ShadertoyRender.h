@@ -36,9 +36,7 @@
 #include "ofxsMultiThread.h"
 #include "ofxsCoords.h"
 
-#ifndef M_LN2
-#define M_LN2       0.693147180559945309417232121458176568  /* loge(2)        */
-#endif
+#define kRenderTileSizeMax 256 // (OSMesa-only) the maximum size of the tiles rendered in parallel
 
 // first, check that the file is used in a good way
 #if !defined(USE_OPENGL) && !defined(USE_OSMESA)
@@ -58,11 +56,15 @@
 #  include <GL/glu_mangle.h>
 #  include <GL/osmesa.h>
 #  define RENDERFUNC renderMesa
+#  define RENDERTILESFUNC renderTilesMesa
+#  define RenderData RenderDataMesa
 #  define contextAttached contextAttachedMesa
 #  define contextDetached contextDetachedMesa
 #  define ShadertoyShader ShadertoyShaderMesa // in case OpenGL and Mesa use different type definitions
 #else
 #  define RENDERFUNC renderGL
+#  define RENDERTILESFUNC renderTilesGL
+#  define RenderData RenderDataGL
 #  define ShadertoyShader ShadertoyShaderOpenGL
 #endif
 
@@ -127,6 +129,15 @@ print_dbg(const char *format,
 
 #define NBINPUTS SHADERTOY_NBINPUTS
 #define NBUNIFORMS SHADERTOY_NBUNIFORMS
+#define NBBUFFERS SHADERTOY_NBBUFFERS
+
+#ifndef GL_RGBA32F
+#define GL_RGBA32F 0x8814
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
 
 struct ShadertoyShader
 {
@@ -288,10 +299,16 @@ static PFNGLGETSHADERIVPROC glGetShaderiv = NULL;
 typedef void (APIENTRYP PFNGLGENBUFFERSPROC) (GLsizei n, GLuint *buffers);
 typedef void (APIENTRYP PFNGLBINDBUFFERPROC) (GLenum target, GLuint buffer);
 typedef void (APIENTRYP PFNGLBUFFERDATAPROC) (GLenum target, GLsizeiptr size, const void *data, GLenum usage);
+typedef void (APIENTRYP PFNGLDELETEBUFFERSPROC) (GLsizei n, const GLuint *buffers);
+typedef void *(APIENTRYP PFNGLMAPBUFFERPROC) (GLenum target, GLenum access);
+typedef GLboolean (APIENTRYP PFNGLUNMAPBUFFERPROC) (GLenum target);
 #endif
 static PFNGLGENBUFFERSPROC glGenBuffers = NULL;
 static PFNGLBINDBUFFERPROC glBindBuffer = NULL;
 static PFNGLBUFFERDATAPROC glBufferData = NULL;
+static PFNGLDELETEBUFFERSPROC glDeleteBuffers = NULL;
+static PFNGLMAPBUFFERPROC glMapBuffer = NULL;
+static PFNGLUNMAPBUFFERPROC glUnmapBuffer = NULL;
 
 //Multitexture
 #ifndef GL_VERSION_1_3
@@ -345,6 +362,13 @@ static PFNGLDELETESYNCPROC glDeleteSync = NULL;
 static PFNGLCLIENTWAITSYNCPROC glClientWaitSync = NULL;
 static PFNGLWAITSYNCPROC glWaitSync = NULL;
 
+// Program binaries
+#ifdef GL_ARB_get_program_binary
+static PFNGLGETPROGRAMBINARYPROC glGetProgramBinary = NULL;
+static PFNGLPROGRAMBINARYPROC glProgramBinary = NULL;
+static PFNGLPROGRAMPARAMETERIPROC glProgramParameteri = NULL;
+#endif
+
 #endif // if !defined(USE_OSMESA) && ( defined(_WIN32) || defined(__WIN32__) || defined(WIN32 ) )
 
 
@@ -397,6 +421,62 @@ starts_with(const std::string &str,
     return (str.substr( 0, prefix.size() ) == prefix);
 }
 
+static
+void
+getGlVersion(int *major,
+             int *minor)
+{
+    const char *verstr = (const char *) glGetString(GL_VERSION);
+
+    if ( (verstr == NULL) || (std::sscanf(verstr, "%d.%d", major, minor) != 2) ) {
+        *major = *minor = 0;
+        //fprintf(stderr, "Invalid GL_VERSION format!!!\n");
+    }
+}
+
+// check that the current context can save and load program binaries (GL_ARB_get_program_binary)
+static bool
+programBinarySupported()
+{
+#ifdef GL_ARB_get_program_binary
+#if !defined(USE_OSMESA) && ( defined(_WIN32) || defined(__WIN32__) || defined(WIN32 ) )
+    if (!glGetProgramBinary || !glProgramBinary || !glProgramParameteri) {
+        return false;
+    }
+#endif
+    if ( !glutExtensionSupported("GL_ARB_get_program_binary") ) {
+        return false;
+    }
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+    return formats > 0;
+#else
+
+    return false;
+#endif
+}
+
+// check that the current context has pixel buffer objects (OpenGL 2.1 or GL_ARB_pixel_buffer_object)
+// and sync objects (OpenGL 3.2 or GL_ARB_sync), used for asynchronous transfers of the multipass buffers
+static bool
+pixelBufferSyncSupported()
+{
+#if !defined(USE_OSMESA) && ( defined(_WIN32) || defined(__WIN32__) || defined(WIN32 ) )
+    if (!glFenceSync || !glClientWaitSync || !glDeleteSync || !glDeleteBuffers || !glMapBuffer || !glUnmapBuffer) {
+        return false;
+    }
+#endif
+    int major, minor;
+    getGlVersion(&major, &minor);
+    const bool havePBO = ( major > 2 || (major == 2 && minor >= 1) ||
+                           glutExtensionSupported("GL_ARB_pixel_buffer_object") );
+    const bool haveSync = ( major > 3 || (major == 3 && minor >= 2) ||
+                            glutExtensionSupported("GL_ARB_sync") );
+
+    return havePBO && haveSync;
+}
+
 #ifdef USE_OSMESA
 struct ShadertoyPlugin::OSMesaPrivate
 {
@@ -412,6 +492,9 @@ struct ShadertoyPlugin::OSMesaPrivate
     {
         assert(_openGLContextData.imageShader == NULL);
         _openGLContextData.imageShader = new ShadertoyShader;
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            _openGLContextData.bufferShader[b] = new ShadertoyShader;
+        }
     }
 
     ~OSMesaPrivate()
@@ -429,6 +512,10 @@ struct ShadertoyPlugin::OSMesaPrivate
         }
         delete (ShadertoyShader*)_openGLContextData.imageShader;
         _openGLContextData.imageShader = NULL;
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            delete (ShadertoyShader*)_openGLContextData.bufferShader[b];
+            _openGLContextData.bufferShader[b] = NULL;
+        }
     }
 
     void setContext(GLenum format,
@@ -438,7 +525,8 @@ struct ShadertoyPlugin::OSMesaPrivate
                     GLint accumBits,
                     CPUDriverEnum cpuDriver,
                     void* buffer,
-                    const OfxRectI &dstBounds)
+                    const OfxRectI &dstBounds,
+                    GLint rowLength)
     {
         bool newContext = false;
 
@@ -523,13 +611,19 @@ struct ShadertoyPlugin::OSMesaPrivate
             return;
         }
         //OSMesaPixelStore(OSMESA_Y_UP, true); // default value
-        //OSMesaPixelStore(OSMESA_ROW_LENGTH, dstBounds.x2 - dstBounds.x1); // default value
+        // buffer may be a tile of a larger image
+        OSMesaPixelStore(OSMESA_ROW_LENGTH, rowLength);
         if (newContext) {
             _effect->contextAttachedMesa(false);
             OpenGLContextData* contextData = &_openGLContextData;
             // force recompiling the shader
             contextData->imageShaderID = 0;
             contextData->imageShaderUniformsID = 0;
+            contextData->haveProgramBinary = programBinarySupported();
+            contextData->havePixelBufferSync = pixelBufferSyncSupported();
+            // the pixel buffers of the previous context were destroyed with it
+            contextData->unpackBuffer[0] = contextData->unpackBuffer[1] = 0;
+            std::fill(contextData->packBuffer, contextData->packBuffer + NBBUFFERS, 0);
             contextData->haveAniso = glutExtensionSupported("GL_EXT_texture_filter_anisotropic");
             if (contextData->haveAniso) {
                 GLfloat MaxAnisoMax;
@@ -584,6 +678,9 @@ ShadertoyPlugin::initOpenGL()
 {
     assert(_openGLContextData.imageShader == NULL);
     _openGLContextData.imageShader = new ShadertoyShader;
+    for (unsigned b = 0; b < NBBUFFERS; ++b) {
+        _openGLContextData.bufferShader[b] = new ShadertoyShader;
+    }
 }
 
 void
@@ -591,6 +688,10 @@ ShadertoyPlugin::exitOpenGL()
 {
     delete ( (ShadertoyShader*)_openGLContextData.imageShader );
     _openGLContextData.imageShader = NULL;
+    for (unsigned b = 0; b < NBBUFFERS; ++b) {
+        delete ( (ShadertoyShader*)_openGLContextData.bufferShader[b] );
+        _openGLContextData.bufferShader[b] = NULL;
+    }
 }
 
 #endif // USE_OPENGL
@@ -652,6 +753,7 @@ static
 GLuint
 compileAndLinkProgram(const char *vertexShader,
                       const char *fragmentShader,
+                      bool retrievable, // the binary of the program will be retrieved for the program cache
                       std::string &errstr)
 {
     DPRINT( ("CompileAndLink\n") );
@@ -680,6 +782,13 @@ compileAndLinkProgram(const char *vertexShader,
     assert(fs && vs);
     glAttachShader(program, vs);
     glAttachShader(program, fs);
+#ifdef GL_ARB_get_program_binary
+    if (retrievable) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+#else
+    (void)retrievable;
+#endif
     glLinkProgram(program);
 
     GLint param;
@@ -849,6 +958,90 @@ compileAndLinkProgram(const char *vertexShader,
     return program;
 } // compileAndLinkProgram
 
+// the key of a program in the program cache: the renderer of the current context, and the preprocessed sources
+static std::string
+programCacheKey(const std::string &vertexShader,
+                const std::string &fragmentShader)
+{
+    std::string key;
+    const GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+
+    for (int i = 0; i < 3; ++i) {
+        const char *s = (const char *) glGetString(names[i]);
+        if (s) {
+            key += s;
+        }
+        key += '\n';
+    }
+    key += vertexShader;
+    key += '\0';
+    key += fragmentShader;
+
+    return key;
+}
+
+// create a program from the program cache, or return 0 if it is not in the cache or if the driver rejects the binary
+static GLuint
+loadProgramBinary(const std::string &key)
+{
+#ifdef GL_ARB_get_program_binary
+    unsigned int format;
+    std::vector<unsigned char> binary;
+
+    if ( !getShadertoyProgramBinary(key, &format, &binary) ) {
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    if (program == 0) {
+        return 0;
+    }
+    glProgramBinary( program, (GLenum)format, &binary[0], (GLsizei)binary.size() );
+    GLint param = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &param);
+    if (param != GL_TRUE) {
+        // e.g. the driver was updated: the program has to be compiled again
+        DPRINT( ("program binary rejected by the driver\n") );
+        glDeleteProgram(program);
+
+        return 0;
+    }
+    DPRINT( ("program loaded from the program cache\n") );
+
+    return program;
+#else
+    (void)key;
+
+    return 0;
+#endif
+}
+
+// store a linked program in the program cache
+static void
+saveProgramBinary(const std::string &key,
+                  GLuint program)
+{
+#ifdef GL_ARB_get_program_binary
+    GLint length = 0;
+
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+    std::vector<unsigned char> binary(length);
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &format, &binary[0]);
+    if (written <= 0) {
+        return;
+    }
+    binary.resize(written);
+    setShadertoyProgramBinary(key, format, binary);
+#else
+    (void)key;
+    (void)program;
+#endif
+}
+
 // https://raw.githubusercontent.com/beautypi/shadertoy-iOS-v2/master/shadertoy/shaders/vertex_main.glsl
 /*
    precision highp float;
@@ -929,16 +1122,317 @@ static std::string fsFooter =
     "{\n"
     "  mainImage(gl_FragColor, gl_FragCoord.xy + ifFragCoordOffsetUniform );\n"
     "}\n";
-void
-ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
+
+// build the fragment shader of a pass from its Shadertoy source
+static std::string
+fragmentShaderSource(std::string str)
 {
-    const double time = args.time;
-#if GL_ARB_framebuffer_object && !defined(GL_GLEXT_FUNCTION_POINTERS)
-    const bool supportsMipmap = true;
+    // for compatibility with ShaderToy, remove the first line that starts with "const vec2 iRenderScale"
+    std::size_t found = str.find("const vec2 iRenderScale");
+    if ( found != std::string::npos && (found == 0 || (str[found-1] == '\n' || str[found-1] == '\r') ) ) {
+        std::size_t eol = str.find('\n', found);
+        if (eol == std::string::npos) {
+            // last line
+            eol = str.size();
+        }
+        // replace by an empty line
+        str.replace(found, eol - found, std::string());
+    }
+    std::string fsSource = fsHeader;
+    for (unsigned i = 0; i < NBINPUTS; ++i) {
+        fsSource += std::string("uniform sampler2D iChannel") + (char)('0' + i) + ";\n";
+    }
+    fsSource += "#line 1\n";
+    fsSource += str + '\n' + fsFooter;
+
+    return fsSource;
+}
+
+// get the program from the program cache, or compile and link it
+static GLuint
+programFromSource(const std::string &fsSource,
+                  bool haveProgramBinary,
+                  std::string &errstr)
+{
+    GLuint program = 0;
+    // the program may have been compiled by another instance or context, or by another process
+    std::string programKey;
+
+    if (haveProgramBinary) {
+        programKey = programCacheKey(vsSource, fsSource);
+        program = loadProgramBinary(programKey);
+    }
+    if (program == 0) {
+        program = compileAndLinkProgram(vsSource.c_str(), fsSource.c_str(), haveProgramBinary, errstr);
+        if (program && haveProgramBinary) {
+            saveProgramBinary(programKey, program);
+        }
+    }
+
+    return program;
+}
+
+static void
+getUniformLocations(ShadertoyShader *shadertoy)
+{
+    const GLuint program = shadertoy->program;
+
+    shadertoy->iResolutionLoc        = glGetUniformLocation(program, "iResolution");
+    shadertoy->iGlobalTimeLoc        = glGetUniformLocation(program, "iGlobalTime");
+    shadertoy->iTimeDeltaLoc         = glGetUniformLocation(program, "iTimeDelta");
+    shadertoy->iFrameLoc             = glGetUniformLocation(program, "iFrame");
+    shadertoy->iChannelTimeLoc       = glGetUniformLocation(program, "iChannelTime");
+    shadertoy->iMouseLoc             = glGetUniformLocation(program, "iMouse");
+    shadertoy->iDateLoc              = glGetUniformLocation(program, "iDate");
+    shadertoy->iSampleRateLoc        = glGetUniformLocation(program, "iSampleRate");
+    shadertoy->iChannelResolutionLoc = glGetUniformLocation(program, "iChannelResolution");
+    shadertoy->ifFragCoordOffsetUniformLoc = glGetUniformLocation(program, "ifFragCoordOffsetUniform");
+    shadertoy->iRenderScaleLoc = glGetUniformLocation(program, "iRenderScale");
+    char iChannelX[10] = "iChannelX"; // index 8 holds the channel character
+    assert(NBINPUTS < 10 && iChannelX[8] == 'X');
+    for (unsigned i = 0; i < NBINPUTS; ++i) {
+        iChannelX[8] = '0' + i;
+        shadertoy->iChannelLoc[i] = glGetUniformLocation(program, iChannelX);
+        //printf("%s -> %d\n", iChannelX, (int)shadertoy->iChannelLoc[i]);
+    }
+}
+
+// create the floating-point texture a buffer pass is rendered to.
+// If pixels is NULL, the content of the texture is undefined.
+static GLuint
+createBufferTexture(GLsizei width,
+                    GLsizei height,
+                    const GLfloat *pixels)
+{
+    GLuint texture = 0;
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, pixels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return texture;
+}
+
+// create a buffer texture, uploading the pixels through the given pixel buffer object (created if it is 0).
+// The copy to the texture is done asynchronously by the OpenGL implementation, and the pixel buffer storage
+// is orphaned before being mapped, so that mapping never waits for a previous transfer from it to complete.
+static GLuint
+createBufferTextureAsync(GLsizei width,
+                         GLsizei height,
+                         const GLfloat *pixels,
+                         GLuint *pbo)
+{
+    const GLsizeiptr size = (GLsizeiptr)width * height * 4 * sizeof(GLfloat);
+
+    if (*pbo == 0) {
+        glGenBuffers(1, pbo);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, *pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    void *ptr = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (ptr) {
+        std::memcpy(ptr, pixels, size);
+        if ( glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) ) {
+            // the data pointer is an offset in the bound pixel buffer
+            GLuint texture = createBufferTexture(width, height, NULL);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+            return texture;
+        }
+    }
+    // the pixel buffer could not be used, upload synchronously
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    return createBufferTexture(width, height, pixels);
+}
+
+// The data shared by the threads that render the tiles of a render window
+struct ShadertoyPlugin::RenderData
+{
+    RenderData(const OFX::RenderArguments &args_)
+        : args(args_)
+        , dstBoundsFull()
+        , srcTarget(NBINPUTS, GL_TEXTURE_2D)
+        , srcIndex(NBINPUTS, 0)
+        , filter(NBINPUTS, eFilterNearest)
+        , wrap(NBINPUTS, eWrapRepeat)
+        , channelSource( (NBBUFFERS + 1) * NBINPUTS, 0 )
+        , multipass(false)
+        , bufferKept(NBBUFFERS, false)
+        , bufferFeedback(false)
+        , bufferPrevious(NBBUFFERS)
+        , bufferCurrent(NBBUFFERS)
+#ifdef USE_OSMESA
+        , dst(NULL)
+        , format(0)
+        , depthBits(0)
+        , stencilBits(0)
+        , accumBits(0)
+        , type(0)
+        , cpuDriver(eCPUDriverSoftPipe)
+        , rowLength(0)
+#endif
+        , tiles()
+        , nextTile(0)
+        , mutex()
+        , imageShaderParamsUpdated(false)
+        , aborted(false)
+        , status(kOfxStatOK)
+        , errorMessage()
+    {
+        for (unsigned i = 0; i < NBINPUTS; ++i) {
+            src[i] = NULL;
+        }
+    }
+
+    // get the next tile to render, or return false if there is none left or if the render must stop
+    bool getNextTile(OfxRectI *tile)
+    {
+        AutoMutex lock(mutex);
+
+        if ( aborted || (status != kOfxStatOK) || ( nextTile >= tiles.size() ) ) {
+            return false;
+        }
+        *tile = tiles[nextTile];
+        ++nextTile;
+
+        return true;
+    }
+
+    void setAborted()
+    {
+        AutoMutex lock(mutex);
+
+        aborted = true;
+    }
+
+    // record the first error, which stops the render
+    void setStatus(OfxStatus s,
+                   const std::string &message = std::string())
+    {
+        AutoMutex lock(mutex);
+
+        if (status == kOfxStatOK) {
+            status = s;
+            errorMessage = message;
+        }
+    }
+
+    const OFX::RenderArguments &args;
+    OfxRectI dstBoundsFull; // the output region of definition, in pixels
+#ifdef USE_OPENGL
+    const OFX::Texture *src[NBINPUTS];
 #else
-    const bool supportsMipmap = (bool)glGenerateMipmap;
+    const OFX::Image *src[NBINPUTS];
+#endif
+    std::vector<GLenum> srcTarget;
+    std::vector<GLuint> srcIndex; // (OpenGL-only) - the textures given by the host
+    std::vector<FilterEnum> filter;
+    std::vector<WrapEnum> wrap;
+    std::vector<int> channelSource; // what each iChannel of each pass (Buffer A to D, then Image) reads: an input, or NBINPUTS + a buffer
+    bool multipass; // at least one buffer has a shader
+    std::vector<bool> bufferKept; // the buffers read by a pass which is rendered before them, that need the previous frame
+    bool bufferFeedback; // read back the kept buffers after rendering, for the next frame
+    std::vector<std::vector<float> > bufferPrevious; // the kept buffers at the previous frame (black if empty)
+    std::vector<std::vector<float> > bufferCurrent; // the kept buffers, read back after rendering
+#ifdef USE_OSMESA
+    OFX::Image *dst;
+    GLenum format;
+    GLint depthBits;
+    GLint stencilBits;
+    GLint accumBits;
+    GLenum type;
+    CPUDriverEnum cpuDriver;
+    GLint rowLength; // the number of pixels per row of dst
 #endif
+    std::vector<OfxRectI> tiles; // the tiles of the render window
+    std::size_t nextTile;
+    Mutex mutex; // protects nextTile, aborted, status and errorMessage
+    bool imageShaderParamsUpdated;
+    bool aborted;
+    OfxStatus status;
+    std::string errorMessage; // the shader compilation log
+};
+
+#ifdef USE_OSMESA
+// get a Mesa context from the pool, or create a new one
+ShadertoyPlugin::OSMesaPrivate*
+ShadertoyPlugin::popMesaContext()
+{
+    OSMesaPrivate *osmesa;
+    {
+        AutoMutex lock( _osmesaMutex.get() );
+        if ( _osmesa.empty() ) {
+            osmesa = new OSMesaPrivate(this);
+        } else {
+            osmesa = _osmesa.back();
+            _osmesa.pop_back();
+        }
+    }
+    if (OSMesaGetCurrentContext() != NULL) {
+        DPRINT( ("render error: %s\n", "Mesa context still attached") );
+        glFlush(); // waits until commands are submitted but does not wait for the commands to finish executing
+        glFinish(); // waits for all previously submitted commands to complete executing
+        // make sure the buffer is not referenced anymore
+        OSMesaMakeCurrent(NULL, NULL, 0, 0, 0); // disactivate the context so that it can be used from another thread
+    }
+    assert(OSMesaGetCurrentContext() == NULL); // the thread should have no Mesa context attached
+
+    return osmesa;
+}
+
+// detach the buffer and the current thread from osmesa, and give it back to the pool
+void
+ShadertoyPlugin::pushMesaContext(OSMesaPrivate *osmesa)
+{
+    // make sure the buffer is not referenced anymore
+    osmesa->setContext(0, 0, 0, 0, 0, eCPUDriverSoftPipe, NULL, OfxRectI(), 0);
+    OSMesaMakeCurrent(NULL, NULL, 0, 0, 0); // disactivate the context so that it can be used from another thread
+    assert(OSMesaGetCurrentContext() == NULL);
+
+    AutoMutex lock( _osmesaMutex.get() );
+    _osmesa.push_back(osmesa);
+}
+
+// Render the tiles in parallel. Each thread renders tiles until there are none left, using its own Mesa context.
+class ShadertoyPlugin::RenderTilesProcessorMesa
+    : public OFX::MultiThread::Processor
+{
+public:
+    RenderTilesProcessorMesa(ShadertoyPlugin &effect,
+                             RenderData &data)
+        : OFX::MultiThread::Processor()
+        , _effect(effect)
+        , _data(data)
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int /*threadId*/,
+                                     unsigned int /*nThreads*/) OVERRIDE FINAL
+    {
+        // exceptions must not cross the thread boundary
+        try {
+            _effect.renderTilesMesa(_data, NULL);
+        } catch (const OFX::Exception::Suite &e) {
+            _data.setStatus( e.status() );
+        } catch (...) {
+            _data.setStatus(kOfxStatFailed);
+        }
+    }
+
+    ShadertoyPlugin &_effect;
+    RenderData &_data;
+};
+#endif // USE_OSMESA
 
+void
+ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
 #ifdef DEBUG_TIME
     struct timeval t1, t2;
     gettimeofday(&t1, NULL);
@@ -1016,10 +1510,7 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
 
     std::vector<OFX::BitDepthEnum> srcBitDepth(NBINPUTS, OFX::eBitDepthNone);
     std::vector<OFX::PixelComponentEnum> srcComponents(NBINPUTS, OFX::ePixelComponentNone);
-    std::vector<GLenum> srcTarget(NBINPUTS, GL_TEXTURE_2D);
-    std::vector<GLuint> srcIndex(NBINPUTS);
-    std::vector<FilterEnum> filter(NBINPUTS, eFilterNearest);
-    std::vector<WrapEnum> wrap(NBINPUTS, eWrapRepeat);
+    RenderData data(args);
 #ifdef USE_OSMESA
     GLenum format = 0;
     GLint depthBits = 0;
@@ -1041,17 +1532,17 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
             // nearest = GL_NEAREST/GL_NEAREST
             // linear = GL_LINEAR/GL_LINEAR
             // mipmap = GL_LINEAR_MIPMAP_LINEAR/GL_LINEAR
-            filter[i] = args.renderQualityDraft ? eFilterNearest : (FilterEnum)_inputFilter[i]->getValueAtTime(time);
+            data.filter[i] = args.renderQualityDraft ? eFilterNearest : (FilterEnum)_inputFilter[i]->getValueAtTime(time);
 
             // wrap for each texture (repeat [default], clamp, mirror)
             // clamp = GL_CLAMP_TO_EDGE
-            wrap[i] = (WrapEnum)_inputWrap[i]->getValueAtTime(time);
+            data.wrap[i] = (WrapEnum)_inputWrap[i]->getValueAtTime(time);
 
 # ifdef USE_OPENGL
-            srcIndex[i] = (GLuint)src[i]->getIndex();
-            srcTarget[i] = (GLenum)src[i]->getTarget();
+            data.srcIndex[i] = (GLuint)src[i]->getIndex();
+            data.srcTarget[i] = (GLenum)src[i]->getTarget();
             DPRINT( ( "openGL: source texture %u index %d, target 0x%04X, depth %s\n",
-                      i, srcIndex[i], srcTarget[i], mapBitDepthEnumToStr(srcBitDepth[i]) ) );
+                      i, data.srcIndex[i], data.srcTarget[i], mapBitDepthEnumToStr(srcBitDepth[i]) ) );
 # endif
             // XXX: check status for errors
 
@@ -1147,31 +1638,24 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
             return;
         }
     }
-    /* Allocate the image buffer */
-    void* buffer = dst->getPixelData();
-    OSMesaPrivate *osmesa;
-    {
-        AutoMutex lock( _osmesaMutex.get() );
-        if ( _osmesa.empty() ) {
-            osmesa = new OSMesaPrivate(this);
-        } else {
-            osmesa = _osmesa.back();
-            _osmesa.pop_back();
-        }
-    }
-    if (OSMesaGetCurrentContext() != NULL) {
-        DPRINT( ("render error: %s\n", "Mesa context still attached") );
-        glFlush(); // waits until commands are submitted but does not wait for the commands to finish executing
-        glFinish(); // waits for all previously submitted commands to complete executing
-        // make sure the buffer is not referenced anymore
-        OSMesaMakeCurrent(NULL, NULL, 0, 0, 0); // disactivate the context so that it can be used from another thread
-    }
-    assert(OSMesaGetCurrentContext() == NULL); // the thread should have no Mesa context attached
-    CPUDriverEnum cpuDriver = eCPUDriverSoftPipe;
+    data.dst = dst.get();
+    data.format = format;
+    data.depthBits = depthBits;
+    data.stencilBits = stencilBits;
+    data.accumBits = accumBits;
+    data.type = type;
     if (_cpuDriver) {
-        cpuDriver = (CPUDriverEnum)_cpuDriver->getValueAtTime(time);
+        data.cpuDriver = (CPUDriverEnum)_cpuDriver->getValueAtTime(time);
+    }
+    // each tile is rendered directly into the destination image, which must have a whole number of pixels per row
+    const int pixelBytes = ( (format == GL_RGBA) ? 4 : 1 ) * ( (type == GL_UNSIGNED_BYTE) ? 1 : ( (type == GL_UNSIGNED_SHORT) ? 2 : 4 ) );
+    const int rowBytes = dst->getRowBytes();
+    if ( (rowBytes <= 0) || (rowBytes % pixelBytes != 0) ) {
+        OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+
+        return;
     }
-    osmesa->setContext(format, depthBits, type, stencilBits, accumBits, cpuDriver, buffer, dstBounds);
+    data.rowLength = rowBytes / pixelBytes;
 #endif // ifdef USE_OSMESA
 
 #ifdef USE_OPENGL
@@ -1190,32 +1674,189 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
         _openGLContextAttached = true;
     }
 #endif
-#ifdef USE_OSMESA
-    OpenGLContextData* contextData = &osmesa->_openGLContextData;
-#endif
 
-    {
-        AutoMutex lock( _rendererInfoMutex.get() );
-        std::string &message = _rendererInfo;
-        if ( message.empty() ) {
-            message += "OpenGL renderer information:";
-            message += "\nGL_RENDERER = ";
-            message += (char *) glGetString(GL_RENDERER);
-            message += "\nGL_VERSION = ";
-            message += (char *) glGetString(GL_VERSION);
-            message += "\nGL_VENDOR = ";
-            message += (char *) glGetString(GL_VENDOR);
-            message += "\nGL_SHADING_LANGUAGE_VERSION = ";
-            message += (char *) glGetString(GL_SHADING_LANGUAGE_VERSION);
-            message += "\nGL_EXTENSIONS = ";
-            message += (char *) glGetString(GL_EXTENSIONS);
-        }
+    for (unsigned i = 0; i < NBINPUTS; ++i) {
+        data.src[i] = src[i].get();
     }
+    OFX::Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(time), args.renderScale, _dstClip->getPixelAspectRatio(), &data.dstBoundsFull);
 
+    // multipass: get what each pass reads, and the buffers of the previous frame
+    for (unsigned i = 0; i < NBINPUTS; ++i) {
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            data.channelSource[b * NBINPUTS + i] = _bufferChannel[b * NBINPUTS + i]->getValueAtTime(time);
+        }
+        data.channelSource[NBBUFFERS * NBINPUTS + i] = _imageChannel[i]->getValueAtTime(time);
+    }
+    for (unsigned b = 0; b < NBBUFFERS; ++b) {
+        std::string bufferSource;
+        _bufferSource[b]->getValue(bufferSource);
+        if ( !bufferSource.empty() ) {
+            data.multipass = true;
+        }
+        for (unsigned i = 0; i < NBINPUTS; ++i) {
+            const int source = data.channelSource[b * NBINPUTS + i];
+            if ( (source >= NBINPUTS) && (source - NBINPUTS >= (int)b) ) {
+                data.bufferKept[source - NBINPUTS] = true;
+            }
+        }
+    }
+    unsigned int shaderID = 0;
+    if (data.multipass) {
+        data.bufferFeedback = _bufferFeedback->getValueAtTime(time);
+        {
+            AutoMutex lock( _imageShaderMutex.get() );
+            shaderID = _imageShaderID;
+        }
+        if (data.bufferFeedback) {
+            AutoMutex lock( _bufferHistoryMutex.get() );
+            std::map<double, BufferHistory>::const_iterator it = _bufferHistory.find(time - 1);
+            if ( ( it != _bufferHistory.end() ) &&
+                 ( it->second.bounds.x1 == data.dstBoundsFull.x1) && ( it->second.bounds.y1 == data.dstBoundsFull.y1) &&
+                 ( it->second.bounds.x2 == data.dstBoundsFull.x2) && ( it->second.bounds.y2 == data.dstBoundsFull.y2) &&
+                 ( it->second.renderScale.x == args.renderScale.x) && ( it->second.renderScale.y == args.renderScale.y) &&
+                 ( it->second.shaderID == shaderID) ) {
+                data.bufferPrevious = it->second.buffers;
+            }
+        }
+    }
+
+#ifdef USE_OPENGL
+    data.tiles.push_back(renderWindow);
+    RENDERTILESFUNC(data, contextData);
+#else
+    {
+        // Split the render window into tiles, which are rendered in parallel, each thread using its own Mesa context.
+        // The tile size is a multiple of llvmpipe's tile size (64x64), and there are at least 4 tiles per CPU
+        // (if the tiles are not smaller than 64x64), so that the load is balanced even if the cost of the shader
+        // varies across the image.
+        const unsigned int nCPUs = OFX::MultiThread::getNumCPUs();
+        OfxRectI window;
+        if ( OFX::Coords::rectIntersection(renderWindow, dstBounds, &window) ) {
+            const int w = window.x2 - window.x1;
+            const int h = window.y2 - window.y1;
+            int tileSize = kRenderTileSizeMax;
+            if (data.multipass) {
+                // each context renders the whole buffers before its tiles, so render the window as a single tile
+                tileSize = std::max(w, h);
+            }
+            while ( !data.multipass && tileSize > 64 &&
+                    ( ( (w + tileSize - 1) / tileSize ) * ( (h + tileSize - 1) / tileSize ) < 4 * (int)nCPUs ) ) {
+                tileSize /= 2;
+            }
+            for (int y1 = window.y1; y1 < window.y2; y1 += tileSize) {
+                for (int x1 = window.x1; x1 < window.x2; x1 += tileSize) {
+                    OfxRectI tile = { x1, y1, std::min(x1 + tileSize, window.x2), std::min(y1 + tileSize, window.y2) };
+                    data.tiles.push_back(tile);
+                }
+            }
+        }
+        const unsigned int nThreads = std::min( nCPUs, (unsigned int)data.tiles.size() );
+        if (nThreads <= 1) {
+            RENDERTILESFUNC(data, NULL);
+        } else {
+            RenderTilesProcessorMesa processor(*this, data);
+            processor.multiThread(nThreads);
+        }
+    }
+#endif
+    if (data.status != kOfxStatOK) {
+        if ( !data.errorMessage.empty() ) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "Failed to compile and link program");
+            sendMessage( OFX::Message::eMessageError, "", data.errorMessage.c_str() );
+        }
+        OFX::throwSuiteStatusException(data.status);
+
+        return;
+    }
+    if (data.aborted) {
+        DPRINT( ("Shadertoy: aborted!\n") );
+    } else if (data.multipass && data.bufferFeedback) {
+        bool kept = false;
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            kept = kept || !data.bufferCurrent[b].empty();
+        }
+        if (kept) {
+            AutoMutex lock( _bufferHistoryMutex.get() );
+            BufferHistory &history = _bufferHistory[time];
+            history.bounds = data.dstBoundsFull;
+            history.renderScale = args.renderScale;
+            history.shaderID = shaderID;
+            history.buffers.swap(data.bufferCurrent);
+            // keep this frame for the next one, and the previous frame, which is needed if the host renders this frame
+            // in several render windows
+            std::map<double, BufferHistory>::iterator it = _bufferHistory.begin();
+            while ( it != _bufferHistory.end() ) {
+                if ( (it->first == time) || (it->first == time - 1) ) {
+                    ++it;
+                } else {
+                    _bufferHistory.erase(it++);
+                }
+            }
+        }
+    }
+#ifdef DEBUG_TIME
+    gettimeofday(&t2, NULL);
+    DPRINT( ( "rendering took %d us\n", 1000000 * (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) ) );
+#endif
+    if (data.imageShaderParamsUpdated) {
+        // Note: InstanceChanged is (illegally) triggered at the end of render() using:
+        _imageShaderParamsUpdated->setValue( !_imageShaderParamsUpdated->getValueAtTime(time) );
+        // (setValue is normally not authorized from render())
+    }
+} // ShadertoyPlugin::RENDERFUNC
+
+
+void
+ShadertoyPlugin::RENDERTILESFUNC(RenderData &data,
+                                 OpenGLContextData *contextData)
+{
+    const OFX::RenderArguments &args = data.args;
+    const double time = args.time;
+#if GL_ARB_framebuffer_object && !defined(GL_GLEXT_FUNCTION_POINTERS)
+    const bool supportsMipmap = true;
+#else
+    const bool supportsMipmap = (bool)glGenerateMipmap;
+#endif
+    OfxRectI tile;
+
+    if ( !data.getNextTile(&tile) ) {
+        return;
+    }
+
+#ifdef USE_OSMESA
+    assert(!contextData);
+    OSMesaPrivate *osmesa = popMesaContext();
+    osmesa->setContext(data.format, data.depthBits, data.type, data.stencilBits, data.accumBits, data.cpuDriver,
+                       data.dst->getPixelAddress(tile.x1, tile.y1), tile, data.rowLength);
+    contextData = &osmesa->_openGLContextData;
+#endif
+    assert(contextData);
+    const std::vector<GLenum> &srcTarget = data.srcTarget;
+    std::vector<GLuint> srcIndex = data.srcIndex; // (OSMesa) the textures are created in this context
+    const std::vector<FilterEnum> &filter = data.filter;
+    const std::vector<WrapEnum> &wrap = data.wrap;
 
-    // compile and link the shader if necessary
-    bool imageShaderParamsUpdated = false;
-    ShadertoyShader *shadertoy;
+    {
+        AutoMutex lock( _rendererInfoMutex.get() );
+        std::string &message = _rendererInfo;
+        if ( message.empty() ) {
+            message += "OpenGL renderer information:";
+            message += "\nGL_RENDERER = ";
+            message += (char *) glGetString(GL_RENDERER);
+            message += "\nGL_VERSION = ";
+            message += (char *) glGetString(GL_VERSION);
+            message += "\nGL_VENDOR = ";
+            message += (char *) glGetString(GL_VENDOR);
+            message += "\nGL_SHADING_LANGUAGE_VERSION = ";
+            message += (char *) glGetString(GL_SHADING_LANGUAGE_VERSION);
+            message += "\nGL_EXTENSIONS = ";
+            message += (char *) glGetString(GL_EXTENSIONS);
+        }
+    }
+
+
+    // compile and link the shader if necessary
+    ShadertoyShader *shadertoy;
     {
         AutoMutex lock( _imageShaderMutex.get() );
         bool must_recompile = false;
@@ -1234,54 +1875,42 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
             }
             std::string str;
             _imageShaderSource->getValue(str);
-            {
-                // for compatibility with ShaderToy, remove the first line that starts with "const vec2 iRenderScale"
-                std::size_t found = str.find("const vec2 iRenderScale");
-                if ( found != std::string::npos && (found == 0 || (str[found-1] == '\n' || str[found-1] == '\r') ) ) {
-                    std::size_t eol = str.find('\n', found);
-                    if (eol == std::string::npos) {
-                        // last line
-                        eol = str.size();
-                    }
-                    // replace by an empty line
-                    str.replace(found, eol - found, std::string());
-                }
-            }
-            std::string fsSource = fsHeader;
-            for (unsigned i = 0; i < NBINPUTS; ++i) {
-                fsSource += std::string("uniform sampler2D iChannel") + (char)('0' + i) + ";\n";
-            }
-            fsSource += "#line 1\n";
-            fsSource += str + '\n' + fsFooter;
-            std::string errstr;
+            const std::string fsSource = fragmentShaderSource(str);
             const char* fragmentShader = fsSource.c_str();
-            shadertoy->program = compileAndLinkProgram(vsSource.c_str(), fragmentShader, errstr);
+            std::string errstr;
+            shadertoy->program = programFromSource(fsSource, contextData->haveProgramBinary, errstr);
             const GLuint program = shadertoy->program;
-            if (shadertoy->program == 0) {
-                setPersistentMessage(OFX::Message::eMessageError, "", "Failed to compile and link program");
-                sendMessage( OFX::Message::eMessageError, "", errstr.c_str() );
-                OFX::throwSuiteStatusException(kOfxStatFailed);
+            // compile the buffer passes (a buffer with an empty source is not rendered)
+            for (unsigned b = 0; b < NBBUFFERS && program != 0; ++b) {
+                ShadertoyShader *buffer = (ShadertoyShader *)contextData->bufferShader[b];
+                assert(buffer);
+                if (buffer->program) {
+                    glDeleteProgram(buffer->program);
+                    buffer->program = 0;
+                }
+                std::string bufferSource;
+                _bufferSource[b]->getValue(bufferSource);
+                if ( bufferSource.empty() ) {
+                    continue;
+                }
+                buffer->program = programFromSource(fragmentShaderSource(bufferSource), contextData->haveProgramBinary, errstr);
+                if (buffer->program == 0) {
+                    errstr = std::string("Buffer ") + (char)('A' + b) + ":\n" + errstr;
+                    break;
+                }
+                getUniformLocations(buffer);
+            }
+            if ( (program == 0) || !errstr.empty() ) {
+                // the error is reported by RENDERFUNC, and the next render of this context tries again
+                contextData->imageShaderID = 0;
+                data.setStatus( kOfxStatFailed, errstr.empty() ? std::string("(no error log)") : errstr );
+#ifdef USE_OSMESA
+                pushMesaContext(osmesa);
+#endif
 
                 return;
             }
-            shadertoy->iResolutionLoc        = glGetUniformLocation(program, "iResolution");
-            shadertoy->iGlobalTimeLoc        = glGetUniformLocation(program, "iGlobalTime");
-            shadertoy->iTimeDeltaLoc         = glGetUniformLocation(program, "iTimeDelta");
-            shadertoy->iFrameLoc             = glGetUniformLocation(program, "iFrame");
-            shadertoy->iChannelTimeLoc       = glGetUniformLocation(program, "iChannelTime");
-            shadertoy->iMouseLoc             = glGetUniformLocation(program, "iMouse");
-            shadertoy->iDateLoc              = glGetUniformLocation(program, "iDate");
-            shadertoy->iSampleRateLoc        = glGetUniformLocation(program, "iSampleRate");
-            shadertoy->iChannelResolutionLoc = glGetUniformLocation(program, "iChannelResolution");
-            shadertoy->ifFragCoordOffsetUniformLoc = glGetUniformLocation(program, "ifFragCoordOffsetUniform");
-            shadertoy->iRenderScaleLoc = glGetUniformLocation(program, "iRenderScale");
-            char iChannelX[10] = "iChannelX"; // index 8 holds the channel character
-            assert(NBINPUTS < 10 && iChannelX[8] == 'X');
-            for (unsigned i = 0; i < NBINPUTS; ++i) {
-                iChannelX[8] = '0' + i;
-                shadertoy->iChannelLoc[i] = glGetUniformLocation(shadertoy->program, iChannelX);
-                //printf("%s -> %d\n", iChannelX, (int)shadertoy->iChannelLoc[i]);
-            }
+            getUniformLocations(shadertoy);
 
             if (_imageShaderUpdateParams) {
                 _imageShaderHasMouse = false;
@@ -1445,7 +2074,7 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
                         getBboxInfo(fragmentShader, _imageShaderBBox);
                     } // for (i = 0; i < count; i++) {
                 }
-                imageShaderParamsUpdated = true;
+                data.imageShaderParamsUpdated = true; // protected by _imageShaderMutex
             } // if (_imageShaderUpdateParams)
 
             // Note: InstanceChanged is (illegally) triggered at the end of render() using:
@@ -1455,19 +2084,49 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
             _imageShaderCompiled = true;
         }
         if (must_recompile || uniforms_changed) {
-            std::fill(shadertoy->iParamLoc, shadertoy->iParamLoc + NBUNIFORMS, -1);
+            // the extra parameters are available in all passes
             unsigned paramCount = std::max( 0, std::min(_paramCount->getValue(), NBUNIFORMS) );
-            for (unsigned i = 0; i < paramCount; ++i) {
-                std::string paramName;
-                _paramName[i]->getValue(paramName);
-                if ( !paramName.empty() ) {
-                    shadertoy->iParamLoc[i] = glGetUniformLocation( shadertoy->program, paramName.c_str() );
+            for (unsigned p = 0; p <= NBBUFFERS; ++p) {
+                ShadertoyShader *pass = (p < NBBUFFERS) ? (ShadertoyShader *)contextData->bufferShader[p] : shadertoy;
+                std::fill(pass->iParamLoc, pass->iParamLoc + NBUNIFORMS, -1);
+                if (pass->program == 0) {
+                    continue;
+                }
+                for (unsigned i = 0; i < paramCount; ++i) {
+                    std::string paramName;
+                    _paramName[i]->getValue(paramName);
+                    if ( !paramName.empty() ) {
+                        pass->iParamLoc[i] = glGetUniformLocation( pass->program, paramName.c_str() );
+                    }
                 }
             }
         }
     }
     glCheckError();
 
+    // the passes to render: the buffers that have a shader, then the image
+    ShadertoyShader *passes[NBBUFFERS + 1];
+    bool multipass = false;
+    for (unsigned b = 0; b < NBBUFFERS; ++b) {
+        passes[b] = (ShadertoyShader *)contextData->bufferShader[b];
+        if (passes[b]->program == 0) {
+            passes[b] = NULL;
+        } else {
+            multipass = true;
+        }
+    }
+    passes[NBBUFFERS] = shadertoy;
+    // the inputs read by the passes
+    std::vector<bool> inputUsed(NBINPUTS, false);
+    for (unsigned p = 0; p <= NBBUFFERS; ++p) {
+        for (unsigned i = 0; passes[p] && i < NBINPUTS; ++i) {
+            const int source = data.channelSource[p * NBINPUTS + i];
+            if ( (source < NBINPUTS) && (passes[p]->iChannelLoc[i] >= 0) ) {
+                inputUsed[source] = true;
+            }
+        }
+    }
+
 #ifdef USE_OSMESA
     // load the source image into a texture
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
@@ -1475,9 +2134,9 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
 
     glActiveTexture(GL_TEXTURE0);
     for (unsigned i = 0; i < NBINPUTS; ++i) {
-        if ( src[i].get() && (shadertoy->iChannelLoc[i] >= 0) ) {
+        if ( data.src[i] && inputUsed[i] ) {
             glGenTextures(1, &srcIndex[i]);
-            OfxRectI srcBounds = src[i]->getBounds();
+            OfxRectI srcBounds = data.src[i]->getBounds();
             glBindTexture(srcTarget[i], srcIndex[i]);
             // legacy mipmap generation was replaced by glGenerateMipmap from GL_ARB_framebuffer_object (see below)
             if ((filter[i] == eFilterMipmap || filter[i] == eFilterAnisotropic) && !supportsMipmap) {
@@ -1488,9 +2147,9 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
                 glTexParameteri(srcTarget[i], GL_GENERATE_MIPMAP, GL_TRUE); // Allocate the mipmaps
             }
 
-            glTexImage2D( srcTarget[i], 0, format,
+            glTexImage2D( srcTarget[i], 0, data.format,
                           srcBounds.x2 - srcBounds.x1, srcBounds.y2 - srcBounds.y1, 0,
-                          format, type, src[i]->getPixelData() );
+                          data.format, data.type, data.src[i]->getPixelData() );
             glBindTexture(srcTarget[i], 0);
         }
     }
@@ -1499,17 +2158,6 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
 
     bool haveAniso = contextData->haveAniso;
     float maxAnisoMax = contextData->maxAnisoMax;
-    int w = (renderWindow.x2 - renderWindow.x1);
-    int h = (renderWindow.y2 - renderWindow.y1);
-
-    // setup the projection
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, w, 0, h, -1, 1);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    glClear(GL_DEPTH_BUFFER_BIT); // does not hurt, even if there is no Z-buffer (Sony Catalyst)
-    glCheckError();
 
     double fps = _dstClip->getFrameRate();
     if (fps <= 0) {
@@ -1517,245 +2165,434 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
     }
     GLfloat t = time / fps;
     const OfxPointD& rs = args.renderScale;
-    OfxRectI dstBoundsFull;
-    OFX::Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(time), rs, _dstClip->getPixelAspectRatio(), &dstBoundsFull);
+    const OfxRectI& dstBoundsFull = data.dstBoundsFull;
+    const GLsizei bufferWidth = dstBoundsFull.x2 - dstBoundsFull.x1;
+    const GLsizei bufferHeight = dstBoundsFull.y2 - dstBoundsFull.y1;
+
+    // generate the mipmaps of the inputs once, even if they are read by several passes
+    for (unsigned i = 0; i < NBINPUTS; ++i) {
+        // GL_ARB_framebuffer_object
+        // https://www.opengl.org/wiki/Common_Mistakes#Automatic_mipmap_generation
+        if ( data.src[i] && inputUsed[i] && (filter[i] == eFilterMipmap || filter[i] == eFilterAnisotropic) && supportsMipmap ) {
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(srcTarget[i], srcIndex[i]);
+            glHint(GL_GENERATE_MIPMAP_HINT, GL_NICEST);
+            glGenerateMipmap(GL_TEXTURE_2D);  //Generate mipmaps now!!!
+            glBindTexture(srcTarget[i], 0);
+            glCheckError();
+        }
+    }
 
-    glUseProgram(shadertoy->program);
+    glPushAttrib(GL_ALL_ATTRIB_BITS);
+    glDisable(GL_BLEND);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     glCheckError();
 
-    // Uniform locations may be -1 if the Uniform was optimised out by the compîler.
-    // see https://www.opengl.org/wiki/GLSL_:_common_mistakes#glGetUniformLocation_and_glGetActiveUniform
-    if (shadertoy->iResolutionLoc >= 0) {
-        double width = dstBoundsFull.x2 - dstBoundsFull.x1;
-        double height = dstBoundsFull.y2 - dstBoundsFull.y1;
-        // last coord is 1.
-        // see https://github.com/beautypi/shadertoy-iOS-v2/blob/a852d8fd536e0606377a810635c5b654abbee623/shadertoy/ShaderPassRenderer.m#L329
-        glUniform3f (shadertoy->iResolutionLoc, width, height, 1.);
-    }
-    if (shadertoy->iGlobalTimeLoc >= 0) {
-        glUniform1f (shadertoy->iGlobalTimeLoc, t);
-    }
-    if (shadertoy->iTimeDeltaLoc >= 0) {
-        glUniform1f (shadertoy->iTimeDeltaLoc, 1 / fps); // is that it?
-    }
-    if (shadertoy->iFrameLoc >= 0) {
-        glUniform1f (shadertoy->iFrameLoc, time); // is that it?
-    }
-    if (shadertoy->iChannelTimeLoc >= 0) {
-        GLfloat tv[NBINPUTS];
-        std::fill(tv, tv + NBINPUTS, t);
-        glUniform1fv(shadertoy->iChannelTimeLoc, NBINPUTS, tv);
-    }
-    if (shadertoy->iChannelResolutionLoc >= 0) {
-        GLfloat rv[3 * NBINPUTS];
-        for (unsigned i = 0; i < NBINPUTS; ++i) {
-        }
-        glUniform3fv(shadertoy->iChannelResolutionLoc, NBINPUTS, rv);
-    }
-    if (shadertoy->iMouseLoc >= 0) {
-        double x, y, xc, yc;
-        _mousePosition->getValueAtTime(time, x, y);
-        _mouseClick->getValueAtTime(time, xc, yc);
-        if ( !_mousePressed->getValueAtTime(time) ) {
-            // negative is mouse released
-            // see https://github.com/beautypi/shadertoy-iOS-v2/blob/a852d8fd536e0606377a810635c5b654abbee623/shadertoy/ShaderCanvasViewController.m#L315
-            xc = -xc;
-            yc = -yc;
-        }
-        glUniform4f (shadertoy->iMouseLoc, x * rs.x, y * rs.y, xc * rs.x, yc * rs.y);
-    }
-    unsigned paramCount = std::max( 0, std::min(_paramCount->getValue(), NBUNIFORMS) );
-    for (unsigned i = 0; i < paramCount; ++i) {
-        if (shadertoy->iParamLoc[i] >= 0) {
-            UniformTypeEnum paramType = (UniformTypeEnum)_paramType[i]->getValue();
-            switch (paramType) {
-            case eUniformTypeNone: {
-                break;
+    // the buffers are rendered to textures, using our own framebuffer
+    GLint hostFramebuffer = 0;
+    GLint hostViewport[4] = {0, 0, 0, 0};
+    GLuint bufferFramebuffer = 0;
+    GLuint bufferTexture[NBBUFFERS]; // the buffers rendered at this frame
+    GLuint bufferPreviousTexture[NBBUFFERS]; // the kept buffers, at the previous frame
+    bool bufferReadPending[NBBUFFERS]; // the kept buffers being read back asynchronously to contextData->packBuffer
+    GLsync bufferReadFence = 0; // signaled when all the pending readbacks are complete
+    std::fill(bufferTexture, bufferTexture + NBBUFFERS, 0);
+    std::fill(bufferPreviousTexture, bufferPreviousTexture + NBBUFFERS, 0);
+    std::fill(bufferReadPending, bufferReadPending + NBBUFFERS, false);
+    if (multipass) {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &hostFramebuffer);
+        glGetIntegerv(GL_VIEWPORT, hostViewport);
+        glGenFramebuffers(1, &bufferFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, bufferFramebuffer);
+        glActiveTexture(GL_TEXTURE0);
+        glClearColor(0., 0., 0., 0.);
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            if (!passes[b]) {
+                continue;
             }
-            case eUniformTypeBool: {
-                bool v = _paramValueBool[i]->getValue();
-                glUniform1i(shadertoy->iParamLoc[i], v);
-                break;
-            }
-            case eUniformTypeInt: {
-                int v = _paramValueInt[i]->getValue();
-                glUniform1i(shadertoy->iParamLoc[i], v);
-                break;
-            }
-            case eUniformTypeFloat: {
-                double v = _paramValueFloat[i]->getValue();
-                glUniform1f(shadertoy->iParamLoc[i], v);
-                break;
-            }
-            case eUniformTypeVec2: {
-                double x, y;
-                _paramValueVec2[i]->getValue(x, y);
-                glUniform2f(shadertoy->iParamLoc[i], x, y);
-                break;
-            }
-            case eUniformTypeVec3: {
-                double x, y, z;
-                _paramValueVec3[i]->getValue(x, y, z);
-                glUniform3f(shadertoy->iParamLoc[i], x, y, z);
-                break;
+            bufferTexture[b] = createBufferTexture(bufferWidth, bufferHeight, NULL);
+            if (data.bufferKept[b]) {
+                const std::vector<float> &previous = data.bufferPrevious[b];
+                if ( previous.size() == (std::size_t)bufferWidth * bufferHeight * 4 ) {
+                    if (contextData->havePixelBufferSync) {
+                        // the two pixel buffers are used in turn, so that an upload may start while the previous one is still running
+                        GLuint *pbo = &contextData->unpackBuffer[contextData->unpackBufferIndex];
+                        contextData->unpackBufferIndex = 1 - contextData->unpackBufferIndex;
+                        bufferPreviousTexture[b] = createBufferTextureAsync(bufferWidth, bufferHeight, &previous[0], pbo);
+                    } else {
+                        bufferPreviousTexture[b] = createBufferTexture(bufferWidth, bufferHeight, &previous[0]);
+                    }
+                } else {
+                    // no previous frame: black
+                    bufferPreviousTexture[b] = createBufferTexture(bufferWidth, bufferHeight, NULL);
+                    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bufferPreviousTexture[b], 0);
+                    glClear(GL_COLOR_BUFFER_BIT);
+                }
             }
-            case eUniformTypeVec4: {
-                double x, y, z, w;
-                _paramValueVec4[i]->getValue(x, y, z, w);
-                glUniform4f(shadertoy->iParamLoc[i], x, y, z, w);
-                break;
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bufferTexture[b], 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                DPRINT( ("Shadertoy: cannot render to a floating-point texture\n") );
+                data.setStatus(kOfxStatFailed);
             }
-            default: {
-                assert(false);
-                break;
+        }
+        glCheckError();
+    }
+
+    // Render the passes: first the buffers, each into its texture, then the image.
+    bool aborted = false;
+    for (unsigned p = 0; p <= NBBUFFERS && data.status == kOfxStatOK; ++p) {
+        ShadertoyShader *pass = passes[p];
+        if (!pass) {
+            continue;
+        }
+        const bool imagePass = (p == NBBUFFERS);
+
+        // what each iChannel of this pass reads.
+        // A buffer rendered before this pass is read from this frame, else from the previous frame.
+        GLenum channelTarget[NBINPUTS];
+        GLuint channelIndex[NBINPUTS];
+        FilterEnum channelFilter[NBINPUTS];
+        WrapEnum channelWrap[NBINPUTS];
+        GLfloat channelResolution[3 * NBINPUTS];
+        for (unsigned i = 0; i < NBINPUTS; ++i) {
+            const int source = data.channelSource[p * NBINPUTS + i];
+            channelTarget[i] = GL_TEXTURE_2D;
+            channelIndex[i] = 0;
+            channelFilter[i] = eFilterLinear;
+            channelWrap[i] = eWrapClamp;
+            channelResolution[3 * i] = channelResolution[3 * i + 1] = channelResolution[3 * i + 2] = 0.;
+            if (source < NBINPUTS) {
+                if (data.src[source]) {
+                    const OfxRectI srcBounds = data.src[source]->getBounds();
+                    channelTarget[i] = srcTarget[source];
+                    channelIndex[i] = srcIndex[source];
+                    channelFilter[i] = filter[source];
+                    channelWrap[i] = wrap[source];
+                    channelResolution[3 * i] = srcBounds.x2 - srcBounds.x1;
+                    channelResolution[3 * i + 1] = srcBounds.y2 - srcBounds.y1;
+                    channelResolution[3 * i + 2] = 1.;
+                }
+            } else if (passes[source - NBINPUTS]) {
+                const unsigned b = source - NBINPUTS;
+                channelIndex[i] = (b < p) ? bufferTexture[b] : bufferPreviousTexture[b];
+                channelResolution[3 * i] = bufferWidth;
+                channelResolution[3 * i + 1] = bufferHeight;
+                channelResolution[3 * i + 2] = 1.;
             }
+        }
+
+        if (imagePass) {
+            if (multipass) {
+                glBindFramebuffer(GL_FRAMEBUFFER, hostFramebuffer);
+                glViewport(hostViewport[0], hostViewport[1], hostViewport[2], hostViewport[3]);
             }
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_LESS);
+        } else {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, bufferTexture[p], 0);
+            glViewport(0, 0, bufferWidth, bufferHeight);
+            glDisable(GL_DEPTH_TEST);
         }
-    }
-    glCheckError();
-    for (unsigned i = 0; i < NBINPUTS; ++i) {
-        glActiveTexture(GL_TEXTURE0 + i);
-        if ( src[i].get() && (shadertoy->iChannelLoc[i] >= 0) ) {
-            glUniform1i(shadertoy->iChannelLoc[i], i);
-            glBindTexture(srcTarget[i], srcIndex[i]);
-            glEnable(srcTarget[i]);
+        glCheckError();
 
-            // GL_ARB_framebuffer_object
-            // https://www.opengl.org/wiki/Common_Mistakes#Automatic_mipmap_generation
-            if ((filter[i] == eFilterMipmap || filter[i] == eFilterAnisotropic) && supportsMipmap) {
-                glHint(GL_GENERATE_MIPMAP_HINT, GL_NICEST);
-                glGenerateMipmap(GL_TEXTURE_2D);  //Generate mipmaps now!!!
-                glCheckError();
+        glUseProgram(pass->program);
+        glCheckError();
+
+        // Uniform locations may be -1 if the Uniform was optimised out by the compîler.
+        // see https://www.opengl.org/wiki/GLSL_:_common_mistakes#glGetUniformLocation_and_glGetActiveUniform
+        if (pass->iResolutionLoc >= 0) {
+            // last coord is 1.
+            // see https://github.com/beautypi/shadertoy-iOS-v2/blob/a852d8fd536e0606377a810635c5b654abbee623/shadertoy/ShaderPassRenderer.m#L329
+            glUniform3f (pass->iResolutionLoc, bufferWidth, bufferHeight, 1.);
+        }
+        if (pass->iGlobalTimeLoc >= 0) {
+            glUniform1f (pass->iGlobalTimeLoc, t);
+        }
+        if (pass->iTimeDeltaLoc >= 0) {
+            glUniform1f (pass->iTimeDeltaLoc, 1 / fps); // is that it?
+        }
+        if (pass->iFrameLoc >= 0) {
+            glUniform1i (pass->iFrameLoc, (GLint)time); // iFrame is an int
+        }
+        if (pass->iChannelTimeLoc >= 0) {
+            GLfloat tv[NBINPUTS];
+            std::fill(tv, tv + NBINPUTS, t);
+            glUniform1fv(pass->iChannelTimeLoc, NBINPUTS, tv);
+        }
+        if (pass->iChannelResolutionLoc >= 0) {
+            glUniform3fv(pass->iChannelResolutionLoc, NBINPUTS, channelResolution);
+        }
+        if (pass->iMouseLoc >= 0) {
+            double x, y, xc, yc;
+            _mousePosition->getValueAtTime(time, x, y);
+            _mouseClick->getValueAtTime(time, xc, yc);
+            if ( !_mousePressed->getValueAtTime(time) ) {
+                // negative is mouse released
+                // see https://github.com/beautypi/shadertoy-iOS-v2/blob/a852d8fd536e0606377a810635c5b654abbee623/shadertoy/ShaderCanvasViewController.m#L315
+                xc = -xc;
+                yc = -yc;
             }
-            GLenum min_filter = GL_NEAREST;
-            GLenum mag_filter = GL_NEAREST;
-            switch (filter[i]) {
-                case eFilterNearest:
-                    min_filter = GL_NEAREST;
-                    mag_filter = GL_NEAREST;
+            glUniform4f (pass->iMouseLoc, x * rs.x, y * rs.y, xc * rs.x, yc * rs.y);
+        }
+        unsigned paramCount = std::max( 0, std::min(_paramCount->getValue(), NBUNIFORMS) );
+        for (unsigned i = 0; i < paramCount; ++i) {
+            if (pass->iParamLoc[i] >= 0) {
+                UniformTypeEnum paramType = (UniformTypeEnum)_paramType[i]->getValue();
+                switch (paramType) {
+                case eUniformTypeNone: {
                     break;
-                case eFilterLinear:
-                    min_filter = GL_LINEAR;
-                    mag_filter = GL_LINEAR;
+                }
+                case eUniformTypeBool: {
+                    bool v = _paramValueBool[i]->getValue();
+                    glUniform1i(pass->iParamLoc[i], v);
                     break;
-                case eFilterMipmap:
-                    min_filter = GL_LINEAR_MIPMAP_LINEAR;
-                    mag_filter = GL_LINEAR;
+                }
+                case eUniformTypeInt: {
+                    int v = _paramValueInt[i]->getValue();
+                    glUniform1i(pass->iParamLoc[i], v);
                     break;
-                case eFilterAnisotropic:
-                    min_filter = GL_LINEAR_MIPMAP_LINEAR;
-                    mag_filter = GL_LINEAR;
-                    if (haveAniso) {
-                        glTexParameterf(srcTarget[i], GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAnisoMax);
-                    }
+                }
+                case eUniformTypeFloat: {
+                    double v = _paramValueFloat[i]->getValue();
+                    glUniform1f(pass->iParamLoc[i], v);
                     break;
+                }
+                case eUniformTypeVec2: {
+                    double x, y;
+                    _paramValueVec2[i]->getValue(x, y);
+                    glUniform2f(pass->iParamLoc[i], x, y);
+                    break;
+                }
+                case eUniformTypeVec3: {
+                    double x, y, z;
+                    _paramValueVec3[i]->getValue(x, y, z);
+                    glUniform3f(pass->iParamLoc[i], x, y, z);
+                    break;
+                }
+                case eUniformTypeVec4: {
+                    double x, y, z, w;
+                    _paramValueVec4[i]->getValue(x, y, z, w);
+                    glUniform4f(pass->iParamLoc[i], x, y, z, w);
+                    break;
+                }
+                default: {
+                    assert(false);
+                    break;
+                }
+                }
             }
-            glTexParameteri(srcTarget[i], GL_TEXTURE_MIN_FILTER, min_filter);
-            glTexParameteri(srcTarget[i], GL_TEXTURE_MAG_FILTER, mag_filter);
+        }
+        glCheckError();
+        for (unsigned i = 0; i < NBINPUTS; ++i) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            if ( channelIndex[i] && (pass->iChannelLoc[i] >= 0) ) {
+                const GLenum target = channelTarget[i];
+                glUniform1i(pass->iChannelLoc[i], i);
+                glBindTexture(target, channelIndex[i]);
+                glEnable(target);
+
+                GLenum min_filter = GL_NEAREST;
+                GLenum mag_filter = GL_NEAREST;
+                switch (channelFilter[i]) {
+                    case eFilterNearest:
+                        min_filter = GL_NEAREST;
+                        mag_filter = GL_NEAREST;
+                        break;
+                    case eFilterLinear:
+                        min_filter = GL_LINEAR;
+                        mag_filter = GL_LINEAR;
+                        break;
+                    case eFilterMipmap:
+                        min_filter = GL_LINEAR_MIPMAP_LINEAR;
+                        mag_filter = GL_LINEAR;
+                        break;
+                    case eFilterAnisotropic:
+                        min_filter = GL_LINEAR_MIPMAP_LINEAR;
+                        mag_filter = GL_LINEAR;
+                        if (haveAniso) {
+                            glTexParameterf(target, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAnisoMax);
+                        }
+                        break;
+                }
+                glTexParameteri(target, GL_TEXTURE_MIN_FILTER, min_filter);
+                glTexParameteri(target, GL_TEXTURE_MAG_FILTER, mag_filter);
 
-            GLenum wrapst = (wrap[i] == eWrapClamp) ? GL_CLAMP_TO_EDGE : ((wrap[i] == eWrapMirror) ? GL_MIRRORED_REPEAT : GL_REPEAT);
-            glTexParameteri(srcTarget[i], GL_TEXTURE_WRAP_S, wrapst);
-            glTexParameteri(srcTarget[i], GL_TEXTURE_WRAP_T, wrapst);
+                GLenum wrapst = (channelWrap[i] == eWrapClamp) ? GL_CLAMP_TO_EDGE : ((channelWrap[i] == eWrapMirror) ? GL_MIRRORED_REPEAT : GL_REPEAT);
+                glTexParameteri(target, GL_TEXTURE_WRAP_S, wrapst);
+                glTexParameteri(target, GL_TEXTURE_WRAP_T, wrapst);
 
-            // The texture parameters vflip and srgb [default = false] should be handled by the reader
+                // The texture parameters vflip and srgb [default = false] should be handled by the reader
 
-        } else {
-            glBindTexture(srcTarget[i], 0);
+            } else {
+                glBindTexture(channelTarget[i], 0);
+            }
         }
-    }
-    glCheckError();
-    if (shadertoy->iDateLoc >= 0) {
-        // do not use the current date, as it may generate a different image at each render
-        glUniform4f(shadertoy->iDateLoc, 1970, 1, 1, 0);
-    }
-    if (shadertoy->iSampleRateLoc >= 0) {
-        glUniform1f(shadertoy->iSampleRateLoc, 44100);
-    }
-    if (shadertoy->ifFragCoordOffsetUniformLoc >= 0) {
-        glUniform2f(shadertoy->ifFragCoordOffsetUniformLoc, renderWindow.x1 - dstBoundsFull.x1, renderWindow.y1 - dstBoundsFull.y1);
-        //DPRINT(("offset=%d,%d\n",(int)(renderWindow.x1 - dstBoundsFull.x1), (int)(renderWindow.y1 - dstBoundsFull.y1)));
-    }
-    if (shadertoy->iRenderScaleLoc >= 0) {
-        glUniform2f(shadertoy->iRenderScaleLoc, rs.x, rs.y);
-    }
-    glCheckError();
-
-    glPushAttrib(GL_ALL_ATTRIB_BITS);
-    glDisable(GL_BLEND);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    glCheckError();
+        glCheckError();
+        if (pass->iDateLoc >= 0) {
+            // do not use the current date, as it may generate a different image at each render
+            glUniform4f(pass->iDateLoc, 1970, 1, 1, 0);
+        }
+        if (pass->iSampleRateLoc >= 0) {
+            glUniform1f(pass->iSampleRateLoc, 44100);
+        }
+        if (pass->iRenderScaleLoc >= 0) {
+            glUniform2f(pass->iRenderScaleLoc, rs.x, rs.y);
+        }
+        glCheckError();
 
-    // Are your images pretty large? Maybe one approach would to render the scene in tiled chunks.
-    // For example, divide the window into an NxM grid of tiles, then render the scene into each tile with glScissor.
-    // After rendering each tile, check if there's user input and abort drawing the grid if needed.
-    // Ideally the tile size should be a multiple of llvmpipe's tile size which is 64x64.
-    // llvmpipe employs multiple threads to process tiles in parallel so your tiles should probably
-    // be 128x128 for 4 cores, 256x128 for 8 cores, etc.
-    int tile_w;
-    int tile_h;
-#ifdef USE_OSMESA
-    glEnable(GL_SCISSOR_TEST);
-    {
-        int nCPUs = OFX::MultiThread::getNumCPUs();
-        // - take the square root of nCPUs
-        // - compute the next closest power of two -> this gives the number of tiles for the x dimension
-        int pow2_x = std::ceil(std::log( std::sqrt(nCPUs) ) / M_LN2);
-        tile_w = 64 * (1 << pow2_x);
-        // - compute the next power of two for the other side
-        int pow2_y = std::ceil(std::log( nCPUs / (double)(1 << pow2_x) ) / M_LN2);
-        tile_h = 64 * (1 << pow2_y);
-        //DPRINT( ("Shadertoy: tile size: %d %d for %d CPUs\n", tile_w, tile_h, nCPUs) );
-    }
-#else
-    tile_w = w;
-    tile_h = h;
-#endif
+        if (!imagePass) {
+            // a buffer covers the whole output region of definition
+            glMatrixMode(GL_PROJECTION);
+            glLoadIdentity();
+            glOrtho(0, bufferWidth, 0, bufferHeight, -1, 1);
+            glMatrixMode(GL_MODELVIEW);
+            glLoadIdentity();
+            if (pass->ifFragCoordOffsetUniformLoc >= 0) {
+                glUniform2f(pass->ifFragCoordOffsetUniformLoc, 0, 0);
+            }
+            glBegin(GL_QUADS);
+            glVertex2f(0, 0);
+            glVertex2f(0, bufferHeight);
+            glVertex2f(bufferWidth, bufferHeight);
+            glVertex2f(bufferWidth, 0);
+            glEnd();
+            glCheckError();
+            if ( data.bufferKept[p] && data.bufferFeedback ) {
+                // keep this buffer for the next frame
+                if (contextData->havePixelBufferSync) {
+                    // read back to a pixel buffer: glReadPixels returns immediately, and the following passes
+                    // are rendered while the transfer runs. The pixels are fetched after the image pass (see below).
+                    if (contextData->packBuffer[p] == 0) {
+                        glGenBuffers(1, &contextData->packBuffer[p]);
+                    }
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, contextData->packBuffer[p]);
+                    glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)bufferWidth * bufferHeight * 4 * sizeof(GLfloat), NULL, GL_STREAM_READ);
+                    glReadPixels(0, 0, bufferWidth, bufferHeight, GL_RGBA, GL_FLOAT, NULL);
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                    bufferReadPending[p] = true;
+                    // the fence is placed after the last readback, so that waiting on it does not wait for the image pass
+                    if (bufferReadFence) {
+                        glDeleteSync(bufferReadFence);
+                    }
+                    bufferReadFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                } else {
+                    std::vector<float> pixels( (std::size_t)bufferWidth * bufferHeight * 4 );
+                    glReadPixels(0, 0, bufferWidth, bufferHeight, GL_RGBA, GL_FLOAT, &pixels[0]);
+                    AutoMutex lock(data.mutex);
+                    data.bufferCurrent[p].swap(pixels);
+                }
+                glCheckError();
+            }
+            aborted = abort();
+            if (aborted) {
+                data.setAborted();
+                break;
+            }
+            continue;
+        }
 
-    bool aborted = abort();
-    for (int y1 = 0; y1 < h && !aborted; y1 += tile_h) {
-        for (int x1 = 0; x1 < w && !aborted; x1 += tile_w) {
+        // Render the tiles, each tile being rendered using its own fragCoord offset.
+        // With OSMesa, the tiles are rendered directly into the destination image (see OSMESA_ROW_LENGTH in setContext()),
+        // and the tiles that are not taken by this thread are rendered in parallel by other threads and contexts.
+        for (;;) {
 #ifdef DEBUG_TIME
             struct timeval t1, t2;
             gettimeofday(&t1, NULL);
 #endif
-            glScissor(x1, y1, tile_w, tile_h);
+            int w = (tile.x2 - tile.x1);
+            int h = (tile.y2 - tile.y1);
+
+            // setup the projection
+            glMatrixMode(GL_PROJECTION);
+            glLoadIdentity();
+            glOrtho(0, w, 0, h, -1, 1);
+            glMatrixMode(GL_MODELVIEW);
+            glLoadIdentity();
+            glClear(GL_DEPTH_BUFFER_BIT); // does not hurt, even if there is no Z-buffer (Sony Catalyst)
+            if (pass->ifFragCoordOffsetUniformLoc >= 0) {
+                glUniform2f(pass->ifFragCoordOffsetUniformLoc, tile.x1 - dstBoundsFull.x1, tile.y1 - dstBoundsFull.y1);
+                //DPRINT(("offset=%d,%d\n",(int)(tile.x1 - dstBoundsFull.x1), (int)(tile.y1 - dstBoundsFull.y1)));
+            }
             glBegin(GL_QUADS);
             glVertex2f(0, 0);
             glVertex2f(0, h);
             glVertex2f(w, h);
             glVertex2f(w, 0);
             glEnd();
-            aborted = abort();
-#ifdef USE_OSMESA
-            // render the tile if we are using osmesa
-            if (!aborted) {
-                glFlush(); // waits until commands are submitted but does not wait for the commands to finish executing
-            }
-#endif
+            glCheckError();
 #ifdef DEBUG_TIME
             gettimeofday(&t2, NULL);
-            DPRINT( ( "rendering tile: %d %d %d %d took %d us\n", x1, y1, tile_w, tile_h, 1000000 * (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) ) );
+            DPRINT( ( "rendering tile: %d %d %d %d took %d us\n", tile.x1, tile.y1, w, h, 1000000 * (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) ) );
+#endif
+            aborted = abort();
+            if (aborted) {
+                data.setAborted();
+                break;
+            }
+            if ( !data.getNextTile(&tile) ) {
+                break;
+            }
+#ifdef USE_OSMESA
+            // make sure the previous tile is rendered, and bind the next tile of the destination image
+            glFlush(); // waits until commands are submitted but does not wait for the commands to finish executing
+            glFinish(); // waits for all previously submitted commands to complete executing
+            osmesa->setContext(data.format, data.depthBits, data.type, data.stencilBits, data.accumBits, data.cpuDriver,
+                               data.dst->getPixelAddress(tile.x1, tile.y1), tile, data.rowLength);
 #endif
         }
+        glCheckError();
     }
-    if (aborted) {
-        DPRINT( ("Shadertoy: aborted!\n") );
+
+    if (bufferReadFence) {
+        // fetch the buffers that were read back while the following passes were rendering
+        GLenum waitStatus;
+        do {
+            waitStatus = glClientWaitSync(bufferReadFence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000); // 100ms
+        } while ( waitStatus == GL_TIMEOUT_EXPIRED && !abort() );
+        glDeleteSync(bufferReadFence);
+        const bool ready = (waitStatus == GL_ALREADY_SIGNALED || waitStatus == GL_CONDITION_SATISFIED);
+        for (unsigned b = 0; ready && b < NBBUFFERS; ++b) {
+            if (!bufferReadPending[b]) {
+                continue;
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, contextData->packBuffer[b]);
+            const GLfloat *ptr = (const GLfloat *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+            if (ptr) {
+                std::vector<float> pixels(ptr, ptr + (std::size_t)bufferWidth * bufferHeight * 4);
+                if ( glUnmapBuffer(GL_PIXEL_PACK_BUFFER) ) {
+                    AutoMutex lock(data.mutex);
+                    data.bufferCurrent[b].swap(pixels);
+                }
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        glCheckError();
     }
-    glCheckError();
 
     for (unsigned i = 0; i < NBINPUTS; ++i) {
-        if (shadertoy->iChannelLoc[i] >= 0) {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(srcTarget[i], 0);
-        }
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindTexture(srcTarget[i], 0);
     }
     glCheckError();
 
     glUseProgram(0);
     glCheckError();
 
+    if (multipass) {
+        glBindFramebuffer(GL_FRAMEBUFFER, hostFramebuffer);
+        glDeleteFramebuffers(1, &bufferFramebuffer);
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            if (bufferTexture[b] != 0) {
+                glDeleteTextures(1, &bufferTexture[b]);
+            }
+            if (bufferPreviousTexture[b] != 0) {
+                glDeleteTextures(1, &bufferPreviousTexture[b]);
+            }
+        }
+        glCheckError();
+    }
+
     // done; clean up.
     glPopAttrib();
 
@@ -1777,7 +2614,7 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
      * Make sure buffered commands are finished!!!
      */
     for (unsigned i = 0; i < NBINPUTS; ++i) {
-        if ( src[i].get() ) {
+        if (srcIndex[i] != 0) {
             glDeleteTextures(1, &srcIndex[i]);
         }
     }
@@ -1787,40 +2624,12 @@ ShadertoyPlugin::RENDERFUNC(const OFX::RenderArguments &args)
         glFinish(); // waits for all previously submitted commands to complete executing
     }
     glCheckError();
-    // make sure the buffer is not referenced anymore
-    osmesa->setContext(format, depthBits, type, stencilBits, accumBits, cpuDriver, NULL, dstBounds);
-    OSMesaMakeCurrent(NULL, NULL, 0, 0, 0); // disactivate the context so that it can be used from another thread
-    assert(OSMesaGetCurrentContext() == NULL);
 
     // We're finished with this osmesa, make it available for other renders
-    {
-        AutoMutex lock( _osmesaMutex.get() );
-        _osmesa.push_back(osmesa);
-    }
+    pushMesaContext(osmesa);
 #endif // ifdef USE_OSMESA
-#ifdef DEBUG_TIME
-    gettimeofday(&t2, NULL);
-    DPRINT( ( "rendering took %d us\n", 1000000 * (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) ) );
-#endif
-    if (imageShaderParamsUpdated) {
-        // Note: InstanceChanged is (illegally) triggered at the end of render() using:
-        _imageShaderParamsUpdated->setValue( !_imageShaderParamsUpdated->getValueAtTime(time) );
-        // (setValue is normally not authorized from render())
-    }
-} // ShadertoyPlugin::RENDERFUNC
-
-static
-void
-getGlVersion(int *major,
-             int *minor)
-{
-    const char *verstr = (const char *) glGetString(GL_VERSION);
+} // ShadertoyPlugin::RENDERTILESFUNC
 
-    if ( (verstr == NULL) || (std::sscanf(verstr, "%d.%d", major, minor) != 2) ) {
-        *major = *minor = 0;
-        //fprintf(stderr, "Invalid GL_VERSION format!!!\n");
-    }
-}
 
 #if 0
 static
@@ -1934,35 +2743,6 @@ ShadertoyPlugin::contextAttached(bool createContextData)
         }
     }
 
-#ifdef USE_OPENGL
-#ifdef DEBUG
-    if (OFX::getImageEffectHostDescription()->isNatron && !createContextData) {
-        DPRINT( ("ERROR: Natron did not ask to create context data\n") );
-    }
-#endif
-    OpenGLContextData* contextData = &_openGLContextData;
-    assert(contextData->imageShader);
-    if (createContextData) {
-        contextData = new OpenGLContextData;
-        contextData->imageShader = new ShadertoyShader;
-    }
-    assert(contextData->imageShader);
-    // force recompiling the shader
-    contextData->imageShaderID = 0;
-    contextData->imageShaderUniformsID = 0;
-    contextData->haveAniso = glutExtensionSupported("GL_EXT_texture_filter_anisotropic");
-    if (contextData->haveAniso) {
-        GLfloat MaxAnisoMax;
-        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &MaxAnisoMax);
-        contextData->maxAnisoMax = MaxAnisoMax;
-        DPRINT( ("GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT = %f\n", contextData->maxAnisoMax) );
-    } else {
-        contextData->maxAnisoMax = 1.;
-    }
-#else
-    assert(!createContextData); // context data is handled differently in CPU rendering
-#endif
-
 #if !defined(USE_OSMESA) && ( defined(_WIN32) || defined(__WIN32__) || defined(WIN32 ) )
     if (glCreateProgram == NULL) {
         // Program
@@ -2021,6 +2801,9 @@ ShadertoyPlugin::contextAttached(bool createContextData)
         glGenBuffers = (PFNGLGENBUFFERSPROC)wglGetProcAddress("glGenBuffers");
         glBindBuffer = (PFNGLBINDBUFFERPROC)wglGetProcAddress("glBindBuffer");
         glBufferData = (PFNGLBUFFERDATAPROC)wglGetProcAddress("glBufferData");
+        glDeleteBuffers = (PFNGLDELETEBUFFERSPROC)wglGetProcAddress("glDeleteBuffers");
+        glMapBuffer = (PFNGLMAPBUFFERPROC)wglGetProcAddress("glMapBuffer");
+        glUnmapBuffer = (PFNGLUNMAPBUFFERPROC)wglGetProcAddress("glUnmapBuffer");
 
         // Multitexture
         // GL_VERSION_1_3
@@ -2045,18 +2828,58 @@ ShadertoyPlugin::contextAttached(bool createContextData)
 
         // GL_ARB_sync
         // Sync Objects https://www.opengl.org/wiki/Sync_Object
-        glFenceSync = (PFNGLFENCESYNCPROC)wglGetProcAddress("glFenceSync​");
+        glFenceSync = (PFNGLFENCESYNCPROC)wglGetProcAddress("glFenceSync");
         glIsSync = (PFNGLISSYNCPROC)wglGetProcAddress("glIsSync");
         glDeleteSync = (PFNGLDELETESYNCPROC)wglGetProcAddress("glDeleteSync");
-        glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC)wglGetProcAddress("glClientWaitSync​");
-        glWaitSync = (PFNGLWAITSYNCPROC)wglGetProcAddress("glWaitSync​");
+        glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC)wglGetProcAddress("glClientWaitSync");
+        glWaitSync = (PFNGLWAITSYNCPROC)wglGetProcAddress("glWaitSync");
+
+#ifdef GL_ARB_get_program_binary
+        // GL_ARB_get_program_binary
+        glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC)wglGetProcAddress("glGetProgramBinary");
+        glProgramBinary = (PFNGLPROGRAMBINARYPROC)wglGetProcAddress("glProgramBinary");
+        glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC)wglGetProcAddress("glProgramParameteri");
+#endif
     }
 #endif // if !defined(USE_OSMESA) && ( defined(_WIN32) || defined(__WIN32__) || defined(WIN32 ) )
 
 #ifdef USE_OPENGL
+#ifdef DEBUG
+    if (OFX::getImageEffectHostDescription()->isNatron && !createContextData) {
+        DPRINT( ("ERROR: Natron did not ask to create context data\n") );
+    }
+#endif
+    OpenGLContextData* contextData = &_openGLContextData;
+    assert(contextData->imageShader);
+    if (createContextData) {
+        contextData = new OpenGLContextData;
+        contextData->imageShader = new ShadertoyShader;
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            contextData->bufferShader[b] = new ShadertoyShader;
+        }
+    }
+    assert(contextData->imageShader);
+    // force recompiling the shader
+    contextData->imageShaderID = 0;
+    contextData->imageShaderUniformsID = 0;
+    contextData->haveProgramBinary = programBinarySupported();
+    contextData->havePixelBufferSync = pixelBufferSyncSupported();
+    contextData->unpackBuffer[0] = contextData->unpackBuffer[1] = 0;
+    std::fill(contextData->packBuffer, contextData->packBuffer + NBBUFFERS, 0);
+    contextData->haveAniso = glutExtensionSupported("GL_EXT_texture_filter_anisotropic");
+    if (contextData->haveAniso) {
+        GLfloat MaxAnisoMax;
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &MaxAnisoMax);
+        contextData->maxAnisoMax = MaxAnisoMax;
+        DPRINT( ("GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT = %f\n", contextData->maxAnisoMax) );
+    } else {
+        contextData->maxAnisoMax = 1.;
+    }
     if (createContextData) {
         return contextData;
     }
+#else
+    assert(!createContextData); // context data is handled differently in CPU rendering
 #endif
 
     return NULL;
@@ -2077,9 +2900,29 @@ ShadertoyPlugin::contextDetached(void* contextData)
 {
     // Shadertoy:
 #ifdef USE_OPENGL
+    {
+        // the pixel buffers of the multipass transfers
+        OpenGLContextData* data = contextData ? (OpenGLContextData*)contextData : &_openGLContextData;
+        for (unsigned i = 0; i < 2; ++i) {
+            if (data->unpackBuffer[i] != 0) {
+                glDeleteBuffers(1, &data->unpackBuffer[i]);
+                data->unpackBuffer[i] = 0;
+            }
+        }
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            if (data->packBuffer[b] != 0) {
+                glDeleteBuffers(1, &data->packBuffer[b]);
+                data->packBuffer[b] = 0;
+            }
+        }
+    }
     if (contextData) {
         delete (ShadertoyShader*)( (OpenGLContextData*)contextData )->imageShader;
         ( (OpenGLContextData*)contextData )->imageShader = NULL;
+        for (unsigned b = 0; b < NBBUFFERS; ++b) {
+            delete (ShadertoyShader*)( (OpenGLContextData*)contextData )->bufferShader[b];
+            ( (OpenGLContextData*)contextData )->bufferShader[b] = NULL;
+        }
         delete (OpenGLContextData*)contextData;
     } else {
         _openGLContextAttached = false;
@@ -59,19 +59,35 @@
    Et il y aura aussi un paramètre pourri qui s'appellera "maximum input frame range". Ce paramètre permettra de préfetcher toutes les images nécessaires à l'effet avant son exécution. On pourra dépasser ce range sous Natron, mais pas sous Nuke (Natron est plus tolérant).
  */
 
-#ifdef DEBUG
-
 #include <cmath> // for floor
 #include <climits> // for INT_MAX
 #include <cassert>
+#include <cstring> // for memcpy
+#include <map>
+#include <vector>
+#include <algorithm>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 
-#include "ofxsPixelProcessor.h"
+#include "ofxsProcessing.H"
 #include "ofxsMaskMix.h"
 #include "ofxsCoords.h"
 #include "ofxsMacros.h"
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+namespace {
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+}
+#else
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+namespace {
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+}
+#endif
 
 using namespace OFX;
 
@@ -85,6 +101,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "The default retime function corresponds to a horizontal slit: it is a vertical ramp, which is a linear function of y, which is 0 at the center of the bottom image line, and 1 at the center of the tom image line. Optionally, a vertical slit may be used (0 at the center of the leftmost image column, 1 at the center of the rightmost image column), or the optional single-channel \"Retime Map\" input may also be used.\n" \
     "\n" \
     "This plugin requires to render many frames on input, which may fill up the host cache, but if more than 4 frames required on input, Natron renders them on-demand, rather than pre-caching them.\n" \
+    "Each input frame is fetched only once per render, and released as soon as it was used. Input frames are also kept in a cache of limited size (see \"Cache Input Frames\"), so that consecutive output frames reuse them rather than fetching them again from the host.\n" \
     "Note that the results may be on higher quality if the video is slowed fown (e.g. using slowmoVideo)\n" \
     "\n" \
     "The parameters are:\n" \
@@ -100,7 +117,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -135,7 +152,7 @@ enum RetimeFunctionEnum
 #define kParamRetimeOffsetDefault 0.
 
 #define kParamRetimeGain "retimeGain"
-#define kParamRetimeGainLabel "Retime Offset"
+#define kParamRetimeGainLabel "Retime Gain"
 #define kParamRetimeGainHint "Gain applied to the retime map (after offset). With the horizontal or vertical slits, to get one line or column per frame you should use respectively (height-1) or (width-1)."
 #define kParamRetimeGainDefault -10
 
@@ -171,6 +188,187 @@ enum FilterEnum
 
 #define kParamFilterDefault eFilterNearest
 
+#define kParamCacheFrames "cacheFrames"
+#define kParamCacheFramesLabel "Cache Input Frames"
+#define kParamCacheFramesHint "Keep the input frames in memory during a sequence render (up to 512MB), so that consecutive output frames reuse them rather than fetching them again from the host. The cache is cleared at the beginning and at the end of each sequence render, when the input is reconnected, and when the host purges its caches. Changes made upstream during a sequence render are not detected: press \"Clear Cache\" if the nodes upstream are modified."
+#define kParamCacheFramesDefault false
+
+#define kParamClearCache "clearCache"
+#define kParamClearCacheLabel "Clear Cache"
+#define kParamClearCacheHint "Clear the cache of input frames."
+
+#define kFrameCacheMaxBytes ( (std::size_t)512 * 1024 * 1024 )
+
+// The pixels of a cached frame. They are shared by the cache and the renders that read them, so that a render
+// does not keep the cache locked while processing them, and they are deleted when the last reference is released.
+// refCount is protected by the frame cache mutex.
+struct SlitScanPixels
+{
+    std::vector<unsigned char> data;
+    int refCount;
+
+    SlitScanPixels() : data(), refCount(1) {}
+};
+
+// release a reference to cached pixels. The frame cache mutex must be locked.
+static void
+releasePixels(SlitScanPixels *pixels)
+{
+    if (pixels && --pixels->refCount == 0) {
+        delete pixels;
+    }
+}
+
+// An input frame kept by the plugin instance, with the properties it was fetched with.
+struct SlitScanFrame
+{
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    OfxRectI window; // the render window the frame was fetched for
+    OfxRectI bounds; // the bounds of the image data
+    OFX::PixelComponentEnum pixelComponents;
+    OFX::BitDepthEnum bitDepth;
+    int rowBytes;
+    SlitScanPixels *pixels; // owned by the cache, see releasePixels()
+
+    SlitScanFrame() : renderScale(), field(OFX::eFieldNone), window(), bounds(), pixelComponents(OFX::ePixelComponentNone), bitDepth(OFX::eBitDepthNone), rowBytes(0), pixels(0) {}
+};
+
+// the frame cache, indexed by integer time
+typedef std::map<int, SlitScanFrame> SlitScanFrameCache;
+
+// a reference to cached pixels, released on destruction
+class SlitScanPixelsRef
+{
+public:
+    SlitScanPixelsRef(Mutex &mutex,
+                      SlitScanPixels *pixels)
+        : _mutex(mutex)
+        , _pixels(pixels)
+    {
+    }
+
+    ~SlitScanPixelsRef()
+    {
+        AutoMutex guard(_mutex);
+
+        releasePixels(_pixels);
+    }
+
+private:
+    Mutex &_mutex;
+    SlitScanPixels *_pixels;
+};
+
+class SlitScanProcessorBase
+    : public OFX::ImageProcessor
+{
+protected:
+    const void *_srcPixelData; // the pixel at the bottom left corner of _srcBounds
+    OfxRectI _srcBounds;
+    int _srcRowBytes;
+    int _srcTime; // the integer time of the source frame
+    const float *_timeMap; // the source time of each pixel of _window
+    float *_accum; // the accumulated pixel values over _window
+    OfxRectI _window;
+    FilterEnum _filter;
+
+public:
+    SlitScanProcessorBase(OFX::ImageEffect &instance)
+        : OFX::ImageProcessor(instance)
+        , _srcPixelData(0)
+        , _srcRowBytes(0)
+        , _srcTime(0)
+        , _timeMap(0)
+        , _accum(0)
+        , _filter(eFilterNearest)
+    {
+        _srcBounds.x1 = _srcBounds.y1 = _srcBounds.x2 = _srcBounds.y2 = 0;
+        _window.x1 = _window.y1 = _window.x2 = _window.y2 = 0;
+    }
+
+    void setTimeMap(const float *timeMap,
+                    float *accum,
+                    const OfxRectI &window,
+                    FilterEnum filter)
+    {
+        _timeMap = timeMap;
+        _accum = accum;
+        _window = window;
+        _filter = filter;
+    }
+
+    /** @brief set the source frame to accumulate. If pixelData is NULL, the accumulated values are written to the destination image. */
+    void setSrc(const void *pixelData,
+                const OfxRectI &bounds,
+                int rowBytes,
+                int time)
+    {
+        _srcPixelData = pixelData;
+        _srcBounds = bounds;
+        _srcRowBytes = rowBytes;
+        _srcTime = time;
+    }
+};
+
+template <class PIX, int nComponents, int maxValue>
+class SlitScanProcessor
+    : public SlitScanProcessorBase
+{
+public:
+    SlitScanProcessor(OFX::ImageEffect &instance)
+        : SlitScanProcessorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(procWindow.x1 >= _window.x1 && procWindow.x2 <= _window.x2 &&
+               procWindow.y1 >= _window.y1 && procWindow.y2 <= _window.y2);
+        const int w = _window.x2 - _window.x1;
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+            const float *t = _timeMap + (y - _window.y1) * w + (procWindow.x1 - _window.x1);
+            float *accPix = _accum + ( (y - _window.y1) * w + (procWindow.x1 - _window.x1) ) * nComponents;
+            if (!_srcPixelData) {
+                // write the accumulated values
+                PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+                assert(dstPix);
+                for (int x = procWindow.x1; x < procWindow.x2; ++x, accPix += nComponents, dstPix += nComponents) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        dstPix[c] = ofxsClampIfInt<PIX, maxValue>(accPix[c], 0, maxValue);
+                    }
+                }
+                continue;
+            }
+            const bool insideY = (_srcBounds.y1 <= y && y < _srcBounds.y2);
+            const PIX *srcRow = insideY ? (const PIX *)( (const char *)_srcPixelData + (std::ptrdiff_t)(y - _srcBounds.y1) * _srcRowBytes ) : 0;
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, ++t, accPix += nComponents) {
+                // the weight of the source frame at this pixel
+                float weight;
+                if (_filter == eFilterNearest) {
+                    weight = ( (int)std::floor(*t + 0.5f) == _srcTime ) ? 1.f : 0.f;
+                } else {
+                    const int t0 = (int)std::floor(*t);
+                    const float alpha = *t - t0;
+                    weight = (t0 == _srcTime) ? (1.f - alpha) : ( (t0 + 1 == _srcTime) ? alpha : 0.f );
+                }
+                if ( (weight == 0.f) || !srcRow || (x < _srcBounds.x1) || (_srcBounds.x2 <= x) ) {
+                    // outside of the source image, the source is black
+                    continue;
+                }
+                const PIX *srcPix = srcRow + (x - _srcBounds.x1) * nComponents;
+                for (int c = 0; c < nComponents; ++c) {
+                    accPix[c] += weight * srcPix[c];
+                }
+            }
+        }
+    }
+};
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -188,6 +386,10 @@ protected:
     OFX::BooleanParam *_retimeAbsolute;
     OFX::Int2DParam *_frameRange;
     OFX::ChoiceParam *_filter;   /**< @brief how images are interpolated (or not). */
+    OFX::BooleanParam *_cacheFrames;
+    Mutex _frameCacheMutex; // protects _frameCache and _frameCacheBytes
+    SlitScanFrameCache _frameCache; // the input frames kept between renders
+    std::size_t _frameCacheBytes; // the memory used by _frameCache
 
 public:
     /** @brief ctor */
@@ -202,6 +404,10 @@ public:
         , _retimeAbsolute(0)
         , _frameRange(0)
         , _filter(0)
+        , _cacheFrames(0)
+        , _frameCacheMutex()
+        , _frameCache()
+        , _frameCacheBytes(0)
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         _srcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
@@ -214,22 +420,45 @@ public:
         _frameRange = fetchInt2DParam(kParamFrameRange);
         _filter = fetchChoiceParam(kParamFilter);
         assert(_retimeFunction && _retimeOffset && _retimeGain && _retimeAbsolute && _frameRange && _filter);
+        _cacheFrames = fetchBooleanParam(kParamCacheFrames);
+        assert(_cacheFrames);
+    }
+
+    virtual ~SlitScanPlugin()
+    {
+        clearFrameCache();
     }
 
 private:
     /* Override the render */
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
 
-    //template <int nComponents>
-    //void renderInternal(const OFX::RenderArguments &args, double sourceTime, FilterEnum filter, OFX::BitDepthEnum dstBitDepth);
+    template <int nComponents>
+    void renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderForBitDepth(const OFX::RenderArguments &args);
 
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+    virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+    virtual void purgeCaches() OVERRIDE FINAL;
+    virtual void beginSequenceRender(const OFX::BeginSequenceRenderArguments &args) OVERRIDE FINAL;
+    virtual void endSequenceRender(const OFX::EndSequenceRenderArguments &args) OVERRIDE FINAL;
+
+    // the range of input frames that may be used to render the given time
+    void getFrameRange(double time, double *tmin, double *tmax);
 
-    /* set up and run a processor */
-    //void setupAndProcess(OFX::SlitScanerBase &, const OFX::RenderArguments &args, double sourceTime, FilterEnum filter);
+    // find a cached frame fetched with the same properties, that covers the render window. _frameCacheMutex must be locked.
+    const SlitScanFrame* findFrame(int t, const OFX::RenderArguments &args, const OfxRectI &window, OFX::PixelComponentEnum components, OFX::BitDepthEnum bitDepth) const;
+
+    // copy an input frame to the cache, evicting the frames farthest from [tmin, tmax] if necessary. _frameCacheMutex must be locked.
+    void storeFrame(int t, const OFX::RenderArguments &args, const OfxRectI &window, const OFX::Image &src, int pixelBytes, int tmin, int tmax);
+
+    void clearFrameCache();
 };
 
 
@@ -261,7 +490,20 @@ SlitScanPlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
     if (!_srcClip) {
         return;
     }
-    const double time = args.time;
+    double tmin, tmax;
+    getFrameRange(args.time, &tmin, &tmax);
+
+    OfxRangeD range;
+    range.min = tmin;
+    range.max = tmax;
+    frames.setFramesNeeded(*_srcClip, range);
+}
+
+void
+SlitScanPlugin::getFrameRange(double time,
+                              double *tmin_,
+                              double *tmax_)
+{
     double tmin, tmax;
     bool retimeAbsolute;
     _retimeAbsolute->getValueAtTime(time, retimeAbsolute);
@@ -295,11 +537,8 @@ SlitScanPlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
             tmax = std::ceil(tmax);
         }
     }
-
-    OfxRangeD range;
-    range.min = tmin;
-    range.max = tmax;
-    frames.setFramesNeeded(*_srcClip, range);
+    *tmin_ = tmin;
+    *tmax_ = tmax;
 }
 
 bool
@@ -377,17 +616,141 @@ SlitScanPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &ar
     return false;
 }
 
-#if 0
-/* set up and run a processor for a standard horizontal slit scan with linear time interpolation */
 void
-SlitScanPlugin::setupAndProcessSlitScanLinear(OFX::ImageBlenderBase &processor,
-                                              const OFX::RenderArguments &args,
-                                              double sourceTime,
-                                              FilterEnum filter)
+SlitScanPlugin::changedParam(const OFX::InstanceChangedArgs &args,
+                             const std::string &paramName)
+{
+    if ( ( (paramName == kParamClearCache) && (args.reason == OFX::eChangeUserEdit) ) ||
+         ( (paramName == kParamCacheFrames) && !_cacheFrames->getValueAtTime(args.time) ) ) {
+        clearFrameCache();
+    }
+}
+
+void
+SlitScanPlugin::changedClip(const OFX::InstanceChangedArgs & /*args*/,
+                            const std::string &clipName)
+{
+    if (clipName == kOfxImageEffectSimpleSourceClipName) {
+        clearFrameCache();
+    }
+}
+
+void
+SlitScanPlugin::purgeCaches()
+{
+    clearFrameCache();
+}
+
+// the frames are only reused within a sequence render, since changes upstream cannot be detected
+void
+SlitScanPlugin::beginSequenceRender(const OFX::BeginSequenceRenderArguments & /*args*/)
+{
+    clearFrameCache();
+}
+
+void
+SlitScanPlugin::endSequenceRender(const OFX::EndSequenceRenderArguments & /*args*/)
+{
+    clearFrameCache();
+}
+
+void
+SlitScanPlugin::clearFrameCache()
+{
+    AutoMutex guard(_frameCacheMutex);
+
+    for (SlitScanFrameCache::iterator it = _frameCache.begin(); it != _frameCache.end(); ++it) {
+        releasePixels(it->second.pixels);
+    }
+    _frameCache.clear();
+    _frameCacheBytes = 0;
+}
+
+const SlitScanFrame*
+SlitScanPlugin::findFrame(int t,
+                          const OFX::RenderArguments &args,
+                          const OfxRectI &window,
+                          OFX::PixelComponentEnum components,
+                          OFX::BitDepthEnum bitDepth) const
+{
+    SlitScanFrameCache::const_iterator it = _frameCache.find(t);
+
+    if ( it == _frameCache.end() ) {
+        return NULL;
+    }
+    const SlitScanFrame &frame = it->second;
+    if ( (frame.renderScale.x != args.renderScale.x) || (frame.renderScale.y != args.renderScale.y) ||
+         (frame.field != args.fieldToRender) ||
+         (frame.pixelComponents != components) || (frame.bitDepth != bitDepth) ||
+         (window.x1 < frame.window.x1) || (frame.window.x2 < window.x2) ||
+         (window.y1 < frame.window.y1) || (frame.window.y2 < window.y2) ) {
+        return NULL;
+    }
+
+    return &frame;
+}
+
+void
+SlitScanPlugin::storeFrame(int t,
+                           const OFX::RenderArguments &args,
+                           const OfxRectI &window,
+                           const OFX::Image &src,
+                           int pixelBytes,
+                           int tmin,
+                           int tmax)
+{
+    const OfxRectI &bounds = src.getBounds();
+    const int rowBytes = (bounds.x2 - bounds.x1) * pixelBytes;
+    const std::size_t bytes = (std::size_t)rowBytes * (bounds.y2 - bounds.y1);
+
+    // remove the previous version of this frame
+    SlitScanFrameCache::iterator it = _frameCache.find(t);
+    if ( it != _frameCache.end() ) {
+        _frameCacheBytes -= it->second.pixels->data.size();
+        releasePixels(it->second.pixels);
+        _frameCache.erase(it);
+    }
+    // make room by evicting the frames farthest from [tmin, tmax], unless the new frame is farther
+    const int distance = (t < tmin) ? (tmin - t) : ( (t > tmax) ? (t - tmax) : 0 );
+    while ( !_frameCache.empty() && (_frameCacheBytes + bytes > kFrameCacheMaxBytes) ) {
+        // the farthest frame is either the first or the last one
+        SlitScanFrameCache::iterator first = _frameCache.begin();
+        SlitScanFrameCache::iterator last = --_frameCache.end();
+        const int firstDistance = std::max(0, tmin - first->first);
+        const int lastDistance = std::max(0, last->first - tmax);
+        SlitScanFrameCache::iterator farthest = (firstDistance >= lastDistance) ? first : last;
+        if ( std::max(firstDistance, lastDistance) <= distance ) {
+            return;
+        }
+        _frameCacheBytes -= farthest->second.pixels->data.size();
+        releasePixels(farthest->second.pixels);
+        _frameCache.erase(farthest);
+    }
+    if (_frameCacheBytes + bytes > kFrameCacheMaxBytes) {
+        return;
+    }
+    SlitScanFrame &frame = _frameCache[t];
+    frame.renderScale = args.renderScale;
+    frame.field = args.fieldToRender;
+    frame.window = window;
+    frame.bounds = bounds;
+    frame.pixelComponents = src.getPixelComponents();
+    frame.bitDepth = src.getPixelDepth();
+    frame.rowBytes = rowBytes;
+    frame.pixels = new SlitScanPixels;
+    frame.pixels->data.resize(bytes);
+    for (int y = bounds.y1; y < bounds.y2; ++y) {
+        std::memcpy(&frame.pixels->data[(std::size_t)(y - bounds.y1) * rowBytes], src.getPixelAddress(bounds.x1, y), rowBytes);
+    }
+    _frameCacheBytes += bytes;
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+SlitScanPlugin::renderForBitDepth(const OFX::RenderArguments &args)
 {
     const double time = args.time;
-    // get a dst image
-    std::auto_ptr<OFX::Image>  dst( _dstClip->fetchImage(time) );
+    std::auto_ptr<OFX::Image> dst( _dstClip->fetchImage(time) );
 
     if ( !dst.get() ) {
         OFX::throwSuiteStatusException(kOfxStatFailed);
@@ -405,113 +768,187 @@ SlitScanPlugin::setupAndProcessSlitScanLinear(OFX::ImageBlenderBase &processor,
         setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
-
-    // TODO: loop over lines
-    if ( (sourceTime == (int)sourceTime) || (filter == eFilterNone) || (filter == eFilterNearest) ) {
-        // should have been caught by isIdentity...
-        std::auto_ptr<const OFX::Image> src( ( _srcClip && _srcClip->isConnected() ) ?
-                                             _srcClip->fetchImage(sourceTime) : 0 );
-        if ( src.get() ) {
-            if ( (src->getRenderScale().x != args.renderScale.x) ||
-                 ( src->getRenderScale().y != args.renderScale.y) ||
-                 ( ( src->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( src->getField() != args.fieldToRender) ) ) {
-                setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                OFX::throwSuiteStatusException(kOfxStatFailed);
-            }
-            OFX::BitDepthEnum srcBitDepth      = src->getPixelDepth();
-            OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
-            if ( (srcBitDepth != dstBitDepth) || (srcComponents != dstComponents) ) {
-                OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
-            }
-        }
-        copyPixels( *this, args.renderWindow, src.get(), dst.get() );
-
+    OfxRectI window;
+    if ( !OFX::Coords::rectIntersection(args.renderWindow, dst->getBounds(), &window) ) {
         return;
     }
+    const int w = window.x2 - window.x1;
+    const int h = window.y2 - window.y1;
 
-    // figure the two images we are blending between
-    double fromTime, toTime;
-    double blend;
-    framesNeeded(sourceTime, args.fieldToRender, &fromTime, &toTime, &blend);
-
-    // fetch the two source images
-    std::auto_ptr<OFX::Image> fromImg( ( _srcClip && _srcClip->isConnected() ) ?
-                                       _srcClip->fetchImage(fromTime) : 0 );
-    std::auto_ptr<OFX::Image> toImg( ( _srcClip && _srcClip->isConnected() ) ?
-                                     _srcClip->fetchImage(toTime) : 0 );
-
-    // make sure bit depths are sane
-    if ( fromImg.get() ) {
-        if ( (fromImg->getRenderScale().x != args.renderScale.x) ||
-             ( fromImg->getRenderScale().y != args.renderScale.y) ||
-             ( ( fromImg->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( fromImg->getField() != args.fieldToRender) ) ) {
+    RetimeFunctionEnum retimeFunction = (RetimeFunctionEnum)_retimeFunction->getValueAtTime(time);
+    double retimeOffset, retimeGain;
+    _retimeOffset->getValueAtTime(time, retimeOffset);
+    _retimeGain->getValueAtTime(time, retimeGain);
+    bool retimeAbsolute;
+    _retimeAbsolute->getValueAtTime(time, retimeAbsolute);
+    FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+    bool cacheFrames = _cacheFrames->getValueAtTime(time);
+    double tmin, tmax;
+    getFrameRange(time, &tmin, &tmax);
+
+    // the retime function, as a map (Retime Map) or a ramp (slits)
+    std::auto_ptr<const OFX::Image> retimeMap( ( (retimeFunction == eRetimeFunctionRetimeMap) && _retimeMapClip && _retimeMapClip->isConnected() ) ?
+                                               _retimeMapClip->fetchImage(time) : 0 );
+    if ( retimeMap.get() ) {
+        if ( (retimeMap->getRenderScale().x != args.renderScale.x) ||
+             ( retimeMap->getRenderScale().y != args.renderScale.y) ||
+             ( ( retimeMap->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( retimeMap->getField() != args.fieldToRender) ) ) {
             setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
             OFX::throwSuiteStatusException(kOfxStatFailed);
         }
-        checkComponents(*fromImg, dstBitDepth, dstComponents);
+        if ( (retimeMap->getPixelDepth() != dstBitDepth) || (retimeMap->getPixelComponents() != OFX::ePixelComponentAlpha) ) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
     }
-    if ( toImg.get() ) {
-        if ( (toImg->getRenderScale().x != args.renderScale.x) ||
-             ( toImg->getRenderScale().y != args.renderScale.y) ||
-             ( ( toImg->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( toImg->getField() != args.fieldToRender) ) ) {
-            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-            OFX::throwSuiteStatusException(kOfxStatFailed);
+    OfxRectI rodPixel;
+    OFX::Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(time), args.renderScale, _dstClip->getPixelAspectRatio(), &rodPixel);
+
+    // compute the source time of each pixel, and the part of the render window that uses each input frame
+    const int frameMin = (int)std::floor(tmin);
+    const int frameMax = (int)std::ceil(tmax);
+    std::vector<OfxRectI> frameWindow(frameMax - frameMin + 1);
+    for (std::size_t i = 0; i < frameWindow.size(); ++i) {
+        frameWindow[i].x1 = frameWindow[i].y1 = INT_MAX;
+        frameWindow[i].x2 = frameWindow[i].y2 = INT_MIN;
+    }
+    std::vector<float> timeMap( (std::size_t)w * h );
+    for (int y = window.y1; y < window.y2; ++y) {
+        float *t = &timeMap[(std::size_t)(y - window.y1) * w];
+        for (int x = window.x1; x < window.x2; ++x, ++t) {
+            double value = 0.;
+            switch (retimeFunction) {
+            case eRetimeFunctionHorizontalSlit:
+                if (rodPixel.y2 - rodPixel.y1 > 1) {
+                    value = (y - rodPixel.y1) / (double)(rodPixel.y2 - rodPixel.y1 - 1);
+                }
+                break;
+            case eRetimeFunctionVerticalSlit:
+                if (rodPixel.x2 - rodPixel.x1 > 1) {
+                    value = (x - rodPixel.x1) / (double)(rodPixel.x2 - rodPixel.x1 - 1);
+                }
+                break;
+            case eRetimeFunctionRetimeMap: {
+                const PIX *mapPix = (const PIX *) (retimeMap.get() ? retimeMap->getPixelAddress(x, y) : 0);
+                if (mapPix) {
+                    value = *mapPix / (double)maxValue;
+                }
+                break;
+            }
+            }
+            double st = retimeOffset + retimeGain * value;
+            if (!retimeAbsolute) {
+                st += time;
+            }
+            st = std::max( tmin, std::min(st, tmax) );
+            *t = (float)st;
+            // the frames used by this pixel
+            int f0, f1;
+            if (filter == eFilterNearest) {
+                f0 = f1 = (int)std::floor(*t + 0.5f);
+            } else {
+                f0 = (int)std::floor(*t);
+                f1 = (*t == f0) ? f0 : (f0 + 1);
+            }
+            for (int f = std::max(f0, frameMin); f <= std::min(f1, frameMax); ++f) {
+                OfxRectI &r = frameWindow[f - frameMin];
+                r.x1 = std::min(r.x1, x);
+                r.x2 = std::max(r.x2, x + 1);
+                r.y1 = std::min(r.y1, y);
+                r.y2 = std::max(r.y2, y + 1);
+            }
         }
-        checkComponents(*toImg, dstBitDepth, dstComponents);
     }
 
-    // set the images
+    // accumulate the contribution of each input frame, fetching each frame only once
+    std::vector<float> accum( (std::size_t)w * h * nComponents, 0.f );
+    SlitScanProcessor<PIX, nComponents, maxValue> processor(*this);
     processor.setDstImg( dst.get() );
-    processor.setFromImg( fromImg.get() );
-    processor.setToImg( toImg.get() );
-
-    // set the render window
-    processor.setRenderWindow(args.renderWindow);
-
-    // set the blend between
-    processor.setBlend( (float)blend );
+    processor.setTimeMap(&timeMap[0], &accum[0], window, filter);
+    if (!cacheFrames) {
+        clearFrameCache();
+    }
+    for (int f = frameMin; f <= frameMax; ++f) {
+        const OfxRectI &r = frameWindow[f - frameMin];
+        if ( (r.x1 >= r.x2) || (r.y1 >= r.y2) ) {
+            continue;
+        }
+        if ( abort() ) {
+            return;
+        }
+        if (cacheFrames) {
+            // take a reference to the cached pixels, so that the cache is not locked during the processing
+            SlitScanFrame frame;
+            {
+                AutoMutex guard(_frameCacheMutex);
+                const SlitScanFrame *cached = findFrame(f, args, window, dstComponents, dstBitDepth);
+                if (cached) {
+                    frame = *cached;
+                    ++frame.pixels->refCount;
+                }
+            }
+            if (frame.pixels) {
+                SlitScanPixelsRef ref(_frameCacheMutex, frame.pixels);
+                processor.setSrc(&frame.pixels->data[0], frame.bounds, frame.rowBytes, f);
+                processor.setRenderWindow(r);
+                processor.process();
+                continue;
+            }
+        }
+        std::auto_ptr<const OFX::Image> src( ( _srcClip && _srcClip->isConnected() ) ?
+                                             _srcClip->fetchImage(f) : 0 );
+        if ( !src.get() ) {
+            continue; // black
+        }
+        if ( (src->getRenderScale().x != args.renderScale.x) ||
+             ( src->getRenderScale().y != args.renderScale.y) ||
+             ( ( src->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( src->getField() != args.fieldToRender) ) ) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        checkComponents(*src, dstBitDepth, dstComponents);
+        const OfxRectI &srcBounds = src->getBounds();
+        if ( (srcBounds.x1 < srcBounds.x2) && (srcBounds.y1 < srcBounds.y2) ) {
+            processor.setSrc(src->getPixelAddress(srcBounds.x1, srcBounds.y1), srcBounds, src->getRowBytes(), f);
+            processor.setRenderWindow(r);
+            processor.process();
+            if (cacheFrames) {
+                AutoMutex guard(_frameCacheMutex);
+                storeFrame(f, args, window, *src, nComponents * sizeof(PIX), frameMin, frameMax);
+            }
+        }
+        // the input image is released here, so that the host may reuse its memory
+    }
 
-    // Call the base class process member, this will call the derived templated process code
+    // write the result
+    processor.setSrc(0, window, 0, 0);
+    processor.setRenderWindow(window);
     processor.process();
-} // SlitScanPlugin::setupAndProcessSlitScanLinear
-
-// the internal render function for a standard horizontal slit scan with linear time interpolation
+} // SlitScanPlugin::renderForBitDepth
 
 template <int nComponents>
 void
-SlitScanPlugin::renderInternalSlitScanLinear(const OFX::RenderArguments &args,
-                                             double sourceTime,
-                                             FilterEnum filter,
-                                             OFX::BitDepthEnum dstBitDepth)
+SlitScanPlugin::renderForComponents(const OFX::RenderArguments &args,
+                                    OFX::BitDepthEnum dstBitDepth)
 {
     switch (dstBitDepth) {
-    case OFX::eBitDepthUByte: {
-        OFX::ImageBlender<unsigned char, nComponents> fred(*this);
-        setupAndProcess(fred, args, sourceTime, filter);
+    case OFX::eBitDepthUByte:
+        renderForBitDepth<unsigned char, nComponents, 255>(args);
         break;
-    }
-    case OFX::eBitDepthUShort: {
-        OFX::ImageBlender<unsigned short, nComponents> fred(*this);
-        setupAndProcess(fred, args, sourceTime, filter);
+    case OFX::eBitDepthUShort:
+        renderForBitDepth<unsigned short, nComponents, 65535>(args);
         break;
-    }
-    case OFX::eBitDepthFloat: {
-        OFX::ImageBlender<float, nComponents> fred(*this);
-        setupAndProcess(fred, args, sourceTime, filter);
+    case OFX::eBitDepthFloat:
+        renderForBitDepth<float, nComponents, 1>(args);
         break;
-    }
     default:
         OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
     }
 }
 
-#endif // if 0
-
 // the overridden render function
 void
 SlitScanPlugin::render(const OFX::RenderArguments &args)
 {
-    const double time = args.time;
     // instantiate the render code based on the pixel depth of the dst clip
     OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
     OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
@@ -519,40 +956,16 @@ SlitScanPlugin::render(const OFX::RenderArguments &args)
     assert( kSupportsMultipleClipPARs   || !_srcClip || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio() );
     assert( kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth() );
 
-    RetimeFunctionEnum retimeFunction = (RetimeFunctionEnum)_retimeFunction->getValueAtTime(time);
-#if 0
-
-    if ( _retimeMapClip && _retimeMapClip->isConnected() ) {
-#pragma message WARN("TODO")
-        OFX::throwSuiteStatusException(kOfxStatFailed);
-
-        return;
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        renderForComponents<4>(args, dstBitDepth);
+    } else if (dstComponents == OFX::ePixelComponentRGB) {
+        renderForComponents<3>(args, dstBitDepth);
+    } else if (dstComponents == OFX::ePixelComponentXY) {
+        renderForComponents<2>(args, dstBitDepth);
     } else {
-        FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
-
-        switch (filter) {
-        case eFilterNearest:
-#pragma message WARN("TODO")
-            OFX::throwSuiteStatusException(kOfxStatFailed);
-            break;
-        case eFilterLinear:
-            // do the rendering
-            if (dstComponents == OFX::ePixelComponentRGBA) {
-                renderInternalSlitScanHorizontal<4>(args, dstBitDepth);
-            } else if (dstComponents == OFX::ePixelComponentRGB) {
-                renderInternalSlitScanLinear<3>(args, dstBitDepth);
-            } else if (dstComponents == OFX::ePixelComponentXY) {
-                renderInternalSlitScanLinear<2>(args, dstBitDepth);
-            } else {
-                assert(dstComponents == OFX::ePixelComponentAlpha);
-                renderInternalSlitScanLinear<1>(args, dstBitDepth);
-            }
-            break;
-        }
+        assert(dstComponents == OFX::ePixelComponentAlpha);
+        renderForComponents<1>(args, dstBitDepth);
     }
-#else
-    OFX::throwSuiteStatusException(kOfxStatFailed);
-#endif
 }
 
 mDeclarePluginFactory(SlitScanPluginFactory,; , {});
@@ -706,6 +1119,25 @@ SlitScanPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamCacheFrames);
+        param->setLabel(kParamCacheFramesLabel);
+        param->setHint(kParamCacheFramesHint);
+        param->setDefault(kParamCacheFramesDefault);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamClearCache);
+        param->setLabel(kParamClearCacheLabel);
+        param->setHint(kParamClearCacheHint);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 } // SlitScanPluginFactory::describeInContext
 
 /** @brief The create instance function, the plugin must return an object derived from the \ref OFX::ImageEffect class */
@@ -721,5 +1153,3 @@ mRegisterPluginFactoryInstance(p)
 
 OFXS_NAMESPACE_ANONYMOUS_EXIT
 
-#endif // ifdef DEBUG
-
@@ -24,6 +24,7 @@
 #include <climits> // for INT_MAX
 #include <cassert>
 #include <algorithm>
+#include <vector>
 #ifdef DEBUG
 #include <cstdio>
 #endif
@@ -51,7 +52,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -110,13 +111,53 @@ public:
 
 private:
 
+    // add a row of source pixels to a row of the accumulator.
+    // n is the number of values (pixels * nComponents): this loop is easily vectorized by the compiler.
+    static void accumulateRow(float *acc,
+                              const PIX *src,
+                              int n)
+    {
+        for (int i = 0; i < n; ++i) {
+            acc[i] += src[i];
+        }
+    }
+
+    // compute a row of the output image from a row of the accumulator
+    static void normalizeRow(const float *acc,
+                             float scale,
+                             PIX *dst,
+                             int n)
+    {
+        for (int i = 0; i < n; ++i) {
+            dst[i] = ofxsClampIfInt<PIX, maxValue>(acc[i] * scale, 0, maxValue);
+        }
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow)
     {
         assert(1 <= nComponents && nComponents <= 4);
         assert(!_divisions || _dstPixelData);
-        float tmpPix[nComponents];
-        const float initVal = 0.;
         const bool lastPass = (_divisions != 0);
+        const int rowSize = (procWindow.x2 - procWindow.x1) * nComponents;
+        if (rowSize <= 0) {
+            return;
+        }
+        // the accumulator row, if there is no accumulator image
+        std::vector<float> tmpRow(_accumulatorData ? 0 : rowSize);
+        // the part of each row covered by each source image
+        std::vector<int> srcX1( _srcImgs.size() );
+        std::vector<int> srcX2( _srcImgs.size() );
+        for (unsigned i = 0; i < _srcImgs.size(); ++i) {
+            if (_srcImgs[i]) {
+                const OfxRectI &srcBounds = _srcImgs[i]->getBounds();
+                srcX1[i] = std::max(procWindow.x1, srcBounds.x1);
+                srcX2[i] = std::min(procWindow.x2, srcBounds.x2);
+            } else {
+                srcX1[i] = srcX2[i] = procWindow.x1;
+            }
+        }
+        const float scale = lastPass ? 1.f / _divisions : 1.f;
+
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if ( _effect.abort() ) {
                 break;
@@ -129,37 +170,29 @@ private:
                 continue;
             }
 
-            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+            // the accumulator row, starting at procWindow.x1
+            float *acc;
+            if (_accumulatorData) {
                 size_t renderPix = ( (_renderWindow.x2 - _renderWindow.x1) * (y - _renderWindow.y1) +
-                                     (x - _renderWindow.x1) );
-                if (_accumulatorData) {
-                    std::copy(&_accumulatorData[renderPix * nComponents], &_accumulatorData[renderPix * nComponents + nComponents], tmpPix);
-                } else {
-                    std::fill(tmpPix, tmpPix + nComponents, initVal);
-                }
-                // accumulate
-                for (unsigned i = 0; i < _srcImgs.size(); ++i) {
-                    const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
-                    if (srcPixi) {
-                        for (int c = 0; c < nComponents; ++c) {
-                            tmpPix[c] += srcPixi[c];
-                        }
-                    }
+                                     (procWindow.x1 - _renderWindow.x1) );
+                acc = &_accumulatorData[renderPix * nComponents];
+            } else {
+                acc = &tmpRow[0];
+                std::fill(acc, acc + rowSize, 0.f);
+            }
+            // accumulate
+            for (unsigned i = 0; i < _srcImgs.size(); ++i) {
+                if (srcX1[i] >= srcX2[i]) {
+                    continue;
                 }
-                if (!lastPass) {
-                    assert(_accumulatorData);
-                    if (_accumulatorData) {
-                        std::copy(tmpPix, tmpPix + nComponents, &_accumulatorData[renderPix * nComponents]);
-                    }
-                } else {
-                    for (int c = 0; c < nComponents; ++c) {
-                        float v = tmpPix[c] / _divisions;
-                        dstPix[c] = ofxsClampIfInt<PIX, maxValue>(v, 0, maxValue);
-                    }
-                    // increment the dst pixel
-                    dstPix += nComponents;
+                const PIX *srcPix = (const PIX *) _srcImgs[i]->getPixelAddress(srcX1[i], y);
+                if (srcPix) {
+                    accumulateRow(acc + (srcX1[i] - procWindow.x1) * nComponents, srcPix, (srcX2[i] - srcX1[i]) * nComponents);
                 }
             }
+            if (lastPass) {
+                normalizeRow(acc, scale, dstPix, rowSize);
+            }
         }
     } // multiThreadProcessImages
 };
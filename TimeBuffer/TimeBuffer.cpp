@@ -22,10 +22,19 @@
 
 #include <cmath>
 #include <cfloat> // DBL_MAX
+#include <climits> // INT_MAX
+#include <limits>
 #include <algorithm>
+#include <map>
+#include <sstream>
+#include <iomanip>
 //#include <iostream>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#include <cerrno>
 #endif
 #ifdef DEBUG
 #include <iostream>
@@ -73,8 +82,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping "Time"
 // History:
 // version 1.0: initial version
+// version 1.1: double-buffered, wait for the write using a condition variable instead of polling
+// version 1.2: history of several frames (History Depth, Delay), Info dialog
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTilesRead 0
 #define kSupportsTilesWrite 0
@@ -100,6 +111,21 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStartFrameLabel "Start Frame"
 #define kParamStartFrameHint "First frame of the effect. TimeBufferRead outputs a black and transparent image for this frame and all frames before. The size of the black image is either the size of the Source clip, or the project size if it is not connected."
 
+#define kParamHistoryDepth "historyDepth"
+#define kParamHistoryDepthLabel "History Depth"
+#define kParamHistoryDepthHint \
+    "Number of past frames retained in the buffer. The TimeBufferRead effect with the same buffer name can output any of them, using its \"Delay\" parameter.\n" \
+    "Each retained frame uses the memory of a full image, which is reported by the \"Info...\" button."
+#define kParamHistoryDepthDefault 1
+#define kParamHistoryDepthMax 1000
+
+#define kParamDelay "delay"
+#define kParamDelayLabel "Delay"
+#define kParamDelayHint \
+    "Number of frames between the frame written by TimeBufferWrite and the frame output by TimeBufferRead. 1 outputs the image written at the previous frame.\n" \
+    "It must not be larger than the \"History Depth\" of the corresponding TimeBufferWrite effect."
+#define kParamDelayDefault 1
+
 #define kParamUnorderedRender "unorderedRender"
 #define kParamUnorderedRenderLabel "Unordered Render"
 #define kParamUnorderedRenderHint \
@@ -130,28 +156,141 @@ enum UnorderedRenderEnum
 
 #define kParamInfo "info"
 #define kParamInfoLabel "Info..."
-#define kParamInfoHint "Reset the buffer state."
+#define kParamInfoHint "Give information about all the buffers, and the memory they use."
+
+#define kWaitSliceMs 50 // abort() is checked at least this often (in ms) while waiting for the write
 
-inline void
-sleep(const unsigned int milliseconds)
+/*
+   A condition that can be waited for with a time-out.
+   There are no condition variables in the multithread suite, so we use the native ones.
+   Each notification increments a generation counter, so that a waiter that read the counter
+   before unlocking the buffer mutex cannot miss a notification.
+ */
+class TimeBufferCondition
 {
+public:
+    TimeBufferCondition()
+        : _generation(0)
+    {
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
-    Sleep(milliseconds);
+        InitializeCriticalSection(&_mutex);
+        InitializeConditionVariable(&_cond);
 #else
-    struct timespec tv;
-    tv.tv_sec = milliseconds / 1000;
-    tv.tv_nsec = (milliseconds % 1000) * 1000000;
-    nanosleep(&tv, 0);
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_cond, NULL);
 #endif
-}
+    }
+
+    ~TimeBufferCondition()
+    {
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+        DeleteCriticalSection(&_mutex);
+#else
+        pthread_cond_destroy(&_cond);
+        pthread_mutex_destroy(&_mutex);
+#endif
+    }
+
+    unsigned int generation()
+    {
+        lock();
+        unsigned int generation = _generation;
+        unlock();
+
+        return generation;
+    }
+
+    void notifyAll()
+    {
+        lock();
+        ++_generation;
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+        WakeAllConditionVariable(&_cond);
+#else
+        pthread_cond_broadcast(&_cond);
+#endif
+        unlock();
+    }
+
+    // wait until a notification after the given generation, or until milliseconds have elapsed.
+    // return true if a notification was received.
+    bool waitFor(unsigned int generation,
+                 unsigned int milliseconds)
+    {
+        lock();
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+        DWORD start = GetTickCount();
+        while (_generation == generation) {
+            DWORD elapsed = GetTickCount() - start;
+            if ( (elapsed >= milliseconds) ||
+                 !SleepConditionVariableCS(&_cond, &_mutex, milliseconds - elapsed) ) {
+                break;
+            }
+        }
+#else
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        struct timespec deadline;
+        deadline.tv_sec = now.tv_sec + milliseconds / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000 + (milliseconds % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (_generation == generation) {
+            if (pthread_cond_timedwait(&_cond, &_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+#endif
+        bool notified = (_generation != generation);
+        unlock();
+
+        return notified;
+    }
+
+private:
+    void lock()
+    {
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+        EnterCriticalSection(&_mutex);
+#else
+        pthread_mutex_lock(&_mutex);
+#endif
+    }
+
+    void unlock()
+    {
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+        LeaveCriticalSection(&_mutex);
+#else
+        pthread_mutex_unlock(&_mutex);
+#endif
+    }
+
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    CRITICAL_SECTION _mutex;
+    CONDITION_VARIABLE _cond;
+#else
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+#endif
+    unsigned int _generation;
+};
 
 /*
    We maintain a global map from the buffer name to the buffer data.
 
    The buffer data contains:
-   - an image buffers stored with its valid read time (which is the write time +1), or an invalid date
+   - the valid read time (which is the last write time +1), or an invalid date
+   - a ring of History Depth+1 image slots, indexed by the write time modulo History Depth+1: the last History Depth written images are retained, and the remaining slot is filled by the next write. The image data of each slot is reference-counted: it is shared by the slot and by the renders that copy from or to it, so that resetting the buffer or changing its history depth never frees data that is being copied. The data of a slot is allocated when the slot is first written, and reused by the next writes if it is not being read.
    - the pointer to the read and the write instances, which should be unique, or NULL if it is not yet created.
 
+   The buffer mutex is only held to check and update the buffer state, never while copying images:
+   TimeBufferWrite copies the image to the data of its slot, then publishes the slot and notifies the condition,
+   on which TimeBufferRead waits. TimeBufferRead takes a copy of the slot of the image written at t-Delay
+   and a reference to its data while the mutex is locked, then copies the image from the data.
+
 
    When TimeBufferReadPlugin::render(t) is called:
  * if the write instance does not exist, an error is displayed and render fails
@@ -160,9 +299,9 @@ sleep(const unsigned int milliseconds)
    - if t == startTime, the buffer is locked and marked as dirty, with date t+1, then unlocked
  * if t > startTime:
    - the buffer is locked, and if it doesn't have date t, then either the render fails, a black image is rendered, or the buffer is used anyway, depending on the user-chosen strategy
-   - if it is marked as dirty, it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-   - when the buffer is locked and clean, it is copied to output and unlocked
-   - the buffer is re-locked for writing, and marked as dirty, with date t+1, then unlocked
+   - if it is marked as dirty, it is unlocked, and we wait until TimeBufferWrite publishes an image or the time-out expires. abort() is checked at least every 50ms.
+   - when the buffer is clean, the slot of the image written at t-Delay and a reference to its data are taken, the buffer is unlocked, and the image is copied to output (TimeBufferWrite does not write while the buffer is clean). If t-Delay < startTime, a black image is rendered. If the image is not retained, either the render fails, a black image is rendered, or the last written image is used, depending on the user-chosen strategy
+   - the buffer is re-locked, and marked as dirty, with date t+1, then unlocked
 
    When TimeBufferReadPlugin::getRegionOfDefinition(t) is called:
  * if the write instance does not exist, an error is displayed and render fails
@@ -170,21 +309,23 @@ sleep(const unsigned int milliseconds)
    - the RoD is empty
  * if t > startTime:
    - the buffer is locked, and if it doesn't have date t, then either getRoD fails, a black image with an empty RoD is rendered, or the RoD from buffer is used anyway, depending on the user-chosen strategy
-   - if it is marked as dirty ,it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-   - when the buffer is locked and clean, the buffer's RoD is returned and it is unlocked
+   - if it is marked as dirty, it is unlocked, and we wait until TimeBufferWrite publishes an image or the time-out expires. abort() is checked at least every 50ms.
+   - when the buffer is locked and clean, the RoD of the image written at t-Delay is returned and it is unlocked
 
 
    When TimeBufferWritePlugin::render(t) is called:
    - if the read instance does not exist, an error is displayed and render fails
    - if the "Sync" input is not connected, issue an error message (it should be connected to TimeBufferRead)
    - the buffer is locked for writing, and if it doesn't have date t+1 or is not dirty, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
-   - src is copied to the buffer, and it is marked as not dirty, then unlocked
+   - the slot t mod (History Depth+1) is reserved, after changing the number of slots if the history depth changed, and a reference to its data is taken
+   - src is copied to the data, without holding the lock
+   - the buffer is locked, the slot is published with time t (unless the buffer was reset meanwhile), the buffer is marked as not dirty, the condition is notified, and it is unlocked
    - src is also copied to output.
 
 
    There is a "Reset" button both in TimeBufferRead and TimeBufferWrite, which resets the lock and the buffer.
 
-   There is a "Info.." button both in TimeBufferRead and TimeBufferWrite, which gives information about all available buffers.
+   There is a "Info.." button both in TimeBufferRead and TimeBufferWrite, which gives information about all available buffers, and the memory they use.
 
    If we ever need it, a read-write lock can be implemented using two mutexes, as described in
    https://en.wikipedia.org/wiki/Readers%E2%80%93writer_lock#Using_two_mutexes
@@ -192,14 +333,21 @@ sleep(const unsigned int milliseconds)
 
  */
 
-struct TimeBuffer
+// The image data of a slot. It is shared by the slot and the renders that copy from or to it, and is deleted when
+// the last reference is released. refCount is protected by the mutex of the TimeBuffer.
+struct TimeBufferData
 {
-    OFX::ImageEffect *readInstance; // written only once, not protected by mutex
-    OFX::ImageEffect *writeInstance; // written only once, not protected by mutex
-    mutable Mutex mutex;
-    double time; // can store any integer from 0 to 2^53
-    bool dirty; // TimeBufferRead sets this to true and sets date to t+1, TimeBufferWrite sets this to false
-    std::vector<unsigned char> pixelData;
+    std::vector<unsigned char> pixels;
+    int refCount;
+
+    TimeBufferData() : pixels(), refCount(1) {}
+};
+
+// An image stored in a TimeBuffer
+struct TimeBufferSlot
+{
+    double time; // the time the image was written at, or -DBL_MAX if the slot is unused
+    std::size_t bytes; // the size of the image data
     OfxRectI bounds;
     OFX::PixelComponentEnum pixelComponents;
     int pixelComponentCount;
@@ -207,23 +355,228 @@ struct TimeBuffer
     int rowBytes;
     OfxPointD renderScale;
     double par;
+    TimeBufferData *data; // the image data, see TimeBuffer::acquire() and TimeBuffer::release()
 
-    TimeBuffer()
-        : readInstance(0)
-        , writeInstance(0)
-        , mutex()
-        , time(-DBL_MAX)
-        , dirty(true)
-        , pixelData()
+    TimeBufferSlot()
+        : time(-DBL_MAX)
+        , bytes(0)
         , pixelComponents(ePixelComponentNone)
         , pixelComponentCount(0)
         , bitDepth(eBitDepthNone)
         , rowBytes(0)
         , par(1.)
+        , data(0)
     {
+        reset();
+    }
+
+    // reset the image properties, but not the data
+    void reset()
+    {
+        time = -DBL_MAX;
+        bytes = 0;
+        pixelComponents = ePixelComponentNone;
+        pixelComponentCount = 0;
+        bitDepth = eBitDepthNone;
+        rowBytes = 0;
+        par = 1.;
         bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
         renderScale.x = renderScale.y = 1;
     }
+
+    bool empty() const
+    {
+        return (bytes == 0) || (bounds.x1 >= bounds.x2) || (bounds.y1 >= bounds.y2);
+    }
+};
+
+enum WaitResultEnum
+{
+    eWaitResultClean = 0,
+    eWaitResultTimedOut,
+    eWaitResultAborted,
+};
+
+struct TimeBuffer
+{
+    OFX::ImageEffect *readInstance; // written only once, not protected by mutex
+    OFX::ImageEffect *writeInstance; // written only once, not protected by mutex
+    mutable Mutex mutex;
+    TimeBufferCondition written; // notified when TimeBufferWrite publishes an image
+    double time; // can store any integer from 0 to 2^53
+    bool dirty; // TimeBufferRead sets this to true and sets date to t+1, TimeBufferWrite sets this to false
+    double lastWriteTime; // the time of the last written image, or -DBL_MAX
+    std::vector<TimeBufferSlot> slots; // depth+1 slots, the image written at time t is in slot t mod (depth+1)
+
+    TimeBuffer()
+        : readInstance(0)
+        , writeInstance(0)
+        , mutex()
+        , written()
+        , time(-DBL_MAX)
+        , dirty(true)
+        , lastWriteTime(-DBL_MAX)
+        , slots(2)
+    {
+    }
+
+    ~TimeBuffer()
+    {
+        for (std::size_t i = 0; i < slots.size(); ++i) {
+            release(slots[i].data);
+        }
+    }
+
+    int depth() const { return (int)slots.size() - 1; }
+
+    int slotIndex(double t) const
+    {
+        const int n = (int)slots.size();
+        int i = (int)std::fmod(t, (double)n);
+
+        return (i < 0) ? (i + n) : i;
+    }
+
+    // the slot holding the image written at time t, or NULL if it is not retained. mutex must be locked.
+    const TimeBufferSlot* findSlot(double t) const
+    {
+        if (t == -DBL_MAX) {
+            return NULL;
+        }
+        const TimeBufferSlot &slot = slots[slotIndex(t)];
+
+        return (slot.time == t) ? &slot : NULL;
+    }
+
+    // take a reference to image data. mutex must be locked.
+    static TimeBufferData* acquire(TimeBufferData *data)
+    {
+        if (data) {
+            ++data->refCount;
+        }
+
+        return data;
+    }
+
+    // release a reference to image data. mutex must be locked.
+    static void release(TimeBufferData *data)
+    {
+        if (data && --data->refCount == 0) {
+            delete data;
+        }
+    }
+
+    // the memory used by the image data of the slots. mutex must be locked.
+    std::size_t memoryUsed() const
+    {
+        std::size_t bytes = 0;
+
+        for (std::size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].data) {
+                bytes += slots[i].data->pixels.capacity();
+            }
+        }
+
+        return bytes;
+    }
+
+    // the number of retained images. mutex must be locked.
+    int retainedCount() const
+    {
+        int count = 0;
+
+        for (std::size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].time != -DBL_MAX) {
+                ++count;
+            }
+        }
+
+        return count;
+    }
+
+    // change the history depth, keeping the retained images that are still within the history. mutex must be locked.
+    // The data of the other slots is released: it is only freed once the renders that use it have released it.
+    void reallocate(int newDepth)
+    {
+        std::vector<TimeBufferSlot> oldSlots(newDepth + 1);
+
+        slots.swap(oldSlots);
+        for (std::size_t i = 0; i < oldSlots.size(); ++i) {
+            const TimeBufferSlot &old = oldSlots[i];
+            if ( (old.time == -DBL_MAX) || (lastWriteTime - old.time > newDepth) ) {
+                release(old.data);
+                continue;
+            }
+            slots[slotIndex(old.time)] = old;
+        }
+    }
+
+    // reserve the slot for the image written at time t, with bytes of image data, and return a reference to its data.
+    // The data of the slot is allocated on the first write, and reused if no render references it. mutex must be locked.
+    TimeBufferData* reserveSlot(double t,
+                                std::size_t bytes)
+    {
+        TimeBufferSlot &slot = slots[slotIndex(t)];
+
+        slot.reset(); // the slot is not valid while it is being written
+        if (slot.data && (slot.data->refCount > 1) ) {
+            // a render is still copying the previous image
+            release(slot.data);
+            slot.data = 0;
+        }
+        if (!slot.data) {
+            slot.data = new TimeBufferData;
+        }
+        slot.data->pixels.resize(bytes);
+
+        return acquire(slot.data);
+    }
+
+    // reset the buffer to a clean state, and release its memory. mutex must be locked.
+    void reset()
+    {
+        time = -DBL_MAX;
+        dirty = true;
+        lastWriteTime = -DBL_MAX;
+        for (std::size_t i = 0; i < slots.size(); ++i) {
+            release(slots[i].data);
+        }
+        std::vector<TimeBufferSlot>( slots.size() ).swap(slots);
+        written.notifyAll();
+    }
+
+    // wait until the buffer is clean, the time-out (in ms, 0 means infinite) expires, or the render is aborted.
+    // mutex must be locked by guard, and is locked on return.
+    WaitResultEnum waitClean(AutoMutex &guard,
+                             double timeout,
+                             OFX::ImageEffect &effect)
+    {
+        double waited = 0.;
+
+        while (dirty) {
+            if ( (timeout > 0.) && (waited >= timeout) ) {
+                return eWaitResultTimedOut;
+            }
+            unsigned int slice = kWaitSliceMs;
+            if ( (timeout > 0.) && (timeout - waited < slice) ) {
+                slice = (unsigned int)std::ceil(timeout - waited);
+            }
+            // read the generation before unlocking, so that a write that happens meanwhile is not missed
+            unsigned int generation = written.generation();
+            guard.unlock();
+            if ( !written.waitFor(generation, slice) ) {
+                waited += slice;
+            }
+            if ( effect.abort() ) {
+                guard.relock();
+
+                return eWaitResultAborted;
+            }
+            guard.relock();
+        }
+
+        return eWaitResultClean;
+    }
 };
 
 // This is the global map from buffer names to buffers.
@@ -234,6 +587,39 @@ typedef std::map<TimeBufferKey, TimeBuffer*> TimeBufferMap;
 static std::auto_ptr<TimeBufferMap> gTimeBufferMap;
 static std::auto_ptr<Mutex> gTimeBufferMapMutex;
 
+// a description of all the buffers and the memory they use, for the "Info..." button
+static std::string
+getTimeBufferInfo()
+{
+    std::ostringstream oss;
+    std::size_t total = 0;
+    AutoMutex guard( gTimeBufferMapMutex.get() );
+
+    if ( gTimeBufferMap->empty() ) {
+        return "No TimeBuffer exists.";
+    }
+    oss << std::fixed << std::setprecision(1);
+    for (TimeBufferMap::const_iterator it = gTimeBufferMap->begin(); it != gTimeBufferMap->end(); ++it) {
+        const TimeBuffer *timeBuffer = it->second;
+        AutoMutex bufferGuard(timeBuffer->mutex);
+        const std::size_t bytes = timeBuffer->memoryUsed();
+        oss << "Buffer \"" << it->first << "\": history depth " << timeBuffer->depth()
+            << ", " << timeBuffer->retainedCount() << " retained frame(s)"
+            << ", " << bytes / (1024. * 1024.) << " MB";
+        if (!timeBuffer->readInstance) {
+            oss << " (no TimeBufferRead)";
+        }
+        if (!timeBuffer->writeInstance) {
+            oss << " (no TimeBufferWrite)";
+        }
+        oss << '\n';
+        total += bytes;
+    }
+    oss << "Total: " << total / (1024. * 1024.) << " MB";
+
+    return oss.str();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class TimeBufferReadPlugin
@@ -248,6 +634,7 @@ public:
         , _srcClip(0)
         , _bufferName(0)
         , _startFrame(0)
+        , _delay(0)
         , _unorderedRender(0)
         , _timeOut(0)
         , _resetTrigger(0)
@@ -273,17 +660,18 @@ public:
 
         _bufferName = fetchStringParam(kParamBufferName);
         _startFrame = fetchIntParam(kParamStartFrame);
+        _delay = fetchIntParam(kParamDelay);
         _unorderedRender = fetchChoiceParam(kParamUnorderedRender);
         _timeOut = fetchDoubleParam(kParamTimeOut);
         _resetTrigger = fetchBooleanParam(kParamResetTrigger);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
-        assert(_bufferName && _startFrame && _unorderedRender && _sublabel);
+        assert(_bufferName && _startFrame && _delay && _unorderedRender && _sublabel);
 
+        _projectId = getPropertySet().propGetString(kNatronOfxImageEffectPropProjectId, false);
+        _groupId = getPropertySet().propGetString(kNatronOfxImageEffectPropGroupId, false);
         std::string name;
         _bufferName->getValue(name);
         setName(name);
-        _projectId = getPropertySet().propGetString(kNatronOfxImageEffectPropProjectId, false);
-        _groupId = getPropertySet().propGetString(kNatronOfxImageEffectPropGroupId, false);
     }
 
     virtual ~TimeBufferReadPlugin()
@@ -309,13 +697,14 @@ private:
             return;
         }
         std::string key = _projectId + '.' + _groupId + '.' + name;
+        std::string oldKey = _projectId + '.' + _groupId + '.' + _name;
         if ( _buffer && (name != _name) ) {
             _buffer->readInstance = 0; // remove reference to this instance
             if (!_buffer->writeInstance) {
                 // we may free this buffer
                 {
                     AutoMutex guard( gTimeBufferMapMutex.get() );
-                    gTimeBufferMap->erase(_name);
+                    gTimeBufferMap->erase(oldKey);
                 }
                 delete _buffer;
                 _buffer = 0;
@@ -453,6 +842,7 @@ private:
     OFX::Clip *_srcClip;
     OFX::StringParam *_bufferName;
     OFX::IntParam *_startFrame;
+    OFX::IntParam *_delay;
     OFX::ChoiceParam *_unorderedRender;
     OFX::DoubleParam *_timeOut;
     OFX::BooleanParam *_resetTrigger;
@@ -542,36 +932,55 @@ TimeBufferReadPlugin::render(const OFX::RenderArguments &args)
             break;
         }
     }
-    //   - if it is marked as dirty, it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-    int delay = 5; // initial delay, in milliseconds
-    double timeout = _timeOut->getValue();
-    while (timeBuffer->dirty) {
-        guard.unlock();
-        sleep(delay);
-        if ( abort() ) {
+    //   - if it is marked as dirty, it is unlocked, and we wait until TimeBufferWrite publishes an image or the time-out expires. abort() is checked at least every 50ms.
+    switch ( timeBuffer->waitClean( guard, _timeOut->getValue(), *this ) ) {
+    case eWaitResultClean:
+        break;
+    case eWaitResultAborted:
+
+        return;
+    case eWaitResultTimedOut: {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+        case eUnorderedRenderLast:
+            setPersistentMessage(OFX::Message::eMessageError, "", "Timed out");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        case eUnorderedRenderBlack:
+            fillBlack( *this, args.renderWindow, dst.get() );
+            timeBuffer->dirty = true;
+            timeBuffer->time = time + 1;
+
             return;
         }
-        delay *= 2;
-        if (delay > timeout) {
+        break;
+    }
+    }
+    //   - when the buffer is clean, the slot of the image written at t-Delay and a reference to its data are taken, the buffer is unlocked, and the image is copied to output (TimeBufferWrite does not write while the buffer is clean). If t-Delay < startTime, a black image is rendered. If the image is not retained, either the render fails, a black image is rendered, or the last written image is used, depending on the user-chosen strategy
+    const double readTime = time - _delay->getValue();
+    const TimeBufferSlot *slot = NULL;
+    TimeBufferSlot slotCopy;
+    if (readTime >= startFrame) {
+        slot = timeBuffer->findSlot(readTime);
+        if (!slot) {
             UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
             switch (e) {
             case eUnorderedRenderError:
-            case eUnorderedRenderLast:
-                setPersistentMessage(OFX::Message::eMessageError, "", "Timed out");
+                setPersistentMessage(OFX::Message::eMessageError, "", "The image written at frame t-Delay is not retained by the TimeBuffer. Increase the History Depth of the corresponding TimeBufferWrite effect.");
                 OFX::throwSuiteStatusException(kOfxStatFailed);
 
                 return;
             case eUnorderedRenderBlack:
-                fillBlack( *this, args.renderWindow, dst.get() );
-                timeBuffer->dirty = true;
-                timeBuffer->time = time + 1;
-
-                return;
+                break;
+            case eUnorderedRenderLast:
+                slot = timeBuffer->findSlot(timeBuffer->lastWriteTime);
+                break;
             }
         }
-        guard.relock();
     }
-    if ( (args.renderScale.x != timeBuffer->renderScale.x) || (args.renderScale.y != timeBuffer->renderScale.y) ) {
+    if ( slot && ( (args.renderScale.x != slot->renderScale.x) || (args.renderScale.y != slot->renderScale.y) ) ) {
         UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
         switch (e) {
         case eUnorderedRenderError:
@@ -588,16 +997,35 @@ TimeBufferReadPlugin::render(const OFX::RenderArguments &args)
             return;
         }
     }
-    //   - when the buffer is locked and clean, it is copied to output and unlocked
-    copyPixels( *this, args.renderWindow,
-                (void*)&timeBuffer->pixelData.front(),
-                timeBuffer->bounds,
-                timeBuffer->pixelComponents,
-                timeBuffer->pixelComponentCount,
-                timeBuffer->bitDepth,
-                timeBuffer->rowBytes,
-                dst.get() );
-    //   - the buffer is re-locked for writing, and marked as dirty, with date t+1, then unlocked
+    // the slot may be rewritten and its data released by TimeBufferWrite or Reset once the buffer is unlocked:
+    // take a copy of the slot and a reference to its data
+    if (slot) {
+        slotCopy = *slot;
+        slotCopy.data = TimeBuffer::acquire(slot->data);
+        slot = &slotCopy;
+    }
+    guard.unlock();
+    try {
+        if ( !slot || slot->empty() || !slot->data ) {
+            fillBlack( *this, args.renderWindow, dst.get() );
+        } else {
+            copyPixels( *this, args.renderWindow,
+                        (void*)&slot->data->pixels[0],
+                        slot->bounds,
+                        slot->pixelComponents,
+                        slot->pixelComponentCount,
+                        slot->bitDepth,
+                        slot->rowBytes,
+                        dst.get() );
+        }
+    } catch (...) {
+        guard.relock();
+        TimeBuffer::release(slotCopy.data);
+        throw;
+    }
+    //   - the buffer is re-locked, and marked as dirty, with date t+1, then unlocked
+    guard.relock();
+    TimeBuffer::release(slotCopy.data);
     timeBuffer->dirty = true;
     timeBuffer->time = time + 1;
     clearPersistentMessage();
@@ -660,33 +1088,56 @@ TimeBufferReadPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArgumen
             break;
         }
     }
-    // - if it is marked as dirty ,it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-    int delay = 5; // initial delay, in milliseconds
-    double timeout = _timeOut->getValue();
-    while (timeBuffer->dirty) {
-        guard.unlock();
-        sleep(delay);
-        if ( abort() ) {
+    // - if it is marked as dirty, it is unlocked, and we wait until TimeBufferWrite publishes an image or the time-out expires. abort() is checked at least every 50ms.
+    switch ( timeBuffer->waitClean( guard, _timeOut->getValue(), *this ) ) {
+    case eWaitResultClean:
+        break;
+    case eWaitResultAborted:
+
+        return false;
+    case eWaitResultTimedOut: {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+        case eUnorderedRenderLast:
+            setPersistentMessage(OFX::Message::eMessageError, "", "Timed out");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+
             return false;
+        case eUnorderedRenderBlack:
+
+            return false;     // use default behavior
         }
-        delay *= 2;
-        if (delay > timeout) {
-            UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
-            switch (e) {
-            case eUnorderedRenderError:
-            case eUnorderedRenderLast:
-                setPersistentMessage(OFX::Message::eMessageError, "", "Timed out");
-                OFX::throwSuiteStatusException(kOfxStatFailed);
+        break;
+    }
+    }
+    const double readTime = time - _delay->getValue();
+    if (readTime < startFrame) {
+        clearPersistentMessage();
 
-                return false;
-            case eUnorderedRenderBlack:
+        return false; // use default behavior
+    }
+    const TimeBufferSlot *slot = timeBuffer->findSlot(readTime);
+    if (!slot) {
+        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
+        switch (e) {
+        case eUnorderedRenderError:
+            setPersistentMessage(OFX::Message::eMessageError, "", "The image written at frame t-Delay is not retained by the TimeBuffer. Increase the History Depth of the corresponding TimeBufferWrite effect.");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+
+            return false;
+        case eUnorderedRenderBlack:
 
+            return false;     // use default behavior
+        case eUnorderedRenderLast:
+            slot = timeBuffer->findSlot(timeBuffer->lastWriteTime);
+            if (!slot) {
                 return false;     // use default behavior
             }
+            break;
         }
-        guard.relock();
     }
-    if ( (args.renderScale.x != timeBuffer->renderScale.x) || (args.renderScale.y != timeBuffer->renderScale.y) ) {
+    if ( (args.renderScale.x != slot->renderScale.x) || (args.renderScale.y != slot->renderScale.y) ) {
         UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
         switch (e) {
         case eUnorderedRenderError:
@@ -701,10 +1152,10 @@ TimeBufferReadPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArgumen
             return false;
         }
     }
-    // - when the buffer is locked and clean, the buffer's RoD is returned and it is unlocked
-    OFX::Coords::toCanonical(timeBuffer->bounds,
-                             timeBuffer->renderScale,
-                             timeBuffer->par,
+    // - when the buffer is locked and clean, the RoD of the image written at t-Delay is returned and it is unlocked
+    OFX::Coords::toCanonical(slot->bounds,
+                             slot->renderScale,
+                             slot->par,
                              &rod);
     clearPersistentMessage();
 
@@ -732,19 +1183,11 @@ TimeBufferReadPlugin::changedParam(const OFX::InstanceChangedArgs & /*args*/,
         }
         // reset the buffer to a clean state
         AutoMutex guard(timeBuffer->mutex);
-        timeBuffer->time = -DBL_MAX;
-        timeBuffer->dirty = true;
-        timeBuffer->pixelComponents = ePixelComponentNone;
-        timeBuffer->pixelComponentCount = 0;
-        timeBuffer->bitDepth = eBitDepthNone;
-        timeBuffer->rowBytes = 0;
-        timeBuffer->par = 1.;
-        timeBuffer->bounds.x1 = timeBuffer->bounds.y1 = timeBuffer->bounds.x2 = timeBuffer->bounds.y2 = 0;
-        timeBuffer->renderScale.x = timeBuffer->renderScale.y = 1;
+        timeBuffer->reset();
         _resetTrigger->setValue( !_resetTrigger->getValue() ); // trigger a render
     } else if (paramName == kParamInfo) {
         // give information about allocated buffers
-        // TODO
+        sendMessage( OFX::Message::eMessageMessage, "", getTimeBufferInfo() );
     }
 }
 
@@ -833,6 +1276,18 @@ TimeBufferReadPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kParamDelay);
+        param->setLabel(kParamDelayLabel);
+        param->setHint(kParamDelayHint);
+        param->setRange(1, kParamHistoryDepthMax);
+        param->setDisplayRange(1, 10);
+        param->setDefault(kParamDelayDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamUnorderedRender);
         param->setLabel(kParamUnorderedRenderLabel);
@@ -882,16 +1337,14 @@ TimeBufferReadPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
-    /*
-       {
+    {
         OFX::PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamInfo);
         param->setLabel(kParamInfoLabel);
         param->setHint(kParamInfoHint);
         if (page) {
             page->addChild(*param);
         }
-       }
-     */
+    }
     // sublabel
     {
         StringParamDescriptor* param = desc.defineStringParam(kNatronOfxParamStringSublabelName);
@@ -928,6 +1381,7 @@ public:
         , _srcClip(0)
         , _syncClip(0)
         , _bufferName(0)
+        , _historyDepth(0)
         , _resetTrigger(0)
         , _sublabel(0)
         , _buffer(0)
@@ -951,14 +1405,15 @@ public:
         assert(_syncClip && _syncClip->getPixelComponents() == ePixelComponentRGBA);
 
         _bufferName = fetchStringParam(kParamBufferName);
+        _historyDepth = fetchIntParam(kParamHistoryDepth);
         _resetTrigger = fetchBooleanParam(kParamResetTrigger);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
-        assert(_bufferName && _sublabel);
+        assert(_bufferName && _historyDepth && _sublabel);
+        _projectId = getPropertySet().propGetString(kNatronOfxImageEffectPropProjectId, false);
+        _groupId = getPropertySet().propGetString(kNatronOfxImageEffectPropGroupId, false);
         std::string name;
         _bufferName->getValue(name);
         setName(name);
-        _projectId = getPropertySet().propGetString(kNatronOfxImageEffectPropProjectId, false);
-        _groupId = getPropertySet().propGetString(kNatronOfxImageEffectPropGroupId, false);
     }
 
     virtual ~TimeBufferWritePlugin()
@@ -981,13 +1436,14 @@ private:
             return;
         }
         std::string key = _projectId + '.' + _groupId + '.' + name;
+        std::string oldKey = _projectId + '.' + _groupId + '.' + _name;
         if ( _buffer && (name != _name) ) {
             _buffer->writeInstance = 0; // remove reference to this instance
             if (!_buffer->readInstance) {
                 // we may free this buffer
                 {
                     AutoMutex guard( gTimeBufferMapMutex.get() );
-                    gTimeBufferMap->erase(_name);
+                    gTimeBufferMap->erase(oldKey);
                 }
                 delete _buffer;
                 _buffer = 0;
@@ -1125,6 +1581,7 @@ private:
     OFX::Clip *_srcClip;
     OFX::Clip *_syncClip;
     OFX::StringParam *_bufferName;
+    OFX::IntParam *_historyDepth;
     OFX::BooleanParam *_resetTrigger;
     OFX::StringParam *_sublabel;
     TimeBuffer *_buffer; // associated TimeBuffer
@@ -1199,28 +1656,73 @@ TimeBufferWritePlugin::render(const OFX::RenderArguments &args)
         return;
     }
     // - the buffer is locked for writing, and if it doesn't have date t+1 or is not dirty, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
+    // - the slot t mod (History Depth+1) is reserved, after changing the number of slots if the history depth changed, and a reference to its data is taken
+    const int depth = std::max( 1, std::min(_historyDepth->getValue(), kParamHistoryDepthMax) );
+    const int pixelComponentCount = src.get() ? src->getPixelComponentCount() : 0;
+    const std::size_t width = (std::size_t)(args.renderWindow.x2 - args.renderWindow.x1);
+    const std::size_t height = (std::size_t)(args.renderWindow.y2 - args.renderWindow.y1);
+    if ( (width > (std::size_t)INT_MAX / sizeof(float) / 4) ||
+         ( (width > 0) && ( height > std::numeric_limits<std::size_t>::max() / (width * pixelComponentCount * sizeof(float) + 1) ) ) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "The image is too large to be stored in the TimeBuffer.");
+        OFX::throwSuiteStatusException(kOfxStatErrMemory);
+    }
+    const int rowBytes = (int)(width * pixelComponentCount * sizeof(float));
+    const std::size_t bytes = (std::size_t)rowBytes * height;
+    TimeBufferSlot slot; // filled without holding the lock, and published once the image is copied
     {
         AutoMutex guard(timeBuffer->mutex);
         if ( (timeBuffer->time != time + 1) || !timeBuffer->dirty ) {
             setPersistentMessage(OFX::Message::eMessageError, "", "The TimeBuffer has wrong properties. Check that the corresponding TimeBufferRead effect is connected to the Sync input.");
             OFX::throwSuiteStatusException(kOfxStatFailed);
         }
-        // - src is copied to the buffer, and it is marked as not dirty, then unlocked
-        std::vector<unsigned char> pixelData;
-        timeBuffer->bounds = args.renderWindow;
-        timeBuffer->pixelComponents = src->getPixelComponents();
-        timeBuffer->pixelComponentCount = src->getPixelComponentCount();
-        timeBuffer->bitDepth = src->getPixelDepth();
-        timeBuffer->rowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * timeBuffer->pixelComponentCount * sizeof(float);
-        timeBuffer->renderScale = args.renderScale;
-        timeBuffer->par = src->getPixelAspectRatio();
-        timeBuffer->pixelData.resize( timeBuffer->rowBytes * (args.renderWindow.y2 - args.renderWindow.y1) );
-        copyPixels(*this, args.renderWindow, src.get(), &timeBuffer->pixelData.front(), timeBuffer->bounds, timeBuffer->pixelComponents, timeBuffer->pixelComponentCount, timeBuffer->bitDepth, timeBuffer->rowBytes);
-        timeBuffer->dirty = false;
+        if ( depth != timeBuffer->depth() ) {
+            timeBuffer->reallocate(depth);
+        }
+        slot.data = timeBuffer->reserveSlot(time, bytes);
+    }
+    // - src is copied to the data, without holding the lock
+    slot.time = time;
+    slot.bytes = bytes;
+    slot.renderScale = args.renderScale;
+    try {
+        if ( src.get() ) {
+            slot.bounds = args.renderWindow;
+            slot.pixelComponents = src->getPixelComponents();
+            slot.pixelComponentCount = pixelComponentCount;
+            slot.bitDepth = src->getPixelDepth();
+            slot.rowBytes = rowBytes;
+            slot.par = src->getPixelAspectRatio();
+            if ( !slot.empty() ) {
+                copyPixels(*this, args.renderWindow, src.get(), &slot.data->pixels[0], slot.bounds, slot.pixelComponents, slot.pixelComponentCount, slot.bitDepth, slot.rowBytes);
+            }
+        } else {
+            // no source: TimeBufferRead outputs black
+            slot.par = _dstClip->getPixelAspectRatio();
+        }
+    } catch (...) {
+        AutoMutex guard(timeBuffer->mutex);
+        TimeBuffer::release(slot.data);
+        throw;
+    }
+    // - the buffer is locked, the slot is published with time t (unless the buffer was reset meanwhile), the buffer is marked as not dirty, the condition is notified, and it is unlocked
+    {
+        AutoMutex guard(timeBuffer->mutex);
+        TimeBufferSlot &bufferSlot = timeBuffer->slots[timeBuffer->slotIndex(time)];
+        if (bufferSlot.data == slot.data) {
+            bufferSlot = slot;
+            timeBuffer->lastWriteTime = time;
+            timeBuffer->dirty = false;
+            timeBuffer->written.notifyAll();
+        }
+        TimeBuffer::release(slot.data);
     }
     // - src is also copied to output.
 
-    copyPixels( *this, args.renderWindow, src.get(), dst.get() );
+    if ( src.get() ) {
+        copyPixels( *this, args.renderWindow, src.get(), dst.get() );
+    } else {
+        fillBlack( *this, args.renderWindow, dst.get() );
+    }
     clearPersistentMessage();
     //std::cout << "render! OK\n";
 } // TimeBufferWritePlugin::render
@@ -1252,19 +1754,11 @@ TimeBufferWritePlugin::changedParam(const OFX::InstanceChangedArgs & /*args*/,
 
             return;
         }
-        timeBuffer->time = -DBL_MAX;
-        timeBuffer->dirty = true;
-        timeBuffer->pixelComponents = ePixelComponentNone;
-        timeBuffer->pixelComponentCount = 0;
-        timeBuffer->bitDepth = eBitDepthNone;
-        timeBuffer->rowBytes = 0;
-        timeBuffer->par = 1.;
-        timeBuffer->bounds.x1 = timeBuffer->bounds.y1 = timeBuffer->bounds.x2 = timeBuffer->bounds.y2 = 0;
-        timeBuffer->renderScale.x = timeBuffer->renderScale.y = 1;
+        timeBuffer->reset();
         _resetTrigger->setValue( !_resetTrigger->getValue() ); // trigger a render
     } else if (paramName == kParamInfo) {
         // give information about allocated buffers
-        // TODO
+        sendMessage( OFX::Message::eMessageMessage, "", getTimeBufferInfo() );
     }
 }
 
@@ -1346,6 +1840,18 @@ TimeBufferWritePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
             page->addChild(*param);
         }
     }
+    {
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kParamHistoryDepth);
+        param->setLabel(kParamHistoryDepthLabel);
+        param->setHint(kParamHistoryDepthHint);
+        param->setRange(1, kParamHistoryDepthMax);
+        param->setDisplayRange(1, 10);
+        param->setDefault(kParamHistoryDepthDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         OFX::PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamReset);
         param->setLabel(kParamResetLabel);
@@ -1364,16 +1870,14 @@ TimeBufferWritePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
             page->addChild(*param);
         }
     }
-    /*
-       {
+    {
         OFX::PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamInfo);
         param->setLabel(kParamInfoLabel);
         param->setHint(kParamInfoHint);
         if (page) {
             page->addChild(*param);
         }
-       }
-     */
+    }
     // sublabel
     {
         StringParamDescriptor* param = desc.defineStringParam(kNatronOfxParamStringSublabelName);
@@ -22,8 +22,10 @@
 
 #include <cmath>
 #include <cfloat> // DBL_MAX
+#include <complex>
 #include <map>
 #include <limits>
+#include <vector>
 #include <algorithm>
 
 #include "ofxsProcessing.H"
@@ -45,6 +47,10 @@ typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
 }
 #endif
 
+#ifndef M_PI
+#define M_PI        3.14159265358979323846264338327950288   /* pi             */
+#endif
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -60,7 +66,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "the tracker will continue tracking, picking up the previous/next frame as reference. "
 #define kPluginIdentifier "net.sf.openfx.TrackerPM"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 3 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -81,6 +87,27 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamScoreOptionZNCC "ZNCC"
 #define kParamScoreOptionZNCCHint "Zero-mean Normalized Cross-Correlation, less sensitive to illumination changes"
 
+#define kParamSearchMethod "searchMethod"
+#define kParamSearchMethodLabel "Search Method"
+#define kParamSearchMethodHint "Method used to find the pattern in the search area."
+#define kParamSearchMethodOptionExhaustive "Exhaustive"
+#define kParamSearchMethodOptionExhaustiveHint "Compute the score at every position in the search area. Slow for large search areas."
+#define kParamSearchMethodOptionCoarseToFine "Coarse-to-Fine"
+#define kParamSearchMethodOptionCoarseToFineHint "Search the whole area on a low-resolution version of the images, then refine the position at each higher resolution. Much faster for large search areas, but small or thin features of the pattern may be missed."
+
+enum SearchMethodEnum
+{
+    eSearchMethodExhaustive = 0,
+    eSearchMethodCoarseToFine,
+};
+
+#define kPyramidMaxLevels 6 // maximum number of levels of the coarse-to-fine search
+#define kPyramidMinPatternSize 8 // the pattern is at least that size (in pixels) at the coarsest level
+#define kPyramidRefineRadius 2 // radius of the neighborhood searched at each finer level
+
+#define kFFTCostRatio 4. // the FFT is used if the direct search is estimated to be that many times slower
+#define kFFTTolerance 1e-6 // relative tolerance on the scores computed using the FFT
+
 
 enum TrackerScoreEnum
 {
@@ -101,6 +128,7 @@ public:
     TrackerPMPlugin(OfxImageEffectHandle handle)
         : GenericTrackerPlugin(handle)
         , _score(0)
+        , _searchMethod(0)
         , _center(0)
         , _offset(0)
         , _referenceFrame(0)
@@ -114,7 +142,8 @@ public:
         _maskClip = fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
         assert(!_maskClip || !_maskClip->isConnected() || _maskClip->getPixelComponents() == ePixelComponentAlpha);
         _score = fetchChoiceParam(kParamScore);
-        assert(_score);
+        _searchMethod = fetchChoiceParam(kParamSearchMethod);
+        assert(_score && _searchMethod);
 
         _center = fetchDouble2DParam(kParamTrackingCenterPoint);
         _offset = fetchDouble2DParam(kParamTrackingOffset);
@@ -138,7 +167,8 @@ private:
     virtual void trackRange(const OFX::TrackArguments& args);
 
     template <int nComponents>
-    void trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args);
+    void trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args,
+                       std::auto_ptr<const OFX::Image>& prevOtherImg, OfxTime& prevOtherTime);
 
     template <class PIX, int nComponents, int maxValue>
     void trackInternalForDepth(OfxTime refTime,
@@ -165,6 +195,7 @@ private:
 
     OFX::Clip *_maskClip;
     ChoiceParam* _score;
+    ChoiceParam* _searchMethod;
     OFX::Double2DParam* _center;
     OFX::Double2DParam* _offset;
     OFX::IntParam* _referenceFrame;
@@ -177,64 +208,624 @@ private:
 };
 
 
+// Gaussian kernel used to build the search pyramid
+static const float kPyramidKernel[5] = { 1.f / 16, 4.f / 16, 6.f / 16, 4.f / 16, 1.f / 16 };
+
+// floor(x / 2)
+static inline int
+floorHalf(int x)
+{
+    return (x >= 0) ? (x / 2) : -( (1 - x) / 2 );
+}
+
+typedef std::complex<double> Complex;
+
+// smallest power of two that is >= n
+static int
+nextPowerOfTwo(int n)
+{
+    int p = 1;
+
+    while (p < n) {
+        p *= 2;
+    }
+
+    return p;
+}
+
+/* In-place radix-2 FFT of 2D complex buffers, width and height must be powers of two.
+ * The inverse transform is not normalized.
+ */
+class FFT2D
+{
+public:
+    FFT2D(int width,
+          int height)
+        : _width(width)
+        , _height(height)
+        , _twiddlesX()
+        , _twiddlesY()
+        , _column(height)
+    {
+        computeTwiddles(width, &_twiddlesX);
+        computeTwiddles(height, &_twiddlesY);
+    }
+
+    int width() const { return _width; }
+
+    int height() const { return _height; }
+
+    void transform(std::vector<Complex> &data,
+                   bool inverse)
+    {
+        assert( (int)data.size() == _width * _height );
+        for (int y = 0; y < _height; ++y) {
+            transform1D(&data[y * _width], _width, _twiddlesX, inverse);
+        }
+        for (int x = 0; x < _width; ++x) {
+            for (int y = 0; y < _height; ++y) {
+                _column[y] = data[y * _width + x];
+            }
+            transform1D(&_column[0], _height, _twiddlesY, inverse);
+            for (int y = 0; y < _height; ++y) {
+                data[y * _width + x] = _column[y];
+            }
+        }
+    }
+
+private:
+    static void computeTwiddles(int n,
+                                std::vector<Complex> *twiddles)
+    {
+        twiddles->resize(std::max(1, n / 2));
+        for (int k = 0; k < n / 2; ++k) {
+            const double a = -2. * M_PI * k / n;
+            (*twiddles)[k] = Complex( std::cos(a), std::sin(a) );
+        }
+    }
+
+    static void transform1D(Complex *data,
+                            int n,
+                            const std::vector<Complex> &twiddles,
+                            bool inverse)
+    {
+        // bit-reversal permutation
+        for (int i = 1, j = 0; i < n; ++i) {
+            int bit = n >> 1;
+            for (; j & bit; bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j) {
+                std::swap(data[i], data[j]);
+            }
+        }
+        // butterflies (complex products are written explicitly, std::complex checks for infinities)
+        const double sign = inverse ? -1. : 1.;
+        for (int len = 2; len <= n; len *= 2) {
+            const int half = len / 2;
+            const int step = n / len;
+            for (int i = 0; i < n; i += len) {
+                Complex *a = data + i;
+                Complex *b = data + i + half;
+                for (int k = 0; k < half; ++k) {
+                    const double wr = twiddles[k * step].real();
+                    const double wi = sign * twiddles[k * step].imag();
+                    const double vr = b[k].real() * wr - b[k].imag() * wi;
+                    const double vi = b[k].real() * wi + b[k].imag() * wr;
+                    const double ur = a[k].real();
+                    const double ui = a[k].imag();
+                    a[k] = Complex(ur + vr, ui + vi);
+                    b[k] = Complex(ur - vr, ui - vi);
+                }
+            }
+        }
+    }
+
+    int _width;
+    int _height;
+    std::vector<Complex> _twiddlesX;
+    std::vector<Complex> _twiddlesY;
+    std::vector<Complex> _column;
+};
+
+// acc += a * conj(b)
+static void
+accumulateCorrelation(const std::vector<Complex> &a,
+                      const std::vector<Complex> &b,
+                      double scale,
+                      std::vector<Complex> *acc)
+{
+    assert( a.size() == b.size() && a.size() == acc->size() );
+    Complex *accPtr = &(*acc)[0];
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        const double re = a[i].real() * b[i].real() + a[i].imag() * b[i].imag();
+        const double im = a[i].imag() * b[i].real() - a[i].real() * b[i].imag();
+        accPtr[i] = Complex(accPtr[i].real() + scale * re, accPtr[i].imag() + scale * im);
+    }
+}
+
+/* Summed-area table of a w x h image: sat[y * (w + 1) + x] is the sum of the pixels in [0,x) x [0,y).
+ */
+static void
+computeSummedAreaTable(const double *data,
+                       int w,
+                       int h,
+                       std::vector<double> *sat)
+{
+    sat->assign( (std::size_t)(w + 1) * (h + 1), 0. );
+    for (int y = 0; y < h; ++y) {
+        const double *src = data + (std::size_t)y * w;
+        const double *prev = &(*sat)[(std::size_t)y * (w + 1)];
+        double *dst = &(*sat)[(std::size_t)(y + 1) * (w + 1)];
+        double rowSum = 0.;
+        for (int x = 0; x < w; ++x) {
+            rowSum += src[x];
+            dst[x + 1] = prev[x + 1] + rowSum;
+        }
+    }
+}
+
+// sum of the pixels in [x,x+bw) x [y,y+bh), using the summed-area table of an image of width w
+static inline double
+boxSum(const std::vector<double> &sat,
+       int w,
+       int x,
+       int y,
+       int bw,
+       int bh)
+{
+    const std::size_t stride = w + 1;
+
+    return sat[(y + bh) * stride + x + bw] - sat[(y + bh) * stride + x] - sat[y * stride + x + bw] + sat[y * stride + x];
+}
+
+
+/* One level of the search pyramid of a track.
+ * Pixel (X,Y) of a level corresponds to pixel (2X,2Y) of the finer level.
+ * The part of the other image used by the search has a one-pixel margin around the area covered by the pattern at
+ * all searched positions, so that the subpixel refinement can compute scores just outside of the search window.
+ */
+struct TrackerPMLevel
+{
+    OfxRectI pattern; // the pattern pixels, relative to the pattern center
+    std::vector<float> patternData; // nComponents values per pattern pixel
+    std::vector<float> weightData; // one weight per pattern pixel
+    double weightTotal;
+    double patternMean[3]; // weighted mean of the pattern, used by ZNCC
+    bool uniform; // all the weights are equal
+    OfxRectI search; // the searched positions of the pattern center
+    OfxRectI other; // the part of the other image used by the search
+
+    TrackerPMLevel()
+        : pattern()
+        , patternData()
+        , weightData()
+        , weightTotal(0.)
+        , uniform(false)
+        , search()
+        , other()
+    {
+        patternMean[0] = patternMean[1] = patternMean[2] = 0.;
+    }
+
+    void setOtherRect()
+    {
+        other.x1 = search.x1 + pattern.x1 - 1;
+        other.y1 = search.y1 + pattern.y1 - 1;
+        other.x2 = search.x2 - 1 + pattern.x2 + 1;
+        other.y2 = search.y2 - 1 + pattern.y2 + 1;
+    }
+
+    // compute patternMean and uniform from the pattern and the weights
+    void computePatternStatistics(int nComponents)
+    {
+        const int scoreComps = std::min(nComponents, 3);
+
+        uniform = true;
+        for (std::size_t p = 1; p < weightData.size(); ++p) {
+            if (weightData[p] != weightData[0]) {
+                uniform = false;
+                break;
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            patternMean[c] = 0.;
+        }
+        if (weightTotal <= 0.) {
+            return;
+        }
+        for (std::size_t p = 0; p < weightData.size(); ++p) {
+            for (int c = 0; c < scoreComps; ++c) {
+                patternMean[c] += weightData[p] * patternData[p * nComponents + c];
+            }
+        }
+        for (int c = 0; c < scoreComps; ++c) {
+            patternMean[c] /= weightTotal;
+        }
+    }
+
+    /* build this level from the finer level.
+       The pattern is filtered using normalized convolution, so that pixels with a zero weight do not contribute. */
+    void downsample(const TrackerPMLevel &fine,
+                    int nComponents)
+    {
+        pattern.x1 = floorHalf(fine.pattern.x1);
+        pattern.y1 = floorHalf(fine.pattern.y1);
+        pattern.x2 = floorHalf(fine.pattern.x2 - 1) + 1;
+        pattern.y2 = floorHalf(fine.pattern.y2 - 1) + 1;
+        search.x1 = floorHalf(fine.search.x1);
+        search.y1 = floorHalf(fine.search.y1);
+        search.x2 = floorHalf(fine.search.x2 - 1) + 1;
+        search.y2 = floorHalf(fine.search.y2 - 1) + 1;
+        setOtherRect();
+
+        // filter w*p and w, zero outside of the fine pattern
+        const int fineW = fine.pattern.x2 - fine.pattern.x1;
+        const int fineH = fine.pattern.y2 - fine.pattern.y1;
+        const int w = pattern.x2 - pattern.x1;
+        const int h = pattern.y2 - pattern.y1;
+        const int nc = nComponents + 1; // weighted values, followed by the weight
+        // horizontal pass
+        std::vector<float> tmp(fineH * w * nc, 0.f);
+        for (int i = 0; i < fineH; ++i) {
+            for (int X = pattern.x1; X < pattern.x2; ++X) {
+                float *t = &tmp[(i * w + (X - pattern.x1)) * nc];
+                for (int k = 0; k < 5; ++k) {
+                    int j = 2 * X + k - 2 - fine.pattern.x1;
+                    if ( (j < 0) || (j >= fineW) ) {
+                        continue;
+                    }
+                    const float wk = kPyramidKernel[k] * fine.weightData[i * fineW + j];
+                    const float *p = &fine.patternData[(i * fineW + j) * nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        t[c] += wk * p[c];
+                    }
+                    t[nComponents] += wk;
+                }
+            }
+        }
+        // vertical pass
+        patternData.assign(w * h * nComponents, 0.f);
+        weightData.assign(w * h, 0.f);
+        weightTotal = 0.;
+        std::vector<float> sum(nc);
+        for (int Y = pattern.y1; Y < pattern.y2; ++Y) {
+            for (int X = pattern.x1; X < pattern.x2; ++X) {
+                std::fill(sum.begin(), sum.end(), 0.f);
+                for (int k = 0; k < 5; ++k) {
+                    int i = 2 * Y + k - 2 - fine.pattern.y1;
+                    if ( (i < 0) || (i >= fineH) ) {
+                        continue;
+                    }
+                    const float *t = &tmp[(i * w + (X - pattern.x1)) * nc];
+                    for (int c = 0; c < nc; ++c) {
+                        sum[c] += kPyramidKernel[k] * t[c];
+                    }
+                }
+                const int idx = (Y - pattern.y1) * w + (X - pattern.x1);
+                const float weight = sum[nComponents];
+                weightData[idx] = weight;
+                weightTotal += weight;
+                if (weight > 0.f) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        patternData[idx * nComponents + c] = sum[c] / weight;
+                    }
+                }
+            }
+        }
+        computePatternStatistics(nComponents);
+    } // downsample
+};
+
+/* One level of the pyramid of the other image.
+ * The summed-area tables are only computed if they are needed by the FFT scoring.
+ */
+struct TrackerPMImageLevel
+{
+    OfxRectI bounds;
+    std::vector<float> data; // nComponents values per pixel
+    std::vector<double> satSq; // summed-area table of the sum of the squared components
+    std::vector<double> sat[3]; // summed-area tables of the components
+
+    TrackerPMImageLevel()
+        : bounds()
+        , data()
+        , satSq()
+    {
+    }
+
+    int width() const { return bounds.x2 - bounds.x1; }
+
+    int height() const { return bounds.y2 - bounds.y1; }
+
+    const float* getPixelAddress(int x,
+                                 int y,
+                                 int nComponents) const
+    {
+        assert(bounds.x1 <= x && x < bounds.x2 && bounds.y1 <= y && y < bounds.y2);
+
+        return &data[( (std::size_t)(y - bounds.y1) * width() + (x - bounds.x1) ) * nComponents];
+    }
+
+    /* build this level from the finer level. The bounds must be set.
+       Pixels outside of the finer level are clamped to its edges. */
+    void downsample(const TrackerPMImageLevel &fine,
+                    int nComponents)
+    {
+        const int fineW = fine.width();
+        const int fineH = fine.height();
+        const int w = width();
+        const int h = height();
+        // horizontal pass
+        std::vector<float> tmp(fineH * w * nComponents, 0.f);
+
+        for (int i = 0; i < fineH; ++i) {
+            for (int X = bounds.x1; X < bounds.x2; ++X) {
+                float *t = &tmp[(i * w + (X - bounds.x1)) * nComponents];
+                for (int k = 0; k < 5; ++k) {
+                    int j = std::max( 0, std::min(2 * X + k - 2 - fine.bounds.x1, fineW - 1) );
+                    const float *p = &fine.data[(i * fineW + j) * nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        t[c] += kPyramidKernel[k] * p[c];
+                    }
+                }
+            }
+        }
+        // vertical pass
+        data.assign(w * h * nComponents, 0.f);
+        for (int Y = bounds.y1; Y < bounds.y2; ++Y) {
+            float *o = &data[(Y - bounds.y1) * w * nComponents];
+            for (int k = 0; k < 5; ++k) {
+                int i = std::max( 0, std::min(2 * Y + k - 2 - fine.bounds.y1, fineH - 1) );
+                const float *t = &tmp[i * w * nComponents];
+                for (int v = 0; v < w * nComponents; ++v) {
+                    o[v] += kPyramidKernel[k] * t[v];
+                }
+            }
+        }
+    } // downsample
+
+    // compute satSq, and sat if components is true
+    void computeSummedAreaTables(int nComponents,
+                                 bool components)
+    {
+        const int scoreComps = std::min(nComponents, 3);
+        const std::size_t nPix = (std::size_t)width() * height();
+        std::vector<double> values(nPix, 0.);
+
+        for (std::size_t p = 0; p < nPix; ++p) {
+            for (int c = 0; c < scoreComps; ++c) {
+                const double v = data[p * nComponents + c];
+                values[p] += v * v;
+            }
+        }
+        computeSummedAreaTable(&values[0], width(), height(), &satSq);
+        if (components) {
+            for (int c = 0; c < scoreComps; ++c) {
+                for (std::size_t p = 0; p < nPix; ++p) {
+                    values[p] = data[p * nComponents + c];
+                }
+                computeSummedAreaTable(&values[0], width(), height(), &sat[c]);
+            }
+        }
+    }
+};
+
+/* The pattern tracked by TrackerPMProcessor, with its search pyramid and its results.
+ */
+struct TrackerPMTrack
+{
+    OfxRectI pattern; // the pattern window in the ref image, relative to centeri
+    OfxPointI centeri; // the pattern center in the ref image
+    OfxRectI search; // the searched positions of the pattern center in the other image
+    std::vector<TrackerPMLevel> levels; // levels[0] is the full resolution
+    bool useFFT; // the scores of the coarsest level are computed using the FFT
+    std::vector<double> scoreMap; // approximate scores at the coarsest level
+    double scoreMapTolerance; // maximum error on the values of scoreMap
+    bool valid; // false if the track cannot be processed
+    OfxPointD bestMatch;
+    double bestScore;
+
+    TrackerPMTrack()
+        : pattern()
+        , centeri()
+        , search()
+        , levels()
+        , useFFT(false)
+        , scoreMap()
+        , scoreMapTolerance(0.)
+        , valid(false)
+        , bestMatch()
+        , bestScore( std::numeric_limits<double>::infinity() )
+    {
+    }
+};
+
+/* Track a pattern of the ref image in the other image.
+ * The pattern and the searched part of the other image are extracted and their pyramids are built in the calling
+ * thread. The search is then split in blocks of rows of the coarsest level, and the threads take the next block
+ * from a shared counter, so that the threads that finish early process the remaining blocks.
+ */
 class TrackerPMProcessorBase
-    : public OFX::ImageProcessor
+    : public OFX::MultiThread::Processor
 {
 protected:
+    struct SearchBlock
+    {
+        int y1, y2; // rows of the coarsest level
+    };
+
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_refImg;
     const OFX::Image *_otherImg;
-    OfxRectI _refRectPixel;
-    OfxPointI _refCenterI;
-    std::pair<OfxPointD, double> _bestMatch; //< the results for the current processor
-    Mutex _bestMatchMutex; //< this is used so we can multi-thread the tracking and protect the shared results
+    const OFX::Image *_maskImg;
+    int _maxLevels; //< maximum number of pyramid levels, 1 means exhaustive search
+    TrackerPMTrack _track;
+    std::vector<TrackerPMImageLevel> _images; //< the pyramid of the searched part of the other image
+    std::vector<SearchBlock> _blocks;
+    Mutex _mutex; //< protects the work counter, _failed, and the results of the track
+    int _nextBlock;
+    bool _failed;
 
 public:
     TrackerPMProcessorBase(OFX::ImageEffect &instance)
-        : OFX::ImageProcessor(instance)
+        : OFX::MultiThread::Processor()
+        , _effect(instance)
+        , _refImg(0)
         , _otherImg(0)
-        , _refRectPixel()
-        , _refCenterI()
+        , _maskImg(0)
+        , _maxLevels(1)
+        , _track()
+        , _images()
+        , _blocks()
+        , _mutex()
+        , _nextBlock(0)
+        , _failed(false)
     {
-        _bestMatch.second = std::numeric_limits<double>::infinity();
     }
 
     virtual ~TrackerPMProcessorBase()
     {
     }
 
-    /** @brief set the processing parameters. return false if processing cannot be done. */
-    virtual bool setValues(const OFX::Image *ref, const OFX::Image *other, const OFX::Image *mask,
-                           const OfxRectI& pattern, const OfxPointI& centeri) = 0;
+    /** @brief set the maximum number of pyramid levels. */
+    void setMaxLevels(int maxLevels) { _maxLevels = std::max(1, maxLevels); }
+
+    /** @brief set the images. The mask may be NULL. */
+    void setImages(const OFX::Image *ref,
+                   const OFX::Image *other,
+                   const OFX::Image *mask)
+    {
+        _refImg = ref;
+        _otherImg = other;
+        _maskImg = mask;
+    }
+
+    /** @brief set the pattern to be tracked.
+        pattern is the pattern window relative to centeri in the ref image,
+        search is the window of the searched positions of the pattern center in the other image. */
+    void setTrack(const OfxRectI& pattern,
+                  const OfxPointI& centeri,
+                  const OfxRectI& search)
+    {
+        _track = TrackerPMTrack();
+        _track.pattern = pattern;
+        _track.centeri = centeri;
+        _track.search = search;
+    }
+
+    /** @brief track the pattern. */
+    void process()
+    {
+        assert(_refImg && _otherImg);
+        processPattern();
+        if ( !_track.valid || _effect.abort() ) {
+            return;
+        }
+        processImagePyramid();
+        if ( _effect.abort() ) {
+            return;
+        }
+        processScoreMap();
+        if ( _effect.abort() ) {
+            return;
+        }
+        makeSearchBlocks();
+        _nextBlock = 0;
+        multiThread( std::min( OFX::MultiThread::getNumCPUs(), (unsigned int)_blocks.size() ) );
+        if (_failed) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+    }
 
     /**
      * @brief Retrieves the results of the track. Must be called once process() returns so it is thread safe.
+     * isValid() returns false if the track could not be processed (e.g. the pattern is empty or fully masked).
      **/
-    const OfxPointD& getBestMatch() const { return _bestMatch.first; }
+    bool isValid() const { return _track.valid; }
+
+    const OfxPointD& getBestMatch() const { return _track.bestMatch; }
+
+    double getBestScore() const { return _track.bestScore; }
+
+protected:
+    // extract the pattern and build the pattern pyramid
+    virtual void processPattern() = 0;
+
+    // build the pyramid of the searched part of the other image
+    virtual void processImagePyramid() = 0;
+
+    // compute the FFT scores, if needed
+    virtual void processScoreMap() = 0;
+
+    // search a block of rows
+    virtual void processSearchBlock(const SearchBlock &block) = 0;
+
+private:
+    virtual void multiThreadFunction(unsigned int /*threadId*/,
+                                     unsigned int /*nThreads*/) OVERRIDE FINAL
+    {
+        for (;;) {
+            int i;
+            {
+                AutoMutex guard(_mutex);
+                if ( ( _nextBlock >= (int)_blocks.size() ) || _failed ) {
+                    return;
+                }
+                i = _nextBlock;
+                ++_nextBlock;
+            }
+            if ( _effect.abort() ) {
+                return;
+            }
+            // exceptions must not cross the thread boundary
+            try {
+                processSearchBlock(_blocks[i]);
+            } catch (...) {
+                AutoMutex guard(_mutex);
+                _failed = true;
+            }
+        }
+    }
 
-    double getBestScore() const { return _bestMatch.second; }
+    // split the coarsest level in blocks of rows
+    void makeSearchBlocks()
+    {
+        // a few blocks per thread, so that the threads that finish early can help the others
+        const int nBlocks = 4 * std::max(1u, OFX::MultiThread::getNumCPUs() );
+        const OfxRectI &search = _track.levels.back().search;
+        const int rowsPerBlock = std::max(1, (search.y2 - search.y1 + nBlocks - 1) / nBlocks);
+
+        _blocks.clear();
+        for (int y = search.y1; y < search.y2; y += rowsPerBlock) {
+            SearchBlock block;
+            block.y1 = y;
+            block.y2 = std::min(y + rowsPerBlock, search.y2);
+            _blocks.push_back(block);
+        }
+    }
 };
 
 
-// The "masked", "filter" and "clamp" template parameters allow filter-specific optimization
-// by the compiler, using the same generic code for all filters.
+/* The pattern and the searched part of the other image are first converted to float buffers,
+ * which are downsampled to build the search pyramids.
+ * The coarsest level is searched exhaustively, and the best match found in each block of rows is refined at each
+ * finer level within a small neighborhood. The subpixel position is computed at the finest level.
+ * With a single level, this is an exhaustive search at full resolution.
+ *
+ * When the exhaustive search is large, the SSD, NCC and ZNCC scores of all positions are first computed at once
+ * using FFT-based cross-correlations (see computeScoreMap()). Only the positions whose score is within the
+ * precision of the FFT from the best one are then scored directly, so that the result is the same as with the
+ * direct search.
+ */
 template <class PIX, int nComponents, int maxValue, TrackerScoreEnum scoreType>
 class TrackerPMProcessor
     : public TrackerPMProcessorBase
 {
-protected:
-    std::auto_ptr<OFX::ImageMemory> _patternImg;
-    PIX *_patternData;
-    std::auto_ptr<OFX::ImageMemory> _weightImg;
-    float *_weightData;
-    double _weightTotal;
-
 public:
     TrackerPMProcessor(OFX::ImageEffect &instance)
         : TrackerPMProcessorBase(instance)
-        , _patternImg(0)
-        , _patternData(0)
-        , _weightImg(0)
-        , _weightData(0)
-        , _weightTotal(0.)
     {
     }
 
@@ -243,13 +834,11 @@ public:
     }
 
 private:
-    /** @brief set the processing parameters. return false if processing cannot be done. */
-    virtual bool setValues(const OFX::Image *ref,
-                           const OFX::Image *other,
-                           const OFX::Image *mask,
-                           const OfxRectI& pattern,
-                           const OfxPointI& centeri)
+    virtual void processPattern() OVERRIDE FINAL
     {
+        TrackerPMTrack &track = _track;
+        const OfxRectI &pattern = track.pattern;
+        const OfxPointI &centeri = track.centeri;
         size_t rowsize = pattern.x2 - pattern.x1;
         size_t nPix = rowsize * (pattern.y2 - pattern.y1);
 
@@ -257,42 +846,45 @@ private:
         // This happens if the pattern is empty. Most probably this is because it is totally outside the image
         // we better return quickly.
         if (nPix == 0) {
-            return false;
+            return;
+        }
+        const OfxRectI& otherBounds = _otherImg->getBounds();
+        if ( (otherBounds.x2 <= otherBounds.x1) || (otherBounds.y2 <= otherBounds.y1) ) {
+            return;
         }
 
-        _patternImg.reset( new ImageMemory(sizeof(PIX) * nComponents * nPix, &_effect) );
-        _weightImg.reset( new ImageMemory(sizeof(float) * nPix, &_effect) );
-        _otherImg = other;
-        _refRectPixel = pattern;
-        _refCenterI = centeri;
-
-        _patternData = (PIX*)_patternImg->lock();
-        _weightData = (float*)_weightImg->lock();
+        track.levels.resize(1);
+        TrackerPMLevel &level0 = track.levels[0];
+        level0.pattern = pattern;
+        level0.patternData.resize(nPix * nComponents);
+        level0.weightData.resize(nPix);
+        level0.search = track.search;
+        level0.setOtherRect();
 
         // sliding pointers
         long patternIdx = 0; // sliding index
-        PIX *patternPtr = _patternData;
-        float *weightPtr = _weightData;
-        _weightTotal = 0.;
+        float *patternPtr = &level0.patternData[0];
+        float *weightPtr = &level0.weightData[0];
+        level0.weightTotal = 0.;
 
         // extract ref and mask
-        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                PIX *refPix = (PIX*) ref->getPixelAddress(_refCenterI.x + j, _refCenterI.y + i);
+        for (int i = pattern.y1; i < pattern.y2; ++i) {
+            for (int j = pattern.x1; j < pattern.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
+                assert( patternIdx == ( (i - pattern.y1) * (pattern.x2 - pattern.x1) + (j - pattern.x1) ) );
+                PIX *refPix = (PIX*) _refImg->getPixelAddress(centeri.x + j, centeri.y + i);
 
                 if (!refPix) {
                     // no reference pixel, set weight to 0
                     *weightPtr = 0.f;
                     for (int c = 0; c < nComponents; ++c) {
-                        patternPtr[c] = PIX();
+                        patternPtr[c] = 0.f;
                     }
                 } else {
-                    if (!mask) {
+                    if (!_maskImg) {
                         // no mask, weight is uniform
                         *weightPtr = 1.f;
                     } else {
-                        PIX *maskPix = (PIX*) mask->getPixelAddress(_refCenterI.x + j, _refCenterI.y + i);
+                        PIX *maskPix = (PIX*) _maskImg->getPixelAddress(centeri.x + j, centeri.y + i);
                         // weight is zero if there's a mask but we're outside of it
                         *weightPtr = maskPix ? (*maskPix / (float)maxValue) : 0.f;
                     }
@@ -300,88 +892,320 @@ private:
                         patternPtr[c] = refPix[c];
                     }
                 }
-                _weightTotal += *weightPtr;
+                level0.weightTotal += *weightPtr;
             }
         }
+        if (level0.weightTotal <= 0) {
+            return;
+        }
+        level0.computePatternStatistics(nComponents);
+
+        // build the pattern pyramid
+        while ( (int)track.levels.size() < _maxLevels ) {
+            const TrackerPMLevel &fine = track.levels.back();
+            // stop if the pattern would become too small, or if the search window is already small
+            if ( (std::min(fine.pattern.x2 - fine.pattern.x1, fine.pattern.y2 - fine.pattern.y1) < 2 * kPyramidMinPatternSize) ||
+                 ( std::max(fine.search.x2 - fine.search.x1, fine.search.y2 - fine.search.y1) <= 2 * kPyramidRefineRadius + 1 ) ) {
+                break;
+            }
+            TrackerPMLevel coarse;
+            coarse.downsample(fine, nComponents);
+            if (coarse.weightTotal <= 0) {
+                break;
+            }
+            track.levels.push_back(coarse);
+        }
 
-        return (_weightTotal > 0);
-    } // setValues
+        // the coarsest level is searched exhaustively
+        track.useFFT = useScoreMap( track.levels.back() );
+        track.valid = true;
+    } // processPattern
 
-    void multiThreadProcessImages(OfxRectI procWindow)
+    virtual void processImagePyramid() OVERRIDE FINAL
     {
-        switch (scoreType) {
-        case eTrackerSSD:
+        const int nLevels = (int)_track.levels.size();
 
-            return multiThreadProcessImagesForScore<eTrackerSSD>(procWindow);
-        case eTrackerSAD:
+        _images.resize(nLevels);
+        for (int l = 0; l < nLevels; ++l) {
+            _images[l].bounds = _track.levels[l].other;
+        }
+
+        // extract the other image.
+        // take nearest pixel in other image (more chance to get a track than with black)
+        {
+            const OfxRectI& otherBounds = _otherImg->getBounds();
+            TrackerPMImageLevel &level0 = _images[0];
+            level0.data.resize( (size_t)level0.width() * level0.height() * nComponents );
+            float *otherPtr = &level0.data[0];
+            for (int y = level0.bounds.y1; y < level0.bounds.y2; ++y) {
+                const int othery = std::max( otherBounds.y1, std::min(y, otherBounds.y2 - 1) );
+                for (int x = level0.bounds.x1; x < level0.bounds.x2; ++x, otherPtr += nComponents) {
+                    const int otherx = std::max( otherBounds.x1, std::min(x, otherBounds.x2 - 1) );
+                    const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+                    assert(otherPix);
+                    for (int c = 0; c < nComponents; ++c) {
+                        otherPtr[c] = otherPix[c];
+                    }
+                }
+            }
+        }
 
-            return multiThreadProcessImagesForScore<eTrackerSAD>(procWindow);
-        case eTrackerNCC:
+        // each coarser level covers the part of the image searched at that level
+        for (int l = 1; l < nLevels; ++l) {
+            _images[l].downsample(_images[l - 1], nComponents);
+        }
 
-            return multiThreadProcessImagesForScore<eTrackerNCC>(procWindow);
-        case eTrackerZNCC:
+        // summed-area tables of the coarsest level, if the FFT scoring uses them
+        if ( _track.useFFT && _track.levels.back().uniform ) {
+            _images.back().computeSummedAreaTables(nComponents, scoreType == eTrackerZNCC);
+        }
+    } // processImagePyramid
 
-            return multiThreadProcessImagesForScore<eTrackerZNCC>(procWindow);
+    virtual void processScoreMap() OVERRIDE FINAL
+    {
+        if (_track.valid && _track.useFFT) {
+            computeScoreMap(_track.levels.back(), _images.back(), &_track);
         }
     }
 
+    // return true if computing the scores using the FFT is expected to be faster than the direct computation
+    bool useScoreMap(const TrackerPMLevel &level)
+    {
+        if (scoreType == eTrackerSAD) {
+            // SAD cannot be computed from correlations
+            return false;
+        }
+        const int scoreComps = std::min(nComponents, 3);
+        const double fftSize = (double)nextPowerOfTwo(level.other.x2 - level.other.x1) * nextPowerOfTwo(level.other.y2 - level.other.y1);
+        // estimated costs: the direct search does one operation per pattern pixel, component and position,
+        // and about 3 transforms per component are needed
+        const double directCost = (double)(level.pattern.x2 - level.pattern.x1) * (level.pattern.y2 - level.pattern.y1) *
+                                  (level.search.x2 - level.search.x1) * (level.search.y2 - level.search.y1) * scoreComps;
+        const double fftCost = 3. * (scoreComps + 1) * fftSize * std::log(fftSize) / std::log(2.);
+
+        return directCost >= kFFTCostRatio * fftCost;
+    }
+
+    /* Compute the approximate score at all the positions of the search window of a level.
+     * The correlations of the pattern with the other image are computed using FFTs. The weighted energy and mean of
+     * the other image under the pattern are computed using the summed-area tables of the image if the weights are
+     * uniform, or using FFTs otherwise.
+     * Positions where the normalization factor is too small to be accurate are set to infinity, so that their score
+     * is computed directly.
+     */
+    void computeScoreMap(const TrackerPMLevel &level,
+                         const TrackerPMImageLevel &image,
+                         TrackerPMTrack *track)
+    {
+        const int scoreComps = std::min(nComponents, 3);
+        const int patternWidth = level.pattern.x2 - level.pattern.x1;
+        const int patternHeight = level.pattern.y2 - level.pattern.y1;
+        const int otherWidth = level.other.x2 - level.other.x1;
+        const int otherHeight = level.other.y2 - level.other.y1;
+        const int searchWidth = level.search.x2 - level.search.x1;
+        const int searchHeight = level.search.y2 - level.search.y1;
+        const int fftWidth = nextPowerOfTwo(otherWidth);
+        const int fftHeight = nextPowerOfTwo(otherHeight);
+        const std::size_t fftSize = (std::size_t)fftWidth * fftHeight;
+        const bool uniform = level.uniform;
+        std::vector<double> &scoreMap = track->scoreMap;
+
+        // the kernel weights: SSD uses the squared weights
+        std::vector<double> kernelWeights( level.weightData.size() );
+        for (std::size_t p = 0; p < kernelWeights.size(); ++p) {
+            const double w = level.weightData[p];
+            kernelWeights[p] = (scoreType == eTrackerSSD) ? (w * w) : w;
+        }
+        const double kernelWeight0 = kernelWeights[0];
+
+        FFT2D fft(fftWidth, fftHeight);
+        std::vector<Complex> correlation(fftSize, Complex(0., 0.)); // sum of the correlations of the components
+        std::vector<Complex> otherF(fftSize);
+        std::vector<Complex> patternF(fftSize);
+        std::vector<Complex> weightF; // transform of the kernel weights, if they are not uniform
+        std::vector<double> otherSq; // sum of the squared components, if the weights are not uniform
+        std::vector<double> meanSq; // ZNCC: sum of the squared weighted sums of the components
+        double patternSq = 0.; // SSD, NCC: weighted energy of the pattern, ZNCC: weighted variance
+        // scoreMap[sy * searchWidth + sx] is the score of the position (level.search.x1 + sx, level.search.y1 + sy).
+        // At that position, the first pattern pixel lies at (sx + dx, sy + dy) in level.other, which is where
+        // the correlations and the weighted sums are read.
+        const int dx = level.search.x1 + level.pattern.x1 - level.other.x1;
+        const int dy = level.search.y1 + level.pattern.y1 - level.other.y1;
+        // position of level.other in the summed-area tables of the image
+        const int satdx = level.other.x1 - image.bounds.x1;
+        const int satdy = level.other.y1 - image.bounds.y1;
+
+        if (!uniform) {
+            otherSq.assign( (std::size_t)otherWidth * otherHeight, 0. );
+            weightF.assign( fftSize, Complex(0., 0.) );
+            for (int i = 0; i < patternHeight; ++i) {
+                for (int j = 0; j < patternWidth; ++j) {
+                    weightF[i * fftWidth + j] = kernelWeights[i * patternWidth + j];
+                }
+            }
+            fft.transform(weightF, false);
+        }
+        if (scoreType == eTrackerZNCC) {
+            meanSq.assign( (std::size_t)searchWidth * searchHeight, 0. );
+        }
+
+        for (int c = 0; c < scoreComps; ++c) {
+            // transform the other image
+            std::fill( otherF.begin(), otherF.end(), Complex(0., 0.) );
+            for (int y = 0; y < otherHeight; ++y) {
+                const float *otherPix = image.getPixelAddress(level.other.x1, level.other.y1 + y, nComponents) + c;
+                for (int x = 0; x < otherWidth; ++x, otherPix += nComponents) {
+                    otherF[y * fftWidth + x] = *otherPix;
+                    if (!uniform) {
+                        otherSq[y * otherWidth + x] += (double)*otherPix * *otherPix;
+                    }
+                }
+            }
+            fft.transform(otherF, false);
+
+            // transform the weighted pattern
+            std::fill( patternF.begin(), patternF.end(), Complex(0., 0.) );
+            for (int i = 0; i < patternHeight; ++i) {
+                for (int j = 0; j < patternWidth; ++j) {
+                    const int p = i * patternWidth + j;
+                    double r = level.patternData[p * nComponents + c];
+                    if (scoreType == eTrackerZNCC) {
+                        r -= level.patternMean[c];
+                    }
+                    patternF[i * fftWidth + j] = kernelWeights[p] * r;
+                    patternSq += kernelWeights[p] * r * r;
+                }
+            }
+            fft.transform(patternF, false);
+
+            // SSD = sum(w^2.r^2) - 2.sum(w^2.r.o) + sum(w^2.o^2)
+            // NCC = -sum(w.r.o) / sqrt( sum(w.o^2) )
+            // ZNCC = -sum( w.(r-mean(r)).o ) / sqrt( sum(w.o^2) - sum(w.o)^2 / sum(w) )
+            accumulateCorrelation(otherF, patternF, (scoreType == eTrackerSSD) ? -2. : 1., &correlation);
+
+            if (scoreType == eTrackerZNCC) {
+                // weighted sum of the other image under the pattern
+                if (!uniform) {
+                    std::fill( patternF.begin(), patternF.end(), Complex(0., 0.) );
+                    accumulateCorrelation(otherF, weightF, 1., &patternF);
+                    fft.transform(patternF, true);
+                }
+                for (int sy = 0; sy < searchHeight; ++sy) {
+                    for (int sx = 0; sx < searchWidth; ++sx) {
+                        const double sum = uniform ? kernelWeight0 * boxSum(image.sat[c], image.width(), sx + dx + satdx, sy + dy + satdy, patternWidth, patternHeight)
+                                           : patternF[(sy + dy) * fftWidth + sx + dx].real() / fftSize;
+                        meanSq[sy * searchWidth + sx] += sum * sum;
+                    }
+                }
+            }
+        }
+
+        // weighted energy of the other image under the pattern
+        scoreMap.resize( (std::size_t)searchWidth * searchHeight );
+        if (uniform) {
+            for (int sy = 0; sy < searchHeight; ++sy) {
+                for (int sx = 0; sx < searchWidth; ++sx) {
+                    scoreMap[sy * searchWidth + sx] = kernelWeight0 * boxSum(image.satSq, image.width(), sx + dx + satdx, sy + dy + satdy, patternWidth, patternHeight);
+                }
+            }
+        } else {
+            std::fill( otherF.begin(), otherF.end(), Complex(0., 0.) );
+            for (int y = 0; y < otherHeight; ++y) {
+                for (int x = 0; x < otherWidth; ++x) {
+                    otherF[y * fftWidth + x] = otherSq[y * otherWidth + x];
+                }
+            }
+            fft.transform(otherF, false);
+            std::fill( patternF.begin(), patternF.end(), Complex(0., 0.) );
+            accumulateCorrelation(otherF, weightF, 1., &patternF);
+            fft.transform(patternF, true);
+            for (int sy = 0; sy < searchHeight; ++sy) {
+                for (int sx = 0; sx < searchWidth; ++sx) {
+                    scoreMap[sy * searchWidth + sx] = patternF[(sy + dy) * fftWidth + sx + dx].real() / fftSize;
+                }
+            }
+        }
+        fft.transform(correlation, true);
+
+        // compute the scores
+        double maxEnergy = 0.;
+        for (std::size_t i = 0; i < scoreMap.size(); ++i) {
+            maxEnergy = std::max(maxEnergy, scoreMap[i]);
+        }
+        for (int sy = 0; sy < searchHeight; ++sy) {
+            for (int sx = 0; sx < searchWidth; ++sx) {
+                double &score = scoreMap[sy * searchWidth + sx];
+                const double energy = score;
+                const double corr = correlation[(sy + dy) * fftWidth + sx + dx].real() / fftSize;
+                if (scoreType == eTrackerSSD) {
+                    score = patternSq + corr + energy;
+                } else {
+                    double norm = energy;
+                    if (scoreType == eTrackerZNCC) {
+                        norm -= meanSq[sy * searchWidth + sx] / level.weightTotal;
+                    }
+                    if ( norm <= kFFTTolerance * maxEnergy ) {
+                        score = std::numeric_limits<double>::infinity();
+                    } else {
+                        score = -corr / std::sqrt(norm);
+                    }
+                }
+            }
+        }
+        // the errors of the FFT are proportional to the magnitude of the scores
+        if (scoreType == eTrackerSSD) {
+            track->scoreMapTolerance = kFFTTolerance * (patternSq + maxEnergy);
+        } else {
+            // by the Cauchy-Schwarz inequality, the absolute value of the score is at most sqrt(patternSq)
+            track->scoreMapTolerance = kFFTTolerance * std::sqrt(patternSq);
+        }
+    } // computeScoreMap
+
     template<enum TrackerScoreEnum scoreTypeE>
-    double computeScore(int x,
-                        int y,
-                        const double refMean[3])
+    double computeScore(const TrackerPMLevel &level,
+                        const TrackerPMImageLevel &image,
+                        int x,
+                        int y)
     {
         double score = 0;
         double otherSsq = 0.;
         double otherMean[3];
         const int scoreComps = std::min(nComponents, 3);
+        const double *refMean = level.patternMean;
+        const int patternWidth = level.pattern.x2 - level.pattern.x1;
+
+        assert(image.bounds.x1 <= x + level.pattern.x1 && x + level.pattern.x2 <= image.bounds.x2 &&
+               image.bounds.y1 <= y + level.pattern.y1 && y + level.pattern.y2 <= image.bounds.y2);
 
         if (scoreTypeE == eTrackerZNCC) {
             for (int c = 0; c < 3; ++c) {
                 otherMean[c] = 0;
             }
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                    // take nearest pixel in other image (more chance to get a track than with black)
-                    int otherx = x + j;
-                    int othery = y + i;
-                    otherx = std::max( _otherImg->getBounds().x1, std::min(otherx, _otherImg->getBounds().x2 - 1) );
-                    othery = std::max( _otherImg->getBounds().y1, std::min(othery, _otherImg->getBounds().y2 - 1) );
-                    const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+            const float *weightPtr = &level.weightData[0];
+            for (int i = level.pattern.y1; i < level.pattern.y2; ++i) {
+                const float *otherPix = image.getPixelAddress(x + level.pattern.x1, y + i, nComponents);
+                for (int j = 0; j < patternWidth; ++j, ++weightPtr, otherPix += nComponents) {
                     for (int c = 0; c < scoreComps; ++c) {
                         otherMean[c] += *weightPtr * otherPix[c];
                     }
                 }
             }
             for (int c = 0; c < scoreComps; ++c) {
-                otherMean[c] /= _weightTotal;
+                otherMean[c] /= level.weightTotal;
             }
         }
 
         // sliding pointers
-        long patternIdx = 0; // sliding index
-        const PIX *patternPtr = _patternData;
-        float *weightPtr = _weightData;
-
-        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                const PIX * const refPix = patternPtr;
+        const float *patternPtr = &level.patternData[0];
+        const float *weightPtr = &level.weightData[0];
+
+        for (int i = level.pattern.y1; i < level.pattern.y2; ++i) {
+            // the row of the other image under the pattern row
+            const float *otherPix = image.getPixelAddress(x + level.pattern.x1, y + i, nComponents);
+            for (int j = 0; j < patternWidth; ++j, ++weightPtr, patternPtr += nComponents, otherPix += nComponents) {
+                const float * const refPix = patternPtr;
                 const float weight = *weightPtr;
 
-                // take nearest pixel in other image (more chance to get a track than with black)
-                int otherx = x + j;
-                int othery = y + i;
-                otherx = std::max( _otherImg->getBounds().x1, std::min(otherx, _otherImg->getBounds().x2 - 1) );
-                othery = std::max( _otherImg->getBounds().y1, std::min(othery, _otherImg->getBounds().y2 - 1) );
-                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
-
-                ///the search window & pattern window have been intersected to the reference image's bounds
-                assert(refPix && otherPix);
                 for (int c = 0; c < scoreComps; ++c) {
                     switch (scoreTypeE) {
                     case eTrackerSSD:
@@ -415,76 +1239,129 @@ private:
         return score;
     } // computeScore
 
+    // search the neighborhood of the given position at the given level
     template<enum TrackerScoreEnum scoreTypeE>
-    void multiThreadProcessImagesForScore(const OfxRectI& procWindow)
+    OfxPointI refine(const TrackerPMLevel &level,
+                     const TrackerPMImageLevel &image,
+                     const OfxPointI &center,
+                     double *bestScore)
     {
-        assert(_patternImg.get() && _patternData && _weightImg.get() && _weightData && _otherImg && _weightTotal > 0.);
-        assert(scoreType == scoreTypeE);
+        OfxPointI point = center;
+
+        *bestScore = std::numeric_limits<double>::infinity();
+        const int y1 = std::max(level.search.y1, center.y - kPyramidRefineRadius);
+        const int y2 = std::min(level.search.y2, center.y + kPyramidRefineRadius + 1);
+        const int x1 = std::max(level.search.x1, center.x - kPyramidRefineRadius);
+        const int x2 = std::min(level.search.x2, center.x + kPyramidRefineRadius + 1);
+        for (int y = y1; y < y2; ++y) {
+            for (int x = x1; x < x2; ++x) {
+                double score = computeScore<scoreTypeE>(level, image, x, y);
+                if (score < *bestScore) {
+                    *bestScore = score;
+                    point.x = x;
+                    point.y = y;
+                }
+            }
+        }
+
+        return point;
+    }
+
+    virtual void processSearchBlock(const SearchBlock &block) OVERRIDE FINAL
+    {
+        TrackerPMTrack &track = _track;
+        const std::vector<TrackerPMImageLevel> &images = _images;
+        const int coarsestIndex = (int)track.levels.size() - 1;
+        const TrackerPMLevel &coarsest = track.levels[coarsestIndex];
+        const TrackerPMImageLevel &coarsestImage = images[coarsestIndex];
         double bestScore = std::numeric_limits<double>::infinity();
         OfxPointI point;
         point.x = -1;
         point.y = -1;
 
+        assert(track.valid);
+
         ///For every pixel in the sub window of the search area we find the pixel
         ///that minimize the sum of squared differences between the pattern in the ref image
         ///and the pattern in the other image.
 
-        const int scoreComps = std::min(nComponents, 3);
-        double refMean[3];
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                refMean[c] = 0;
-            }
-        }
-        if (scoreTypeE == eTrackerZNCC) {
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert( patternIdx == ( (i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1) ) );
-                    const PIX *refPix = patternPtr;
-                    for (int c = 0; c < scoreComps; ++c) {
-                        refMean[c] += *weightPtr * refPix[c];
+        ///we're not interested in the alpha channel for RGBA images
+        if (!track.useFFT) {
+            for (int y = block.y1; y < block.y2; ++y) {
+                if ( _effect.abort() ) {
+                    break;
+                }
+
+                for (int x = coarsest.search.x1; x < coarsest.search.x2; ++x) {
+                    double score = computeScore<scoreType>(coarsest, coarsestImage, x, y);
+                    if (score < bestScore) {
+                        bestScore = score;
+                        point.x = x;
+                        point.y = y;
                     }
                 }
             }
-            for (int c = 0; c < scoreComps; ++c) {
-                refMean[c] /= _weightTotal;
-            }
-        }
-
-        ///we're not interested in the alpha channel for RGBA images
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if ( _effect.abort() ) {
-                break;
+        } else {
+            // the scores were computed using the FFT: compute the exact score at the positions that may be the best
+            // match, or where the score could not be computed
+            const int mapWidth = coarsest.search.x2 - coarsest.search.x1;
+            double bestMapScore = std::numeric_limits<double>::infinity();
+            for (int y = block.y1; y < block.y2; ++y) {
+                const double *mapPtr = &track.scoreMap[(y - coarsest.search.y1) * mapWidth];
+                for (int x = 0; x < mapWidth; ++x, ++mapPtr) {
+                    bestMapScore = std::min(bestMapScore, *mapPtr);
+                }
             }
+            const double threshold = bestMapScore + 2 * track.scoreMapTolerance;
+            for (int y = block.y1; y < block.y2; ++y) {
+                if ( _effect.abort() ) {
+                    break;
+                }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                double score = computeScore<scoreTypeE>(x, y, refMean);
-                if (score < bestScore) {
-                    bestScore = score;
-                    point.x = x;
-                    point.y = y;
+                const double *mapPtr = &track.scoreMap[(y - coarsest.search.y1) * mapWidth];
+                for (int x = coarsest.search.x1; x < coarsest.search.x2; ++x, ++mapPtr) {
+                    if ( (*mapPtr <= threshold) || ( *mapPtr == std::numeric_limits<double>::infinity() ) ) {
+                        double score = computeScore<scoreType>(coarsest, coarsestImage, x, y);
+                        if (score < bestScore) {
+                            bestScore = score;
+                            point.x = x;
+                            point.y = y;
+                        }
+                    }
                 }
             }
         }
+        if ( bestScore == std::numeric_limits<double>::infinity() ) {
+            // no match in this part of the search window
+            return;
+        }
+
+        // refine the best match of this block at each finer level
+        for (int l = coarsestIndex - 1; l >= 0; --l) {
+            OfxPointI center;
+            center.x = 2 * point.x;
+            center.y = 2 * point.y;
+            point = refine<scoreType>(track.levels[l], images[l], center, &bestScore);
+        }
+        if ( bestScore == std::numeric_limits<double>::infinity() ) {
+            return;
+        }
 
         // do the subpixel refinement, only if the score is a possible winner
-        // TODO: only do this for the best match
+        const TrackerPMLevel &level0 = track.levels[0];
+        const TrackerPMImageLevel &image0 = images[0];
         double dx = 0.;
         double dy = 0.;
 
-        _bestMatchMutex.lock();
-        if (_bestMatch.second < bestScore) {
-            _bestMatchMutex.unlock();
+        _mutex.lock();
+        if (track.bestScore < bestScore) {
+            _mutex.unlock();
         } else {
             // don't block other threads
-            _bestMatchMutex.unlock();
+            _mutex.unlock();
             // compute subpixel position.
-            double scorepc = computeScore<scoreTypeE>(point.x - 1, point.y, refMean);
-            double scorenc = computeScore<scoreTypeE>(point.x + 1, point.y, refMean);
+            double scorepc = computeScore<scoreType>(level0, image0, point.x - 1, point.y);
+            double scorenc = computeScore<scoreType>(level0, image0, point.x + 1, point.y);
             if ( (bestScore < scorepc) && (bestScore <= scorenc) ) {
                 // don't simplify the denominator in the following expression,
                 // 2*bestScore - scorenc - scorepc may cause an underflow.
@@ -494,8 +1371,8 @@ private:
                     assert(-0.5 < dx && dx <= 0.5);
                 }
             }
-            double scorecp = computeScore<scoreTypeE>(point.x, point.y - 1, refMean);
-            double scorecn = computeScore<scoreTypeE>(point.x, point.y + 1, refMean);
+            double scorecp = computeScore<scoreType>(level0, image0, point.x, point.y - 1);
+            double scorecn = computeScore<scoreType>(level0, image0, point.x, point.y + 1);
             if ( (bestScore < scorecp) && (bestScore <= scorecn) ) {
                 // don't simplify the denominator in the following expression,
                 // 2*bestScore - scorenc - scorepc may cause an underflow.
@@ -507,39 +1384,39 @@ private:
             }
             // check again...
             {
-                AutoMutex lock(_bestMatchMutex);
-                if (_bestMatch.second > bestScore) {
-                    _bestMatch.second = bestScore;
-                    _bestMatch.first.x = point.x + dx;
-                    _bestMatch.first.y = point.y + dy;
+                AutoMutex lock(_mutex);
+                if (track.bestScore > bestScore) {
+                    track.bestScore = bestScore;
+                    track.bestMatch.x = point.x + dx;
+                    track.bestMatch.y = point.y + dy;
                 }
             }
         }
-    } // multiThreadProcessImagesForScore
+    } // processSearchBlock
 
-    double aggregateSD(PIX refPix,
-                       PIX otherPix)
+    double aggregateSD(float refPix,
+                       float otherPix)
     {
         double d = (double)refPix - otherPix;
 
         return d * d;
     }
 
-    double aggregateAD(PIX refPix,
-                       PIX otherPix)
+    double aggregateAD(float refPix,
+                       float otherPix)
     {
         return std::abs( (double)refPix - otherPix );
     }
 
-    double aggregateCC(PIX refPix,
-                       PIX otherPix)
+    double aggregateCC(float refPix,
+                       float otherPix)
     {
         return -(double)refPix * otherPix;
     }
 
-    double aggregateNCC(PIX refPix,
+    double aggregateNCC(float refPix,
                         double refMean,
-                        PIX otherPix,
+                        float otherPix,
                         double otherMean)
     {
         return -(refPix - refMean) * (otherPix - otherMean);
@@ -573,6 +1450,10 @@ TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
     }
 
     bool enableRefFrame = _enableReferenceFrame->getValue();
+    // When tracking from the previous/next frame, the other image of a frame is the reference image of the next frame:
+    // keep it, so that each frame is fetched only once.
+    std::auto_ptr<const OFX::Image> prevOtherImg;
+    OfxTime prevOtherTime = 0.;
 
     while ( args.forward ? (t <= args.last) : (t >= args.last) ) {
         OfxTime refFrame;
@@ -588,12 +1469,12 @@ TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
                srcComponents == OFX::ePixelComponentAlpha);
 
         if (srcComponents == OFX::ePixelComponentRGBA) {
-            trackInternal<4>(refFrame, t, args);
+            trackInternal<4>(refFrame, t, args, prevOtherImg, prevOtherTime);
         } else if (srcComponents == OFX::ePixelComponentRGB) {
-            trackInternal<3>(refFrame, t, args);
+            trackInternal<3>(refFrame, t, args, prevOtherImg, prevOtherTime);
         } else {
             assert(srcComponents == OFX::ePixelComponentAlpha);
-            trackInternal<1>(refFrame, t, args);
+            trackInternal<1>(refFrame, t, args, prevOtherImg, prevOtherTime);
         }
         if (args.forward) {
             ++t;
@@ -735,19 +1616,19 @@ TrackerPMPlugin::setupAndProcess(TrackerPMProcessorBase &processor,
     refRectPixel.y1 -= refCenterI.y;
     refRectPixel.y2 -= refCenterI.y;
 
-    // set the render window
-    processor.setRenderWindow(trackSearchBoundsPixel);
+    SearchMethodEnum searchMethod = (SearchMethodEnum)_searchMethod->getValueAtTime(refTime);
+    processor.setMaxLevels( (searchMethod == eSearchMethodCoarseToFine) ? kPyramidMaxLevels : 1 );
+    processor.setImages(refImg, otherImg, maskImg);
+    processor.setTrack(refRectPixel, refCenterI, trackSearchBoundsPixel);
 
-    bool canProcess = processor.setValues(refImg, otherImg, maskImg, refRectPixel, refCenterI);
+    // Call the base class process member, this will call the derived templated process code
+    processor.process();
 
-    if (!canProcess) {
+    if ( !processor.isValid() ) {
         // can't track: erase any existing track
         _center->deleteKeyAtTime(otherTime);
         _correlationScore->deleteKeyAtTime(otherTime);
     } else {
-        // Call the base class process member, this will call the derived templated process code
-        processor.process();
-
         //////////////////////////////////
         // TODO: subpixel interpolation //
         //////////////////////////////////
@@ -826,7 +1707,9 @@ template <int nComponents>
 void
 TrackerPMPlugin::trackInternal(OfxTime refTime,
                                OfxTime otherTime,
-                               const OFX::TrackArguments& args)
+                               const OFX::TrackArguments& args,
+                               std::auto_ptr<const OFX::Image>& prevOtherImg,
+                               OfxTime& prevOtherTime)
 {
     OfxRectD refRect;
 
@@ -862,8 +1745,22 @@ TrackerPMPlugin::trackInternal(OfxTime refTime,
     OfxRectD otherBounds;
     getOtherBounds(prevTimeCenterWithOffset, searchRect, &otherBounds);
 
-    std::auto_ptr<const OFX::Image> srcRef( ( _srcClip && _srcClip->isConnected() ) ?
-                                            _srcClip->fetchImage(refTime, refBounds) : 0 );
+    std::auto_ptr<const OFX::Image> srcRef;
+    if ( prevOtherImg.get() && (prevOtherTime == refTime) && _srcClip ) {
+        // reuse the image of the previous track if it contains the pattern
+        const OfxPointD rsOne = {1., 1.};
+        OfxRectI refBoundsPixel;
+        OFX::Coords::toPixelEnclosing(refBounds, rsOne, _srcClip->getPixelAspectRatio(), &refBoundsPixel);
+        const OfxRectI& prevBounds = prevOtherImg->getBounds();
+        if ( (prevBounds.x1 <= refBoundsPixel.x1) && (refBoundsPixel.x2 <= prevBounds.x2) &&
+             ( prevBounds.y1 <= refBoundsPixel.y1) && ( refBoundsPixel.y2 <= prevBounds.y2) ) {
+            srcRef = prevOtherImg;
+        }
+    }
+    prevOtherImg.reset();
+    if ( !srcRef.get() && _srcClip && _srcClip->isConnected() ) {
+        srcRef.reset( _srcClip->fetchImage(refTime, refBounds) );
+    }
     std::auto_ptr<const OFX::Image> srcOther( ( _srcClip && _srcClip->isConnected() ) ?
                                               _srcClip->fetchImage(otherTime, otherBounds) : 0 );
     if ( !srcRef.get() || !srcOther.get() ) {
@@ -924,6 +1821,8 @@ TrackerPMPlugin::trackInternal(OfxTime refTime,
     default:
         OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
     }
+    prevOtherImg = srcOther;
+    prevOtherTime = otherTime;
 } // TrackerPMPlugin::trackInternal
 
 mDeclarePluginFactory(TrackerPMPluginFactory, {}, {});
@@ -1164,6 +2063,21 @@ TrackerPMPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+
+    // search method
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamSearchMethod);
+        param->setLabel(kParamSearchMethodLabel);
+        param->setHint(kParamSearchMethodHint);
+        assert(param->getNOptions() == eSearchMethodExhaustive);
+        param->appendOption(kParamSearchMethodOptionExhaustive, kParamSearchMethodOptionExhaustiveHint);
+        assert(param->getNOptions() == eSearchMethodCoarseToFine);
+        param->appendOption(kParamSearchMethodOptionCoarseToFine, kParamSearchMethodOptionCoarseToFineHint);
+        param->setDefault( (int)eSearchMethodExhaustive );
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 } // TrackerPMPluginFactory::describeInContext
 
 OFX::ImageEffect*